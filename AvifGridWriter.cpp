@@ -0,0 +1,610 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <cstring>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include "AvifGridWriter.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        constexpr uint32_t FourCC(const char* type)
+        {
+            return static_cast<uint32_t>(static_cast<uint8_t>(type[0])) << 24 |
+                static_cast<uint32_t>(static_cast<uint8_t>(type[1])) << 16 |
+                static_cast<uint32_t>(static_cast<uint8_t>(type[2])) << 8 |
+                static_cast<uint32_t>(static_cast<uint8_t>(type[3]));
+        }
+
+        struct Box
+        {
+            uint32_t type;
+            const uint8_t* data;
+            size_t size;
+        };
+
+        // Big-endian reader over a box payload, throws when reading past its end
+        class BoxReader
+        {
+        public:
+            BoxReader(const uint8_t* data, const size_t size)
+                : _data(data), _size(size), _position(0)
+            {
+            }
+
+            explicit BoxReader(const Box& box)
+                : BoxReader(box.data, box.size)
+            {
+            }
+
+            uint64_t Read(const uint32_t bytes)
+            {
+                Require(bytes);
+                uint64_t value = 0;
+                for (uint32_t i = 0; i < bytes; i++)
+                {
+                    value = value << 8 | _data[_position++];
+                }
+                return value;
+            }
+
+            void Skip(const size_t bytes)
+            {
+                Require(bytes);
+                _position += bytes;
+            }
+
+            // Reads version and flags of a full box, returns the version
+            uint8_t ReadFullBoxHeader()
+            {
+                const auto version = static_cast<uint8_t>(Read(1));
+                Skip(3);
+                return version;
+            }
+
+            bool NextBox(Box& box)
+            {
+                if (_position == _size)
+                    return false;
+
+                const auto start = _position;
+                uint64_t boxSize = Read(4);
+                box.type = static_cast<uint32_t>(Read(4));
+
+                if (boxSize == 1)
+                    boxSize = Read(8);
+                else if (boxSize == 0)
+                    boxSize = _size - start;
+
+                const auto headerSize = _position - start;
+                if (boxSize < headerSize || boxSize > _size - start)
+                    throw std::runtime_error("Malformed box in the AVIF cell.");
+
+                box.data = _data + _position;
+                box.size = static_cast<size_t>(boxSize) - headerSize;
+                _position = start + static_cast<size_t>(boxSize);
+                return true;
+            }
+
+            bool FindBox(const uint32_t type, Box& box)
+            {
+                while (NextBox(box))
+                {
+                    if (box.type == type)
+                        return true;
+                }
+                return false;
+            }
+
+        private:
+            const uint8_t* _data;
+            size_t _size;
+            size_t _position;
+
+            void Require(const size_t bytes) const
+            {
+                if (bytes > _size - _position)
+                    throw std::runtime_error("Unexpected end of a box in the AVIF cell.");
+            }
+        };
+
+        // Big-endian writer, box sizes are patched when a box ends
+        class BoxWriter
+        {
+        public:
+            explicit BoxWriter(std::vector<uint8_t>& data)
+                : _data(data)
+            {
+            }
+
+            void Write(const uint64_t value, const uint32_t bytes)
+            {
+                for (auto i = bytes; i > 0; i--)
+                {
+                    _data.push_back(static_cast<uint8_t>(value >> (8 * (i - 1))));
+                }
+            }
+
+            void WriteType(const char* type)
+            {
+                Write(FourCC(type), 4);
+            }
+
+            void WriteBytes(const std::vector<uint8_t>& bytes)
+            {
+                _data.insert(_data.end(), bytes.begin(), bytes.end());
+            }
+
+            size_t BeginBox(const char* type)
+            {
+                const auto start = _data.size();
+                Write(0, 4);
+                WriteType(type);
+                return start;
+            }
+
+            size_t BeginFullBox(const char* type, const uint8_t version, const uint32_t flags)
+            {
+                const auto start = BeginBox(type);
+                Write(version, 1);
+                Write(flags, 3);
+                return start;
+            }
+
+            void EndBox(const size_t start)
+            {
+                const auto size = _data.size() - start;
+                if (size > std::numeric_limits<uint32_t>::max())
+                    throw std::runtime_error("AVIF header box is too large.");
+                Patch(start, size, 4);
+            }
+
+            void Patch(const size_t position, const uint64_t value, const uint32_t bytes)
+            {
+                for (uint32_t i = 0; i < bytes; i++)
+                {
+                    _data[position + i] = static_cast<uint8_t>(value >> (8 * (bytes - 1 - i)));
+                }
+            }
+
+        private:
+            std::vector<uint8_t>& _data;
+        };
+
+        // Item properties in ipco order, indices are 1-based
+        enum PropertyIndex : uint16_t
+        {
+            GridSpatialExtent = 1,
+            CellSpatialExtent,
+            PixelInformation,
+            ColourInformation,
+            ContentLightLevel,
+            FirstCodecConfiguration
+        };
+
+        constexpr uint32_t GridItemId = 1;
+
+        // Size of the ImageGrid descriptor the grid item points to
+        uint32_t GetGridDescriptorSize(const bool largeFields)
+        {
+            return largeFields ? 12 : 8;
+        }
+    }
+
+    AvifGridWriter::AvifGridWriter(const avifImage* image, const uint32_t columns, const uint32_t rows,
+        const uint32_t cellWidth, const uint32_t cellHeight)
+        : _width(image->width), _height(image->height), _columns(columns), _rows(rows), _cellWidth(cellWidth), _cellHeight(cellHeight),
+        _depth(static_cast<uint8_t>(image->depth)), _channels(image->yuvFormat == AVIF_PIXEL_FORMAT_YUV400 ? 1 : 3),
+        _colorPrimaries(image->colorPrimaries), _transferCharacteristics(image->transferCharacteristics),
+        _matrixCoefficients(image->matrixCoefficients), _range(image->yuvRange),
+        _maxCLL(image->clli.maxCLL), _maxPALL(image->clli.maxPALL)
+    {
+        if (columns == 0 || rows == 0 || columns > MaxColumns || rows > MaxRows || columns * rows > MaxCells)
+        {
+            throw std::invalid_argument("Unsupported number of grid cells.");
+        }
+
+        // Every column and row must contribute to the output, only the last ones may be cropped
+        if (static_cast<uint64_t>(cellWidth) * columns < _width || static_cast<uint64_t>(cellWidth) * (columns - 1) >= _width ||
+            static_cast<uint64_t>(cellHeight) * rows < _height || static_cast<uint64_t>(cellHeight) * (rows - 1) >= _height)
+        {
+            throw std::invalid_argument("Grid cells must cover the image.");
+        }
+
+        _cells.resize(static_cast<size_t>(columns) * rows);
+    }
+
+    void AvifGridWriter::SetCell(const uint32_t index, const uint8_t* file, const size_t size)
+    {
+        auto& cell = _cells.at(index);
+
+        BoxReader fileReader(file, size);
+        Box meta{};
+        if (!fileReader.FindBox(FourCC("meta"), meta))
+            throw std::runtime_error("AVIF cell has no meta box.");
+
+        BoxReader metaReader(meta);
+        metaReader.ReadFullBoxHeader();
+
+        uint32_t primaryItem = 0;
+        Box iloc{}, iprp{};
+        bool hasIloc = false, hasIprp = false;
+        Box child{};
+        while (metaReader.NextBox(child))
+        {
+            if (child.type == FourCC("pitm"))
+            {
+                BoxReader reader(child);
+                primaryItem = static_cast<uint32_t>(reader.Read(reader.ReadFullBoxHeader() == 0 ? 2 : 4));
+            }
+            else if (child.type == FourCC("iloc"))
+            {
+                iloc = child;
+                hasIloc = true;
+            }
+            else if (child.type == FourCC("iprp"))
+            {
+                iprp = child;
+                hasIprp = true;
+            }
+        }
+
+        if (!primaryItem || !hasIloc || !hasIprp)
+            throw std::runtime_error("AVIF cell has no primary item.");
+
+        // Codec configuration of the primary item
+        Box ipco{}, ipma{};
+        bool hasIpco = false, hasIpma = false;
+        BoxReader iprpReader(iprp);
+        while (iprpReader.NextBox(child))
+        {
+            if (child.type == FourCC("ipco"))
+            {
+                ipco = child;
+                hasIpco = true;
+            }
+            else if (child.type == FourCC("ipma"))
+            {
+                ipma = child;
+                hasIpma = true;
+            }
+        }
+
+        if (!hasIpco || !hasIpma)
+            throw std::runtime_error("AVIF cell has no item properties.");
+
+        std::vector<Box> properties;
+        BoxReader ipcoReader(ipco);
+        while (ipcoReader.NextBox(child))
+        {
+            properties.push_back(child);
+        }
+
+        BoxReader ipmaReader(ipma);
+        const auto ipmaVersion = static_cast<uint8_t>(ipmaReader.Read(1));
+        const auto ipmaFlags = static_cast<uint32_t>(ipmaReader.Read(3));
+        const auto entryCount = ipmaReader.Read(4);
+        const Box* configuration = nullptr;
+
+        for (uint64_t i = 0; i < entryCount && !configuration; i++)
+        {
+            const auto itemId = ipmaReader.Read(ipmaVersion < 1 ? 2 : 4);
+            const auto associationCount = ipmaReader.Read(1);
+
+            for (uint64_t j = 0; j < associationCount; j++)
+            {
+                const auto index = (ipmaFlags & 1) ? ipmaReader.Read(2) & 0x7FFF : ipmaReader.Read(1) & 0x7F;
+                if (itemId == primaryItem && index > 0 && index <= properties.size() &&
+                    properties[index - 1].type == FourCC("av1C"))
+                {
+                    configuration = &properties[index - 1];
+                }
+            }
+        }
+
+        if (!configuration)
+            throw std::runtime_error("AVIF cell has no AV1 codec configuration.");
+
+        cell.configuration.assign(configuration->data, configuration->data + configuration->size);
+
+        // Payload of the primary item, extents are concatenated
+        BoxReader ilocReader(iloc);
+        const auto ilocVersion = ilocReader.ReadFullBoxHeader();
+        const auto sizes = static_cast<uint32_t>(ilocReader.Read(1));
+        const auto offsetSize = sizes >> 4, lengthSize = sizes & 15;
+        const auto moreSizes = static_cast<uint32_t>(ilocReader.Read(1));
+        const auto baseOffsetSize = moreSizes >> 4;
+        const auto indexSize = ilocVersion == 1 || ilocVersion == 2 ? moreSizes & 15 : 0;
+        const auto itemCount = ilocReader.Read(ilocVersion < 2 ? 2 : 4);
+
+        cell.payload.clear();
+        bool found = false;
+
+        for (uint64_t i = 0; i < itemCount && !found; i++)
+        {
+            const auto itemId = ilocReader.Read(ilocVersion < 2 ? 2 : 4);
+            uint32_t constructionMethod = 0;
+            if (ilocVersion == 1 || ilocVersion == 2)
+                constructionMethod = static_cast<uint32_t>(ilocReader.Read(2) & 15);
+            ilocReader.Skip(2); // data_reference_index
+            const auto baseOffset = ilocReader.Read(baseOffsetSize);
+            const auto extentCount = ilocReader.Read(2);
+
+            for (uint64_t j = 0; j < extentCount; j++)
+            {
+                ilocReader.Skip(indexSize);
+                const auto offset = baseOffset + ilocReader.Read(offsetSize);
+                auto length = ilocReader.Read(lengthSize);
+
+                if (itemId != primaryItem)
+                    continue;
+
+                if (constructionMethod != 0)
+                    throw std::runtime_error("Unsupported AVIF cell item construction method.");
+
+                if (offset > size)
+                    throw std::runtime_error("AVIF cell item is out of file bounds.");
+
+                // Zero length means the rest of the file
+                if (length == 0)
+                    length = size - offset;
+
+                if (length > size - offset)
+                    throw std::runtime_error("AVIF cell item is out of file bounds.");
+
+                cell.payload.insert(cell.payload.end(), file + offset, file + offset + length);
+            }
+
+            found = itemId == primaryItem;
+        }
+
+        if (cell.payload.empty())
+            throw std::runtime_error("AVIF cell has no image data.");
+    }
+
+    std::vector<uint8_t> AvifGridWriter::BuildMeta(const uint64_t payloadOffset, const uint8_t offsetSize) const
+    {
+        const auto cellCount = static_cast<uint32_t>(_cells.size());
+        const auto largeFields = _width > 0xFFFF || _height > 0xFFFF;
+
+        // Cells with the same codec configuration share the property
+        std::vector<uint16_t> configurationIndices(cellCount);
+        std::vector<const std::vector<uint8_t>*> configurations;
+        for (uint32_t i = 0; i < cellCount; i++)
+        {
+            uint16_t index = 0;
+            for (size_t k = 0; k < configurations.size(); k++)
+            {
+                if (*configurations[k] == _cells[i].configuration)
+                    index = static_cast<uint16_t>(FirstCodecConfiguration + k);
+            }
+            if (!index)
+            {
+                if (FirstCodecConfiguration + configurations.size() > 0x7FFF)
+                    throw std::runtime_error("Too many distinct AVIF cell configurations.");
+                index = static_cast<uint16_t>(FirstCodecConfiguration + configurations.size());
+                configurations.push_back(&_cells[i].configuration);
+            }
+            configurationIndices[i] = index;
+        }
+
+        std::vector<uint8_t> data;
+        BoxWriter writer(data);
+
+        const auto meta = writer.BeginFullBox("meta", 0, 0);
+        {
+            const auto hdlr = writer.BeginFullBox("hdlr", 0, 0);
+            writer.Write(0, 4);
+            writer.WriteType("pict");
+            writer.Write(0, 12);
+            writer.Write(0, 1);
+            writer.EndBox(hdlr);
+        }
+        {
+            const auto pitm = writer.BeginFullBox("pitm", 0, 0);
+            writer.Write(GridItemId, 2);
+            writer.EndBox(pitm);
+        }
+        {
+            const auto iloc = writer.BeginFullBox("iloc", 0, 0);
+            writer.Write(static_cast<uint64_t>(offsetSize) << 4 | 4, 1);
+            writer.Write(0, 1);
+            writer.Write(cellCount + 1, 2);
+
+            auto offset = payloadOffset;
+            const auto writeItem = [&writer, &offset, offsetSize](const uint32_t itemId, const uint64_t length)
+            {
+                writer.Write(itemId, 2);
+                writer.Write(0, 2);
+                writer.Write(1, 2);
+                writer.Write(offset, offsetSize);
+                writer.Write(length, 4);
+                offset += length;
+            };
+
+            writeItem(GridItemId, GetGridDescriptorSize(largeFields));
+            for (uint32_t i = 0; i < cellCount; i++)
+            {
+                if (_cells[i].payload.size() > std::numeric_limits<uint32_t>::max())
+                    throw std::runtime_error("AVIF cell is too large.");
+                writeItem(GridItemId + 1 + i, _cells[i].payload.size());
+            }
+            writer.EndBox(iloc);
+        }
+        {
+            const auto iinf = writer.BeginFullBox("iinf", 0, 0);
+            writer.Write(cellCount + 1, 2);
+            for (uint32_t i = 0; i <= cellCount; i++)
+            {
+                const auto infe = writer.BeginFullBox("infe", 2, 0);
+                writer.Write(GridItemId + i, 2);
+                writer.Write(0, 2);
+                writer.WriteType(i == 0 ? "grid" : "av01");
+                writer.Write(0, 1);
+                writer.EndBox(infe);
+            }
+            writer.EndBox(iinf);
+        }
+        {
+            const auto iref = writer.BeginFullBox("iref", 0, 0);
+            const auto dimg = writer.BeginBox("dimg");
+            writer.Write(GridItemId, 2);
+            writer.Write(cellCount, 2);
+            for (uint32_t i = 0; i < cellCount; i++)
+            {
+                writer.Write(GridItemId + 1 + i, 2);
+            }
+            writer.EndBox(dimg);
+            writer.EndBox(iref);
+        }
+        {
+            const auto iprp = writer.BeginBox("iprp");
+            const auto ipco = writer.BeginBox("ipco");
+
+            for (const auto& [width, height] : {std::make_pair(_width, _height), std::make_pair(_cellWidth, _cellHeight)})
+            {
+                const auto ispe = writer.BeginFullBox("ispe", 0, 0);
+                writer.Write(width, 4);
+                writer.Write(height, 4);
+                writer.EndBox(ispe);
+            }
+
+            const auto pixi = writer.BeginFullBox("pixi", 0, 0);
+            writer.Write(_channels, 1);
+            for (uint8_t i = 0; i < _channels; i++)
+            {
+                writer.Write(_depth, 1);
+            }
+            writer.EndBox(pixi);
+
+            const auto colr = writer.BeginBox("colr");
+            writer.WriteType("nclx");
+            writer.Write(_colorPrimaries, 2);
+            writer.Write(_transferCharacteristics, 2);
+            writer.Write(_matrixCoefficients, 2);
+            writer.Write(_range == AVIF_RANGE_FULL ? 0x80 : 0, 1);
+            writer.EndBox(colr);
+
+            const auto clli = writer.BeginBox("clli");
+            writer.Write(_maxCLL, 2);
+            writer.Write(_maxPALL, 2);
+            writer.EndBox(clli);
+
+            for (const auto configuration : configurations)
+            {
+                const auto av1C = writer.BeginBox("av1C");
+                writer.WriteBytes(*configuration);
+                writer.EndBox(av1C);
+            }
+
+            writer.EndBox(ipco);
+
+            // Large property indices need 16 bit associations
+            const auto wideIndices = FirstCodecConfiguration + configurations.size() > 0x7F;
+            const auto ipma = writer.BeginFullBox("ipma", 0, wideIndices ? 1 : 0);
+            const auto writeAssociation = [&writer, wideIndices](const uint16_t index, const bool essential)
+            {
+                if (wideIndices)
+                    writer.Write((essential ? 0x8000 : 0) | index, 2);
+                else
+                    writer.Write((essential ? 0x80 : 0) | index, 1);
+            };
+
+            writer.Write(cellCount + 1, 4);
+
+            writer.Write(GridItemId, 2);
+            writer.Write(4, 1);
+            writeAssociation(GridSpatialExtent, false);
+            writeAssociation(PixelInformation, false);
+            writeAssociation(ColourInformation, false);
+            writeAssociation(ContentLightLevel, false);
+
+            for (uint32_t i = 0; i < cellCount; i++)
+            {
+                writer.Write(GridItemId + 1 + i, 2);
+                writer.Write(3, 1);
+                writeAssociation(configurationIndices[i], true);
+                writeAssociation(CellSpatialExtent, false);
+                writeAssociation(PixelInformation, false);
+            }
+
+            writer.EndBox(ipma);
+            writer.EndBox(iprp);
+        }
+        writer.EndBox(meta);
+
+        return data;
+    }
+
+    void AvifGridWriter::Write(avifRWData* output, const bool largeOffsets) const
+    {
+        const auto largeFields = _width > 0xFFFF || _height > 0xFFFF;
+
+        uint64_t dataSize = GetGridDescriptorSize(largeFields);
+        for (const auto& cell : _cells)
+        {
+            if (cell.payload.empty())
+                throw std::logic_error("Every grid cell must be set before writing.");
+            dataSize += cell.payload.size();
+        }
+
+        std::vector<uint8_t> header;
+        BoxWriter writer(header);
+
+        const auto ftyp = writer.BeginBox("ftyp");
+        writer.WriteType("avif");
+        writer.Write(0, 4);
+        writer.WriteType("avif");
+        writer.WriteType("mif1");
+        writer.WriteType("miaf");
+        writer.EndBox(ftyp);
+
+        // Offsets only change the size of the header through the offset width
+        const auto mdatHeaderSize = largeOffsets || dataSize + 8 > std::numeric_limits<uint32_t>::max() ? 16u : 8u;
+        uint8_t offsetSize = largeOffsets ? 8 : 4;
+        auto metaSize = BuildMeta(0, offsetSize).size();
+        if (header.size() + metaSize + mdatHeaderSize + dataSize > std::numeric_limits<uint32_t>::max())
+        {
+            offsetSize = 8;
+            metaSize = BuildMeta(0, offsetSize).size();
+        }
+
+        const auto payloadOffset = header.size() + metaSize + mdatHeaderSize;
+        writer.WriteBytes(BuildMeta(payloadOffset, offsetSize));
+
+        if (mdatHeaderSize == 16)
+        {
+            writer.Write(1, 4);
+            writer.WriteType("mdat");
+            writer.Write(dataSize + 16, 8);
+        }
+        else
+        {
+            writer.Write(dataSize + 8, 4);
+            writer.WriteType("mdat");
+        }
+
+        // ImageGrid descriptor
+        writer.Write(0, 1);
+        writer.Write(largeFields ? 1 : 0, 1);
+        writer.Write(_rows - 1, 1);
+        writer.Write(_columns - 1, 1);
+        writer.Write(_width, largeFields ? 4 : 2);
+        writer.Write(_height, largeFields ? 4 : 2);
+
+        const auto totalSize = header.size() + dataSize - GetGridDescriptorSize(largeFields);
+        const auto result = avifRWDataRealloc(output, totalSize);
+        if (result != AVIF_RESULT_OK)
+            throw std::bad_alloc();
+
+        std::memcpy(output->data, header.data(), header.size());
+        auto position = header.size();
+        for (const auto& cell : _cells)
+        {
+            std::memcpy(output->data + position, cell.payload.data(), cell.payload.size());
+            position += cell.payload.size();
+        }
+    }
+}
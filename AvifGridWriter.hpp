@@ -0,0 +1,71 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __AVIF_GRID_WRITER_HPP__
+#define __AVIF_GRID_WRITER_HPP__
+
+#include <cstdint>
+#include <vector>
+#include <avif/avif.h>
+
+namespace JxrToAvif
+{
+    // Assembles single image AVIF files, one per cell, into a file with a single grid image item.
+    // Cells are added in any order and from any thread, as long as every index is set once.
+    class AvifGridWriter
+    {
+    public:
+        static constexpr uint32_t MaxColumns = 256;
+        static constexpr uint32_t MaxRows = 256;
+
+        // Item IDs are 16 bit, one of them is taken by the grid
+        static constexpr uint32_t MaxCells = 65534;
+
+        // The image supplies the output size and the color properties of the grid
+        AvifGridWriter(const avifImage* image, uint32_t columns, uint32_t rows, uint32_t cellWidth, uint32_t cellHeight);
+
+        AvifGridWriter(const AvifGridWriter&) = delete;
+
+        AvifGridWriter(AvifGridWriter&&) = delete;
+
+        AvifGridWriter& operator=(const AvifGridWriter&) = delete;
+
+        AvifGridWriter& operator=(AvifGridWriter&&) = delete;
+
+        ~AvifGridWriter() = default;
+
+        // Takes the AV1 payload and configuration of the primary item of the file, cells go in row-major order
+        void SetCell(uint32_t index, const uint8_t* file, size_t size);
+
+        // Files past 4 GiB take 8 byte item offsets and a 64 bit mdat size. Large offsets
+        // use them for any file, so the layout can be checked without writing that much.
+        void Write(avifRWData* output, bool largeOffsets = false) const;
+
+    private:
+        struct Cell
+        {
+            // Contents of the av1C box
+            std::vector<uint8_t> configuration;
+            std::vector<uint8_t> payload;
+        };
+
+        uint32_t _width;
+        uint32_t _height;
+        uint32_t _columns;
+        uint32_t _rows;
+        uint32_t _cellWidth;
+        uint32_t _cellHeight;
+        uint8_t _depth;
+        uint8_t _channels;
+        avifColorPrimaries _colorPrimaries;
+        avifTransferCharacteristics _transferCharacteristics;
+        avifMatrixCoefficients _matrixCoefficients;
+        avifRange _range;
+        uint16_t _maxCLL;
+        uint16_t _maxPALL;
+        std::vector<Cell> _cells;
+
+        [[nodiscard]] std::vector<uint8_t> BuildMeta(uint64_t payloadOffset, uint8_t offsetSize) const;
+    };
+}
+
+#endif // __AVIF_GRID_WRITER_HPP__
@@ -0,0 +1,355 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <cwctype>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include "jxr_sys_helpers.h"
+#include "BoundedQueue.hpp"
+#include "JsonWriter.hpp"
+#include "JxrData.hpp"
+#include "StatisticsReport.hpp"
+#include "Trace.hpp"
+#include "BatchConverter.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        std::string GetErrorDescription(const int hr)
+        {
+            const auto errorDesc = jxr_get_error_description(hr);
+            std::string description(errorDesc ? errorDesc : "");
+            jxr_free_error_description(errorDesc);
+            return description;
+        }
+
+        std::string ToNarrow(const std::wstring& str)
+        {
+            const auto narrow = jxr_wide_to_multibyte(str.c_str());
+            std::string result(narrow ? narrow : "?");
+            jxr_free_multibyte(narrow);
+            return result;
+        }
+
+        std::wstring JoinPath(const std::wstring& directory, const std::wstring& name)
+        {
+            if (directory.empty() || jxr_is_path_separator(directory.back()))
+                return directory + name;
+            return directory + jxr_get_path_separator() + name;
+        }
+
+        bool HasExtension(const std::wstring& name, const std::wstring& extension)
+        {
+            if (name.size() <= extension.size())
+                return false;
+
+            return std::equal(extension.begin(), extension.end(), name.end() - static_cast<ptrdiff_t>(extension.size()),
+                [](const wchar_t a, const wchar_t b) { return std::towlower(a) == std::towlower(b); });
+        }
+    }
+
+    BatchConverter::BatchConverter(const ConversionOptions& options, std::wstring outputDirectory, std::ostream& log, std::ostream* stats,
+        OutputCache* cache)
+        : _converter(options), _outputDirectory(std::move(outputDirectory)), _log(log), _stats(stats), _cache(cache), _failedCount(0), _cacheHitCount(0)
+    {
+    }
+
+    void BatchConverter::AddInput(const std::wstring& path)
+    {
+        uint64_t size = 0;
+        int isDirectory = 0;
+        // Files that can not be opened fail in the batch along with the others
+        if (jxr_get_file_info(path.c_str(), &size, &isDirectory) < 0 || !isDirectory)
+        {
+            _jobs.push_back({ path, GetOutputPath(path), size, {} });
+            return;
+        }
+
+        jxr_directory_list list{};
+        const auto listResult = jxr_list_directory(path.c_str(), &list);
+        if (listResult < 0)
+        {
+            throw std::runtime_error("Failed to list " + ToNarrow(path) + ": " + GetErrorDescription(listResult));
+        }
+
+        std::vector<std::wstring> names(list.names, list.names + list.count);
+        jxr_free_directory_list(&list);
+
+        // Directory order differs between file systems
+        std::sort(names.begin(), names.end());
+
+        for (const auto& name : names)
+        {
+            if (HasExtension(name, InputExtension))
+            {
+                AddInput(JoinPath(path, name));
+            }
+        }
+    }
+
+    void BatchConverter::AddListFile(const std::wstring& path)
+    {
+        uint8_t* data = nullptr;
+        size_t size = 0;
+        const auto rv = jxr_read_file(path.c_str(), &data, &size);
+        if (rv < 0)
+        {
+            throw std::runtime_error("Failed to read " + ToNarrow(path) + ": " + GetErrorDescription(rv));
+        }
+
+        const std::string text(reinterpret_cast<const char*>(data), size);
+        jxr_free_file_data(data);
+
+        for (size_t start = 0; start < text.size();)
+        {
+            auto end = text.find('\n', start);
+            if (end == std::string::npos)
+                end = text.size();
+
+            auto line = text.substr(start, end - start);
+            start = end + 1;
+
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (line.empty())
+                continue;
+
+            const auto wide = jxr_multibyte_to_wide(line.c_str());
+            if (!wide)
+            {
+                throw std::runtime_error("List file " + ToNarrow(path) + " is not valid text.");
+            }
+
+            const std::wstring input(wide);
+            jxr_free_wide(wide);
+            AddInput(input);
+        }
+    }
+
+    size_t BatchConverter::Run()
+    {
+        // Largest files first, equal ones in the order they were given
+        std::stable_sort(_jobs.begin(), _jobs.end(), [](const Job& a, const Job& b) { return a.size > b.size; });
+
+        _failedCount = 0;
+        _cacheHitCount = 0;
+
+        // Several inputs may map to one output when they share a name in different directories
+        std::vector<bool> skipped(_jobs.size());
+        std::set<std::wstring> outputs;
+        for (size_t i = 0; i < _jobs.size(); i++)
+        {
+            if (!outputs.insert(_jobs[i].output).second)
+            {
+                skipped[i] = true;
+                ReportFailure(_jobs[i], "Output file is already written for another input.");
+            }
+        }
+
+        BoundedQueue<EncodeItem> encodeQueue(QueueCapacity);
+        BoundedQueue<WriteItem> writeQueue(QueueCapacity);
+
+        std::thread encodeThread([this, &encodeQueue, &writeQueue]
+        {
+            Trace::SetThreadName("encoder");
+            EncodeItem item;
+            while (encodeQueue.Pop(item))
+            {
+                WriteItem written;
+                written.job = item.job;
+                const auto encoded = RunStage(_jobs[item.job], [&] { written.result = _converter.Encode(std::move(*item.image)); });
+                item.image.reset();
+                if (encoded)
+                {
+                    writeQueue.Push(std::move(written));
+                }
+            }
+            writeQueue.Close();
+        });
+
+        std::thread writeThread([this, &writeQueue]
+        {
+            Trace::SetThreadName("writer");
+            WriteItem item;
+            while (writeQueue.Pop(item))
+            {
+                const auto& job = _jobs[item.job];
+                const auto& avif = item.result.avif;
+                if (RunStage(job, [&]
+                {
+                    const TraceScope trace("write");
+                    Stopwatch stopwatch;
+                    const auto rv = jxr_write_data_to_file(job.output.c_str(), avif.GetData(), avif.GetSize());
+                    if (rv < 0)
+                    {
+                        throw std::runtime_error("Failed to write output: " + GetErrorDescription(rv));
+                    }
+
+                    const auto& thumbnail = item.result.thumbnail;
+                    if (thumbnail.GetSize() > 0)
+                    {
+                        const auto thumbnailResult = jxr_write_data_to_file(GetThumbnailPath(job.output).c_str(), thumbnail.GetData(), thumbnail.GetSize());
+                        if (thumbnailResult < 0)
+                        {
+                            throw std::runtime_error("Failed to write thumbnail: " + GetErrorDescription(thumbnailResult));
+                        }
+                    }
+                    item.result.phases.push_back(stopwatch.Lap("write"));
+                }))
+                {
+                    if (_cache && !_cache->Store(job.cache.key, item.result))
+                    {
+                        const std::lock_guard lock(_logMutex);
+                        _log << ToNarrow(job.input) << ": Failed to store the output in the cache\n" << std::flush;
+                    }
+                    ReportSuccess(job, item.result);
+                }
+                item.result = ConversionResult();
+            }
+        });
+
+        try
+        {
+            // Decoder state of this thread is set up once for the whole batch
+            const JxrLoaderThreadState state;
+
+            for (size_t i = 0; i < _jobs.size(); i++)
+            {
+                if (skipped[i])
+                    continue;
+
+                if (_cache)
+                {
+                    auto& job = _jobs[i];
+                    const auto thumbnail = _converter.GetOptions().thumbnailSize > 0 ? GetThumbnailPath(job.output) : std::wstring();
+                    // A lookup that fails, say out of memory for the copy, fails the file like a conversion would
+                    if (!RunStage(job, [&] { job.cache = _cache->Fetch(job.input, _converter.GetOptions(), job.output, thumbnail); }))
+                        continue;
+                    if (job.cache.hit)
+                    {
+                        ReportCacheHit(job);
+                        continue;
+                    }
+                }
+
+                EncodeItem item;
+                item.job = i;
+                if (RunStage(_jobs[i], [&] { item.image = std::make_unique<PreparedImage>(_converter.PrepareFile(_jobs[i].input)); }))
+                {
+                    // Blocks while the encoder is behind, which bounds the prepared images
+                    encodeQueue.Push(std::move(item));
+                }
+            }
+        }
+        catch (...)
+        {
+            // Joinable threads would terminate the process, let them finish the files already queued
+            encodeQueue.Close();
+            encodeThread.join();
+            writeThread.join();
+            throw;
+        }
+
+        encodeQueue.Close();
+        encodeThread.join();
+        writeThread.join();
+
+        {
+            const std::lock_guard lock(_logMutex);
+            _log << "Converted " << _jobs.size() - _failedCount << " of " << _jobs.size() << " files";
+            if (_failedCount > 0)
+            {
+                _log << ", " << _failedCount << " failed";
+            }
+            if (_cache)
+            {
+                _log << ", " << _cacheHitCount << " from the cache";
+            }
+            _log << "\n" << std::flush;
+        }
+
+        return _failedCount;
+    }
+
+    std::wstring BatchConverter::GetOutputPath(const std::wstring& input) const
+    {
+        auto nameStart = input.size();
+        while (nameStart > 0 && !jxr_is_path_separator(input[nameStart - 1]))
+            nameStart--;
+
+        auto name = input.substr(nameStart);
+        const auto dot = name.rfind(L'.');
+        if (dot != std::wstring::npos && dot > 0)
+            name.resize(dot);
+        name += OutputExtension;
+
+        return _outputDirectory.empty() ? input.substr(0, nameStart) + name : JoinPath(_outputDirectory, name);
+    }
+
+    std::wstring BatchConverter::GetThumbnailPath(const std::wstring& output)
+    {
+        const std::wstring extension(OutputExtension);
+        if (HasExtension(output, extension))
+            return output.substr(0, output.size() - extension.size()) + ThumbnailExtension;
+        return output + ThumbnailExtension;
+    }
+
+    void BatchConverter::ReportSuccess(const Job& job, const ConversionResult& result)
+    {
+        const std::lock_guard lock(_logMutex);
+        _log << ToNarrow(job.input) << " -> " << ToNarrow(job.output) << ": "
+            << result.width << "x" << result.height << ", "
+            << result.maxCLL << " MaxCLL, " << result.maxFALL << " MaxFALL, "
+            << result.avif.GetSize() << " bytes\n" << std::flush;
+
+        if (_stats)
+        {
+            JsonWriter json(*_stats);
+            const auto cache = _cache ? _cache->GetStatistics(job.cache) : CacheStatistics();
+            WriteStatisticsReport(json, job.input, job.output, result, _cache ? &cache : nullptr);
+            *_stats << "\n" << std::flush;
+        }
+    }
+
+    void BatchConverter::ReportCacheHit(const Job& job)
+    {
+        const std::lock_guard lock(_logMutex);
+        _cacheHitCount++;
+        _log << ToNarrow(job.input) << " -> " << ToNarrow(job.output) << ": from the cache\n" << std::flush;
+
+        if (_stats)
+        {
+            JsonWriter json(*_stats);
+            WriteCacheHitReport(json, job.input, job.output, _cache->GetStatistics(job.cache));
+            *_stats << "\n" << std::flush;
+        }
+    }
+
+    void BatchConverter::ReportFailure(const Job& job, const char* message)
+    {
+        const std::lock_guard lock(_logMutex);
+        _failedCount++;
+        _log << ToNarrow(job.input) << ": " << message << "\n" << std::flush;
+    }
+
+    template <typename Action>
+    bool BatchConverter::RunStage(const Job& job, Action&& action)
+    {
+        try
+        {
+            action();
+            return true;
+        }
+        catch (std::bad_alloc&)
+        {
+            ReportFailure(job, "Out of memory");
+        }
+        catch (std::exception& e)
+        {
+            ReportFailure(job, e.what());
+        }
+        return false;
+    }
+}
@@ -0,0 +1,113 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __BATCH_CONVERTER_HPP__
+#define __BATCH_CONVERTER_HPP__
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "Converter.hpp"
+#include "OutputCache.hpp"
+
+namespace JxrToAvif
+{
+    // Converts many files in one process as a pipeline of three stages, each on its own thread:
+    // decoding and converting to YUV, AV1 encoding, and writing the output file.
+    // While image N is being encoded, image N+1 is converted and image N-1 is written.
+    //
+    // Stages are joined by queues of QueueCapacity items, so at most three prepared images
+    // and three encoded files are alive at once. Files run largest-first to keep the tail
+    // of the batch short. A failed file is reported and the batch goes on. With a cache, inputs
+    // are looked up before decoding and the outputs of the misses are stored once written.
+    class BatchConverter
+    {
+    public:
+        static constexpr size_t QueueCapacity = 1;
+
+        static constexpr auto InputExtension = L".jxr";
+
+        static constexpr auto OutputExtension = L".avif";
+
+        static constexpr auto ThumbnailExtension = L".thumb.avif";
+
+        // The thumbnail of an output is written next to it, name.avif gets name.thumb.avif
+        static std::wstring GetThumbnailPath(const std::wstring& output);
+
+        // Outputs are written next to the inputs when the output directory is empty.
+        // Statistics of every converted file go to the stats stream as a line of JSON, unless it is null.
+        // The cache is optional and must outlive the batch.
+        BatchConverter(const ConversionOptions& options, std::wstring outputDirectory, std::ostream& log, std::ostream* stats = nullptr,
+            OutputCache* cache = nullptr);
+
+        BatchConverter(const BatchConverter&) = delete;
+
+        BatchConverter(BatchConverter&&) = delete;
+
+        BatchConverter& operator=(const BatchConverter&) = delete;
+
+        BatchConverter& operator=(BatchConverter&&) = delete;
+
+        ~BatchConverter() = default;
+
+        // Adds a file, or every JPEG XR file of a directory
+        void AddInput(const std::wstring& path);
+
+        // Adds the inputs named on the lines of a text file
+        void AddListFile(const std::wstring& path);
+
+        [[nodiscard]] size_t GetJobCount() const
+        {
+            return _jobs.size();
+        }
+
+        // Returns the number of files that failed
+        size_t Run();
+
+    private:
+        struct Job
+        {
+            std::wstring input;
+            std::wstring output;
+            uint64_t size = 0;
+            CacheLookup cache;
+        };
+
+        struct EncodeItem
+        {
+            size_t job = 0;
+            std::unique_ptr<PreparedImage> image;
+        };
+
+        struct WriteItem
+        {
+            size_t job = 0;
+            ConversionResult result;
+        };
+
+        Converter _converter;
+        std::wstring _outputDirectory;
+        std::ostream& _log;
+        std::ostream* _stats;
+        OutputCache* _cache;
+        std::vector<Job> _jobs;
+        std::mutex _logMutex;
+        size_t _failedCount;
+        size_t _cacheHitCount;
+
+        std::wstring GetOutputPath(const std::wstring& input) const;
+
+        void ReportSuccess(const Job& job, const ConversionResult& result);
+
+        void ReportCacheHit(const Job& job);
+
+        void ReportFailure(const Job& job, const char* message);
+
+        template <typename Action>
+        bool RunStage(const Job& job, Action&& action);
+    };
+}
+
+#endif // __BATCH_CONVERTER_HPP__
@@ -0,0 +1,614 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "jxr_sys_helpers.h"
+#include "AvifGridWriter.hpp"
+#include "GridEncoder.hpp"
+#include "JsonWriter.hpp"
+#include "JxrImage.hpp"
+#include "PqCurve.hpp"
+#include "ThreadPool.hpp"
+#include "Benchmark.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        using Clock = std::chrono::steady_clock;
+        using ImagePtr = std::unique_ptr<avifImage, decltype(&avifImageDestroy)>;
+
+        // Depth of the RGB intermediate, as in Converter
+        constexpr uint32_t IntermediateBits = 16;
+
+        // The deepest output, where the curves must be off by less than half a step
+        constexpr uint32_t OutputBits = 12;
+
+        // Bit patterns of the floats from zero to one
+        constexpr size_t PqInputCount = 0x3F800001;
+
+        const char* GetFormatName(const PixelFormat format)
+        {
+            switch (format)
+            {
+            case PixelFormat::Rgb:
+                return "rgb";
+            case PixelFormat::Yuv444:
+                return "yuv444";
+            case PixelFormat::Yuv422:
+                return "yuv422";
+            case PixelFormat::Yuv420:
+                return "yuv420";
+            case PixelFormat::Yuv400:
+                return "yuv400";
+            }
+            return "unknown";
+        }
+
+        ImagePtr CreateImage(const PixelSpan& pixels, const uint8_t depth, const PixelFormat format)
+        {
+            auto yuvFormat = AVIF_PIXEL_FORMAT_YUV444;
+            if (format == PixelFormat::Yuv422)
+                yuvFormat = AVIF_PIXEL_FORMAT_YUV422;
+            else if (format == PixelFormat::Yuv420)
+                yuvFormat = AVIF_PIXEL_FORMAT_YUV420;
+            else if (format == PixelFormat::Yuv400)
+                yuvFormat = AVIF_PIXEL_FORMAT_YUV400;
+
+            ImagePtr image(avifImageCreate(pixels.width, pixels.height, depth, yuvFormat), avifImageDestroy);
+            if (!image)
+            {
+                throw std::bad_alloc();
+            }
+
+            image->colorPrimaries = AVIF_COLOR_PRIMARIES_BT2020;
+            image->transferCharacteristics = AVIF_TRANSFER_CHARACTERISTICS_SMPTE2084;
+            image->matrixCoefficients = format == PixelFormat::Rgb ? AVIF_MATRIX_COEFFICIENTS_IDENTITY : AVIF_MATRIX_COEFFICIENTS_BT2020_NCL;
+            return image;
+        }
+
+        void ThrowIfFailed(const avifResult result, const char* message)
+        {
+            if (result != AVIF_RESULT_OK)
+            {
+                throw std::runtime_error(std::string(message) + avifResultToString(result));
+            }
+        }
+
+        avifEncoder* CreateLosslessEncoder(const int threads)
+        {
+            const auto encoder = avifEncoderCreate();
+            if (encoder)
+            {
+                encoder->quality = AVIF_QUALITY_LOSSLESS;
+                encoder->speed = AVIF_SPEED_FASTEST;
+                encoder->maxThreads = threads;
+            }
+            return encoder;
+        }
+
+        // Converted straight from the pixels, as with --direct-yuv
+        ImagePtr CreateYuvImage(const SyntheticImage& source, const PixelFormat format)
+        {
+            const auto pixels = source.GetPixels();
+            jxr_data data{};
+            data.width = pixels.width;
+            data.height = pixels.height;
+            data.stride = pixels.stride;
+            data.buffer_size = source.GetSize();
+            data.bytes_per_pixel = pixels.bytesPerPixel;
+            data.pixels = const_cast<uint8_t*>(pixels.pixels);
+
+            auto image = CreateImage(pixels, ConversionOptions::DefaultDepth, format);
+            ThrowIfFailed(avifImageAllocatePlanes(image.get(), AVIF_PLANES_YUV), "Failed to allocate YUV planes: ");
+            JxrImage(data).ConvertToYuv(image.get());
+            return image;
+        }
+
+        // Returns false and logs the first difference, if any
+        bool CompareImages(std::ostream& log, const char* name, const avifImage* source, const avifImage* decoded)
+        {
+            if (decoded->width != source->width || decoded->height != source->height ||
+                decoded->depth != source->depth || decoded->yuvFormat != source->yuvFormat)
+            {
+                log << name << ": decoded as " << decoded->width << "x" << decoded->height << " " << decoded->depth
+                    << " bit, expected " << source->width << "x" << source->height << " " << source->depth << " bit, FAILED\n";
+                return false;
+            }
+
+            avifPixelFormatInfo formatInfo;
+            avifGetPixelFormatInfo(source->yuvFormat, &formatInfo);
+            const auto bytesPerSample = source->depth > 8 ? 2u : 1u;
+
+            for (int channel = AVIF_CHAN_Y; channel <= AVIF_CHAN_V; channel++)
+            {
+                const auto chroma = channel != AVIF_CHAN_Y;
+                if (chroma && formatInfo.monochrome)
+                    break;
+
+                const auto shiftX = chroma ? formatInfo.chromaShiftX : 0;
+                const auto shiftY = chroma ? formatInfo.chromaShiftY : 0;
+                const auto rowSize = ((source->width + shiftX) >> shiftX) * bytesPerSample;
+                const auto rows = (source->height + shiftY) >> shiftY;
+                for (uint32_t y = 0; y < rows; y++)
+                {
+                    if (std::memcmp(source->yuvPlanes[channel] + static_cast<size_t>(y) * source->yuvRowBytes[channel],
+                        decoded->yuvPlanes[channel] + static_cast<size_t>(y) * decoded->yuvRowBytes[channel], rowSize) != 0)
+                    {
+                        log << name << ": plane " << channel << " differs in row " << y << ", FAILED\n";
+                        return false;
+                    }
+                }
+            }
+
+            log << name << ": " << decoded->width << "x" << decoded->height << " decoded as encoded\n";
+            return true;
+        }
+
+        bool DecodeAndCompare(std::ostream& log, const char* name, const avifImage* source, const avifRWData& file)
+        {
+            const std::unique_ptr<avifDecoder, decltype(&avifDecoderDestroy)> decoder(avifDecoderCreate(), avifDecoderDestroy);
+            ImagePtr decoded(avifImageCreateEmpty(), avifImageDestroy);
+            if (!decoder || !decoded)
+            {
+                throw std::bad_alloc();
+            }
+
+            const auto result = avifDecoderReadMemory(decoder.get(), decoded.get(), file.data, file.size);
+            if (result != AVIF_RESULT_OK)
+            {
+                log << name << ": " << avifResultToString(result) << ", FAILED\n";
+                return false;
+            }
+
+            return CompareImages(log, name, source, decoded.get());
+        }
+    }
+
+    Benchmark::Benchmark(const BenchmarkOptions& options)
+        : _options(options), _generateSeconds(0)
+    {
+        if (!options.iterations)
+        {
+            throw std::invalid_argument("At least one iteration is required.");
+        }
+    }
+
+    void Benchmark::Run(std::ostream& log)
+    {
+        _measurements.clear();
+
+        const auto generateStart = Clock::now();
+        const SyntheticImage image(_options.image);
+        _generateSeconds = std::chrono::duration<double>(Clock::now() - generateStart).count();
+
+        const auto pixels = image.GetPixels();
+        jxr_data data{};
+        data.width = pixels.width;
+        data.height = pixels.height;
+        data.stride = pixels.stride;
+        data.buffer_size = image.GetSize();
+        data.bytes_per_pixel = pixels.bytesPerPixel;
+        data.pixels = const_cast<uint8_t*>(pixels.pixels);
+
+        log << "Image: " << pixels.width << "x" << pixels.height << ", " << (_options.image.halfFloat ? "half" : "float")
+            << " components, generated in " << std::fixed << std::setprecision(1) << _generateSeconds * 1000 << " ms\n";
+        log << "Using " << ThreadPool::GetInstance().GetWorkerCount() << " threads, "
+            << _options.iterations << " iterations per measurement\n" << std::flush;
+
+        // scRGB to PQ RGB, which includes the light level statistics
+        for (const auto fastPq : { false, true })
+        {
+            std::unique_ptr<JxrImage> jxrImage;
+            auto measurement = Measure("convert-rgb",
+                [&] { jxrImage = std::make_unique<JxrImage>(data); jxrImage->SetFastPq(fastPq); },
+                [&] { jxrImage->ConvertToRgb(); });
+            measurement.fastPq = fastPq;
+            Record(log, std::move(measurement));
+        }
+
+        JxrImage rgbImage(data);
+        rgbImage.ConvertToRgb();
+
+        {
+            HdrStatistics statistics;
+            Record(log, Measure("maxcll",
+                [&] { statistics = HdrStatistics(); },
+                [&]
+                {
+                    statistics.Merge(rgbImage.GetStatistics());
+                    statistics.Finalize();
+                    static_cast<void>(statistics.GetPercentileNits(ConversionOptions::DefaultMaxCllPercentile));
+                }));
+        }
+
+        for (const auto depth : _options.depths)
+        {
+            for (const auto format : _options.formats)
+            {
+                ImagePtr yuvImage(nullptr, avifImageDestroy);
+                auto rgbToYuv = Measure("rgb-to-yuv",
+                    [&] { yuvImage = CreateImage(pixels, depth, format); },
+                    [&]
+                    {
+                        avifRGBImage rgb = {};
+                        avifRGBImageSetDefaults(&rgb, yuvImage.get());
+                        rgb.format = AVIF_RGB_FORMAT_RGB;
+                        rgb.depth = IntermediateBits;
+                        rgb.pixels = reinterpret_cast<uint8_t*>(rgbImage.GetDataPointer());
+                        rgb.rowBytes = static_cast<uint32_t>(rgbImage.GetRowBytes());
+                        ThrowIfFailed(avifImageRGBToYUV(yuvImage.get(), &rgb), "Failed to convert to YUV(A): ");
+                    });
+                rgbToYuv.depth = depth;
+                rgbToYuv.format = format;
+                rgbToYuv.hasFormat = true;
+                Record(log, std::move(rgbToYuv));
+
+                for (const auto fastPq : { false, true })
+                {
+                    std::unique_ptr<JxrImage> jxrImage;
+                    auto directYuv = Measure("convert-yuv",
+                        [&]
+                        {
+                            yuvImage = CreateImage(pixels, depth, format);
+                            ThrowIfFailed(avifImageAllocatePlanes(yuvImage.get(), AVIF_PLANES_YUV), "Failed to allocate YUV planes: ");
+                            jxrImage = std::make_unique<JxrImage>(data);
+                            jxrImage->SetFastPq(fastPq);
+                        },
+                        [&] { jxrImage->ConvertToYuv(yuvImage.get()); });
+                    directYuv.fastPq = fastPq;
+                    directYuv.depth = depth;
+                    directYuv.format = format;
+                    directYuv.hasFormat = true;
+                    Record(log, std::move(directYuv));
+                }
+            }
+        }
+
+        // The release of the RGB intermediate shows in the peak memory of the end to end runs
+        rgbImage.ReleaseData();
+
+        for (const auto speed : _options.speeds)
+        {
+            for (const auto depth : _options.depths)
+            {
+                for (const auto format : _options.formats)
+                {
+                    ConversionOptions conversionOptions;
+                    conversionOptions.speed = speed;
+                    conversionOptions.depth = depth;
+                    conversionOptions.format = format;
+
+                    // Prepared the fastest way, only the encoder is timed
+                    conversionOptions.directYuv = true;
+                    const Converter encodeConverter(conversionOptions);
+                    std::unique_ptr<PreparedImage> prepared;
+                    uint64_t outputSize = 0;
+                    auto encode = Measure("encode",
+                        [&] { prepared = std::make_unique<PreparedImage>(encodeConverter.PreparePixels(pixels)); },
+                        [&] { outputSize = encodeConverter.Encode(std::move(*prepared)).avif.GetSize(); });
+                    encode.speed = speed;
+                    encode.depth = depth;
+                    encode.format = format;
+                    encode.hasFormat = true;
+                    encode.outputSize = outputSize;
+                    Record(log, std::move(encode));
+
+                    // Default conversion path of the command line tool
+                    conversionOptions.directYuv = false;
+                    const Converter converter(conversionOptions);
+                    auto endToEnd = Measure("end-to-end",
+                        [] {},
+                        [&] { outputSize = converter.ConvertPixels(pixels).avif.GetSize(); });
+                    endToEnd.speed = speed;
+                    endToEnd.depth = depth;
+                    endToEnd.format = format;
+                    endToEnd.hasFormat = true;
+                    endToEnd.outputSize = outputSize;
+                    Record(log, std::move(endToEnd));
+                }
+            }
+        }
+
+        // Every job runs on a thread of its own like server connections do. Without the budget,
+        // each encoder takes as many threads as the pool has workers, while the pool converts the other images.
+        if (_options.jobs > 1 && !_options.speeds.empty())
+        {
+            for (const auto useCpuBudget : { true, false })
+            {
+                ConversionOptions conversionOptions;
+                conversionOptions.speed = _options.speeds.front();
+                conversionOptions.depth = _options.depths.front();
+                conversionOptions.format = _options.formats.front();
+                conversionOptions.useCpuBudget = useCpuBudget;
+                const Converter converter(conversionOptions);
+
+                uint64_t outputSize = 0;
+                auto concurrent = Measure(useCpuBudget ? "concurrent" : "concurrent-unbudgeted",
+                    [] {},
+                    [&]
+                    {
+                        std::vector<std::thread> threads;
+                        std::vector<std::exception_ptr> errors(_options.jobs);
+                        for (uint32_t i = 0; i < _options.jobs; i++)
+                        {
+                            threads.emplace_back([&, i]
+                            {
+                                try
+                                {
+                                    const auto size = converter.ConvertPixels(pixels).avif.GetSize();
+                                    if (i == 0)
+                                        outputSize = size;
+                                }
+                                catch (...)
+                                {
+                                    errors[i] = std::current_exception();
+                                }
+                            });
+                        }
+                        for (auto& thread : threads)
+                        {
+                            thread.join();
+                        }
+                        for (const auto& error : errors)
+                        {
+                            if (error)
+                                std::rethrow_exception(error);
+                        }
+                    });
+                concurrent.speed = conversionOptions.speed;
+                concurrent.depth = conversionOptions.depth;
+                concurrent.format = conversionOptions.format;
+                concurrent.hasFormat = true;
+                concurrent.jobs = _options.jobs;
+                concurrent.outputSize = outputSize;
+                Record(log, std::move(concurrent));
+            }
+        }
+
+        log << "Peak memory usage: " << (jxr_get_peak_memory_usage() >> 20) << " MiB\n" << std::flush;
+    }
+
+    void Benchmark::WriteResults(std::ostream& stream) const
+    {
+        const auto& imageOptions = _options.image;
+
+        JsonWriter json(stream);
+        json.BeginObject();
+
+        json.BeginObject("image");
+        json.Write("width", imageOptions.width);
+        json.Write("height", imageOptions.height);
+        json.Write("bytesPerPixel", imageOptions.halfFloat ? 8 : 16);
+        json.Write("sceneNits", imageOptions.sceneNits);
+        json.Write("highlightNits", imageOptions.highlightNits);
+        json.Write("highlightFraction", imageOptions.highlightFraction);
+        json.Write("seed", imageOptions.seed);
+        json.Write("generateSeconds", _generateSeconds);
+        json.EndObject();
+
+        json.Write("threads", ThreadPool::GetInstance().GetWorkerCount());
+        json.Write("iterations", _options.iterations);
+
+        json.BeginArray("results");
+        for (const auto& measurement : _measurements)
+        {
+            json.BeginObject();
+            json.Write("stage", measurement.stage);
+            json.Write("fastPq", measurement.fastPq);
+            if (measurement.hasFormat)
+                json.Write("format", GetFormatName(measurement.format));
+            if (measurement.depth)
+                json.Write("depth", measurement.depth);
+            if (measurement.speed >= 0)
+                json.Write("speed", measurement.speed);
+            json.Write("bestSeconds", measurement.bestSeconds);
+            json.Write("medianSeconds", measurement.medianSeconds);
+            json.Write("meanSeconds", measurement.meanSeconds);
+            if (measurement.jobs > 1)
+                json.Write("jobs", measurement.jobs);
+            json.Write("megapixelsPerSecond", GetMegapixelsPerSecond(measurement));
+            if (measurement.outputSize)
+                json.Write("outputSize", measurement.outputSize);
+            json.Write("peakMemory", measurement.peakMemory);
+            json.EndObject();
+        }
+        json.EndArray();
+
+        json.Write("peakMemory", jxr_get_peak_memory_usage());
+        json.EndObject();
+        stream << '\n';
+    }
+
+    Benchmark::Measurement Benchmark::Measure(const std::string& stage, const std::function<void()>& setup, const std::function<void()>& body) const
+    {
+        std::vector<double> seconds;
+        for (uint32_t i = 0; i < _options.iterations; i++)
+        {
+            setup();
+            const auto start = Clock::now();
+            body();
+            seconds.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+        }
+
+        std::sort(seconds.begin(), seconds.end());
+
+        Measurement measurement;
+        measurement.stage = stage;
+        measurement.bestSeconds = seconds.front();
+        measurement.medianSeconds = seconds[seconds.size() / 2];
+        for (const auto s : seconds)
+        {
+            measurement.meanSeconds += s / static_cast<double>(seconds.size());
+        }
+        measurement.peakMemory = jxr_get_peak_memory_usage();
+        return measurement;
+    }
+
+    void Benchmark::Record(std::ostream& log, Measurement measurement)
+    {
+        log << std::left << std::setw(40) << GetVariantName(measurement) << std::right << std::fixed
+            << std::setw(10) << std::setprecision(2) << measurement.bestSeconds * 1000 << " ms"
+            << std::setw(10) << std::setprecision(1) << GetMegapixelsPerSecond(measurement) << " MP/s";
+        if (measurement.outputSize)
+        {
+            log << std::setw(12) << measurement.outputSize << " bytes";
+        }
+        log << "\n" << std::flush;
+
+        _measurements.push_back(std::move(measurement));
+    }
+
+    double Benchmark::GetMegapixelsPerSecond(const Measurement& measurement) const
+    {
+        const auto megapixels = static_cast<double>(_options.image.width) * _options.image.height * measurement.jobs / 1e6;
+        return measurement.bestSeconds > 0 ? megapixels / measurement.bestSeconds : 0;
+    }
+
+    std::string Benchmark::GetVariantName(const Measurement& measurement)
+    {
+        std::ostringstream name;
+        name << measurement.stage;
+        if (measurement.hasFormat)
+            name << " " << GetFormatName(measurement.format);
+        if (measurement.depth)
+            name << " " << static_cast<int>(measurement.depth) << " bit";
+        if (measurement.speed >= 0)
+            name << " speed " << measurement.speed;
+        if (measurement.jobs > 1)
+            name << " " << measurement.jobs << " jobs";
+        if (measurement.fastPq)
+            name << " fast-pq";
+        return name.str();
+    }
+
+    bool Benchmark::CheckPqAccuracy(std::ostream& log)
+    {
+        struct Errors
+        {
+            double exact = 0;
+            double fast = 0;
+        };
+
+        auto& pool = ThreadPool::GetInstance();
+        std::vector<Errors> errors(pool.GetWorkerCount() + 1);
+
+        const auto start = Clock::now();
+        pool.ParallelFor(0, PqInputCount, 1 << 20, [&errors](const size_t begin, const size_t end, const uint32_t workerIndex)
+        {
+            auto& worst = errors[workerIndex];
+            for (auto i = begin; i < end; i += 8)
+            {
+                alignas(32) float inputs[8];
+                alignas(32) float exact[8];
+                alignas(32) float fast[8];
+                for (size_t j = 0; j < 8; j++)
+                {
+                    // A short last vector repeats the last input of the range
+                    const auto bits = static_cast<uint32_t>(std::min(i + j, end - 1));
+                    std::memcpy(&inputs[j], &bits, sizeof(float));
+                }
+
+                const auto y = _mm256_load_ps(inputs);
+                _mm256_store_ps(exact, PqCurve::InverseEotf(y));
+                _mm256_store_ps(fast, PqCurve::InverseEotfFast(y));
+
+                for (size_t j = 0; j < 8; j++)
+                {
+                    const auto reference = PqCurve::InverseEotfReference(inputs[j]);
+                    worst.exact = std::max(worst.exact, std::abs(exact[j] - reference));
+                    worst.fast = std::max(worst.fast, std::abs(fast[j] - reference));
+                }
+            }
+        });
+        const std::chrono::duration<double> elapsed = Clock::now() - start;
+
+        Errors worst;
+        for (const auto& workerErrors : errors)
+        {
+            worst.exact = std::max(worst.exact, workerErrors.exact);
+            worst.fast = std::max(worst.fast, workerErrors.fast);
+        }
+
+        log << "Checked " << PqInputCount << " inputs in " << std::fixed << std::setprecision(1) << elapsed.count() << " s\n";
+
+        const auto check = [&log](const char* curve, const double error, const double maxError16)
+        {
+            const auto outputSteps = error * ((1 << OutputBits) - 1);
+            const auto intermediateSteps = error * ((1 << IntermediateBits) - 1);
+            const auto passed = outputSteps <= 0.5 && intermediateSteps <= maxError16;
+            log << curve << ": " << std::setprecision(4) << outputSteps << " LSB at " << OutputBits << " bits, "
+                << intermediateSteps << " LSB at " << IntermediateBits << " bits, bound " << maxError16
+                << (passed ? "" : ", FAILED") << "\n";
+            return passed;
+        };
+
+        const auto exactPassed = check("Exact PQ curve", worst.exact, PqCurve::MaxError16);
+        const auto fastPassed = check("Fast PQ curve", worst.fast, PqCurve::FastMaxError16);
+        return exactPassed && fastPassed;
+    }
+
+    bool Benchmark::CheckGridRoundTrip(std::ostream& log)
+    {
+        const CpuBudget::Lease threads(ThreadPool::GetInstance().GetWorkerCount());
+        auto passed = true;
+
+        for (const auto format : { PixelFormat::Yuv444, PixelFormat::Yuv420 })
+        {
+            const auto formatName = std::string(GetFormatName(format));
+
+            // Odd sizes crop the cells at the right and bottom edges, and round the chroma of 4:2:0 up
+            SyntheticImageOptions croppedOptions;
+            croppedOptions.width = 301;
+            croppedOptions.height = 203;
+            const SyntheticImage cropped(croppedOptions);
+            const auto croppedImage = CreateYuvImage(cropped, format);
+
+            const auto layout = GridEncoder::ChooseLayout(croppedImage.get(), 2, 2);
+            AvifData encoded;
+            ThrowIfFailed(GridEncoder::Encode(croppedImage.get(), layout, threads, CreateLosslessEncoder, encoded.Get()), "Failed to encode the grid: ");
+            passed &= DecodeAndCompare(log, (formatName + " grid").c_str(), croppedImage.get(), *encoded.Get());
+
+            // Whole cells, assembled with the offsets and mdat size of files past 4 GiB
+            SyntheticImageOptions wholeOptions;
+            wholeOptions.width = 256;
+            wholeOptions.height = 192;
+            const SyntheticImage whole(wholeOptions);
+            const auto wholeImage = CreateYuvImage(whole, format);
+
+            const auto cellWidth = wholeOptions.width / 2;
+            const auto cellHeight = wholeOptions.height / 2;
+            AvifGridWriter writer(wholeImage.get(), 2, 2, cellWidth, cellHeight);
+            for (uint32_t i = 0; i < 4; i++)
+            {
+                avifCropRect rect{ i % 2 * cellWidth, i / 2 * cellHeight, cellWidth, cellHeight };
+                ImagePtr cell(avifImageCreateEmpty(), avifImageDestroy);
+                const std::unique_ptr<avifEncoder, decltype(&avifEncoderDestroy)> encoder(CreateLosslessEncoder(1), avifEncoderDestroy);
+                if (!cell || !encoder)
+                {
+                    throw std::bad_alloc();
+                }
+                ThrowIfFailed(avifImageSetViewRect(cell.get(), wholeImage.get(), &rect), "Failed to crop a grid cell: ");
+
+                AvifData cellData;
+                ThrowIfFailed(avifEncoderAddImage(encoder.get(), cell.get(), 1, AVIF_ADD_IMAGE_FLAG_SINGLE), "Failed to encode a grid cell: ");
+                ThrowIfFailed(avifEncoderFinish(encoder.get(), cellData.Get()), "Failed to encode a grid cell: ");
+                writer.SetCell(i, cellData.GetData(), cellData.GetSize());
+            }
+
+            AvifData written;
+            writer.Write(written.Get(), true);
+            passed &= DecodeAndCompare(log, (formatName + " grid with large offsets").c_str(), wholeImage.get(), *written.Get());
+        }
+
+        return passed;
+    }
+}
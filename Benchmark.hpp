@@ -0,0 +1,98 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __BENCHMARK_HPP__
+#define __BENCHMARK_HPP__
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "Converter.hpp"
+#include "SyntheticImage.hpp"
+
+namespace JxrToAvif
+{
+    struct BenchmarkOptions
+    {
+        SyntheticImageOptions image;
+        uint32_t iterations = 3;
+        // Every combination is encoded, encoding is skipped when speeds are empty
+        std::vector<int> speeds{ ConversionOptions::DefaultSpeed };
+        std::vector<uint8_t> depths{ ConversionOptions::DefaultDepth };
+        std::vector<PixelFormat> formats{ PixelFormat::Yuv444 };
+        // Images converted at once end to end, with the first speed, depth and format, with and without
+        // the CPU budget. One skips the concurrent measurements.
+        uint32_t jobs = 2;
+    };
+
+    // Times the conversion of a synthetic image stage by stage and end to end:
+    // scRGB to PQ RGB with the exact and the fast curve, the MaxCLL search, RGB to YUV,
+    // direct YUV conversion and AV1 encoding, for every depth, format and speed asked for,
+    // and the throughput of several conversions at once.
+    class Benchmark
+    {
+    public:
+        explicit Benchmark(const BenchmarkOptions& options);
+
+        Benchmark(const Benchmark&) = delete;
+
+        Benchmark(Benchmark&&) = delete;
+
+        Benchmark& operator=(const Benchmark&) = delete;
+
+        Benchmark& operator=(Benchmark&&) = delete;
+
+        ~Benchmark() = default;
+
+        // Prints a line per measurement to the log
+        void Run(std::ostream& log);
+
+        // Results as a JSON document
+        void WriteResults(std::ostream& stream) const;
+
+        // Compares both PQ curves with the double precision one on every float in [0, 1], using the thread pool.
+        // Fails if either is off by more than half a step at 12 bits, or by more than its bound of PqCurve at 16 bits.
+        static bool CheckPqAccuracy(std::ostream& log);
+
+        // Encodes a small image losslessly as a 2x2 grid, once through GridEncoder with cropped cells at the edges
+        // and once through AvifGridWriter with large offsets, and decodes both with libavif.
+        // Fails unless the decoded images have the size, format and pixels of the source.
+        static bool CheckGridRoundTrip(std::ostream& log);
+
+    private:
+        struct Measurement
+        {
+            std::string stage;
+            bool fastPq = false;
+            // Depth 0, speed -1 and no format for stages that do not depend on them
+            uint8_t depth = 0;
+            int speed = -1;
+            PixelFormat format = PixelFormat::Rgb;
+            bool hasFormat = false;
+            // Conversions timed together, the megapixels of all of them count
+            uint32_t jobs = 1;
+            // Best, median and mean of all iterations
+            double bestSeconds = 0;
+            double medianSeconds = 0;
+            double meanSeconds = 0;
+            uint64_t outputSize = 0;
+            uint64_t peakMemory = 0;
+        };
+
+        BenchmarkOptions _options;
+        double _generateSeconds;
+        std::vector<Measurement> _measurements;
+
+        // Runs setup and the timed body once per iteration, only the body is timed
+        Measurement Measure(const std::string& stage, const std::function<void()>& setup, const std::function<void()>& body) const;
+
+        void Record(std::ostream& log, Measurement measurement);
+
+        [[nodiscard]] double GetMegapixelsPerSecond(const Measurement& measurement) const;
+
+        [[nodiscard]] static std::string GetVariantName(const Measurement& measurement);
+    };
+}
+
+#endif // __BENCHMARK_HPP__
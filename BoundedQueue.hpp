@@ -0,0 +1,78 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __BOUNDED_QUEUE_HPP__
+#define __BOUNDED_QUEUE_HPP__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+namespace JxrToAvif
+{
+    // Hands items from one thread to another, the producer blocks while the queue is full
+    template <typename T>
+    class BoundedQueue
+    {
+    public:
+        explicit BoundedQueue(const size_t capacity)
+            : _capacity(capacity), _closed(false)
+        {
+        }
+
+        BoundedQueue(const BoundedQueue&) = delete;
+
+        BoundedQueue(BoundedQueue&&) = delete;
+
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+        BoundedQueue& operator=(BoundedQueue&&) = delete;
+
+        ~BoundedQueue() = default;
+
+        void Push(T item)
+        {
+            {
+                std::unique_lock lock(_mutex);
+                _notFull.wait(lock, [this] { return _items.size() < _capacity; });
+                _items.push_back(std::move(item));
+            }
+            _notEmpty.notify_one();
+        }
+
+        // Returns false once the queue is closed and empty
+        bool Pop(T& item)
+        {
+            {
+                std::unique_lock lock(_mutex);
+                _notEmpty.wait(lock, [this] { return !_items.empty() || _closed; });
+                if (_items.empty())
+                    return false;
+                item = std::move(_items.front());
+                _items.pop_front();
+            }
+            _notFull.notify_one();
+            return true;
+        }
+
+        // Nothing may be pushed after closing
+        void Close()
+        {
+            {
+                const std::lock_guard lock(_mutex);
+                _closed = true;
+            }
+            _notEmpty.notify_all();
+        }
+
+    private:
+        size_t _capacity;
+        bool _closed;
+        std::deque<T> _items;
+        std::mutex _mutex;
+        std::condition_variable _notEmpty;
+        std::condition_variable _notFull;
+    };
+}
+
+#endif // __BOUNDED_QUEUE_HPP__
@@ -9,33 +9,41 @@
 namespace JxrToAvif
 {
     CommandLineParser::CommandLineParser([[maybe_unused]] int argc, [[maybe_unused]] char* argv[])
-        : _cmdline{}, _speed(DefaultSpeed),
-        _helpRequired(false), _useTiling(true), _realMaxCLL(false),
-        _format(PixelFormat::Yuv444), _depth(12), _outputFile(DefaultOutputFile)
+        : CommandLineParser(std::vector<std::wstring>())
     {
-        const auto rv = jxr_get_command_line(argc, argv, &_cmdline);
+        jxr_command_line cmdline{};
+        const auto rv = jxr_get_command_line(argc, argv, &cmdline);
         if(rv < 0)
         {
             throw std::runtime_error("Failed to retrieve process command line.");
         }
+
+        _args.assign(cmdline.argv, cmdline.argv + cmdline.argc);
+        jxr_free_command_line(&cmdline);
     }
 
-    CommandLineParser::~CommandLineParser()
+    CommandLineParser::CommandLineParser(std::vector<std::wstring> args)
+        : _args(std::move(args)), _speed(DefaultSpeed), _maxCllPercentile(DefaultMaxCllPercentile),
+        _helpRequired(false), _useTiling(true), _realMaxCLL(false), _directYuv(false), _lowMemory(false), _streaming(false), _fastPq(false), _gridColumns(0), _gridRows(0),
+        _maxJobs(DefaultMaxJobs), _hasOutputFile(false), _batch(false), _format(PixelFormat::Yuv444), _depth(12), _timeBudget(0), _targetSize(0), _thumbnailSize(0), _gainMapScale(0),
+        _threads(0), _encoderThreads(0),
+        _cacheSize(OutputCache::DefaultMaxSize), _cacheLink(false),
+        _sharedMemoryHandle(false), _rawWidth(0), _rawHeight(0), _rawStride(0), _rawBytesPerPixel(8),
+        _outputFile(DefaultOutputFile), _modelFile(EncodeTimeModel::DefaultFile)
     {
-        jxr_free_command_line(&_cmdline);
     }
 
     bool CommandLineParser::Parse()
     {
+        const auto argc = static_cast<int>(_args.size());
         int i = 1;
-        bool hasInputFile = false, hasOutputFile = false;
 
-        if (_cmdline.argc < 1)
+        if (argc < 1)
             return false;
 
-        while (i < _cmdline.argc)
+        while (i < argc)
         {
-            auto arg = std::wstring(_cmdline.argv[i]);
+            auto arg = _args[i];
             if (arg == L"--help")
             {
                 _helpRequired = true;
@@ -43,11 +51,11 @@ namespace JxrToAvif
             else if (arg == L"--speed")
             {
                 ++i;
-                if (i >= _cmdline.argc)
+                if (i >= argc)
                 {
                     return false;
                 }
-                arg = std::wstring(_cmdline.argv[i]);
+                arg = _args[i];
                 try
                 {
                     const auto n = std::stoi(arg);
@@ -63,11 +71,11 @@ namespace JxrToAvif
             else if(arg == L"--depth")
             {
                 ++i;
-                if(i >= _cmdline.argc)
+                if(i >= argc)
                 {
                     return false;
                 }
-                arg = std::wstring(_cmdline.argv[i]);
+                arg = _args[i];
                 try
                 {
                     const auto n = std::stoi(arg);
@@ -83,11 +91,11 @@ namespace JxrToAvif
             else if (arg == L"--format")
             {
                 ++i;
-                if(i >= _cmdline.argc)
+                if(i >= argc)
                 {
                     return false;
                 }
-                arg = std::wstring(_cmdline.argv[i]);
+                arg = _args[i];
                 std::transform(arg.begin(), arg.end(), arg.begin(), std::towlower);
                 if(arg == L"rgb")
                 {
@@ -122,29 +130,512 @@ namespace JxrToAvif
             {
                 _realMaxCLL = true;
             }
-            else if (hasOutputFile)
+            else if(arg == L"--maxcll-percentile")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                try
+                {
+                    const auto n = std::stod(arg);
+                    if (!(n > 0 && n <= 100))
+                        return false;
+                    _maxCllPercentile = n;
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--direct-yuv")
+            {
+                _directYuv = true;
+            }
+            else if(arg == L"--low-memory")
+            {
+                _lowMemory = true;
+            }
+            else if(arg == L"--streaming")
             {
-                return false;
+                _streaming = true;
             }
-            else if (hasInputFile)
+            else if(arg == L"--fast-pq")
             {
-                hasOutputFile = true;
-                _outputFile = arg;
+                _fastPq = true;
+            }
+            else if(arg == L"--grid")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                std::transform(arg.begin(), arg.end(), arg.begin(), std::towlower);
+                const auto separator = arg.find(L'x');
+                if (separator == std::wstring::npos)
+                {
+                    return false;
+                }
+                try
+                {
+                    size_t columnsLength = 0, rowsLength = 0;
+                    const auto columns = std::stoi(arg.substr(0, separator), &columnsLength);
+                    const auto rows = std::stoi(arg.substr(separator + 1), &rowsLength);
+                    if (columnsLength != separator || rowsLength != arg.size() - separator - 1 ||
+                        columns < 1 || rows < 1 || columns > static_cast<int>(MaxGridSize) || rows > static_cast<int>(MaxGridSize))
+                        return false;
+                    _gridColumns = static_cast<uint32_t>(columns);
+                    _gridRows = static_cast<uint32_t>(rows);
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--serve")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                _serveSocket = _args[i];
+            }
+            else if(arg == L"--max-jobs")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                try
+                {
+                    const auto n = std::stoi(arg);
+                    if (n < 1 || n > static_cast<int>(MaxJobs))
+                        return false;
+                    _maxJobs = static_cast<uint32_t>(n);
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--stats")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                _statsFile = _args[i];
+            }
+            else if(arg == L"--trace")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                _traceFile = _args[i];
+            }
+            else if(arg == L"--batch")
+            {
+                _batch = true;
+            }
+            else if(arg == L"--list")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                _listFile = _args[i];
+                _batch = true;
+            }
+            else if(arg == L"--output-dir")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                _outputDirectory = _args[i];
+                _batch = true;
+            }
+            else if(arg == L"--time-budget")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                try
+                {
+                    const auto n = std::stod(arg);
+                    if (!(n > 0))
+                        return false;
+                    _timeBudget = n;
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--target-size")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                try
+                {
+                    // Negative numbers would wrap around, as would shifting out the top bits
+                    if (arg.find(L'-') != std::wstring::npos)
+                        return false;
+                    size_t length = 0;
+                    const auto n = std::stoull(arg, &length);
+                    const auto suffix = length < arg.size() ? std::towlower(arg[length++]) : L'\0';
+                    int shift = 0;
+                    if (suffix == L'k')
+                        shift = 10;
+                    else if (suffix == L'm')
+                        shift = 20;
+                    else if (suffix != L'\0')
+                        return false;
+                    if (n == 0 || n > (UINT64_MAX >> shift) || length != arg.size())
+                        return false;
+                    _targetSize = static_cast<uint64_t>(n) << shift;
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--thumbnail")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                try
+                {
+                    const auto n = std::stoi(arg);
+                    if (n < 1 || n > static_cast<int>(MaxThumbnailSize))
+                        return false;
+                    _thumbnailSize = static_cast<uint32_t>(n);
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--gain-map")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                try
+                {
+                    const auto n = std::stoi(arg);
+                    if (n < 1 || n > static_cast<int>(GainMap::MaxScale))
+                        return false;
+                    _gainMapScale = static_cast<uint32_t>(n);
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--threads")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                try
+                {
+                    const auto n = std::stoi(arg);
+                    if (n < 1 || n > static_cast<int>(MaxThreads))
+                        return false;
+                    _threads = static_cast<uint32_t>(n);
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--encoder-threads")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                try
+                {
+                    const auto n = std::stoi(arg);
+                    if (n < 1 || n > static_cast<int>(MaxThreads))
+                        return false;
+                    _encoderThreads = static_cast<uint32_t>(n);
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--model")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                _modelFile = _args[i];
+            }
+            else if(arg == L"--calibrate")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                _calibrateFile = _args[i];
+            }
+            else if(arg == L"--cache")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                _cacheDirectory = _args[i];
+            }
+            else if(arg == L"--cache-size")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                try
+                {
+                    size_t length = 0;
+                    const auto n = std::stoull(arg, &length);
+                    if (n == 0 || n > MaxCacheSize || length != arg.size())
+                        return false;
+                    _cacheSize = n << 20;
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--cache-link")
+            {
+                _cacheLink = true;
+            }
+            else if(arg == L"--shm")
+            {
+                ++i;
+                if(i >= argc || _args[i].empty())
+                {
+                    return false;
+                }
+                _sharedMemoryName = _args[i];
+            }
+            else if(arg == L"--shm-fd")
+            {
+                _sharedMemoryHandle = true;
+            }
+            else if(arg == L"--raw-size")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                std::transform(arg.begin(), arg.end(), arg.begin(), std::towlower);
+                const auto separator = arg.find(L'x');
+                if (separator == std::wstring::npos)
+                {
+                    return false;
+                }
+                try
+                {
+                    size_t widthLength = 0, heightLength = 0;
+                    const auto width = std::stoi(arg.substr(0, separator), &widthLength);
+                    const auto height = std::stoi(arg.substr(separator + 1), &heightLength);
+                    if (widthLength != separator || heightLength != arg.size() - separator - 1 ||
+                        width < 1 || height < 1 || width > static_cast<int>(MaxRawSize) || height > static_cast<int>(MaxRawSize))
+                        return false;
+                    _rawWidth = static_cast<uint32_t>(width);
+                    _rawHeight = static_cast<uint32_t>(height);
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--raw-stride")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                try
+                {
+                    size_t length = 0;
+                    const auto n = std::stoul(arg, &length);
+                    if (n == 0 || n > MaxRawSize * 16 || length != arg.size())
+                        return false;
+                    _rawStride = static_cast<uint32_t>(n);
+                }
+                catch (std::exception&)
+                {
+                    return false;
+                }
+            }
+            else if(arg == L"--raw-format")
+            {
+                ++i;
+                if(i >= argc)
+                {
+                    return false;
+                }
+                arg = _args[i];
+                std::transform(arg.begin(), arg.end(), arg.begin(), std::towlower);
+                if(arg == L"half")
+                {
+                    _rawBytesPerPixel = 8;
+                }
+                else if(arg == L"float")
+                {
+                    _rawBytesPerPixel = 16;
+                }
+                else
+                {
+                    return false;
+                }
             }
             else
             {
-                hasInputFile = true;
-                _inputFile = arg;
+                _inputFiles.push_back(arg);
             }
             ++i;
         }
 
-        return hasInputFile;
+        // Gain map images are never split into a grid
+        if (_gainMapScale > 0 && (_gridColumns > 1 || _gridRows > 1))
+            return false;
+
+        // Raw pixels only come in shared memory, which holds nothing else, from a single producer
+        const auto sharedInput = !_sharedMemoryName.empty() || _sharedMemoryHandle;
+        if (sharedInput != (_rawWidth > 0) || (!_sharedMemoryName.empty() && _sharedMemoryHandle) ||
+            (_rawStride > 0 && _rawStride < _rawWidth * _rawBytesPerPixel) || (sharedInput && (_batch || !_serveSocket.empty() || !_calibrateFile.empty())))
+            return false;
+
+        // Calibration converts no files
+        if (!_calibrateFile.empty())
+            return _inputFiles.empty() && !_batch && _serveSocket.empty();
+
+        // The server takes input files with every job instead
+        if (!_serveSocket.empty())
+            return _inputFiles.empty() && !_batch;
+
+        if (_batch)
+            return !_inputFiles.empty() || !_listFile.empty();
+
+        // Shared memory takes the place of the input file
+        const size_t outputIndex = sharedInput ? 0 : 1;
+        if (_inputFiles.size() < outputIndex || _inputFiles.size() > outputIndex + 1)
+            return false;
+
+        if (!sharedInput)
+            _inputFile = _inputFiles[0];
+        if (_inputFiles.size() > outputIndex)
+        {
+            _hasOutputFile = true;
+            _outputFile = _inputFiles[outputIndex];
+        }
+
+        // A file on the standard output has no name to put a thumbnail next to, nor room for statistics
+        if (_outputFile == L"-" && (_thumbnailSize > 0 || _statsFile == L"-"))
+            return false;
+
+        // The cache hashes input files by name, the standard input is read only once, and shared memory is no file
+        if ((_inputFile == L"-" || sharedInput) && !_cacheDirectory.empty())
+            return false;
+
+        // A time budget picks the settings from the load of the machine, an entry would not be what a new run writes
+        if (_timeBudget > 0 && !_cacheDirectory.empty())
+            return false;
+
+        // The time model prices one encode, a quality search makes a dozen or more
+        if (_timeBudget > 0 && _targetSize > 0)
+            return false;
+
+        return true;
+    }
+
+    ConversionOptions CommandLineParser::GetConversionOptions() const
+    {
+        ConversionOptions options;
+        options.speed = _speed;
+        options.useTiling = _useTiling;
+        options.depth = _depth;
+        options.format = _format;
+        options.realMaxCLL = _realMaxCLL;
+        options.maxCllPercentile = _maxCllPercentile / 100;
+        options.directYuv = _directYuv;
+        options.lowMemory = _lowMemory;
+        options.streaming = _streaming;
+        options.fastPq = _fastPq;
+        options.gridColumns = _gridColumns;
+        options.gridRows = _gridRows;
+        options.timeBudget = _timeBudget;
+        options.targetSize = _targetSize;
+        options.thumbnailSize = _thumbnailSize;
+        options.gainMapScale = _gainMapScale;
+        options.encoderThreads = _encoderThreads > 0 ? _encoderThreads : _threads;
+        return options;
+    }
+
+    PixelSpan CommandLineParser::GetRawLayout() const
+    {
+        PixelSpan layout{};
+        layout.width = _rawWidth;
+        layout.height = _rawHeight;
+        layout.stride = _rawStride > 0 ? _rawStride : _rawWidth * _rawBytesPerPixel;
+        layout.bytesPerPixel = _rawBytesPerPixel;
+        return layout;
     }
 
     void CommandLineParser::PrintUsage()
     {
-        std::cout << "Usage: jxr_to_avif [options] input.jxr [output.avif]\n";
+        std::cout << "Usage: jxr_to_avif [options] input.jxr|- [output.avif|-]\n";
+        std::cout << "       jxr_to_avif [options] --batch input.jxr|directory...\n";
+        std::cout << "       jxr_to_avif [options] --shm <name> --raw-size <w>x<h> [output.avif|-]\n";
+        std::cout << "       jxr_to_avif --calibrate <model>\n";
         std::cout << "Options:\n";
         std::cout << "  --help              Print this message.\n";
         std::cout << "  --speed <n>         AVIF encoding speed.\n";
@@ -159,5 +650,73 @@ namespace JxrToAvif
         std::cout << "                        rgb, yuv444, yuv422, yuv420, yuv400\n";
         std::cout << "  --real-maxcll      Calculate real MaxCLL\n";
         std::cout << "                     instead of top percentile.\n";
+        std::cout << "  --maxcll-percentile <n>\n";
+        std::cout << "                      Percentage of pixels at or below MaxCLL.\n";
+        std::cout << "                      Defaults to 99.99.\n";
+        std::cout << "  --direct-yuv        Convert straight into YUV planes\n";
+        std::cout << "                      without the 16 bit RGB intermediate.\n";
+        std::cout << "  --low-memory        Reuse the decoded image buffer for the output\n";
+        std::cout << "                      and free buffers as soon as possible.\n";
+        std::cout << "  --streaming         Decode and convert in bands of rows, the decoded\n";
+        std::cout << "                      image is never held in memory as a whole.\n";
+        std::cout << "  --fast-pq           Use a table approximation of the PQ curve.\n";
+        std::cout << "                      Off by less than 0.06 of a 12 bit step.\n";
+        std::cout << "  --grid <c>x<r>      Encode as a grid of c columns and r rows,\n";
+        std::cout << "                      each cell in parallel. 1x1 disables the grid.\n";
+        std::cout << "                      Images over 8192 pixels use 4096 pixel cells.\n";
+        std::cout << "  --serve <socket>    Serve conversion jobs on a Unix domain socket\n";
+        std::cout << "                      instead of converting a file, see README.\n";
+        std::cout << "  --max-jobs <n>      Number of jobs the server runs at once.\n";
+        std::cout << "                      Defaults to 2.\n";
+        std::cout << "  --stats <file>      Write timings and resource usage as JSON,\n";
+        std::cout << "                      one line per file. - writes to the standard\n";
+        std::cout << "                      output instead of progress messages.\n";
+        std::cout << "  --trace <file>      Write a timeline of the conversion threads\n";
+        std::cout << "                      in Chrome trace event format.\n";
+        std::cout << "  --batch             Convert every input file, and every .jxr file\n";
+        std::cout << "                      of input directories, to a .avif file\n";
+        std::cout << "                      next to it. Failed files do not stop the batch.\n";
+        std::cout << "  --list <file>       Add the inputs named on the lines of a file.\n";
+        std::cout << "                      Implies --batch.\n";
+        std::cout << "  --output-dir <dir>  Write batch outputs to a directory.\n";
+        std::cout << "                      Implies --batch.\n";
+        std::cout << "  --target-size <n>   Encode lossy at the highest quality that fits\n";
+        std::cout << "                      in n bytes, or KiB or MiB with a K or M suffix.\n";
+        std::cout << "  --thumbnail <n>     Also write a lossy preview no larger than n\n";
+        std::cout << "                      pixels on either side, as name.thumb.avif\n";
+        std::cout << "                      next to the output.\n";
+        std::cout << "  --gain-map <n>      Write an SDR base image tone mapped from the HDR\n";
+        std::cout << "                      one, with a gain map 1/n of its size restoring\n";
+        std::cout << "                      HDR on displays that support it. n is 1 to 16.\n";
+        std::cout << "  --threads <n>       Number of conversion threads. Defaults to the\n";
+        std::cout << "                      processors the process may use, as limited by\n";
+        std::cout << "                      its affinity and container CPU quota.\n";
+        std::cout << "  --encoder-threads <n>\n";
+        std::cout << "                      Number of AV1 encoder threads.\n";
+        std::cout << "                      Defaults to --threads.\n";
+        std::cout << "  --time-budget <s>   Choose the slowest speed and the tiling predicted\n";
+        std::cout << "                      to convert each file within s seconds.\n";
+        std::cout << "                      Overrides --speed and --without-tiling.\n";
+        std::cout << "  --model <file>      Encode time model for --time-budget.\n";
+        std::cout << "                      Defaults to jxr_to_avif.model.\n";
+        std::cout << "  --calibrate <file>  Measure encoding times on this machine and\n";
+        std::cout << "                      write the model to a file. Takes minutes.\n";
+        std::cout << "  --cache <dir>       Keep outputs in a directory under a hash of the\n";
+        std::cout << "                      input and the options, and copy them from there\n";
+        std::cout << "                      instead of converting identical inputs again.\n";
+        std::cout << "  --cache-size <n>    Cache size limit in MiB, least recently used\n";
+        std::cout << "                      outputs go first. Defaults to 1024.\n";
+        std::cout << "  --cache-link        Hard link cached outputs instead of copying.\n";
+        std::cout << "                      Linked outputs must not be modified in place.\n";
+        std::cout << "  --shm <name>        Convert raw scRGB RGBA pixels a capture left in\n";
+        std::cout << "                      shared memory of a name, instead of a file.\n";
+        std::cout << "                      They are read from there, without a copy.\n";
+        std::cout << "  --shm-fd            The same for a descriptor passed with a server\n";
+        std::cout << "                      job on Linux, see README.\n";
+        std::cout << "  --raw-size <w>x<h>  Width and height of the raw pixels.\n";
+        std::cout << "  --raw-stride <n>    Bytes from one row of raw pixels to the next.\n";
+        std::cout << "                      Defaults to rows without padding.\n";
+        std::cout << "  --raw-format <f>    Components of the raw pixels, half or float.\n";
+        std::cout << "                      Defaults to half.\n";
     }
 }
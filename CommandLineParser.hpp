@@ -5,6 +5,11 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
+#include "Converter.hpp"
+#include "EncodeTimeModel.hpp"
+#include "GainMap.hpp"
+#include "OutputCache.hpp"
 #include "PixelFormat.hpp"
 #include "jxr_sys_helpers.h"
 
@@ -15,6 +20,9 @@ namespace JxrToAvif
     public:
         CommandLineParser(int argc, char* argv[]);
 
+        // Arguments start with the program name, just like argv
+        explicit CommandLineParser(std::vector<std::wstring> args);
+
         CommandLineParser(const CommandLineParser&) = delete;
 
         CommandLineParser(CommandLineParser&&) = delete;
@@ -23,7 +31,7 @@ namespace JxrToAvif
 
         CommandLineParser&& operator=(CommandLineParser&&) = delete;
 
-        ~CommandLineParser();
+        ~CommandLineParser() = default;
 
         [[nodiscard]] const std::wstring& GetInputFile() const
         {
@@ -65,25 +73,248 @@ namespace JxrToAvif
             return _realMaxCLL;
         }
 
+        // In percent
+        [[nodiscard]] double GetMaxCllPercentile() const
+        {
+            return _maxCllPercentile;
+        }
+
+        [[nodiscard]] bool GetIsDirectYuv() const
+        {
+            return _directYuv;
+        }
+
+        [[nodiscard]] bool GetIsLowMemory() const
+        {
+            return _lowMemory;
+        }
+
+        [[nodiscard]] bool GetIsStreaming() const
+        {
+            return _streaming;
+        }
+
+        [[nodiscard]] bool GetIsFastPq() const
+        {
+            return _fastPq;
+        }
+
+        // Zero if the grid is chosen automatically
+        [[nodiscard]] uint32_t GetGridColumns() const
+        {
+            return _gridColumns;
+        }
+
+        [[nodiscard]] uint32_t GetGridRows() const
+        {
+            return _gridRows;
+        }
+
+        [[nodiscard]] bool GetIsOutputFileSet() const
+        {
+            return _hasOutputFile;
+        }
+
+        // Empty unless running as a server
+        [[nodiscard]] const std::wstring& GetServeSocket() const
+        {
+            return _serveSocket;
+        }
+
+        [[nodiscard]] uint32_t GetMaxJobs() const
+        {
+            return _maxJobs;
+        }
+
+        [[nodiscard]] bool GetIsBatch() const
+        {
+            return _batch;
+        }
+
+        // Files and directories of a batch
+        [[nodiscard]] const std::vector<std::wstring>& GetInputFiles() const
+        {
+            return _inputFiles;
+        }
+
+        // Empty unless a batch takes its inputs from a list file
+        [[nodiscard]] const std::wstring& GetListFile() const
+        {
+            return _listFile;
+        }
+
+        // Empty if batch outputs are written next to their inputs
+        [[nodiscard]] const std::wstring& GetOutputDirectory() const
+        {
+            return _outputDirectory;
+        }
+
+        // Empty unless statistics are asked for, "-" for the standard output
+        [[nodiscard]] const std::wstring& GetStatsFile() const
+        {
+            return _statsFile;
+        }
+
+        // Empty unless a trace is asked for
+        [[nodiscard]] const std::wstring& GetTraceFile() const
+        {
+            return _traceFile;
+        }
+
+        // Zero without a budget
+        [[nodiscard]] double GetTimeBudget() const
+        {
+            return _timeBudget;
+        }
+
+        // Zero without thumbnails
+        [[nodiscard]] uint32_t GetThumbnailSize() const
+        {
+            return _thumbnailSize;
+        }
+
+        // Zero without a gain map
+        [[nodiscard]] uint32_t GetGainMapScale() const
+        {
+            return _gainMapScale;
+        }
+
+        // Zero uses every processor the process may use
+        [[nodiscard]] uint32_t GetThreads() const
+        {
+            return _threads;
+        }
+
+        // Zero follows GetThreads
+        [[nodiscard]] uint32_t GetEncoderThreads() const
+        {
+            return _encoderThreads;
+        }
+
+        // Zero for lossless encoding
+        [[nodiscard]] uint64_t GetTargetSize() const
+        {
+            return _targetSize;
+        }
+
+        [[nodiscard]] const std::wstring& GetModelFile() const
+        {
+            return _modelFile;
+        }
+
+        // Empty unless the encode time model is to be calibrated
+        [[nodiscard]] const std::wstring& GetCalibrateFile() const
+        {
+            return _calibrateFile;
+        }
+
+        // Empty without an output cache
+        [[nodiscard]] const std::wstring& GetCacheDirectory() const
+        {
+            return _cacheDirectory;
+        }
+
+        // In bytes
+        [[nodiscard]] uint64_t GetCacheSize() const
+        {
+            return _cacheSize;
+        }
+
+        [[nodiscard]] bool GetIsCacheLinked() const
+        {
+            return _cacheLink;
+        }
+
+        // Empty unless the input is raw pixels in shared memory of a name
+        [[nodiscard]] const std::wstring& GetSharedMemoryName() const
+        {
+            return _sharedMemoryName;
+        }
+
+        // Raw pixels in shared memory of a descriptor passed with a server job
+        [[nodiscard]] bool GetIsSharedMemoryHandle() const
+        {
+            return _sharedMemoryHandle;
+        }
+
+        // Size, stride and bytes per pixel of raw pixels in shared memory, with null pixels
+        [[nodiscard]] PixelSpan GetRawLayout() const;
+
+        // Everything but the log and the time model
+        [[nodiscard]] ConversionOptions GetConversionOptions() const;
+
         bool Parse();
 
         static void PrintUsage();
 
     private:
+        static constexpr uint32_t MaxGridSize = 256;
+
+        static constexpr uint32_t DefaultMaxJobs = 2;
+
+        static constexpr uint32_t MaxJobs = 64;
+
+        static constexpr uint32_t MaxThumbnailSize = 4096;
+
+        // Windows tops out at 64 processor groups of 64
+        static constexpr uint32_t MaxThreads = 4096;
+
+        // Of raw pixels on either side
+        static constexpr uint32_t MaxRawSize = 1 << 16;
+
+        // In MiB, a million of them is more than any disk holds
+        static constexpr uint64_t MaxCacheSize = 1 << 20;
+
         static constexpr auto DefaultOutputFile = L"output.avif";
 
         // 6 is default speed of the command line encoder, so it should be a good value?
         static constexpr int DefaultSpeed = 6;
 
-        jxr_command_line _cmdline;
+        static constexpr double DefaultMaxCllPercentile = 99.99;
+
+        std::vector<std::wstring> _args;
         int _speed;
+        double _maxCllPercentile;
         bool _helpRequired;
         bool _useTiling;
         bool _realMaxCLL;
+        bool _directYuv;
+        bool _lowMemory;
+        bool _streaming;
+        bool _fastPq;
+        uint32_t _gridColumns;
+        uint32_t _gridRows;
+        uint32_t _maxJobs;
+        bool _hasOutputFile;
+        bool _batch;
         PixelFormat _format;
         uint8_t _depth;
+        double _timeBudget;
+        uint64_t _targetSize;
+        uint32_t _thumbnailSize;
+        uint32_t _gainMapScale;
+        uint32_t _threads;
+        uint32_t _encoderThreads;
+        uint64_t _cacheSize;
+        bool _cacheLink;
+        bool _sharedMemoryHandle;
+        uint32_t _rawWidth;
+        uint32_t _rawHeight;
+        // Zero for rows without padding
+        uint32_t _rawStride;
+        uint8_t _rawBytesPerPixel;
         std::wstring _inputFile;
         std::wstring _outputFile;
+        std::wstring _serveSocket;
+        std::vector<std::wstring> _inputFiles;
+        std::wstring _listFile;
+        std::wstring _outputDirectory;
+        std::wstring _statsFile;
+        std::wstring _traceFile;
+        std::wstring _modelFile;
+        std::wstring _calibrateFile;
+        std::wstring _cacheDirectory;
+        std::wstring _sharedMemoryName;
     };
 }
 
@@ -0,0 +1,200 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "jxr_sys_helpers.h"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
+#include "ContentHash.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        constexpr uint64_t Prime1 = 11400714785074694791ull;
+        constexpr uint64_t Prime2 = 14029467366897019727ull;
+        constexpr uint64_t Prime3 = 1609587929392839161ull;
+        constexpr uint64_t Prime4 = 9650029242287828579ull;
+        constexpr uint64_t Prime5 = 2870177450012600261ull;
+
+        uint64_t RotateLeft(const uint64_t x, const int bits)
+        {
+            return (x << bits) | (x >> (64 - bits));
+        }
+
+        // Little endian loads, the only byte order this converter runs on
+        uint64_t Read64(const uint8_t* p)
+        {
+            uint64_t value;
+            std::memcpy(&value, p, sizeof(value));
+            return value;
+        }
+
+        uint32_t Read32(const uint8_t* p)
+        {
+            uint32_t value;
+            std::memcpy(&value, p, sizeof(value));
+            return value;
+        }
+
+        uint64_t Round(uint64_t accumulator, const uint64_t input)
+        {
+            accumulator += input * Prime2;
+            accumulator = RotateLeft(accumulator, 31);
+            return accumulator * Prime1;
+        }
+
+        uint64_t MergeRound(uint64_t accumulator, const uint64_t value)
+        {
+            accumulator ^= Round(0, value);
+            return accumulator * Prime1 + Prime4;
+        }
+
+        std::string GetErrorDescription(const int hr)
+        {
+            const auto errorDesc = jxr_get_error_description(hr);
+            std::string description(errorDesc ? errorDesc : "");
+            jxr_free_error_description(errorDesc);
+            return description;
+        }
+    }
+
+    uint64_t ContentHash::Hash(const void* data, const size_t size, const uint64_t seed)
+    {
+        auto p = static_cast<const uint8_t*>(data);
+        const auto end = p + size;
+        uint64_t hash;
+
+        if (size >= 32)
+        {
+            auto v1 = seed + Prime1 + Prime2;
+            auto v2 = seed + Prime2;
+            auto v3 = seed;
+            auto v4 = seed - Prime1;
+
+            for (; p + 32 <= end; p += 32)
+            {
+                v1 = Round(v1, Read64(p));
+                v2 = Round(v2, Read64(p + 8));
+                v3 = Round(v3, Read64(p + 16));
+                v4 = Round(v4, Read64(p + 24));
+            }
+
+            hash = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+            hash = MergeRound(hash, v1);
+            hash = MergeRound(hash, v2);
+            hash = MergeRound(hash, v3);
+            hash = MergeRound(hash, v4);
+        }
+        else
+        {
+            hash = seed + Prime5;
+        }
+
+        hash += size;
+
+        for (; p + 8 <= end; p += 8)
+        {
+            hash ^= Round(0, Read64(p));
+            hash = RotateLeft(hash, 27) * Prime1 + Prime4;
+        }
+
+        if (p + 4 <= end)
+        {
+            hash ^= Read32(p) * Prime1;
+            hash = RotateLeft(hash, 23) * Prime2 + Prime3;
+            p += 4;
+        }
+
+        for (; p < end; p++)
+        {
+            hash ^= *p * Prime5;
+            hash = RotateLeft(hash, 11) * Prime1;
+        }
+
+        hash ^= hash >> 33;
+        hash *= Prime2;
+        hash ^= hash >> 29;
+        hash *= Prime3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+    uint64_t ContentHash::HashFile(const std::wstring& filename)
+    {
+        const TraceScope trace("hash");
+
+        jxr_file* file = nullptr;
+        uint64_t fileSize = 0;
+        const auto openResult = jxr_open_file(filename.c_str(), &file, &fileSize);
+        if (openResult < 0)
+        {
+            throw std::runtime_error("Failed to open input: " + GetErrorDescription(openResult));
+        }
+
+        const std::unique_ptr<jxr_file, decltype(&jxr_close_file)> fileGuard(file, jxr_close_file);
+
+        auto& pool = ThreadPool::GetInstance();
+        const auto chunkCount = static_cast<size_t>((fileSize + ChunkSize - 1) / ChunkSize);
+        std::vector<uint64_t> chunkHashes(chunkCount);
+        std::vector<std::unique_ptr<uint8_t[]>> buffers(std::min(ChunksInFlight, chunkCount));
+        ThreadPool::TaskGroup groups[ChunksInFlight];
+
+        try
+        {
+            for (size_t i = 0; i < chunkCount; i++)
+            {
+                // The buffer of chunk i - ChunksInFlight is free again once its hash is done
+                const auto slot = i % ChunksInFlight;
+                if (buffers[slot])
+                    pool.Wait(groups[slot]);
+                else
+                    buffers[slot] = std::unique_ptr<uint8_t[]>(new uint8_t[ChunkSize]);
+
+                const auto size = static_cast<size_t>(std::min<uint64_t>(ChunkSize, fileSize - static_cast<uint64_t>(i) * ChunkSize));
+                size_t bytesRead = 0;
+                const auto readResult = jxr_read_file_part(file, buffers[slot].get(), size, &bytesRead);
+                if (readResult < 0)
+                {
+                    throw std::runtime_error("Failed to read input: " + GetErrorDescription(readResult));
+                }
+                if (bytesRead != size)
+                {
+                    throw std::runtime_error("Input changed while it was hashed.");
+                }
+
+                const auto data = buffers[slot].get();
+                pool.Submit(groups[slot], [data, size, i, &chunkHashes]
+                {
+                    const TraceScope chunkTrace("hash-chunk", "chunk", static_cast<int64_t>(i));
+                    chunkHashes[i] = Hash(data, size);
+                });
+            }
+        }
+        catch (...)
+        {
+            // Tasks still use the buffers
+            for (auto& group : groups)
+            {
+                try
+                {
+                    pool.Wait(group);
+                }
+                catch (...)
+                {
+                }
+            }
+            throw;
+        }
+
+        for (auto& group : groups)
+        {
+            pool.Wait(group);
+        }
+
+        return Hash(chunkHashes.data(), chunkHashes.size() * sizeof(uint64_t), fileSize);
+    }
+}
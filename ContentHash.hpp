@@ -0,0 +1,31 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __CONTENT_HASH_HPP__
+#define __CONTENT_HASH_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace JxrToAvif
+{
+    // XXH64 of memory, and a chunked variant of it for files. Files are read in chunks on the calling thread
+    // while earlier chunks are hashed on the thread pool, the file hash is the XXH64 of the chunk hashes
+    // seeded with the file size. It differs from the XXH64 of the whole file, but hashes at the speed
+    // of the disk instead of a single core.
+    class ContentHash
+    {
+    public:
+        static constexpr size_t ChunkSize = 8 << 20;
+
+        // Chunks read ahead of hashing, which bounds the memory to ChunksInFlight * ChunkSize
+        static constexpr size_t ChunksInFlight = 4;
+
+        static uint64_t Hash(const void* data, size_t size, uint64_t seed = 0);
+
+        // Throws if the file can not be read or changes size while it is hashed
+        static uint64_t HashFile(const std::wstring& filename);
+    };
+}
+
+#endif // __CONTENT_HASH_HPP__
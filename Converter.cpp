@@ -0,0 +1,471 @@
+// adapted from avif-example-encode.c, see libavif license in LICENSE-THIRD-PARTY
+// original copyright notice follows
+
+// Copyright 2020 Joe Drago, 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include "jxr_sys_helpers.h"
+#include "CpuBudget.hpp"
+#include "EncodeTimeModel.hpp"
+#include "GainMap.hpp"
+#include "JxrImage.hpp"
+#include "QualitySearch.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
+#include "Converter.hpp"
+
+constexpr auto INTERMEDIATE_BITS = 16;  // bit depth of the integer texture given to the encoder;
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        using EncoderPtr = std::unique_ptr<avifEncoder, decltype(&avifEncoderDestroy)>;
+
+        void ThrowIfFailed(const avifResult result, const char* message)
+        {
+            if (result != AVIF_RESULT_OK)
+            {
+                throw std::runtime_error(std::string(message) + avifResultToString(result));
+            }
+        }
+    }
+
+    Converter::Converter(const ConversionOptions& options)
+        : _options(options)
+    {
+    }
+
+    PreparedImage::PreparedImage()
+        : _image(nullptr, avifImageDestroy), _thumbnail(nullptr, avifImageDestroy)
+    {
+    }
+
+    PreparedImage::PreparedImage(PreparedImage&&) noexcept(true) = default;
+
+    PreparedImage& PreparedImage::operator=(PreparedImage&&) noexcept(true) = default;
+
+    PreparedImage::~PreparedImage() = default;
+
+    ConversionResult Converter::ConvertFile(const std::wstring& filename) const
+    {
+        return Encode(PrepareFile(filename));
+    }
+
+    ConversionResult Converter::ConvertMemory(const uint8_t* buffer, const size_t size) const
+    {
+        return Encode(PrepareMemory(buffer, size));
+    }
+
+    ConversionResult Converter::ConvertPixels(const PixelSpan& pixels) const
+    {
+        return Encode(PreparePixels(pixels));
+    }
+
+    PreparedImage Converter::PrepareFile(const std::wstring& filename) const
+    {
+        Stopwatch stopwatch;
+        auto jxrImage = std::make_unique<JxrImage>(filename, _options.realMaxCLL, _options.maxCllPercentile, _options.streaming);
+        return Prepare(std::move(jxrImage), { stopwatch.Lap("decode") });
+    }
+
+    PreparedImage Converter::PrepareMemory(const uint8_t* buffer, const size_t size) const
+    {
+        Stopwatch stopwatch;
+        auto jxrImage = std::make_unique<JxrImage>(buffer, size, _options.realMaxCLL, _options.maxCllPercentile, _options.streaming);
+        return Prepare(std::move(jxrImage), { stopwatch.Lap("decode") });
+    }
+
+    PreparedImage Converter::PreparePixels(const PixelSpan& pixels) const
+    {
+        jxr_data data{};
+        data.width = pixels.width;
+        data.height = pixels.height;
+        data.stride = pixels.stride;
+        data.buffer_size = static_cast<size_t>(pixels.stride) * pixels.height;
+        data.bytes_per_pixel = pixels.bytesPerPixel;
+        // Borrowed pixels are never written to
+        data.pixels = const_cast<uint8_t*>(pixels.pixels);
+
+        return Prepare(std::make_unique<JxrImage>(data, _options.realMaxCLL, _options.maxCllPercentile), {});
+    }
+
+    PreparedImage Converter::Prepare(std::unique_ptr<JxrImage> jxrImage, std::vector<PhaseTiming> phases) const
+    {
+        Stopwatch stopwatch;
+        const auto log = _options.log;
+        const auto outputFormat = _options.format;
+        const auto lowMemory = _options.lowMemory;
+        const auto gainMap = _options.gainMapScale > 0;
+
+        if (gainMap && !GainMap::IsSupported())
+        {
+            throw std::runtime_error("Gain maps need libavif 1.2 or later.");
+        }
+
+        jxrImage->SetFastPq(_options.fastPq);
+        jxrImage->SetThumbnailSize(_options.thumbnailSize);
+
+        avifPixelFormat targetFormat = AVIF_PIXEL_FORMAT_YUV444;
+        switch (outputFormat)
+        {
+        case PixelFormat::Yuv400:
+            targetFormat = AVIF_PIXEL_FORMAT_YUV400;
+            break;
+        case PixelFormat::Yuv420:
+            targetFormat = AVIF_PIXEL_FORMAT_YUV420;
+            break;
+        case PixelFormat::Yuv422:
+            targetFormat = AVIF_PIXEL_FORMAT_YUV422;
+            break;
+        case PixelFormat::Yuv444:
+        case PixelFormat::Rgb:
+            targetFormat = AVIF_PIXEL_FORMAT_YUV444;
+            break;
+        }
+
+        PreparedImage prepared;
+        auto& result = prepared._result;
+        result.phases = std::move(phases);
+
+        // these values dictate what goes into the final AVIF
+        prepared._image.reset(avifImageCreate(jxrImage->GetWidth(), jxrImage->GetHeight(), gainMap ? GainMap::BaseDepth : _options.depth, targetFormat));
+        const auto image = prepared._image.get();
+        if (!image)
+        {
+            throw std::bad_alloc();
+        }
+        // Configure image here: (see avif/avif.h)
+        // * colorPrimaries
+        // * transferCharacteristics
+        // * matrixCoefficients
+        // * avifImageSetProfileICC()
+        // * avifImageSetMetadataExif()
+        // * avifImageSetMetadataXMP()
+        // * yuvRange
+        // * alphaPremultiplied
+        // * transforms (transformFlags, pasp, clap, irot, imir)
+        // With a gain map the image is the SDR base, and the PQ signal describes the alternate rendition
+        image->colorPrimaries = gainMap ? AVIF_COLOR_PRIMARIES_BT709 : AVIF_COLOR_PRIMARIES_BT2020;
+        image->transferCharacteristics = gainMap ? AVIF_TRANSFER_CHARACTERISTICS_SRGB : AVIF_TRANSFER_CHARACTERISTICS_SMPTE2084;
+
+        if (outputFormat == PixelFormat::Rgb)
+        {
+            image->matrixCoefficients = AVIF_MATRIX_COEFFICIENTS_IDENTITY;
+        }
+        else
+        {
+            image->matrixCoefficients = gainMap ? AVIF_MATRIX_COEFFICIENTS_BT709 : AVIF_MATRIX_COEFFICIENTS_BT2020_NCL;
+        }
+
+        if (log)
+        {
+            *log << "Using " << ThreadPool::GetInstance().GetWorkerCount() << " threads\n";
+            *log << "Converting pixels to BT.2100 PQ...\n" << std::flush;
+        }
+
+        // Only decoded images have a buffer for the planes to overlay.
+        // Gain maps are computed from the RGB intermediate once MaxCLL is known, never straight into YUV.
+        const auto directYuv = _options.directYuv && !gainMap;
+        const auto overlay = directYuv && lowMemory && !_options.streaming && jxrImage->HasSourceBuffer();
+        if (overlay)
+        {
+            // Planes overlay the decoded pixels, which have to live until the encoder copies them
+            jxrImage->ConvertToYuv(image, true);
+            result.phases.push_back(stopwatch.Lap("convert"));
+        }
+        else if (directYuv)
+        {
+            ThrowIfFailed(avifImageAllocatePlanes(image, AVIF_PLANES_YUV), "Failed to allocate YUV planes: ");
+            jxrImage->ConvertToYuv(image);
+            result.phases.push_back(stopwatch.Lap("convert"));
+        }
+        else
+        {
+            jxrImage->ConvertToRgb(lowMemory);
+            result.phases.push_back(stopwatch.Lap("convert"));
+        }
+
+        if (gainMap)
+        {
+            // The tone curve depends on MaxCLL, so the base is made in a second pass over the 6 byte
+            // PQ intermediate rather than during the first one over the 8 or 16 byte decoded pixels
+            avifContentLightLevelInformationBox clli{};
+            clli.maxCLL = jxrImage->GetMaxCLL();
+            clli.maxPALL = jxrImage->GetMaxFALL();
+            GainMap::Build(jxrImage->GetDataPointer(), jxrImage->GetRowBytes(), _options.gainMapScale, clli, _options.depth, image);
+            result.gainMapWidth = (image->width + _options.gainMapScale - 1) / _options.gainMapScale;
+            result.gainMapHeight = (image->height + _options.gainMapScale - 1) / _options.gainMapScale;
+            result.phases.push_back(stopwatch.Lap("gain-map"));
+
+            if (log)
+            {
+                *log << "Tone mapped to SDR with a " << result.gainMapWidth << "x" << result.gainMapHeight << " gain map\n" << std::flush;
+            }
+        }
+        else if (!overlay && !directYuv)
+        {
+            // If you have RGB(A) data you want to encode, use this path
+            avifRGBImage rgb = {};
+            avifRGBImageSetDefaults(&rgb, image);
+            // Override RGB(A)->YUV(A) defaults here:
+            //   depth, format, chromaDownsampling, avoidLibYUV, ignoreAlpha, alphaPremultiplied, etc.
+            rgb.format = AVIF_RGB_FORMAT_RGB;
+            rgb.depth = INTERMEDIATE_BITS;
+            rgb.pixels = reinterpret_cast<uint8_t*>(jxrImage->GetDataPointer());
+            rgb.rowBytes = static_cast<uint32_t>(jxrImage->GetRowBytes());
+
+            {
+                const TraceScope trace("rgb-to-yuv");
+                ThrowIfFailed(avifImageRGBToYUV(image, &rgb), "Failed to convert to YUV(A): ");
+            }
+            result.phases.push_back(stopwatch.Lap("rgb-to-yuv"));
+        }
+
+        if (_options.thumbnailSize > 0)
+        {
+            prepared._thumbnail.reset(avifImageCreate(jxrImage->GetThumbnailWidth(), jxrImage->GetThumbnailHeight(), _options.depth, targetFormat));
+            const auto thumbnail = prepared._thumbnail.get();
+            if (!thumbnail)
+            {
+                throw std::bad_alloc();
+            }
+            // Thumbnails stay HDR, even next to a gain map image
+            thumbnail->colorPrimaries = AVIF_COLOR_PRIMARIES_BT2020;
+            thumbnail->transferCharacteristics = AVIF_TRANSFER_CHARACTERISTICS_SMPTE2084;
+            thumbnail->matrixCoefficients = outputFormat == PixelFormat::Rgb ? AVIF_MATRIX_COEFFICIENTS_IDENTITY : AVIF_MATRIX_COEFFICIENTS_BT2020_NCL;
+
+            avifRGBImage rgb = {};
+            avifRGBImageSetDefaults(&rgb, thumbnail);
+            rgb.format = AVIF_RGB_FORMAT_RGB;
+            rgb.depth = INTERMEDIATE_BITS;
+            rgb.pixels = const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(jxrImage->GetThumbnailPixels()));
+            rgb.rowBytes = static_cast<uint32_t>(sizeof(ushort3) * thumbnail->width);
+            ThrowIfFailed(avifImageRGBToYUV(thumbnail, &rgb), "Failed to convert thumbnail to YUV(A): ");
+        }
+
+        result.width = jxrImage->GetWidth();
+        result.height = jxrImage->GetHeight();
+        result.maxCLL = jxrImage->GetMaxCLL();
+        result.maxFALL = jxrImage->GetMaxFALL();
+        result.statistics.Merge(jxrImage->GetStatistics());
+        result.statistics.Finalize();
+        result.threads = ThreadPool::GetInstance().GetWorkerCount();
+        result.workerBusySeconds = jxrImage->GetWorkerBusySeconds();
+
+        if (log)
+        {
+            const auto& statistics = result.statistics;
+            *log << "Computed HDR metadata: " << result.maxCLL << " MaxCLL, " << result.maxFALL << " MaxFALL.\n";
+            *log << "Light levels: "
+                << std::lround(statistics.GetPercentileNits(0.5)) << " nits median, "
+                << std::lround(statistics.GetPercentileNits(0.9)) << " nits 90%, "
+                << std::lround(statistics.GetPercentileNits(0.99)) << " nits 99%, "
+                << std::lround(statistics.GetPercentileNits(0.9999)) << " nits 99.99%, "
+                << std::lround(statistics.GetMaxNits()) << " nits max.\n";
+        }
+
+        // The light levels of a gain map image belong to its alternate rendition
+        if (!gainMap)
+        {
+            image->clli.maxCLL = result.maxCLL;
+            image->clli.maxPALL = result.maxFALL;
+        }
+        if (prepared._thumbnail)
+        {
+            prepared._thumbnail->clli.maxCLL = result.maxCLL;
+            prepared._thumbnail->clli.maxPALL = result.maxFALL;
+        }
+
+        // Prepared images wait for the encoder holding nothing but the planes
+        if (overlay)
+        {
+            prepared._jxrImage = std::move(jxrImage);
+        }
+
+        return prepared;
+    }
+
+    ConversionResult Converter::Encode(PreparedImage prepared) const
+    {
+        const TraceScope trace("encode");
+        Stopwatch stopwatch;
+        const auto log = _options.log;
+        const auto image = prepared._image.get();
+        auto result = std::move(prepared._result);
+
+        const auto encoderThreads = _options.encoderThreads > 0 ? _options.encoderThreads : ThreadPool::GetInstance().GetWorkerCount();
+        const auto lease = _options.useCpuBudget ? CpuBudget::GetInstance().Acquire(encoderThreads) : CpuBudget::Lease(encoderThreads);
+        result.encoderThreads = lease.GetCount();
+        result.budgetWaitSeconds = lease.GetWaitSeconds();
+
+        auto speed = _options.speed;
+        auto useTiling = _options.useTiling;
+        auto tileRowsLog2 = _options.tileRowsLog2;
+        auto tileColsLog2 = _options.tileColsLog2;
+        if (_options.timeModel && _options.timeBudget > 0)
+        {
+            // Decoding, conversion and waiting for the CPU budget already spent part of the budget
+            auto remainingSeconds = _options.timeBudget - result.budgetWaitSeconds;
+            for (const auto& phase : result.phases)
+            {
+                remainingSeconds -= phase.wallSeconds;
+            }
+
+            const auto settings = _options.timeModel->Choose(image->width, image->height, _options.format, _options.depth,
+                remainingSeconds, result.encoderThreads);
+            speed = settings.speed;
+            tileRowsLog2 = settings.tileRowsLog2;
+            tileColsLog2 = settings.tileColsLog2;
+            result.predictedEncodeSeconds = settings.predictedSeconds;
+
+            if (log)
+            {
+                *log << "Time budget leaves " << std::max(remainingSeconds, 0.) << " s to encode, using speed " << speed << " with "
+                    << (1 << tileRowsLog2) << "x" << (1 << tileColsLog2) << " tiles, predicted " << settings.predictedSeconds << " s\n";
+            }
+        }
+
+        result.speed = speed;
+        if (tileRowsLog2 >= 0 && tileColsLog2 >= 0)
+        {
+            useTiling = false;
+            result.tileRowsLog2 = tileRowsLog2;
+            result.tileColsLog2 = tileColsLog2;
+        }
+        else
+        {
+            tileRowsLog2 = 0;
+            tileColsLog2 = 0;
+        }
+
+        const auto createEncoder = [speed, useTiling, tileRowsLog2, tileColsLog2](const int quality, const int threads)
+        {
+            const auto encoder = avifEncoderCreate();
+            if (encoder)
+            {
+                // Configure your encoder here (see avif/avif.h):
+                // * maxThreads
+                // * quality
+                // * qualityAlpha
+                // * tileRowsLog2
+                // * tileColsLog2
+                // * speed
+                // * keyframeInterval
+                // * timescale
+                encoder->quality = quality;
+                encoder->qualityAlpha = AVIF_QUALITY_LOSSLESS;
+                encoder->speed = speed;
+                encoder->maxThreads = threads;
+                encoder->autoTiling = useTiling ? AVIF_TRUE : AVIF_FALSE;
+                encoder->tileRowsLog2 = tileRowsLog2;
+                encoder->tileColsLog2 = tileColsLog2;
+#if AVIF_VERSION >= 10200000
+                encoder->qualityGainMap = quality;
+#endif
+            }
+            return encoder;
+        };
+
+        // Grid cells would each need a gain map of their own, so gain map images are never split
+        result.grid = _options.gainMapScale > 0 ? GridEncoder::ChooseLayout(image, 1, 1) : GridEncoder::ChooseLayout(image, _options.gridColumns, _options.gridRows);
+
+        // A quality search encodes the image several times, so its planes are kept to the end
+        const auto searchQuality = _options.targetSize > 0;
+        const auto freePlanes = _options.lowMemory && !searchQuality;
+        const auto encodeImage = [&](const int quality, avifRWData* output)
+        {
+            if (result.grid.IsGrid())
+            {
+                const auto createCellEncoder = [&createEncoder, quality](const int threads)
+                {
+                    return createEncoder(quality, threads);
+                };
+                ThrowIfFailed(GridEncoder::Encode(image, result.grid, lease, createCellEncoder, output), "Failed to encode grid: ");
+                return;
+            }
+
+            const EncoderPtr encoder(createEncoder(quality, static_cast<int>(result.encoderThreads)), avifEncoderDestroy);
+            if (!encoder)
+            {
+                throw std::bad_alloc();
+            }
+
+            // Call avifEncoderAddImage() for each image in your sequence
+            // Only set AVIF_ADD_IMAGE_FLAG_SINGLE if you're not encoding a sequence
+            const auto addResult = avifEncoderAddImage(encoder.get(), image, 1, AVIF_ADD_IMAGE_FLAG_SINGLE);
+
+            if (freePlanes)
+            {
+                // The codec keeps its own copy of the frame from here on
+                avifImageFreePlanes(image, AVIF_PLANES_YUV);
+                prepared._jxrImage.reset();
+            }
+
+            ThrowIfFailed(addResult, "Failed to add image to encoder: ");
+            ThrowIfFailed(avifEncoderFinish(encoder.get(), output), "Failed to finish encoding: ");
+        };
+
+        if (log)
+        {
+            if (result.grid.IsGrid())
+            {
+                *log << "Doing AVIF grid encoding, " << result.grid.columns << "x" << result.grid.rows << " cells...\n" << std::flush;
+            }
+            else
+            {
+                *log << "Doing AVIF encoding...\n" << std::flush;
+            }
+        }
+
+        Stopwatch encodeStopwatch;
+        if (searchQuality)
+        {
+            result.qualitySearch = QualitySearch::Run(image, _options.targetSize, lease, createEncoder, encodeImage, result.avif.Get(), log);
+        }
+        else
+        {
+            encodeImage(AVIF_QUALITY_LOSSLESS, result.avif.Get());
+        }
+        result.encodeSeconds = encodeStopwatch.Lap("encode-image").wallSeconds;
+
+        if (prepared._thumbnail)
+        {
+            const TraceScope thumbnailTrace("encode-thumbnail");
+            const EncoderPtr encoder(createEncoder(ConversionOptions::ThumbnailQuality, static_cast<int>(result.encoderThreads)), avifEncoderDestroy);
+            if (!encoder)
+            {
+                throw std::bad_alloc();
+            }
+            encoder->speed = ConversionOptions::ThumbnailSpeed;
+            encoder->autoTiling = AVIF_FALSE;
+            encoder->tileRowsLog2 = 0;
+            encoder->tileColsLog2 = 0;
+
+            ThrowIfFailed(avifEncoderAddImage(encoder.get(), prepared._thumbnail.get(), 1, AVIF_ADD_IMAGE_FLAG_SINGLE), "Failed to add thumbnail to encoder: ");
+            ThrowIfFailed(avifEncoderFinish(encoder.get(), result.thumbnail.Get()), "Failed to finish encoding thumbnail: ");
+        }
+
+        result.phases.push_back(stopwatch.Lap("encode"));
+
+        if (log)
+        {
+            *log << "Encode success: " << result.avif.GetSize() << " total bytes\n";
+            if (result.thumbnail.GetSize() > 0)
+            {
+                *log << "Thumbnail: " << prepared._thumbnail->width << "x" << prepared._thumbnail->height << ", "
+                    << result.thumbnail.GetSize() << " bytes\n";
+            }
+            if (result.predictedEncodeSeconds > 0)
+            {
+                *log << "Encoding took " << result.encodeSeconds << " s, predicted " << result.predictedEncodeSeconds << " s\n";
+            }
+        }
+
+        return result;
+    }
+}
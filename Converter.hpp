@@ -0,0 +1,257 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __CONVERTER_HPP__
+#define __CONVERTER_HPP__
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <avif/avif.h>
+#include "GridEncoder.hpp"
+#include "HdrStatistics.hpp"
+#include "PixelFormat.hpp"
+#include "QualitySearch.hpp"
+#include "Stopwatch.hpp"
+
+namespace JxrToAvif
+{
+    class EncodeTimeModel;
+    class JxrImage;
+
+    struct ConversionOptions
+    {
+        // 6 is default speed of the command line encoder, so it should be a good value?
+        static constexpr int DefaultSpeed = 6;
+
+        static constexpr uint8_t DefaultDepth = 12;
+
+        static constexpr double DefaultMaxCllPercentile = 0.9999;
+
+        // Previews are small and only looked at briefly, fast lossy encoding is plenty
+        static constexpr int ThumbnailSpeed = 8;
+        static constexpr int ThumbnailQuality = 70;
+
+        int speed = DefaultSpeed;
+        bool useTiling = true;
+        uint8_t depth = DefaultDepth;
+        PixelFormat format = PixelFormat::Yuv444;
+        bool realMaxCLL = false;
+        // Fraction of pixels at or below MaxCLL
+        double maxCllPercentile = DefaultMaxCllPercentile;
+        bool directYuv = false;
+        bool lowMemory = false;
+        bool streaming = false;
+        bool fastPq = false;
+        // Zero columns and rows choose the grid automatically
+        uint32_t gridColumns = 0;
+        uint32_t gridRows = 0;
+        // Zero uses all processors
+        uint32_t encoderThreads = 0;
+        // Encoders lease their threads from CpuBudget::GetInstance(), waiting for a free slot and taking
+        // at most encoderThreads of the free ones. Without, they take encoderThreads whatever else runs.
+        bool useCpuBudget = true;
+        // Negative tile counts leave tiling to useTiling
+        int tileRowsLog2 = -1;
+        int tileColsLog2 = -1;
+        // With a model, a positive budget in seconds for the whole conversion overrides
+        // speed and tiling with the slowest settings predicted to encode in time
+        double timeBudget = 0;
+        const EncodeTimeModel* timeModel = nullptr;
+        // A positive size in bytes encodes lossy at the highest quality that fits, instead of lossless
+        uint64_t targetSize = 0;
+        // A positive size also makes a lossy preview no larger than that on either side,
+        // averaged in linear light during the same pass over the pixels
+        uint32_t thumbnailSize = 0;
+        // A positive scale makes the output an SDR base with a gain map restoring the HDR rendition,
+        // 1/scale of the image size on either side. The base is tone mapped from the PQ intermediate.
+        uint32_t gainMapScale = 0;
+        // Progress messages, nothing is written when null
+        std::ostream* log = nullptr;
+    };
+
+    // Owns encoded AVIF bytes
+    class AvifData
+    {
+    public:
+        AvifData() noexcept(true)
+            : _data(AVIF_DATA_EMPTY)
+        {
+        }
+
+        AvifData(const AvifData&) = delete;
+
+        AvifData(AvifData&& rhs) noexcept(true)
+            : _data(rhs._data)
+        {
+            rhs._data = AVIF_DATA_EMPTY;
+        }
+
+        ~AvifData() noexcept(true)
+        {
+            avifRWDataFree(&_data);
+        }
+
+        AvifData& operator=(const AvifData&) = delete;
+
+        AvifData& operator=(AvifData&& rhs) noexcept(true)
+        {
+            if (this != &rhs)
+            {
+                avifRWDataFree(&_data);
+                _data = rhs._data;
+                rhs._data = AVIF_DATA_EMPTY;
+            }
+            return *this;
+        }
+
+        [[nodiscard]] const uint8_t* GetData() const
+        {
+            return _data.data;
+        }
+
+        [[nodiscard]] size_t GetSize() const
+        {
+            return _data.size;
+        }
+
+        [[nodiscard]] avifRWData* Get()
+        {
+            return &_data;
+        }
+
+    private:
+        avifRWData _data;
+    };
+
+    struct ConversionResult
+    {
+        AvifData avif;
+        // Empty without a thumbnail size
+        AvifData thumbnail;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint16_t maxCLL = 0;
+        uint16_t maxFALL = 0;
+        HdrStatistics statistics;
+        GridLayout grid{};
+        // Zero without a gain map
+        uint32_t gainMapWidth = 0;
+        uint32_t gainMapHeight = 0;
+        // Phases in the order they ran: decode, convert, rgb-to-yuv or gain-map, and encode, as far as they apply.
+        // Streaming decodes during conversion, its decode phase only opens the image.
+        std::vector<PhaseTiming> phases;
+        // Pool workers converting pixels, and the threads given to the encoder after the budget
+        uint32_t threads = 0;
+        uint32_t encoderThreads = 0;
+        // Part of the encode phase spent waiting for the CPU budget
+        double budgetWaitSeconds = 0;
+        // Encoder settings the time budget chose, with zero predicted seconds without a budget
+        int speed = 0;
+        int tileRowsLog2 = 0;
+        int tileColsLog2 = 0;
+        double predictedEncodeSeconds = 0;
+        // Part of the encode phase the prediction is for: the main image, without the budget wait and the thumbnail
+        double encodeSeconds = 0;
+        QualitySearchResult qualitySearch;
+        // Conversion time of every pool worker
+        std::vector<double> workerBusySeconds;
+    };
+
+    // Decoded scRGB RGBA pixels, with half or float components for 8 or 16 bytes per pixel
+    struct PixelSpan
+    {
+        const uint8_t* pixels;
+        uint32_t width;
+        uint32_t height;
+        uint32_t stride;
+        uint8_t bytesPerPixel;
+    };
+
+    // An image converted to YUV, waiting to be encoded. Only images with planes
+    // overlaying the decoded pixels keep them, see ConversionOptions::lowMemory.
+    class PreparedImage
+    {
+    public:
+        PreparedImage(const PreparedImage&) = delete;
+
+        PreparedImage(PreparedImage&&) noexcept(true);
+
+        PreparedImage& operator=(const PreparedImage&) = delete;
+
+        PreparedImage& operator=(PreparedImage&&) noexcept(true);
+
+        ~PreparedImage();
+
+        [[nodiscard]] uint32_t GetWidth() const
+        {
+            return _result.width;
+        }
+
+        [[nodiscard]] uint32_t GetHeight() const
+        {
+            return _result.height;
+        }
+
+    private:
+        friend class Converter;
+
+        std::unique_ptr<JxrImage> _jxrImage;
+        std::unique_ptr<avifImage, decltype(&avifImageDestroy)> _image;
+        std::unique_ptr<avifImage, decltype(&avifImageDestroy)> _thumbnail;
+        // Everything but the AVIF file
+        ConversionResult _result;
+
+        PreparedImage();
+    };
+
+    // Converts JPEG XR images to AVIF in memory. Conversions run on the process-wide thread pool,
+    // so a converter is cheap to create and may be used from several threads at once.
+    // Failures are reported by exceptions.
+    class Converter
+    {
+    public:
+        explicit Converter(const ConversionOptions& options = ConversionOptions());
+
+        Converter(const Converter&) = delete;
+
+        Converter(Converter&&) = delete;
+
+        Converter& operator=(const Converter&) = delete;
+
+        Converter& operator=(Converter&&) = delete;
+
+        ~Converter() = default;
+
+        [[nodiscard]] const ConversionOptions& GetOptions() const
+        {
+            return _options;
+        }
+
+        [[nodiscard]] ConversionResult ConvertFile(const std::wstring& filename) const;
+
+        // The buffer holds a whole JPEG XR file and is only read during the call
+        [[nodiscard]] ConversionResult ConvertMemory(const uint8_t* buffer, size_t size) const;
+
+        // Pixels are only read during the call, the source buffer options do not apply
+        [[nodiscard]] ConversionResult ConvertPixels(const PixelSpan& pixels) const;
+
+        // The Convert* methods in two steps, so pipelines can convert one image while encoding another.
+        // Prepare* decodes and converts the image using the thread pool, Encode runs the AV1 encoder.
+        [[nodiscard]] PreparedImage PrepareFile(const std::wstring& filename) const;
+
+        [[nodiscard]] PreparedImage PrepareMemory(const uint8_t* buffer, size_t size) const;
+
+        [[nodiscard]] PreparedImage PreparePixels(const PixelSpan& pixels) const;
+
+        [[nodiscard]] ConversionResult Encode(PreparedImage image) const;
+
+    private:
+        ConversionOptions _options;
+
+        PreparedImage Prepare(std::unique_ptr<JxrImage> jxrImage, std::vector<PhaseTiming> phases) const;
+    };
+}
+
+#endif // __CONVERTER_HPP__
@@ -0,0 +1,105 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <chrono>
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
+#include "CpuBudget.hpp"
+
+namespace JxrToAvif
+{
+    CpuBudget::Lease::Lease(const uint32_t count)
+        : _budget(nullptr), _count(count), _waitSeconds(0)
+    {
+    }
+
+    CpuBudget::Lease::Lease(CpuBudget* budget, const uint32_t count, const double waitSeconds)
+        : _budget(budget), _count(count), _waitSeconds(waitSeconds)
+    {
+    }
+
+    CpuBudget::Lease::Lease(Lease&& rhs) noexcept(true)
+        : _budget(rhs._budget), _count(rhs._count), _waitSeconds(rhs._waitSeconds)
+    {
+        rhs._budget = nullptr;
+        rhs._count = 0;
+    }
+
+    CpuBudget::Lease::~Lease()
+    {
+        if (_budget)
+            _budget->Release(_count);
+    }
+
+    CpuBudget::Loan::Loan(const Lease& lease, const uint32_t count)
+        : _budget(lease._budget), _count(std::min(count, lease._count))
+    {
+        if (_budget)
+            _budget->Lend(_count);
+    }
+
+    CpuBudget::Loan::~Loan()
+    {
+        if (_budget)
+            _budget->Lend(-static_cast<int64_t>(_count));
+    }
+
+    CpuBudget::CpuBudget(ThreadPool& pool)
+        : _pool(pool), _slotCount(pool.GetWorkerCount()), _leased(0), _lent(0), _nextTicket(0), _servedTicket(0)
+    {
+    }
+
+    CpuBudget& CpuBudget::GetInstance()
+    {
+        static CpuBudget instance(ThreadPool::GetInstance());
+        return instance;
+    }
+
+    CpuBudget::Lease CpuBudget::Acquire(const uint32_t desired)
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        std::unique_lock lock(_mutex);
+        const auto ticket = _nextTicket++;
+
+        if (_servedTicket != ticket || _leased >= _slotCount)
+        {
+            const TraceScope trace("cpu-budget-wait");
+            _released.wait(lock, [this, ticket] { return _servedTicket == ticket && _leased < _slotCount; });
+        }
+
+        const auto count = std::clamp(desired, 1u, _slotCount - _leased);
+        _leased += count;
+        _servedTicket++;
+        UpdatePoolLimit();
+        lock.unlock();
+
+        // The next in line may find slots left
+        _released.notify_all();
+
+        const std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+        return Lease(this, count, waited.count());
+    }
+
+    void CpuBudget::Release(const uint32_t count)
+    {
+        {
+            const std::lock_guard lock(_mutex);
+            _leased -= count;
+            UpdatePoolLimit();
+        }
+        _released.notify_all();
+    }
+
+    void CpuBudget::Lend(const int64_t count)
+    {
+        const std::lock_guard lock(_mutex);
+        _lent = static_cast<uint32_t>(_lent + count);
+        UpdatePoolLimit();
+    }
+
+    void CpuBudget::UpdatePoolLimit()
+    {
+        _pool.SetActiveWorkerLimit(_slotCount - _leased + _lent);
+    }
+}
@@ -0,0 +1,128 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __CPU_BUDGET_HPP__
+#define __CPU_BUDGET_HPP__
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace JxrToAvif
+{
+    class ThreadPool;
+
+    // Shares the processors of a thread pool between the pool and the AV1 encoders of all jobs in the process.
+    // Encoders take a fixed number of threads when they are created, so they lease slots for the whole encode.
+    // Conversions run on the pool, which may only run tasks on the slots nobody leased, and grows or shrinks
+    // at task boundaries as leases come and go. So the slots of a finished conversion go to the next encode,
+    // and those of a finished encode to the conversions still running.
+    class CpuBudget
+    {
+    public:
+        class Loan;
+
+        // Slots held by an encode, returned on destruction
+        class Lease
+        {
+        public:
+            // Threads outside of any budget, for encodes that do not take part
+            explicit Lease(uint32_t count);
+
+            Lease(const Lease&) = delete;
+
+            Lease(Lease&& rhs) noexcept(true);
+
+            Lease& operator=(const Lease&) = delete;
+
+            Lease& operator=(Lease&&) = delete;
+
+            ~Lease();
+
+            [[nodiscard]] uint32_t GetCount() const
+            {
+                return _count;
+            }
+
+            // Seconds the lease waited for a free slot
+            [[nodiscard]] double GetWaitSeconds() const
+            {
+                return _waitSeconds;
+            }
+
+        private:
+            friend class CpuBudget;
+            friend class Loan;
+
+            CpuBudget* _budget;
+            uint32_t _count;
+            double _waitSeconds;
+
+            Lease(CpuBudget* budget, uint32_t count, double waitSeconds);
+        };
+
+        // Lends slots of a lease back to the pool while alive, for encoders running on pool workers:
+        // a worker busy in an encoder is one of the encoder's threads, but the pool only starts it within its limit
+        class Loan
+        {
+        public:
+            Loan(const Lease& lease, uint32_t count);
+
+            Loan(const Loan&) = delete;
+
+            Loan(Loan&&) = delete;
+
+            Loan& operator=(const Loan&) = delete;
+
+            Loan& operator=(Loan&&) = delete;
+
+            ~Loan();
+
+        private:
+            CpuBudget* _budget;
+            uint32_t _count;
+        };
+
+        // As many slots as the pool has workers
+        explicit CpuBudget(ThreadPool& pool);
+
+        CpuBudget(const CpuBudget&) = delete;
+
+        CpuBudget(CpuBudget&&) = delete;
+
+        CpuBudget& operator=(const CpuBudget&) = delete;
+
+        CpuBudget& operator=(CpuBudget&&) = delete;
+
+        ~CpuBudget() = default;
+
+        // The budget of the process-wide thread pool
+        static CpuBudget& GetInstance();
+
+        [[nodiscard]] uint32_t GetSlotCount() const
+        {
+            return _slotCount;
+        }
+
+        // Waits for a free slot, in the order of the calls, and leases up to `desired` of the free ones
+        [[nodiscard]] Lease Acquire(uint32_t desired);
+
+    private:
+        ThreadPool& _pool;
+        const uint32_t _slotCount;
+        std::mutex _mutex;
+        std::condition_variable _released;
+        uint32_t _leased;
+        uint32_t _lent;
+        uint64_t _nextTicket;
+        uint64_t _servedTicket;
+
+        void Release(uint32_t count);
+
+        void Lend(int64_t count);
+
+        // Called under the mutex
+        void UpdatePoolLimit();
+    };
+}
+
+#endif // __CPU_BUDGET_HPP__
@@ -0,0 +1,304 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+#include "jxr_sys_helpers.h"
+#include "Converter.hpp"
+#include "SyntheticImage.hpp"
+#include "ThreadPool.hpp"
+#include "EncodeTimeModel.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        // Per speed sweep, format and depth factors, and thread scaling
+        constexpr uint32_t SweepSize = 256;
+        constexpr uint32_t FactorSize = 512;
+        constexpr uint32_t ThreadingSize = 2048;
+
+        constexpr int FactorSpeed = 6;
+
+        constexpr const char* FormatNames[] = { "rgb", "yuv444", "yuv422", "yuv420", "yuv400" };
+
+        std::string GetErrorDescription(const int hr)
+        {
+            const auto errorDesc = jxr_get_error_description(hr);
+            std::string description(errorDesc ? errorDesc : "");
+            jxr_free_error_description(errorDesc);
+            return description;
+        }
+
+        SyntheticImageOptions GetImageOptions(const uint32_t size)
+        {
+            SyntheticImageOptions options;
+            options.width = size;
+            options.height = size;
+            return options;
+        }
+
+        double MeasureEncode(const SyntheticImage& image, const PixelFormat format, const uint8_t depth, const int speed,
+            const uint32_t threads, const int tileRowsLog2, const int tileColsLog2)
+        {
+            ConversionOptions options;
+            options.speed = speed;
+            options.format = format;
+            options.depth = depth;
+            options.directYuv = true;
+            options.encoderThreads = threads;
+            options.tileRowsLog2 = tileRowsLog2;
+            options.tileColsLog2 = tileColsLog2;
+
+            const Converter converter(options);
+            const auto result = converter.Encode(converter.PreparePixels(image.GetPixels()));
+            return result.phases.back().wallSeconds;
+        }
+
+        double GetMegapixels(const uint32_t width, const uint32_t height)
+        {
+            return static_cast<double>(width) * height / 1e6;
+        }
+
+        uint32_t GetTileCount(const int tileRowsLog2, const int tileColsLog2)
+        {
+            return 1u << (tileRowsLog2 + tileColsLog2);
+        }
+    }
+
+    EncodeTimeModel EncodeTimeModel::Calibrate(std::ostream* log)
+    {
+        EncodeTimeModel model;
+        const auto threads = ThreadPool::GetInstance().GetWorkerCount();
+
+        {
+            const SyntheticImage image(GetImageOptions(SweepSize));
+            for (auto speed = SpeedCount - 1; speed >= 0; speed--)
+            {
+                const auto seconds = MeasureEncode(image, PixelFormat::Yuv444, 12, speed, 1, 0, 0);
+                model._secondsPerMegapixel[speed] = seconds / GetMegapixels(SweepSize, SweepSize);
+                if (log)
+                {
+                    *log << "Speed " << speed << ": " << model._secondsPerMegapixel[speed] << " s per megapixel on one thread\n" << std::flush;
+                }
+            }
+        }
+
+        {
+            const SyntheticImage image(GetImageOptions(FactorSize));
+            const auto baseSeconds = MeasureEncode(image, PixelFormat::Yuv444, 12, FactorSpeed, 1, 0, 0);
+            for (size_t format = 0; format < FormatCount; format++)
+            {
+                if (static_cast<PixelFormat>(format) != PixelFormat::Yuv444)
+                {
+                    model._formatFactors[format] = MeasureEncode(image, static_cast<PixelFormat>(format), 12, FactorSpeed, 1, 0, 0) / baseSeconds;
+                }
+            }
+            model._depth10Factor = MeasureEncode(image, PixelFormat::Yuv444, 10, FactorSpeed, 1, 0, 0) / baseSeconds;
+        }
+
+        {
+            const SyntheticImage image(GetImageOptions(ThreadingSize));
+            int tileRowsLog2, tileColsLog2;
+            ChooseTiles(ThreadingSize, ThreadingSize, threads, tileRowsLog2, tileColsLog2);
+
+            // Solves the speedups of GetSpeedup for the efficiencies
+            const auto singleThreadSeconds = MeasureEncode(image, PixelFormat::Yuv444, 12, FactorSpeed, 1, 0, 0);
+            if (threads > 1)
+            {
+                const auto singleTileSpeedup = singleThreadSeconds / MeasureEncode(image, PixelFormat::Yuv444, 12, FactorSpeed, threads, 0, 0);
+                model._singleTileEfficiency = std::clamp((singleTileSpeedup - 1) / (threads - 1), 0., 1.);
+            }
+
+            const auto tiledThreads = std::min(threads, GetTileCount(tileRowsLog2, tileColsLog2));
+            if (tiledThreads > 1)
+            {
+                const auto tiledSpeedup = singleThreadSeconds / MeasureEncode(image, PixelFormat::Yuv444, 12, FactorSpeed, threads, tileRowsLog2, tileColsLog2);
+                model._tiledEfficiency = std::clamp((tiledSpeedup - 1 - (threads - tiledThreads) * model._singleTileEfficiency) / (tiledThreads - 1), 0., 1.);
+            }
+        }
+
+        if (log)
+        {
+            *log << "Thread efficiency: " << model._singleTileEfficiency << " with a single tile, "
+                << model._tiledEfficiency << " with tiles, " << threads << " threads\n" << std::flush;
+        }
+
+        return model;
+    }
+
+    EncodeTimeModel EncodeTimeModel::Load(const std::wstring& filename)
+    {
+        uint8_t* data = nullptr;
+        size_t size = 0;
+        const auto rv = jxr_read_file(filename.c_str(), &data, &size);
+        if (rv < 0)
+        {
+            throw std::runtime_error("Failed to read encode time model: " + GetErrorDescription(rv));
+        }
+
+        std::istringstream text(std::string(reinterpret_cast<const char*>(data), size));
+        jxr_free_file_data(data);
+
+        EncodeTimeModel model;
+        int version = 0;
+        uint32_t speedsRead = 0;
+        std::string line;
+        while (std::getline(text, line))
+        {
+            std::istringstream fields(line);
+            std::string key;
+            if (!(fields >> key) || key[0] == '#')
+                continue;
+
+            auto valid = true;
+            if (key == "version")
+            {
+                valid = static_cast<bool>(fields >> version);
+            }
+            else if (key == "speed")
+            {
+                int speed = -1;
+                double seconds = 0;
+                valid = fields >> speed >> seconds && speed >= 0 && speed < SpeedCount && seconds > 0;
+                if (valid)
+                {
+                    model._secondsPerMegapixel[speed] = seconds;
+                    speedsRead |= 1u << speed;
+                }
+            }
+            else if (key == "format")
+            {
+                std::string name;
+                double factor = 0;
+                valid = fields >> name >> factor && factor > 0;
+                const auto found = std::find(std::begin(FormatNames), std::end(FormatNames), name);
+                valid = valid && found != std::end(FormatNames);
+                if (valid)
+                    model._formatFactors[static_cast<size_t>(found - std::begin(FormatNames))] = factor;
+            }
+            else if (key == "depth10")
+            {
+                valid = fields >> model._depth10Factor && model._depth10Factor > 0;
+            }
+            else if (key == "single-tile-efficiency")
+            {
+                valid = fields >> model._singleTileEfficiency && model._singleTileEfficiency >= 0 && model._singleTileEfficiency <= 1;
+            }
+            else if (key == "tiled-efficiency")
+            {
+                valid = fields >> model._tiledEfficiency && model._tiledEfficiency >= 0 && model._tiledEfficiency <= 1;
+            }
+
+            // Unknown keys are skipped, so newer files stay readable
+            if (!valid)
+            {
+                throw std::runtime_error("Invalid encode time model line: " + line);
+            }
+        }
+
+        if (version != FileVersion || speedsRead != (1u << SpeedCount) - 1)
+        {
+            throw std::runtime_error("Encode time model is incomplete or of another version, run --calibrate again.");
+        }
+
+        return model;
+    }
+
+    void EncodeTimeModel::Save(const std::wstring& filename) const
+    {
+        std::ostringstream text;
+        text.precision(17);
+        text << "# jxr_to_avif encode time model, written by --calibrate\n";
+        text << "version " << FileVersion << "\n";
+        text << "# Seconds per megapixel on one thread, a single tile, yuv444 at 12 bits\n";
+        for (auto speed = 0; speed < SpeedCount; speed++)
+        {
+            text << "speed " << speed << " " << _secondsPerMegapixel[speed] << "\n";
+        }
+        text << "# Time relative to yuv444 at 12 bits\n";
+        for (size_t format = 0; format < FormatCount; format++)
+        {
+            text << "format " << FormatNames[format] << " " << _formatFactors[format] << "\n";
+        }
+        text << "depth10 " << _depth10Factor << "\n";
+        text << "# Speedup added by each thread, up to the tile count with tiles\n";
+        text << "single-tile-efficiency " << _singleTileEfficiency << "\n";
+        text << "tiled-efficiency " << _tiledEfficiency << "\n";
+
+        const auto str = text.str();
+        const auto rv = jxr_write_data_to_file(filename.c_str(), str.data(), str.size());
+        if (rv < 0)
+        {
+            throw std::runtime_error("Failed to write encode time model: " + GetErrorDescription(rv));
+        }
+    }
+
+    double EncodeTimeModel::Predict(const uint32_t width, const uint32_t height, const PixelFormat format, const uint8_t depth,
+        const int speed, const int tileRowsLog2, const int tileColsLog2, const uint32_t threads) const
+    {
+        const auto clampedSpeed = std::clamp(speed, 0, SpeedCount - 1);
+
+        auto seconds = GetMegapixels(width, height) * _secondsPerMegapixel[clampedSpeed];
+        seconds *= _formatFactors[static_cast<size_t>(format)];
+        if (depth <= 10)
+            seconds *= _depth10Factor;
+
+        return seconds / GetSpeedup(threads, GetTileCount(tileRowsLog2, tileColsLog2));
+    }
+
+    double EncodeTimeModel::GetSpeedup(uint32_t threads, const uint32_t tileCount) const
+    {
+        // Up to one thread per tile scales with the tiled efficiency, more threads only split the rows within tiles
+        threads = std::max<uint32_t>(threads, 1);
+        const auto tiledThreads = tileCount > 1 ? std::min(threads, tileCount) : 1;
+        return 1 + (tiledThreads - 1) * _tiledEfficiency + (threads - tiledThreads) * _singleTileEfficiency;
+    }
+
+    EncoderSettings EncodeTimeModel::Choose(const uint32_t width, const uint32_t height, const PixelFormat format, const uint8_t depth,
+        const double budgetSeconds, const uint32_t threads) const
+    {
+        int tileRowsLog2, tileColsLog2;
+        ChooseTiles(width, height, threads, tileRowsLog2, tileColsLog2);
+
+        EncoderSettings settings;
+        for (auto speed = 0; speed < SpeedCount; speed++)
+        {
+            settings.speed = speed;
+            settings.tileRowsLog2 = 0;
+            settings.tileColsLog2 = 0;
+            settings.predictedSeconds = Predict(width, height, format, depth, speed, 0, 0, threads);
+            if (settings.predictedSeconds <= budgetSeconds * BudgetMargin)
+                return settings;
+
+            settings.tileRowsLog2 = tileRowsLog2;
+            settings.tileColsLog2 = tileColsLog2;
+            settings.predictedSeconds = Predict(width, height, format, depth, speed, tileRowsLog2, tileColsLog2, threads);
+            if (settings.predictedSeconds <= budgetSeconds * BudgetMargin)
+                return settings;
+        }
+
+        // Nothing fits, the fastest tiled settings get closest
+        return settings;
+    }
+
+    void EncodeTimeModel::ChooseTiles(const uint32_t width, const uint32_t height, const uint32_t threads, int& tileRowsLog2, int& tileColsLog2)
+    {
+        tileRowsLog2 = 0;
+        tileColsLog2 = 0;
+
+        // Columns first, they split the work more evenly for wide screenshots
+        while (GetTileCount(tileRowsLog2, tileColsLog2) < threads)
+        {
+            const auto canSplitColumns = tileColsLog2 < MaxTileLog2 && (width >> (tileColsLog2 + 1)) >= MinTileSize;
+            const auto canSplitRows = tileRowsLog2 < MaxTileLog2 && (height >> (tileRowsLog2 + 1)) >= MinTileSize;
+            if (canSplitColumns && (tileColsLog2 <= tileRowsLog2 || !canSplitRows))
+                tileColsLog2++;
+            else if (canSplitRows)
+                tileRowsLog2++;
+            else
+                break;
+        }
+    }
+}
@@ -0,0 +1,80 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __ENCODE_TIME_MODEL_HPP__
+#define __ENCODE_TIME_MODEL_HPP__
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include "PixelFormat.hpp"
+
+namespace JxrToAvif
+{
+    struct EncoderSettings
+    {
+        int speed = 0;
+        // Both zero for a single tile
+        int tileRowsLog2 = 0;
+        int tileColsLog2 = 0;
+        double predictedSeconds = 0;
+    };
+
+    // Predicts AV1 encoding time from the image size, pixel format, depth, speed, tiling and thread count,
+    // with costs measured on this machine by Calibrate and kept in a small text file.
+    //
+    // Encoding one megapixel on one thread takes a calibrated time per speed, scaled by factors
+    // for the format and depth. Each thread up to the tile count adds the tiled efficiency
+    // to the speedup, any further threads the single tile efficiency.
+    class EncodeTimeModel
+    {
+    public:
+        static constexpr int SpeedCount = 11;
+
+        static constexpr auto DefaultFile = L"jxr_to_avif.model";
+
+        // Settings are chosen to finish within this part of the budget, predictions are not exact
+        static constexpr double BudgetMargin = 0.85;
+
+        // Tiles narrower or lower than this hurt compression more than they help speed
+        static constexpr uint32_t MinTileSize = 512;
+
+        static constexpr int MaxTileLog2 = 6;
+
+        // Encodes synthetic images at every speed, which takes a few minutes
+        static EncodeTimeModel Calibrate(std::ostream* log);
+
+        static EncodeTimeModel Load(const std::wstring& filename);
+
+        void Save(const std::wstring& filename) const;
+
+        [[nodiscard]] double Predict(uint32_t width, uint32_t height, PixelFormat format, uint8_t depth,
+            int speed, int tileRowsLog2, int tileColsLog2, uint32_t threads) const;
+
+        // The slowest speed, which compresses best, predicted to finish within the budget. Tiling is used
+        // only where a single tile would miss it. The fastest settings if nothing fits.
+        [[nodiscard]] EncoderSettings Choose(uint32_t width, uint32_t height, PixelFormat format, uint8_t depth,
+            double budgetSeconds, uint32_t threads) const;
+
+    private:
+        static constexpr int FileVersion = 1;
+        static constexpr size_t FormatCount = 5;
+
+        // One thread, a single tile, 4:4:4 at 12 bits
+        std::array<double, SpeedCount> _secondsPerMegapixel{};
+        // Indexed by PixelFormat
+        std::array<double, FormatCount> _formatFactors{ 1, 1, 1, 1, 1 };
+        double _depth10Factor = 1;
+        double _singleTileEfficiency = 0;
+        double _tiledEfficiency = 0;
+
+        EncodeTimeModel() = default;
+
+        [[nodiscard]] double GetSpeedup(uint32_t threads, uint32_t tileCount) const;
+
+        // Enough tiles for every thread, no smaller than MinTileSize
+        static void ChooseTiles(uint32_t width, uint32_t height, uint32_t threads, int& tileRowsLog2, int& tileColsLog2);
+    };
+}
+
+#endif // __ENCODE_TIME_MODEL_HPP__
@@ -0,0 +1,239 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "PqCurve.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
+#include "GainMap.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        constexpr uint32_t MinPixelsPerTile = 16384;
+
+        constexpr size_t SrgbTableSize = (1 << 14) + 1;
+
+        // Linear BT.2020 to linear BT.709 RGB
+        constexpr float Bt2020ToBt709[3][3] =
+        {
+            { 1.660491f, -0.587641f, -0.072850f },
+            { -0.124550f, 1.132900f, -0.008349f },
+            { -0.018151f, -0.100579f, 1.118730f },
+        };
+
+        constexpr float Bt709Luma[3] = { 0.2126f, 0.7152f, 0.0722f };
+
+        void ThrowIfFailed(const avifResult result, const char* message)
+        {
+            if (result != AVIF_RESULT_OK)
+            {
+                throw std::runtime_error(std::string(message) + avifResultToString(result));
+            }
+        }
+
+        // Every 16 bit PQ code to linear light in units of SDR white
+        std::vector<float> BuildPqTable()
+        {
+            std::vector<float> table(65536);
+            for (size_t i = 0; i < table.size(); i++)
+            {
+                const auto signal = std::pow(static_cast<double>(i) / 65535, 1. / PqCurve::M2);
+                const auto linear = std::pow(std::max(signal - PqCurve::C1, 0.) / (PqCurve::C2 - PqCurve::C3 * signal), 1. / PqCurve::M1);
+                table[i] = static_cast<float>(linear * 10000 / GainMap::SdrWhiteNits);
+            }
+            return table;
+        }
+
+        double SrgbToLinear(const double v)
+        {
+            return v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4);
+        }
+
+        // Linear [0, 1] sampled in SrgbTableSize steps to 8 bit sRGB codes
+        std::vector<uint8_t> BuildSrgbTable()
+        {
+            std::vector<uint8_t> table(SrgbTableSize);
+            for (size_t i = 0; i < table.size(); i++)
+            {
+                const auto linear = static_cast<double>(i) / (SrgbTableSize - 1);
+                const auto v = linear <= 0.0031308 ? linear * 12.92 : 1.055 * std::pow(linear, 1 / 2.4) - 0.055;
+                table[i] = static_cast<uint8_t>(std::lround(std::clamp(v, 0., 1.) * 255));
+            }
+            return table;
+        }
+
+        // The base as decoders will see it, so ratios also undo its rounding
+        std::array<float, 256> BuildSrgbDecodeTable()
+        {
+            std::array<float, 256> table{};
+            for (size_t i = 0; i < table.size(); i++)
+            {
+                table[i] = static_cast<float>(SrgbToLinear(static_cast<double>(i) / 255));
+            }
+            return table;
+        }
+    }
+
+    bool GainMap::IsSupported()
+    {
+#if AVIF_VERSION >= 10200000
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void GainMap::Build(const ushort3* pixels, const size_t rowBytes, const uint32_t scale,
+        const avifContentLightLevelInformationBox& clli, const uint32_t alternateDepth, avifImage* base)
+    {
+#if AVIF_VERSION >= 10200000
+        const TraceScope trace("gain-map");
+
+        if (!pixels || !base || base->depth != BaseDepth || base->yuvPlanes[AVIF_CHAN_Y] || scale < 1 || scale > MaxScale)
+        {
+            throw std::invalid_argument("Gain maps need PQ pixels, an 8 bit base without planes and a scale of 1 to 16.");
+        }
+
+        static const auto pqTable = BuildPqTable();
+        static const auto srgbTable = BuildSrgbTable();
+        static const auto srgbDecodeTable = BuildSrgbDecodeTable();
+
+        const auto width = base->width;
+        const auto height = base->height;
+        const auto mapWidth = (width + scale - 1) / scale;
+        const auto mapHeight = (height + scale - 1) / scale;
+
+        const auto peak = std::max(static_cast<float>(clli.maxCLL) / SdrWhiteNits, 1.f);
+        const auto headroom = std::max(std::log2(peak), MinHeadroom);
+        const auto inversePeak2 = 1.f / (peak * peak);
+
+        std::unique_ptr<uint8_t[]> basePixels(new uint8_t[static_cast<size_t>(width) * height * 3]);
+        std::unique_ptr<uint8_t[]> mapPixels(new uint8_t[static_cast<size_t>(mapWidth) * mapHeight * 3]);
+
+        // Rows of boxes are independent, each task owns the sums of its row
+        const auto boxRowsPerTile = std::max<size_t>(1, MinPixelsPerTile / (static_cast<size_t>(width) * scale));
+        ThreadPool::GetInstance().ParallelFor(0, mapHeight, boxRowsPerTile, [&](const size_t begin, const size_t end, uint32_t)
+        {
+            std::vector<float> sums(static_cast<size_t>(mapWidth) * 3);
+
+            for (auto boxRow = begin; boxRow < end; boxRow++)
+            {
+                std::fill(sums.begin(), sums.end(), 0.f);
+                const auto top = static_cast<uint32_t>(boxRow) * scale;
+                const auto bottom = std::min(top + scale, height);
+
+                for (auto y = top; y < bottom; y++)
+                {
+                    const auto source = reinterpret_cast<const uint16_t*>(reinterpret_cast<const uint8_t*>(pixels) + y * rowBytes);
+                    const auto target = basePixels.get() + static_cast<size_t>(y) * width * 3;
+
+                    for (uint32_t x = 0; x < width; x++)
+                    {
+                        const float r2020 = pqTable[source[x * 3]];
+                        const float g2020 = pqTable[source[x * 3 + 1]];
+                        const float b2020 = pqTable[source[x * 3 + 2]];
+
+                        // Colors outside of BT.709 lose their negative components in both renditions
+                        float hdr[3];
+                        for (int c = 0; c < 3; c++)
+                        {
+                            hdr[c] = std::max(Bt2020ToBt709[c][0] * r2020 + Bt2020ToBt709[c][1] * g2020 + Bt2020ToBt709[c][2] * b2020, 0.f);
+                        }
+
+                        const auto luma = Bt709Luma[0] * hdr[0] + Bt709Luma[1] * hdr[1] + Bt709Luma[2] * hdr[2];
+                        const auto toneScale = (1.f + luma * inversePeak2) / (1.f + luma);
+
+                        const auto box = sums.data() + static_cast<size_t>(x / scale) * 3;
+                        for (int c = 0; c < 3; c++)
+                        {
+                            const auto sdr = std::min(hdr[c] * toneScale, 1.f);
+                            const auto code = srgbTable[static_cast<size_t>(sdr * (SrgbTableSize - 1) + 0.5f)];
+                            target[x * 3 + c] = code;
+                            box[c] += std::log2((hdr[c] + Offset) / (srgbDecodeTable[code] + Offset));
+                        }
+                    }
+                }
+
+                // Boxes at the right and bottom edges cover fewer pixels
+                const auto mapRow = mapPixels.get() + boxRow * mapWidth * 3;
+                for (uint32_t x = 0; x < mapWidth; x++)
+                {
+                    const auto boxWidth = std::min(scale, width - x * scale);
+                    const auto toCode = 255.f / (static_cast<float>(boxWidth * (bottom - top)) * headroom);
+                    for (int c = 0; c < 3; c++)
+                    {
+                        mapRow[x * 3 + c] = static_cast<uint8_t>(std::clamp(sums[x * 3 + c] * toCode + 0.5f, 0.f, 255.f));
+                    }
+                }
+            }
+        });
+
+        avifRGBImage rgb = {};
+        avifRGBImageSetDefaults(&rgb, base);
+        rgb.format = AVIF_RGB_FORMAT_RGB;
+        rgb.depth = BaseDepth;
+        rgb.pixels = basePixels.get();
+        rgb.rowBytes = width * 3;
+        ThrowIfFailed(avifImageRGBToYUV(base, &rgb), "Failed to convert base image to YUV(A): ");
+        basePixels.reset();
+
+        base->gainMap = avifGainMapCreate();
+        if (!base->gainMap)
+        {
+            throw std::bad_alloc();
+        }
+        const auto gainMap = base->gainMap;
+
+        // Channels must not mix, so the map is stored as RGB in YUV 4:4:4 planes
+        gainMap->image = avifImageCreate(mapWidth, mapHeight, BaseDepth, AVIF_PIXEL_FORMAT_YUV444);
+        if (!gainMap->image)
+        {
+            throw std::bad_alloc();
+        }
+        gainMap->image->matrixCoefficients = AVIF_MATRIX_COEFFICIENTS_IDENTITY;
+        gainMap->image->yuvRange = AVIF_RANGE_FULL;
+
+        avifRGBImageSetDefaults(&rgb, gainMap->image);
+        rgb.format = AVIF_RGB_FORMAT_RGB;
+        rgb.depth = BaseDepth;
+        rgb.pixels = mapPixels.get();
+        rgb.rowBytes = mapWidth * 3;
+        ThrowIfFailed(avifImageRGBToYUV(gainMap->image, &rgb), "Failed to convert gain map to YUV(A): ");
+
+        for (int c = 0; c < 3; c++)
+        {
+            gainMap->gainMapMin[c] = { 0, 1 };
+            avifDoubleToSignedFraction(headroom, &gainMap->gainMapMax[c]);
+            gainMap->gainMapGamma[c] = { 1, 1 };
+            avifDoubleToSignedFraction(Offset, &gainMap->baseOffset[c]);
+            avifDoubleToSignedFraction(Offset, &gainMap->alternateOffset[c]);
+        }
+        gainMap->baseHdrHeadroom = { 0, 1 };
+        avifDoubleToUnsignedFraction(headroom, &gainMap->alternateHdrHeadroom);
+        gainMap->useBaseColorSpace = AVIF_TRUE;
+
+        gainMap->altColorPrimaries = AVIF_COLOR_PRIMARIES_BT2020;
+        gainMap->altTransferCharacteristics = AVIF_TRANSFER_CHARACTERISTICS_SMPTE2084;
+        gainMap->altMatrixCoefficients = AVIF_MATRIX_COEFFICIENTS_BT2020_NCL;
+        gainMap->altYUVRange = AVIF_RANGE_FULL;
+        gainMap->altDepth = alternateDepth;
+        gainMap->altPlaneCount = 3;
+        gainMap->altCLLI = clli;
+#else
+        (void)pixels;
+        (void)rowBytes;
+        (void)scale;
+        (void)clli;
+        (void)alternateDepth;
+        (void)base;
+        throw std::runtime_error("Gain maps need libavif 1.2 or later.");
+#endif
+    }
+}
@@ -0,0 +1,45 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __GAIN_MAP_HPP__
+#define __GAIN_MAP_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <simd_math.h>
+#include <avif/avif.h>
+
+namespace JxrToAvif
+{
+    // Turns 16 bit BT.2100 PQ RGB into an SDR base image with a gain map that restores the HDR rendition.
+    //
+    // The base is sRGB with BT.709 primaries, tone mapped by an extended Reinhard curve on luminance which
+    // takes MaxCLL to SDR white and leaves dark tones alone. The gain map holds the log2 ratios of HDR to base
+    // in linear light per channel, averaged over boxes of scale x scale pixels. The curve never brightens,
+    // so the ratios span 0 to log2(MaxCLL / SdrWhiteNits), which is the HDR headroom as well.
+    class GainMap
+    {
+    public:
+        static constexpr uint32_t BaseDepth = 8;
+
+        // BT.2408 reference white, where SDR white sits in the HDR rendition
+        static constexpr float SdrWhiteNits = 203.f;
+
+        // Keeps the ratios of near black pixels finite, the usual value of other gain map encoders
+        static constexpr float Offset = 1.f / 64;
+
+        // Headroom of images that barely go past SDR white, a zero range can not be stored
+        static constexpr float MinHeadroom = 1.f / 16;
+
+        static constexpr uint32_t MaxScale = 16;
+
+        // Whether the libavif this was built with supports gain maps
+        static bool IsSupported();
+
+        // Converts the pixels into the planes of the base, which must be 8 bits deep and have none allocated yet,
+        // and attaches the gain map. The alternate HDR rendition is described as PQ of the given depth and light levels.
+        static void Build(const ushort3* pixels, size_t rowBytes, uint32_t scale,
+            const avifContentLightLevelInformationBox& clli, uint32_t alternateDepth, avifImage* base);
+    };
+}
+
+#endif // __GAIN_MAP_HPP__
@@ -0,0 +1,205 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include "AvifGridWriter.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
+#include "GridEncoder.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        using ImagePtr = std::unique_ptr<avifImage, decltype(&avifImageDestroy)>;
+        using EncoderPtr = std::unique_ptr<avifEncoder, decltype(&avifEncoderDestroy)>;
+
+        struct RWDataDeleter
+        {
+            void operator()(avifRWData* data) const
+            {
+                avifRWDataFree(data);
+            }
+        };
+
+        uint32_t DivideRoundUp(const uint32_t value, const uint32_t divisor)
+        {
+            return static_cast<uint32_t>((static_cast<uint64_t>(value) + divisor - 1) / divisor);
+        }
+
+        // Cell size and count along one dimension
+        void ChooseCells(const uint32_t size, const uint32_t alignment, const uint32_t requested, uint32_t& count, uint32_t& cellSize)
+        {
+            if (requested <= 1)
+            {
+                count = 1;
+                cellSize = size;
+                return;
+            }
+
+            cellSize = DivideRoundUp(DivideRoundUp(size, requested), alignment) * alignment;
+            if (cellSize < GridEncoder::MinCellSize)
+            {
+                throw std::invalid_argument("Grid cells must be at least 64 pixels wide and high.");
+            }
+            count = DivideRoundUp(size, cellSize);
+        }
+
+        // Copies the part of the image the cell covers, the rest of the cell repeats the last column and row
+        ImagePtr CreatePaddedCell(const avifImage* image, const avifCropRect& rect, const uint32_t cellWidth, const uint32_t cellHeight)
+        {
+            ImagePtr cell(avifImageCreate(cellWidth, cellHeight, image->depth, image->yuvFormat), avifImageDestroy);
+            if (!cell || avifImageAllocatePlanes(cell.get(), AVIF_PLANES_YUV) != AVIF_RESULT_OK)
+                throw std::bad_alloc();
+
+            cell->yuvRange = image->yuvRange;
+            cell->colorPrimaries = image->colorPrimaries;
+            cell->transferCharacteristics = image->transferCharacteristics;
+            cell->matrixCoefficients = image->matrixCoefficients;
+            cell->clli = image->clli;
+
+            avifPixelFormatInfo formatInfo;
+            avifGetPixelFormatInfo(image->yuvFormat, &formatInfo);
+            const auto sampleSize = avifImageUsesU16(image) ? 2u : 1u;
+            const auto planeCount = formatInfo.monochrome ? 1 : 3;
+
+            for (int plane = 0; plane < planeCount; plane++)
+            {
+                const auto shiftX = plane == AVIF_CHAN_Y ? 0u : static_cast<uint32_t>(formatInfo.chromaShiftX);
+                const auto shiftY = plane == AVIF_CHAN_Y ? 0u : static_cast<uint32_t>(formatInfo.chromaShiftY);
+                const auto sourceX = rect.x >> shiftX;
+                const auto sourceY = rect.y >> shiftY;
+                const auto sourceWidth = (rect.width + (1u << shiftX) - 1) >> shiftX;
+                const auto sourceHeight = (rect.height + (1u << shiftY) - 1) >> shiftY;
+                const auto targetWidth = (cellWidth + (1u << shiftX) - 1) >> shiftX;
+                const auto targetHeight = (cellHeight + (1u << shiftY) - 1) >> shiftY;
+
+                for (uint32_t y = 0; y < targetHeight; y++)
+                {
+                    const auto source = image->yuvPlanes[plane] +
+                        static_cast<size_t>(sourceY + std::min(y, sourceHeight - 1)) * image->yuvRowBytes[plane] +
+                        static_cast<size_t>(sourceX) * sampleSize;
+                    const auto target = cell->yuvPlanes[plane] + static_cast<size_t>(y) * cell->yuvRowBytes[plane];
+                    const auto lastSample = source + static_cast<size_t>(sourceWidth - 1) * sampleSize;
+
+                    std::memcpy(target, source, static_cast<size_t>(sourceWidth) * sampleSize);
+                    for (auto x = sourceWidth; x < targetWidth; x++)
+                    {
+                        std::memcpy(target + static_cast<size_t>(x) * sampleSize, lastSample, sampleSize);
+                    }
+                }
+            }
+
+            return cell;
+        }
+    }
+
+    GridLayout GridEncoder::ChooseLayout(const avifImage* image, uint32_t columns, uint32_t rows)
+    {
+        if (columns == 0 && rows == 0)
+        {
+            if (image->width > AutoGridThreshold || image->height > AutoGridThreshold)
+            {
+                columns = DivideRoundUp(image->width, AutoCellSize);
+                rows = DivideRoundUp(image->height, AutoCellSize);
+            }
+        }
+
+        avifPixelFormatInfo formatInfo;
+        avifGetPixelFormatInfo(image->yuvFormat, &formatInfo);
+
+        GridLayout layout{};
+        ChooseCells(image->width, 1u << formatInfo.chromaShiftX, columns, layout.columns, layout.cellWidth);
+        ChooseCells(image->height, 1u << formatInfo.chromaShiftY, rows, layout.rows, layout.cellHeight);
+
+        if (layout.columns > AvifGridWriter::MaxColumns || layout.rows > AvifGridWriter::MaxRows ||
+            layout.columns * layout.rows > AvifGridWriter::MaxCells)
+        {
+            throw std::invalid_argument("Too many grid cells.");
+        }
+
+        return layout;
+    }
+
+    avifResult GridEncoder::Encode(const avifImage* image, const GridLayout& layout, const CpuBudget::Lease& threads, const EncoderFactory& createEncoder, avifRWData* output)
+    {
+        AvifGridWriter writer(image, layout.columns, layout.rows, layout.cellWidth, layout.cellHeight);
+
+        auto& pool = ThreadPool::GetInstance();
+        const auto cellCount = layout.columns * layout.rows;
+        const auto concurrentCells = std::min({ cellCount, pool.GetWorkerCount(), threads.GetCount() });
+        const auto threadsPerCell = static_cast<int>(std::max<uint32_t>(1, threads.GetCount() / concurrentCells));
+        // A caller on a pool worker is already active, and runs tasks of the group while it waits
+        const auto callerIsWorker = pool.GetCurrentWorkerIndex() < pool.GetWorkerCount();
+        const CpuBudget::Loan loan(threads, concurrentCells - (callerIsWorker ? 1 : 0));
+        std::atomic<avifResult> result(AVIF_RESULT_OK);
+        std::atomic<uint32_t> nextCell(0);
+
+        // Exactly concurrentCells tasks, each taking the next cell until none are left, so no more cells are encoded
+        // at once whoever runs the tasks, and cells of different complexity still balance
+        pool.ParallelFor(0, concurrentCells, 1, [&](size_t, size_t, uint32_t)
+        {
+            for (auto i = nextCell++; i < cellCount && result.load() == AVIF_RESULT_OK; i = nextCell++)
+            {
+                const TraceScope trace("encode-cell", "cell", static_cast<int64_t>(i));
+                const auto column = static_cast<uint32_t>(i % layout.columns);
+                const auto row = static_cast<uint32_t>(i / layout.columns);
+                avifCropRect rect;
+                rect.x = column * layout.cellWidth;
+                rect.y = row * layout.cellHeight;
+                rect.width = std::min(layout.cellWidth, image->width - rect.x);
+                rect.height = std::min(layout.cellHeight, image->height - rect.y);
+
+                // Whole cells point into the image, cropped ones at the right and bottom edges are padded copies
+                ImagePtr cell(nullptr, avifImageDestroy);
+                if (rect.width == layout.cellWidth && rect.height == layout.cellHeight)
+                {
+                    cell.reset(avifImageCreateEmpty());
+                    if (!cell)
+                        throw std::bad_alloc();
+
+                    const auto viewResult = avifImageSetViewRect(cell.get(), image, &rect);
+                    if (viewResult != AVIF_RESULT_OK)
+                    {
+                        auto expected = AVIF_RESULT_OK;
+                        result.compare_exchange_strong(expected, viewResult);
+                        return;
+                    }
+                }
+                else
+                {
+                    cell = CreatePaddedCell(image, rect, layout.cellWidth, layout.cellHeight);
+                }
+
+                EncoderPtr encoder(createEncoder(threadsPerCell), avifEncoderDestroy);
+                if (!encoder)
+                    throw std::bad_alloc();
+
+                avifRWData cellData = AVIF_DATA_EMPTY;
+                const std::unique_ptr<avifRWData, RWDataDeleter> cellDataGuard(&cellData);
+
+                auto cellResult = avifEncoderAddImage(encoder.get(), cell.get(), 1, AVIF_ADD_IMAGE_FLAG_SINGLE);
+                if (cellResult == AVIF_RESULT_OK)
+                    cellResult = avifEncoderFinish(encoder.get(), &cellData);
+
+                if (cellResult != AVIF_RESULT_OK)
+                {
+                    auto expected = AVIF_RESULT_OK;
+                    result.compare_exchange_strong(expected, cellResult);
+                    return;
+                }
+
+                writer.SetCell(i, cellData.data, cellData.size);
+            }
+        });
+
+        if (result.load() != AVIF_RESULT_OK)
+            return result.load();
+
+        writer.Write(output);
+        return AVIF_RESULT_OK;
+    }
+}
@@ -0,0 +1,51 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __GRID_ENCODER_HPP__
+#define __GRID_ENCODER_HPP__
+
+#include <cstdint>
+#include <functional>
+#include <avif/avif.h>
+#include "CpuBudget.hpp"
+
+namespace JxrToAvif
+{
+    struct GridLayout
+    {
+        uint32_t columns;
+        uint32_t rows;
+        uint32_t cellWidth;
+        uint32_t cellHeight;
+
+        [[nodiscard]] bool IsGrid() const
+        {
+            return columns > 1 || rows > 1;
+        }
+    };
+
+    // Splits an image into cells, encodes them in parallel with separate encoders
+    // and assembles the result into a single grid image.
+    class GridEncoder
+    {
+    public:
+        // Frames up to 8192 pixels wide are within AV1 level 6 limits and encode well as a whole.
+        // Larger images are split into cells of about AutoCellSize pixels.
+        static constexpr uint32_t AutoGridThreshold = 8192;
+        static constexpr uint32_t AutoCellSize = 4096;
+
+        // Smaller cells are not allowed by MIAF
+        static constexpr uint32_t MinCellSize = 64;
+
+        // Creates a configured encoder using the given number of threads
+        using EncoderFactory = std::function<avifEncoder*(int threads)>;
+
+        // Zero columns and rows select the layout automatically, which may be a single cell.
+        // Cells are rounded up to the chroma subsampling, so fewer columns or rows may be needed.
+        static GridLayout ChooseLayout(const avifImage* image, uint32_t columns, uint32_t rows);
+
+        // The threads of the lease are shared by the cells encoded at once
+        static avifResult Encode(const avifImage* image, const GridLayout& layout, const CpuBudget::Lease& threads, const EncoderFactory& createEncoder, avifRWData* output);
+    };
+}
+
+#endif // __GRID_ENCODER_HPP__
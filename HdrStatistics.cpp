@@ -0,0 +1,77 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include "HdrStatistics.hpp"
+
+namespace JxrToAvif
+{
+    HdrStatistics::HdrStatistics()
+        : _bins(BinCount), _pixelCount(0), _valueSum(0), _maxValue(0)
+    {
+    }
+
+    void HdrStatistics::AddPixels(const uint64_t count, const float maxValue, const double valueSum)
+    {
+        _pixelCount += count;
+        _maxValue = std::max(_maxValue, maxValue);
+        _valueSum += valueSum;
+    }
+
+    void HdrStatistics::Merge(const HdrStatistics& other)
+    {
+        for (size_t i = 0; i < BinCount; i++)
+        {
+            _bins[i] += other._bins[i];
+        }
+
+        AddPixels(other._pixelCount, other._maxValue, other._valueSum);
+    }
+
+    void HdrStatistics::Finalize()
+    {
+        _cumulativeBins.resize(BinCount);
+
+        uint64_t count = 0;
+        for (size_t i = 0; i < BinCount; i++)
+        {
+            count += _bins[i];
+            _cumulativeBins[i] = count;
+        }
+    }
+
+    double HdrStatistics::GetPercentileNits(const double fraction) const
+    {
+        if (_cumulativeBins.empty())
+        {
+            throw std::logic_error("Statistics must be finalized before querying percentiles.");
+        }
+
+        if (_pixelCount == 0)
+            return 0;
+
+        // Rank of the pixel within all pixels sorted by light level, starting at 1
+        const auto rank = std::clamp(std::ceil(fraction * static_cast<double>(_pixelCount)), 1., static_cast<double>(_pixelCount));
+        const auto target = static_cast<uint64_t>(rank);
+        const auto bin = static_cast<size_t>(std::lower_bound(_cumulativeBins.begin(), _cumulativeBins.end(), target) - _cumulativeBins.begin());
+
+        // The last bin holds exactly 1, others are spread evenly over their range
+        const auto binStart = GetBinStart(bin);
+        const auto binEnd = bin + 1 < BinCount ? GetBinStart(bin + 1) : binStart;
+        const auto before = bin ? _cumulativeBins[bin - 1] : 0;
+        const auto position = static_cast<double>(target - before) / static_cast<double>(_bins[bin]);
+        const auto value = std::min(binStart + (binEnd - binStart) * position, static_cast<double>(_maxValue));
+
+        return value * NitsScale;
+    }
+
+    double HdrStatistics::GetBinStart(const size_t bin)
+    {
+        if (bin == 0)
+            return 0;
+
+        constexpr size_t binsPerOctave = 1 << BinBits;
+        return std::ldexp(1. + static_cast<double>(bin % binsPerOctave) / binsPerOctave, static_cast<int>(bin / binsPerOctave) - Octaves);
+    }
+}
@@ -0,0 +1,91 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __HDR_STATISTICS_HPP__
+#define __HDR_STATISTICS_HPP__
+
+#include <cstdint>
+#include <vector>
+#include <immintrin.h>
+
+namespace JxrToAvif
+{
+    // Light level statistics of the max(R, G, B) values of pixels, normalized to 10000 nits.
+    // Every worker fills its own instance, they are merged once when conversion is done.
+    class HdrStatistics
+    {
+    public:
+        static constexpr float NitsScale = 10000.f;
+
+        // Bins are indexed by the float bits of the value: BinBits mantissa bits pick the bin within
+        // each of the Octaves octaves below 1, so bins are about 0.5% wide at any light level.
+        // Values below 2^-Octaves (0.01 nits) share the first bin, 1 has a bin of its own.
+        static constexpr int Octaves = 20;
+        static constexpr int BinBits = 7;
+        static constexpr size_t BinCount = (static_cast<size_t>(Octaves) << BinBits) + 1;
+
+        HdrStatistics();
+
+        HdrStatistics(const HdrStatistics&) = delete;
+
+        HdrStatistics(HdrStatistics&&) = default;
+
+        HdrStatistics& operator=(const HdrStatistics&) = delete;
+
+        HdrStatistics& operator=(HdrStatistics&&) = default;
+
+        ~HdrStatistics() = default;
+
+        // Values must be in [0, 1]
+        static __m256i GetBins(const __m256 values)
+        {
+            const auto bits = _mm256_castps_si256(_mm256_max_ps(values, _mm256_set1_ps(MinValue)));
+            return _mm256_sub_epi32(_mm256_srli_epi32(bits, 23 - BinBits), _mm256_set1_epi32(BinBias));
+        }
+
+        void AddToBin(const int32_t bin)
+        {
+            _bins[bin]++;
+        }
+
+        // Accounts for pixels already put into bins
+        void AddPixels(uint64_t count, float maxValue, double valueSum);
+
+        void Merge(const HdrStatistics& other);
+
+        // Builds the cumulative counts used by the queries below, call after the last Add or Merge
+        void Finalize();
+
+        // Light level in nits which the given fraction of pixels does not exceed,
+        // interpolated within the bin it falls into
+        [[nodiscard]] double GetPercentileNits(double fraction) const;
+
+        [[nodiscard]] double GetMaxNits() const
+        {
+            return static_cast<double>(_maxValue) * NitsScale;
+        }
+
+        [[nodiscard]] double GetAverageNits() const
+        {
+            return _pixelCount ? _valueSum / static_cast<double>(_pixelCount) * NitsScale : 0;
+        }
+
+        [[nodiscard]] uint64_t GetPixelCount() const
+        {
+            return _pixelCount;
+        }
+
+    private:
+        static constexpr float MinValue = 1.f / (1 << Octaves);
+        static constexpr int32_t BinBias = (127 - Octaves) << BinBits;
+
+        std::vector<uint64_t> _bins;
+        std::vector<uint64_t> _cumulativeBins;
+        uint64_t _pixelCount;
+        double _valueSum;
+        float _maxValue;
+
+        [[nodiscard]] static double GetBinStart(size_t bin);
+    };
+}
+
+#endif // __HDR_STATISTICS_HPP__
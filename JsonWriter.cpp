@@ -0,0 +1,142 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <cmath>
+#include <cstdio>
+#include "JsonWriter.hpp"
+
+namespace JxrToAvif
+{
+    JsonWriter::JsonWriter(std::ostream& stream)
+        : _stream(stream), _afterKey(false)
+    {
+    }
+
+    void JsonWriter::BeginObject()
+    {
+        BeginValue();
+        _stream << '{';
+        _hasMembers.push_back(false);
+    }
+
+    void JsonWriter::BeginObject(const std::string_view key)
+    {
+        WriteKey(key);
+        BeginObject();
+    }
+
+    void JsonWriter::EndObject()
+    {
+        _hasMembers.pop_back();
+        _stream << '}';
+    }
+
+    void JsonWriter::BeginArray()
+    {
+        BeginValue();
+        _stream << '[';
+        _hasMembers.push_back(false);
+    }
+
+    void JsonWriter::BeginArray(const std::string_view key)
+    {
+        WriteKey(key);
+        BeginArray();
+    }
+
+    void JsonWriter::EndArray()
+    {
+        _hasMembers.pop_back();
+        _stream << ']';
+    }
+
+    void JsonWriter::Write(const std::string_view value)
+    {
+        BeginValue();
+        WriteString(value);
+    }
+
+    void JsonWriter::Write(const bool value)
+    {
+        BeginValue();
+        _stream << (value ? "true" : "false");
+    }
+
+    void JsonWriter::Write(const double value)
+    {
+        BeginValue();
+        if (!std::isfinite(value))
+        {
+            _stream << "null";
+            return;
+        }
+
+        // Enough digits to read back the same double
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+        _stream << buffer;
+    }
+
+    void JsonWriter::BeginValue()
+    {
+        if (_afterKey)
+        {
+            _afterKey = false;
+            return;
+        }
+
+        if (!_hasMembers.empty())
+        {
+            if (_hasMembers.back())
+                _stream << ',';
+            _hasMembers.back() = true;
+        }
+    }
+
+    void JsonWriter::WriteKey(const std::string_view key)
+    {
+        BeginValue();
+        WriteString(key);
+        _stream << ':';
+        _afterKey = true;
+    }
+
+    void JsonWriter::WriteString(const std::string_view value)
+    {
+        static constexpr char hexDigits[] = "0123456789abcdef";
+
+        _stream << '"';
+        for (const auto c : value)
+        {
+            switch (c)
+            {
+            case '"':
+                _stream << "\\\"";
+                break;
+            case '\\':
+                _stream << "\\\\";
+                break;
+            case '\n':
+                _stream << "\\n";
+                break;
+            case '\r':
+                _stream << "\\r";
+                break;
+            case '\t':
+                _stream << "\\t";
+                break;
+            default:
+                // Bytes of UTF-8 sequences pass through unchanged
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    _stream << "\\u00" << hexDigits[c >> 4] << hexDigits[c & 15];
+                }
+                else
+                {
+                    _stream << c;
+                }
+                break;
+            }
+        }
+        _stream << '"';
+    }
+}
@@ -0,0 +1,86 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __JSON_WRITER_HPP__
+#define __JSON_WRITER_HPP__
+
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace JxrToAvif
+{
+    // Writes compact JSON on a single line. Keys are only taken inside objects,
+    // the methods without a key write array elements or the outermost value.
+    class JsonWriter
+    {
+    public:
+        explicit JsonWriter(std::ostream& stream);
+
+        JsonWriter(const JsonWriter&) = delete;
+
+        JsonWriter(JsonWriter&&) = delete;
+
+        JsonWriter& operator=(const JsonWriter&) = delete;
+
+        JsonWriter& operator=(JsonWriter&&) = delete;
+
+        ~JsonWriter() = default;
+
+        void BeginObject();
+
+        void BeginObject(std::string_view key);
+
+        void EndObject();
+
+        void BeginArray();
+
+        void BeginArray(std::string_view key);
+
+        void EndArray();
+
+        void Write(std::string_view value);
+
+        void Write(const char* value)
+        {
+            Write(std::string_view(value));
+        }
+
+        void Write(bool value);
+
+        // Infinities and NaN have no JSON representation, they are written as null
+        void Write(double value);
+
+        template<typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>, int> = 0>
+        void Write(const T value)
+        {
+            BeginValue();
+            if constexpr (std::is_signed_v<T>)
+                _stream << static_cast<int64_t>(value);
+            else
+                _stream << static_cast<uint64_t>(value);
+        }
+
+        template<typename T>
+        void Write(const std::string_view key, const T& value)
+        {
+            WriteKey(key);
+            Write(value);
+        }
+
+    private:
+        std::ostream& _stream;
+        // Whether the innermost object or array already has a member
+        std::vector<bool> _hasMembers;
+        bool _afterKey;
+
+        void BeginValue();
+
+        void WriteKey(std::string_view key);
+
+        void WriteString(std::string_view value);
+    };
+}
+
+#endif // __JSON_WRITER_HPP__
@@ -1,81 +1,407 @@
 // Copyright 2020 Joe Drago, 2024 Dmitry Ignatiev. All rights reserved
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include "PqCurve.hpp"
+#include "Trace.hpp"
 #include "JxrChunkLoader.hpp"
 
 namespace JxrToAvif
 {
-    const float3x3 JxrChunkLoader::ScRgbToBt2100 = {
-       {
-           {
-               static_cast<float>(2939026994.L / 585553224375.L),
-               static_cast<float>(9255011753.L / 3513319346250.L),
-               static_cast<float>(173911579.L / 501902763750.L),
-               static_cast<float>(76515593.L / 138420033750.L),
-               static_cast<float>(6109575001.L / 830520202500.L),
-               static_cast<float>(75493061.L / 830520202500.L),
-               static_cast<float>(12225392.L / 93230009375.L),
-               static_cast<float>(1772384008.L / 2517210253125.L),
-               static_cast<float>(18035212433.L / 2517210253125.L)
-           }
-       },
-    };
-
-    JxrChunkLoader::JxrChunkLoader(ushort3* output, const jxr_data& data, const uint32_t startLine, const uint32_t endLine)
-        : _output(output), _data(data), _nitCounts(std::make_unique<uint32_t[]>(MaxNits)),
-        _startLine(startLine), _endLine(endLine), _maxComponentSum(0), _maxNits(0)
+    namespace
     {
-        _thread = std::thread(&JxrChunkLoader::ProcessChunk, this);
+        constexpr float ScRgbToBt2100Coefficients[9] = {
+            static_cast<float>(2939026994.L / 585553224375.L),
+            static_cast<float>(9255011753.L / 3513319346250.L),
+            static_cast<float>(173911579.L / 501902763750.L),
+            static_cast<float>(76515593.L / 138420033750.L),
+            static_cast<float>(6109575001.L / 830520202500.L),
+            static_cast<float>(75493061.L / 830520202500.L),
+            static_cast<float>(12225392.L / 93230009375.L),
+            static_cast<float>(1772384008.L / 2517210253125.L),
+            static_cast<float>(18035212433.L / 2517210253125.L)
+        };
+
+        // Words of the three 8 x 16 bit vectors [R][G][B], in the order they appear in 8 interleaved RGB pixels
+        constexpr int InterleavedWords[3][8] = {
+            {0, 8, 16, 1, 9, 17, 2, 10},
+            {18, 3, 11, 19, 4, 12, 20, 5},
+            {13, 21, 6, 14, 22, 7, 15, 23}
+        };
+
+        __m128i MakeWordShuffle(const int output, const int component)
+        {
+            alignas(16) int8_t bytes[16];
+            for (int i = 0; i < 8; i++)
+            {
+                const auto word = InterleavedWords[output][i];
+                const auto selected = word / 8 == component;
+                bytes[2 * i] = static_cast<int8_t>(selected ? word % 8 * 2 : -128);
+                bytes[2 * i + 1] = static_cast<int8_t>(selected ? word % 8 * 2 + 1 : -128);
+            }
+            return _mm_load_si128(reinterpret_cast<const __m128i*>(bytes));
+        }
+
+        // Deinterleaves 8 RGBA pixels into one register per component, alpha is dropped
+        template<uint8_t BytesPerPixel>
+        void LoadPixels8(const uint8_t* source, __m256& r, __m256& g, __m256& b)
+        {
+            __m256 p04, p15, p26, p37;
+
+            if constexpr (BytesPerPixel == 16)
+            {
+                const auto pixels = reinterpret_cast<const float*>(source);
+                p04 = _mm256_loadu2_m128(pixels + 16, pixels);
+                p15 = _mm256_loadu2_m128(pixels + 20, pixels + 4);
+                p26 = _mm256_loadu2_m128(pixels + 24, pixels + 8);
+                p37 = _mm256_loadu2_m128(pixels + 28, pixels + 12);
+            }
+            else
+            {
+                const auto pixels = reinterpret_cast<const __m128i*>(source);
+                const auto p01 = _mm256_cvtph_ps(_mm_loadu_si128(pixels));
+                const auto p23 = _mm256_cvtph_ps(_mm_loadu_si128(pixels + 1));
+                const auto p45 = _mm256_cvtph_ps(_mm_loadu_si128(pixels + 2));
+                const auto p67 = _mm256_cvtph_ps(_mm_loadu_si128(pixels + 3));
+                p04 = _mm256_permute2f128_ps(p01, p45, 0x20);
+                p15 = _mm256_permute2f128_ps(p01, p45, 0x31);
+                p26 = _mm256_permute2f128_ps(p23, p67, 0x20);
+                p37 = _mm256_permute2f128_ps(p23, p67, 0x31);
+            }
+
+            const auto rg0145 = _mm256_unpacklo_ps(p04, p15);
+            const auto rg2367 = _mm256_unpacklo_ps(p26, p37);
+            const auto ba0145 = _mm256_unpackhi_ps(p04, p15);
+            const auto ba2367 = _mm256_unpackhi_ps(p26, p37);
+
+            r = _mm256_shuffle_ps(rg0145, rg2367, _MM_SHUFFLE(1, 0, 1, 0));
+            g = _mm256_shuffle_ps(rg0145, rg2367, _MM_SHUFFLE(3, 2, 3, 2));
+            b = _mm256_shuffle_ps(ba0145, ba2367, _MM_SHUFFLE(1, 0, 1, 0));
+        }
+
+        __m128i PackCodes(const __m256i codes)
+        {
+            return _mm_packus_epi32(_mm256_castsi256_si128(codes), _mm256_extracti128_si256(codes, 1));
+        }
+
+        __m256 Saturate(const __m256 v)
+        {
+            // NaN ends up as zero, because max returns its second operand then
+            return _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.f));
+        }
     }
 
-    JxrChunkLoader::~JxrChunkLoader()
+    JxrChunkLoader::JxrChunkLoader(ushort3* output, const size_t outputRowBytes, const jxr_data& data, const bool fastPq)
+        : _output(output), _outputRowBytes(outputRowBytes), _yuvOutput(nullptr), _data(data),
+        _sourcePixels(data.pixels), _sourceFirstLine(0), _busySeconds(0),
+        _thumbnailSums(nullptr), _thumbnailWidth(0), _thumbnailScale(1), _chromaShiftX(0), _chromaShiftY(0),
+        _kr(0), _kg(0), _kb(0), _lumaScale(0), _lumaBias(0), _cbScale(0), _crScale(0), _chromaBias(0),
+        _maxCode(0), _identityMatrix(false),
+        _convertRow(SelectConvertRow(data.bytes_per_pixel, fastPq))
     {
-        Wait();
     }
 
-    void JxrChunkLoader::Wait()
+    JxrChunkLoader::JxrChunkLoader(avifImage* output, const jxr_data& data, const bool fastPq)
+        : JxrChunkLoader(nullptr, 0, data, fastPq)
     {
-        if (_thread.joinable())
-            _thread.join();
+        if (!avifImageUsesU16(output))
+        {
+            throw std::runtime_error("Direct YUV conversion requires more than 8 bits per sample.");
+        }
+
+        switch (output->matrixCoefficients)
+        {
+        case AVIF_MATRIX_COEFFICIENTS_IDENTITY:
+            if (output->yuvFormat != AVIF_PIXEL_FORMAT_YUV444)
+            {
+                throw std::runtime_error("Identity matrix coefficients require 4:4:4 output.");
+            }
+            _identityMatrix = true;
+            break;
+        case AVIF_MATRIX_COEFFICIENTS_BT2020_NCL:
+            _kr = 0.2627f;
+            _kb = 0.0593f;
+            _kg = 1.f - _kr - _kb;
+            break;
+        default:
+            throw std::runtime_error("Unsupported matrix coefficients for direct YUV conversion.");
+        }
+
+        avifPixelFormatInfo formatInfo;
+        avifGetPixelFormatInfo(output->yuvFormat, &formatInfo);
+        _chromaShiftX = static_cast<uint32_t>(formatInfo.chromaShiftX);
+        _chromaShiftY = static_cast<uint32_t>(formatInfo.chromaShiftY);
+
+        // Same quantization as avifImageRGBToYUV
+        const auto depthShift = output->depth - 8;
+        float lumaRange, chromaRange;
+        _maxCode = static_cast<float>((1 << output->depth) - 1);
+        if (output->yuvRange == AVIF_RANGE_LIMITED)
+        {
+            lumaRange = static_cast<float>(219 << depthShift);
+            chromaRange = static_cast<float>(224 << depthShift);
+            _lumaBias = static_cast<float>(16 << depthShift);
+        }
+        else
+        {
+            lumaRange = _maxCode;
+            chromaRange = _maxCode;
+            _lumaBias = 0;
+        }
+        _chromaBias = static_cast<float>(1 << (output->depth - 1));
+
+        constexpr float inputRange = (1 << OutputDepth) - 1;
+        _lumaScale = lumaRange / inputRange;
+        _cbScale = chromaRange / inputRange / (2 * (1 - _kb));
+        _crScale = chromaRange / inputRange / (2 * (1 - _kr));
+
+        _yuvOutput = output;
+        _rows = std::unique_ptr<ushort3[]>(new ushort3[2 * static_cast<size_t>(data.width)]);
     }
 
-    void JxrChunkLoader::ProcessChunk()
+    JxrChunkLoader::ConvertRowFunction JxrChunkLoader::SelectConvertRow(const uint8_t bytesPerPixel, const bool fastPq)
     {
-        const float4x4 colorSpaceTransform = float4x4_transpose(float3x3_load(&ScRgbToBt2100));
-        float finalMaxComponent = 0;
-        double maxComponentSum = 0;
+        if (bytesPerPixel == 16)
+            return fastPq ? &JxrChunkLoader::ConvertRow<16, true> : &JxrChunkLoader::ConvertRow<16, false>;
 
-        for (uint32_t i = _startLine; i < _endLine; i++) {
-            for (uint32_t j = 0; j < _data.width; j++) {
-                const auto pixelIndex = i * _data.width + j;
-                float4 v;
+        return fastPq ? &JxrChunkLoader::ConvertRow<8, true> : &JxrChunkLoader::ConvertRow<8, false>;
+    }
 
-                if (_data.bytes_per_pixel == 16) {
-                    v = float3_load(reinterpret_cast<float3*>(&reinterpret_cast<float4*>(_data.pixels)[pixelIndex]));
-                }
-                else {
-                    v = half3_load(reinterpret_cast<half3*>(&reinterpret_cast<half4*>(_data.pixels)[pixelIndex]));
+    void JxrChunkLoader::ProcessRows(const uint32_t startLine, const uint32_t endLine)
+    {
+        const TraceScope trace("convert-rows", "firstRow", startLine);
+        const auto startTime = std::chrono::steady_clock::now();
+
+        if (!_yuvOutput)
+        {
+            for (auto i = startLine; i < endLine; i++)
+            {
+                (this->*_convertRow)(i, reinterpret_cast<ushort3*>(reinterpret_cast<uint8_t*>(_output) + static_cast<size_t>(i) * _outputRowBytes));
+            }
+        }
+        else
+        {
+            const auto rowStep = 1u << _chromaShiftY;
+            const auto row0 = _rows.get();
+            const auto row1 = _rows.get() + _data.width;
+
+            // Whole rows are converted before the planes are written, because those may overlay the source
+            for (auto i = startLine; i < endLine; i += rowStep)
+            {
+                (this->*_convertRow)(i, row0);
+                const auto hasSecondRow = rowStep == 2 && i + 1 < endLine;
+                if (hasSecondRow)
+                {
+                    (this->*_convertRow)(i + 1, row1);
                 }
+                StoreYuvRows(i, row0, hasSecondRow ? row1 : nullptr);
+            }
+        }
 
-                const auto bt2020 = float4_saturate(float3_transform(v, colorSpaceTransform));
+        _busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    }
 
-                const auto maxComponent = float4_hmax(float4_min(bt2020, float4_set(2.f, 2.f, 2.f, 0.f)));
+    template<uint8_t BytesPerPixel, bool FastPq>
+    void JxrChunkLoader::ConvertRow(const uint32_t line, ushort3* output)
+    {
+        static_assert(BytesPerPixel == 16 || BytesPerPixel == 8, "Unsupported pixel format");
+
+        const auto source = _sourcePixels + static_cast<size_t>(line - _sourceFirstLine) * _data.stride;
+        const auto target = reinterpret_cast<uint8_t*>(output);
+        const auto width = _data.width;
 
-                const auto nits = static_cast<uint32_t>(roundf(maxComponent * 10000));
-                _nitCounts[nits]++;
+        __m256 m[9];
+        for (int k = 0; k < 9; k++)
+        {
+            m[k] = _mm256_set1_ps(ScRgbToBt2100Coefficients[k]);
+        }
 
-                if (maxComponent > finalMaxComponent) {
-                    finalMaxComponent = maxComponent;
+        __m128i shuffles[3][3];
+        for (int o = 0; o < 3; o++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                shuffles[o][c] = MakeWordShuffle(o, c);
+            }
+        }
+
+        const auto thumbnailScale = _thumbnailScale;
+        const auto thumbnailRow = _thumbnailSums ?
+            _thumbnailSums + static_cast<size_t>(line / thumbnailScale) * _thumbnailWidth * 3 : nullptr;
+
+        const auto codeScale = _mm256_set1_ps(65535.f);
+        auto maxComponents = _mm256_setzero_ps();
+        auto sumLow = _mm256_setzero_pd();
+        auto sumHigh = _mm256_setzero_pd();
+
+        const auto toCodes = [codeScale](const __m256 v)
+        {
+            if constexpr (FastPq)
+                return PackCodes(_mm256_cvtps_epi32(_mm256_mul_ps(PqCurve::InverseEotfFast(v), codeScale)));
+            else
+                return PackCodes(_mm256_cvtps_epi32(_mm256_mul_ps(PqCurve::InverseEotf(v), codeScale)));
+        };
+
+        // Converts 8 pixels starting at column x, only the first count of them go into the histogram and the thumbnail.
+        // All of them are loaded before the 48 output bytes are stored, which keeps overlaid output behind the read position.
+        const auto convert8 = [&](const uint8_t* pixels, uint8_t* pixelOutput, const uint32_t x, const uint32_t count)
+        {
+            __m256 r, g, b;
+            LoadPixels8<BytesPerPixel>(pixels, r, g, b);
+
+            const auto r2020 = Saturate(_mm256_fmadd_ps(m[0], r, _mm256_fmadd_ps(m[1], g, _mm256_mul_ps(m[2], b))));
+            const auto g2020 = Saturate(_mm256_fmadd_ps(m[3], r, _mm256_fmadd_ps(m[4], g, _mm256_mul_ps(m[5], b))));
+            const auto b2020 = Saturate(_mm256_fmadd_ps(m[6], r, _mm256_fmadd_ps(m[7], g, _mm256_mul_ps(m[8], b))));
+
+            const auto maxComponent = _mm256_max_ps(_mm256_max_ps(r2020, g2020), b2020);
+            maxComponents = _mm256_max_ps(maxComponents, maxComponent);
+            sumLow = _mm256_add_pd(sumLow, _mm256_cvtps_pd(_mm256_castps256_ps128(maxComponent)));
+            sumHigh = _mm256_add_pd(sumHigh, _mm256_cvtps_pd(_mm256_extractf128_ps(maxComponent, 1)));
+
+            alignas(32) int32_t bins[8];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(bins), HdrStatistics::GetBins(maxComponent));
+            for (uint32_t k = 0; k < count; k++)
+            {
+                _statistics.AddToBin(bins[k]);
+            }
+
+            // Averaged in linear light, PQ code values would darken the edges of highlights
+            if (thumbnailRow)
+            {
+                alignas(32) float linear[3][8];
+                _mm256_store_ps(linear[0], r2020);
+                _mm256_store_ps(linear[1], g2020);
+                _mm256_store_ps(linear[2], b2020);
+
+                auto sums = thumbnailRow + static_cast<size_t>(x / thumbnailScale) * 3;
+                auto filled = x % thumbnailScale;
+                for (uint32_t k = 0; k < count; k++)
+                {
+                    sums[0] += linear[0][k];
+                    sums[1] += linear[1][k];
+                    sums[2] += linear[2][k];
+                    if (++filled == thumbnailScale)
+                    {
+                        filled = 0;
+                        sums += 3;
+                    }
                 }
+            }
+
+            const __m128i codes[3] = {toCodes(r2020), toCodes(g2020), toCodes(b2020)};
+
+            for (int o = 0; o < 3; o++)
+            {
+                const auto interleaved = _mm_or_si128(
+                    _mm_or_si128(_mm_shuffle_epi8(codes[0], shuffles[o][0]), _mm_shuffle_epi8(codes[1], shuffles[o][1])),
+                    _mm_shuffle_epi8(codes[2], shuffles[o][2]));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(pixelOutput) + o, interleaved);
+            }
+        };
+
+        uint32_t j = 0;
+        for (; j + 8 <= width; j += 8)
+        {
+            convert8(source + static_cast<size_t>(j) * BytesPerPixel, target + static_cast<size_t>(j) * sizeof(ushort3), j, 8);
+        }
+
+        // The tail goes through zero padded copies, zeros don't change the maximum or the sum
+        if (j < width)
+        {
+            const auto count = width - j;
+            alignas(32) uint8_t pixels[8 * BytesPerPixel] = {};
+            alignas(16) uint8_t pixelOutput[8 * sizeof(ushort3)];
+
+            std::memcpy(pixels, source + static_cast<size_t>(j) * BytesPerPixel, static_cast<size_t>(count) * BytesPerPixel);
+            convert8(pixels, pixelOutput, j, count);
+            std::memcpy(target + static_cast<size_t>(j) * sizeof(ushort3), pixelOutput, static_cast<size_t>(count) * sizeof(ushort3));
+        }
+
+        alignas(32) float maxLanes[8];
+        alignas(32) double sumLanes[4];
+        _mm256_store_ps(maxLanes, maxComponents);
+        _mm256_store_pd(sumLanes, _mm256_add_pd(sumLow, sumHigh));
+
+        _statistics.AddPixels(width, *std::max_element(maxLanes, maxLanes + 8), sumLanes[0] + sumLanes[1] + sumLanes[2] + sumLanes[3]);
+    }
+
+    void JxrChunkLoader::StoreYuvRows(const uint32_t line, const ushort3* row0, const ushort3* row1) const
+    {
+        const auto width = _data.width;
+        const uint16_t* rgbRows[2] = {
+            reinterpret_cast<const uint16_t*>(row0),
+            reinterpret_cast<const uint16_t*>(row1)
+        };
+        const auto rowCount = row1 ? 2u : 1u;
 
-                maxComponentSum += maxComponent;
+        for (uint32_t r = 0; r < rowCount; r++)
+        {
+            const auto rgb = rgbRows[r];
+            const auto y = GetPlaneRow(AVIF_CHAN_Y, line + r);
 
-                const auto pixel2020 = float4_to_int4(float4_scale(float4_pq_inv_eotf(bt2020), 65535));
-                ushort3_store(&_output[pixelIndex], pixel2020);
+            if (_identityMatrix)
+            {
+                for (uint32_t j = 0; j < width; j++)
+                {
+                    y[j] = ToCode(rgb[3 * j + 1] * _lumaScale + _lumaBias);
+                }
+            }
+            else
+            {
+                for (uint32_t j = 0; j < width; j++)
+                {
+                    const auto luma = _kr * rgb[3 * j] + _kg * rgb[3 * j + 1] + _kb * rgb[3 * j + 2];
+                    y[j] = ToCode(luma * _lumaScale + _lumaBias);
+                }
             }
         }
 
-        _maxNits = static_cast<uint16_t>(roundf(finalMaxComponent * 10000));
-        _maxComponentSum = maxComponentSum;
+        if (_yuvOutput->yuvFormat == AVIF_PIXEL_FORMAT_YUV400)
+            return;
+
+        const auto chromaLine = line >> _chromaShiftY;
+        const auto u = GetPlaneRow(AVIF_CHAN_U, chromaLine);
+        const auto v = GetPlaneRow(AVIF_CHAN_V, chromaLine);
+        const auto blockWidth = 1u << _chromaShiftX;
+        const auto chromaWidth = (width + blockWidth - 1) >> _chromaShiftX;
+
+        for (uint32_t cx = 0; cx < chromaWidth; cx++)
+        {
+            const auto first = cx << _chromaShiftX;
+            const auto last = std::min(first + blockWidth, width);
+            float red = 0, green = 0, blue = 0;
+
+            // Subsampled chroma is computed from the average of the block, as avifImageRGBToYUV does it
+            for (uint32_t r = 0; r < rowCount; r++)
+            {
+                const auto rgb = rgbRows[r];
+                for (auto j = first; j < last; j++)
+                {
+                    red += rgb[3 * j];
+                    green += rgb[3 * j + 1];
+                    blue += rgb[3 * j + 2];
+                }
+            }
+
+            const auto scale = 1.f / static_cast<float>((last - first) * rowCount);
+            red *= scale;
+            green *= scale;
+            blue *= scale;
+
+            if (_identityMatrix)
+            {
+                u[cx] = ToCode(blue * _lumaScale + _lumaBias);
+                v[cx] = ToCode(red * _lumaScale + _lumaBias);
+            }
+            else
+            {
+                const auto luma = _kr * red + _kg * green + _kb * blue;
+                u[cx] = ToCode((blue - luma) * _cbScale + _chromaBias);
+                v[cx] = ToCode((red - luma) * _crScale + _chromaBias);
+            }
+        }
     }
 }
@@ -3,21 +3,31 @@
 #ifndef __JXR_CHUNK_LOADER_HPP__
 #define __JXR_CHUNK_LOADER_HPP__
 
+#include <cmath>
 #include <cstdint>
 #include <memory>
-#include <thread>
 #include <simd_math.h>
+#include <avif/avif.h>
 #include "jxr_data.h"
+#include "HdrStatistics.hpp"
 
 namespace JxrToAvif
 {
     class JxrChunkLoader
     {
     public:
-        static constexpr int MaxNits = 10000;
         static constexpr uint8_t OutputDepth = 16;
 
-        JxrChunkLoader(ushort3* output, const jxr_data& data, uint32_t startLine, uint32_t endLine);
+        // Loaders accumulate statistics over every row range they process,
+        // so a single loader serves all tiles executed by one worker thread.
+        // Output rows may overlay the source rows, each pixel is read before anything is written over it.
+        // fastPq selects the table based PQ curve, see PqCurve for its error bound.
+        JxrChunkLoader(ushort3* output, size_t outputRowBytes, const jxr_data& data, bool fastPq = false);
+
+        // Writes Y/Cb/Cr samples straight into the planes of the image, which must be allocated.
+        // Only the rows being processed are kept as 16 bit RGB, two at a time for 4:2:0.
+        // Planes may overlay the source rows they are computed from.
+        JxrChunkLoader(avifImage* output, const jxr_data& data, bool fastPq = false);
 
         JxrChunkLoader(const JxrChunkLoader&) = delete;
 
@@ -27,38 +37,81 @@ namespace JxrToAvif
 
         JxrChunkLoader& operator=(JxrChunkLoader&&) = delete;
 
-        ~JxrChunkLoader();
+        ~JxrChunkLoader() = default;
+
+        // For 4:2:0 output, startLine must be even
+        void ProcessRows(uint32_t startLine, uint32_t endLine);
 
-        void Wait();
+        // Reads the following rows from a band of the image which starts at firstLine,
+        // instead of the pixels of the whole image
+        void SetSourceBand(const uint8_t* pixels, const uint32_t firstLine)
+        {
+            _sourcePixels = pixels;
+            _sourceFirstLine = firstLine;
+        }
 
-        [[nodiscard]] uint16_t GetMaxNits() const
+        // Also adds the linear BT.2100 RGB of every pixel to the float triplet of its scale x scale box
+        // in rows of width boxes. Tiles must start at multiples of scale rows, so no two loaders
+        // add to the same row of boxes at once.
+        void SetThumbnailSums(float* sums, const uint32_t width, const uint32_t scale)
         {
-            return _maxNits;
+            _thumbnailSums = sums;
+            _thumbnailWidth = width;
+            _thumbnailScale = scale;
         }
 
-        [[nodiscard]] double GetMaxComponentSum() const
+        [[nodiscard]] const HdrStatistics& GetStatistics() const
         {
-            return _maxComponentSum;
+            return _statistics;
         }
 
-        [[nodiscard]] uint32_t GetNitCount(const int nit) const
+        // Wall clock time spent in ProcessRows
+        [[nodiscard]] double GetBusySeconds() const
         {
-            return _nitCounts[nit];
+            return _busySeconds;
         }
 
     private:
-        static const float3x3 ScRgbToBt2100;
+        using ConvertRowFunction = void (JxrChunkLoader::*)(uint32_t line, ushort3* output);
 
-        std::thread _thread;
         ushort3* _output;
+        size_t _outputRowBytes;
+        avifImage* _yuvOutput;
         jxr_data _data;
-        std::unique_ptr<uint32_t[]> _nitCounts;
-        uint32_t _startLine;
-        uint32_t _endLine;
-        double _maxComponentSum;
-        uint16_t _maxNits;
+        const uint8_t* _sourcePixels;
+        uint32_t _sourceFirstLine;
+        HdrStatistics _statistics;
+        double _busySeconds;
+        float* _thumbnailSums;
+        uint32_t _thumbnailWidth;
+        uint32_t _thumbnailScale;
+        std::unique_ptr<ushort3[]> _rows;
+        uint32_t _chromaShiftX;
+        uint32_t _chromaShiftY;
+        float _kr, _kg, _kb;
+        float _lumaScale, _lumaBias;
+        float _cbScale, _crScale, _chromaBias;
+        float _maxCode;
+        bool _identityMatrix;
+        ConvertRowFunction _convertRow;
+
+        static ConvertRowFunction SelectConvertRow(uint8_t bytesPerPixel, bool fastPq);
+
+        // Specialized on the input format, RGBA32F or RGBA16F, and on the PQ curve
+        template<uint8_t BytesPerPixel, bool FastPq>
+        void ConvertRow(uint32_t line, ushort3* output);
+
+        void StoreYuvRows(uint32_t line, const ushort3* row0, const ushort3* row1) const;
+
+        [[nodiscard]] uint16_t* GetPlaneRow(int channel, uint32_t line) const
+        {
+            return reinterpret_cast<uint16_t*>(_yuvOutput->yuvPlanes[channel] + static_cast<size_t>(line) * _yuvOutput->yuvRowBytes[channel]);
+        }
 
-        void ProcessChunk();
+        [[nodiscard]] uint16_t ToCode(const float v) const
+        {
+            return static_cast<uint16_t>(std::fmin(std::fmax(v + 0.5f, 0.f), _maxCode));
+        }
     };
 }
 #endif // __JXR_CHUNK_LOADER_HPP__
@@ -52,19 +52,22 @@ namespace JxrToAvif
     class JxrData
     {
     public:
+        JxrData() noexcept(true)
+            : _data{}
+        {
+        }
+
         explicit JxrData(const std::wstring& filename) noexcept(false)
             : _data{}
         {
-            const auto hr = jxr_load_data(filename.c_str(), &_data);
+            ThrowIfFailed(jxr_load_data(filename.c_str(), &_data));
+        }
 
-            if (hr < 0)
-            {
-                std::string s("Failed to get image data: ");
-                const auto errorDesc = jxr_get_error_description(hr);
-                s.append(errorDesc);
-                jxr_free_error_description(errorDesc);
-                throw std::runtime_error(s);
-            }
+        // Decodes a JPEG XR file held in memory
+        JxrData(const uint8_t* buffer, const size_t size) noexcept(false)
+            : _data{}
+        {
+            ThrowIfFailed(jxr_load_data_from_memory(buffer, size, &_data));
         }
 
         JxrData(const JxrData&) = delete;
@@ -97,8 +100,84 @@ namespace JxrToAvif
             return _data;
         }
 
+        void Release() noexcept(true)
+        {
+            jxr_free_data(&_data);
+        }
+
     private:
         jxr_data _data;
+
+        static void ThrowIfFailed(const int hr)
+        {
+            if (hr < 0)
+            {
+                std::string s("Failed to get image data: ");
+                const auto errorDesc = jxr_get_error_description(hr);
+                s.append(errorDesc);
+                jxr_free_error_description(errorDesc);
+                throw std::runtime_error(s);
+            }
+        }
+    };
+
+    // Decodes an image in bands of rows, the image is never held in memory as a whole
+    class JxrDecoder
+    {
+    public:
+        explicit JxrDecoder(const std::wstring& filename) noexcept(false)
+            : _decoder(nullptr), _info{}
+        {
+            ThrowIfFailed(jxr_open_decoder(filename.c_str(), &_decoder, &_info), "Failed to open image: ");
+        }
+
+        // The buffer holds a JPEG XR file and must outlive the decoder
+        JxrDecoder(const uint8_t* buffer, const size_t size) noexcept(false)
+            : _decoder(nullptr), _info{}
+        {
+            ThrowIfFailed(jxr_open_decoder_from_memory(buffer, size, &_decoder, &_info), "Failed to open image: ");
+        }
+
+        JxrDecoder(const JxrDecoder&) = delete;
+
+        JxrDecoder(JxrDecoder&&) = delete;
+
+        ~JxrDecoder() noexcept(true)
+        {
+            jxr_close_decoder(_decoder);
+        }
+
+        JxrDecoder& operator=(const JxrDecoder&) = delete;
+
+        JxrDecoder& operator=(JxrDecoder&&) = delete;
+
+        // Size and format of the image, without pixels
+        [[nodiscard]] const jxr_data& GetInfo() const
+        {
+            return _info;
+        }
+
+        // Buffer rows are spaced by the stride of the image
+        void DecodeRows(const uint32_t firstRow, const uint32_t rowCount, uint8_t* buffer)
+        {
+            ThrowIfFailed(jxr_decode_rows(_decoder, firstRow, rowCount, buffer, _info.stride), "Failed to decode image rows: ");
+        }
+
+    private:
+        jxr_decoder* _decoder;
+        jxr_data _info;
+
+        static void ThrowIfFailed(const int hr, const char* message)
+        {
+            if (hr < 0)
+            {
+                std::string s(message);
+                const auto errorDesc = jxr_get_error_description(hr);
+                s.append(errorDesc);
+                jxr_free_error_description(errorDesc);
+                throw std::runtime_error(s);
+            }
+        }
     };
 }
 
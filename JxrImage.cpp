@@ -1,95 +1,322 @@
 // Copyright 2020 Joe Drago, 2024 Dmitry Ignatiev. All rights reserved
 
+#include <algorithm>
 #include <cstring>
 #include <cmath>
+#include <numeric>
 #include <vector>
-#include <iostream>
+#include <stdexcept>
 #include "jxr_sys_helpers.h"
 #include "JxrData.hpp"
 #include "JxrChunkLoader.hpp"
+#include "PqCurve.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
 #include "JxrImage.hpp"
 
 namespace JxrToAvif
 {
-    JxrImage::JxrImage(const std::wstring& filename, const bool realMaxCLL, const double maxCllPercentile)
-        : _width(0), _height(0), _maxCLL(0), _maxPALL(0)
+    JxrImage::JxrImage(const std::wstring& filename, const bool realMaxCLL, const double maxCllPercentile, const bool streaming)
+        : _loaderState(streaming ? std::make_unique<JxrLoaderThreadState>() : nullptr),
+        _decoder(streaming ? std::make_unique<JxrDecoder>(filename) : nullptr),
+        _data(streaming ? JxrData() : Load(filename)), _borrowedPixels{}, _width(GetSourceInfo().width), _height(GetSourceInfo().height),
+        _maxCLL(0), _maxFALL(0), _realMaxCLL(realMaxCLL), _fastPq(false), _maxCllPercentile(maxCllPercentile), _rgbPixels(nullptr), _rgbRowBytes(0),
+        _thumbnailMaxSize(0), _thumbnailWidth(0), _thumbnailHeight(0)
     {
-        const JxrLoaderThreadState state;
+    }
+
+    JxrImage::JxrImage(const uint8_t* buffer, const size_t size, const bool realMaxCLL, const double maxCllPercentile, const bool streaming)
+        : _loaderState(streaming ? std::make_unique<JxrLoaderThreadState>() : nullptr),
+        _decoder(streaming ? std::make_unique<JxrDecoder>(buffer, size) : nullptr),
+        _data(streaming ? JxrData() : Load(buffer, size)), _borrowedPixels{}, _width(GetSourceInfo().width), _height(GetSourceInfo().height),
+        _maxCLL(0), _maxFALL(0), _realMaxCLL(realMaxCLL), _fastPq(false), _maxCllPercentile(maxCllPercentile), _rgbPixels(nullptr), _rgbRowBytes(0),
+        _thumbnailMaxSize(0), _thumbnailWidth(0), _thumbnailHeight(0)
+    {
+    }
+
+    JxrImage::JxrImage(const jxr_data& pixels, const bool realMaxCLL, const double maxCllPercentile)
+        : _borrowedPixels(pixels), _width(pixels.width), _height(pixels.height), _maxCLL(0), _maxFALL(0),
+        _realMaxCLL(realMaxCLL), _fastPq(false), _maxCllPercentile(maxCllPercentile), _rgbPixels(nullptr), _rgbRowBytes(0),
+        _thumbnailMaxSize(0), _thumbnailWidth(0), _thumbnailHeight(0)
+    {
+        if (!pixels.pixels || !pixels.width || !pixels.height ||
+            (pixels.bytes_per_pixel != 8 && pixels.bytes_per_pixel != 16) ||
+            pixels.stride < static_cast<uint64_t>(pixels.width) * pixels.bytes_per_pixel)
         {
-            const JxrData dataWrapper(filename);
+            throw std::invalid_argument("Pixels must be RGBA with 8 or 16 bytes per pixel and rows no shorter than the width.");
+        }
+    }
 
-            const jxr_data& data = dataWrapper.Get();
+    JxrData JxrImage::Load(const std::wstring& filename)
+    {
+        const TraceScope trace("decode");
+        const JxrLoaderThreadState state;
+        return JxrData(filename);
+    }
 
-            _width = data.width;
-            _height = data.height;
+    JxrData JxrImage::Load(const uint8_t* buffer, const size_t size)
+    {
+        const TraceScope trace("decode");
+        const JxrLoaderThreadState state;
+        return JxrData(buffer, size);
+    }
+
+    void JxrImage::ConvertToRgb(const bool reuseSourceBuffer)
+    {
+        const jxr_data& data = _data.Get();
 
+        if (reuseSourceBuffer && data.pixels)
+        {
+            // A 6 byte RGB pixel never reaches past the 8 or 16 byte source pixel it comes from
+            _rgbPixels = reinterpret_cast<ushort3*>(data.pixels);
+            _rgbRowBytes = data.stride;
+        }
+        else
+        {
             const auto pixelCount = static_cast<size_t>(_width) * _height;
 
             _pixels = std::unique_ptr<ushort3[]>(new ushort3[pixelCount]);
+            _rgbPixels = _pixels.get();
+            _rgbRowBytes = sizeof(ushort3) * _width;
+        }
 
-            const uint32_t numThreads = jxr_get_number_of_processors();
+        Convert(_rgbPixels, _rgbRowBytes, nullptr);
+    }
 
-            std::cout << "Using " << numThreads << " threads\n";
+    void JxrImage::ConvertToYuv(avifImage* image, const bool reuseSourceBuffer)
+    {
+        if (!image || image->width != _width || image->height != _height)
+        {
+            throw std::invalid_argument("Target image must match the source size.");
+        }
 
-            std::cout << "Converting pixels to BT.2100 PQ...\n" << std::flush;
+        if (reuseSourceBuffer)
+        {
+            if (!_data.Get().pixels)
+            {
+                throw std::invalid_argument("Only images decoded as a whole have a source buffer to reuse.");
+            }
 
-            uint32_t convThreads = numThreads < 64 ? numThreads : 64;
+            if (image->yuvPlanes[AVIF_CHAN_Y] || !avifImageUsesU16(image))
+            {
+                throw std::invalid_argument("Target image must have more than 8 bits per sample and no planes allocated.");
+            }
 
-            uint32_t chunkSize = _height / convThreads;
+            const jxr_data& data = _data.Get();
+            avifPixelFormatInfo formatInfo;
+            avifGetPixelFormatInfo(image->yuvFormat, &formatInfo);
 
-            if (chunkSize == 0) {
-                convThreads = _height;
-                chunkSize = 1;
+            // Every plane row lives inside the source row it is computed from: [Y][Cb][Cr] takes
+            // at most 6 bytes per source pixel. 4:2:0 chroma rows take every other source row.
+            const auto lumaRowSize = sizeof(uint16_t) * _width;
+            image->yuvPlanes[AVIF_CHAN_Y] = data.pixels;
+            image->yuvRowBytes[AVIF_CHAN_Y] = data.stride;
+            if (!formatInfo.monochrome)
+            {
+                const auto chromaWidth = (_width + formatInfo.chromaShiftX) >> formatInfo.chromaShiftX;
+                image->yuvPlanes[AVIF_CHAN_U] = data.pixels + lumaRowSize;
+                image->yuvPlanes[AVIF_CHAN_V] = data.pixels + lumaRowSize + sizeof(uint16_t) * chromaWidth;
+                image->yuvRowBytes[AVIF_CHAN_U] = data.stride << formatInfo.chromaShiftY;
+                image->yuvRowBytes[AVIF_CHAN_V] = data.stride << formatInfo.chromaShiftY;
             }
+            image->imageOwnsYUVPlanes = AVIF_FALSE;
+        }
+        else if (!image->yuvPlanes[AVIF_CHAN_Y])
+        {
+            throw std::invalid_argument("Target image must have YUV planes allocated.");
+        }
 
-            std::vector<std::unique_ptr<JxrChunkLoader>> loaders;
+        Convert(nullptr, 0, image);
+    }
 
-            for (uint32_t i = 0; i < convThreads; i++)
-            {
-                uint32_t startLine = i * chunkSize,
-                    endLine = (i == convThreads - 1) ? _height : (i + 1) * chunkSize;
+    void JxrImage::ReleaseData()
+    {
+        _pixels.reset();
+        _rgbPixels = nullptr;
+        _rgbRowBytes = 0;
+        _data.Release();
+        _decoder.reset();
+        _loaderState.reset();
+        _borrowedPixels = jxr_data{};
+    }
 
-                loaders.push_back(std::make_unique<JxrChunkLoader>(_pixels.get(), data, startLine, endLine));
+    void JxrImage::Convert(ushort3* rgbOutput, const size_t rgbRowBytes, avifImage* yuvOutput)
+    {
+        const jxr_data& data = GetSourceInfo();
+        _maxCLL = 0;
+        _maxFALL = 0;
+
+        auto& pool = ThreadPool::GetInstance();
+        const auto numThreads = pool.GetWorkerCount();
+
+        // One loader per worker, tiles are small enough for the pool to balance bright and dark bands
+        std::vector<std::unique_ptr<JxrChunkLoader>> loaders;
+
+        for (uint32_t i = 0; i < numThreads; i++)
+        {
+            if (yuvOutput)
+                loaders.push_back(std::make_unique<JxrChunkLoader>(yuvOutput, data, _fastPq));
+            else
+                loaders.push_back(std::make_unique<JxrChunkLoader>(rgbOutput, rgbRowBytes, data, _fastPq));
+        }
+
+        // 4:2:0 chroma rows are built from pairs of source rows, which must not be split
+        uint32_t rowAlignment = yuvOutput && yuvOutput->yuvFormat == AVIF_PIXEL_FORMAT_YUV420 ? 2 : 1;
+
+        // Rows of thumbnail boxes must not be split either, two loaders would add to the same sums
+        std::vector<float> thumbnailSums;
+        uint32_t thumbnailScale = 1;
+        if (_thumbnailMaxSize > 0)
+        {
+            const auto longestSide = std::max(_width, _height);
+            thumbnailScale = (longestSide + _thumbnailMaxSize - 1) / _thumbnailMaxSize;
+            _thumbnailWidth = (_width + thumbnailScale - 1) / thumbnailScale;
+            _thumbnailHeight = (_height + thumbnailScale - 1) / thumbnailScale;
+            thumbnailSums.assign(static_cast<size_t>(_thumbnailWidth) * _thumbnailHeight * 3, 0.f);
+            rowAlignment = std::lcm(rowAlignment, thumbnailScale);
+
+            for (const auto& loader : loaders)
+            {
+                loader->SetThumbnailSums(thumbnailSums.data(), _thumbnailWidth, thumbnailScale);
             }
+        }
 
-            double maxComponentSum = 0;
+        auto rowsPerTile = std::max<uint32_t>(1, MinPixelsPerTile / _width);
+        rowsPerTile = (rowsPerTile + rowAlignment - 1) / rowAlignment * rowAlignment;
 
-            for (uint32_t i = 0; i < convThreads; i++)
+        if (_decoder)
+        {
+            ConvertBands(loaders, rowsPerTile);
+        }
+        else
+        {
+            pool.ParallelFor(0, _height, rowsPerTile, [&loaders](const size_t startLine, const size_t endLine, const uint32_t worker)
             {
-                loaders[i]->Wait();
+                loaders[worker]->ProcessRows(static_cast<uint32_t>(startLine), static_cast<uint32_t>(endLine));
+            });
+        }
+
+        if (_thumbnailMaxSize > 0)
+        {
+            FinishThumbnail(thumbnailSums, thumbnailScale);
+        }
+
+        const TraceScope trace("merge-statistics");
+        _statistics = HdrStatistics();
+        _workerBusySeconds.clear();
+        for (const auto& loader : loaders)
+        {
+            _statistics.Merge(loader->GetStatistics());
+            _workerBusySeconds.push_back(loader->GetBusySeconds());
+        }
+        _statistics.Finalize();
+
+        const auto maxCLL = _realMaxCLL ? _statistics.GetMaxNits() : _statistics.GetPercentileNits(_maxCllPercentile);
+        _maxCLL = static_cast<uint16_t>(std::lround(maxCLL));
+
+        // A low percentile may fall below the average, which must not exceed MaxCLL
+        _maxFALL = static_cast<uint16_t>(std::min<long>(std::lround(_statistics.GetAverageNits()), _maxCLL));
+    }
 
-                const auto tMaxNits = loaders[i]->GetMaxNits();
-                if (tMaxNits > _maxCLL)
+    void JxrImage::FinishThumbnail(const std::vector<float>& sums, const uint32_t scale)
+    {
+        const TraceScope trace("thumbnail");
+        _thumbnailPixels = std::unique_ptr<ushort3[]>(new ushort3[static_cast<size_t>(_thumbnailWidth) * _thumbnailHeight]);
+
+        const auto toCode = [](const float linear)
+        {
+            // Few enough pixels for the exact scalar curve
+            const auto ym1 = std::pow(std::fmax(linear, 0.f), PqCurve::M1);
+            const auto signal = std::pow((PqCurve::C1 + PqCurve::C2 * ym1) / (1.f + PqCurve::C3 * ym1), PqCurve::M2);
+            return static_cast<uint16_t>(std::lround(std::fmin(signal, 1.f) * 65535.f));
+        };
+
+        const auto pixels = reinterpret_cast<uint16_t*>(_thumbnailPixels.get());
+        for (uint32_t y = 0; y < _thumbnailHeight; y++)
+        {
+            // Boxes at the right and bottom edges cover fewer pixels
+            const auto boxHeight = std::min(scale, _height - y * scale);
+            for (uint32_t x = 0; x < _thumbnailWidth; x++)
+            {
+                const auto boxWidth = std::min(scale, _width - x * scale);
+                const auto index = static_cast<size_t>(y) * _thumbnailWidth + x;
+                const auto box = sums.data() + index * 3;
+                const auto scaleToAverage = 1.f / static_cast<float>(boxWidth * boxHeight);
+
+                for (size_t c = 0; c < 3; c++)
                 {
-                    _maxCLL = tMaxNits;
+                    pixels[index * 3 + c] = toCode(box[c] * scaleToAverage);
                 }
-
-                maxComponentSum += loaders[i]->GetMaxComponentSum();
             }
+        }
+    }
+
+    void JxrImage::ConvertBands(const std::vector<std::unique_ptr<JxrChunkLoader>>& loaders, const uint32_t rowsPerTile)
+    {
+        auto& pool = ThreadPool::GetInstance();
+        const auto stride = _decoder->GetInfo().stride;
 
-            if (!realMaxCLL)
+        // Bands are whole tiles, so 4:2:0 row pairs are never split between them
+        const auto tilesPerBand = std::max<size_t>(1, StreamingBandBytes / stride / rowsPerTile);
+        const auto bandHeight = static_cast<uint32_t>(std::min<size_t>(_height, tilesPerBand * rowsPerTile));
+
+        std::unique_ptr<uint8_t[]> buffers[StreamingBandBuffers];
+        for (auto& buffer : buffers)
+        {
+            buffer = std::unique_ptr<uint8_t[]>(new uint8_t[static_cast<size_t>(bandHeight) * stride]);
+        }
+
+        // This thread decodes the next band while the pool converts the previous one
+        ThreadPool::TaskGroup group;
+        bool converting = false;
+
+        try
+        {
+            size_t band = 0;
+            for (uint32_t firstLine = 0; firstLine < _height; firstLine += bandHeight, band++)
             {
-                uint16_t currentIdx = _maxCLL;
-                uint64_t count = 0;
-                const auto countTarget = static_cast<uint64_t>(round((1 - maxCllPercentile) * static_cast<double>(pixelCount)));
-                while (true)
+                const auto rowCount = std::min(bandHeight, _height - firstLine);
+                const auto buffer = buffers[band % StreamingBandBuffers].get();
+
                 {
-                    for (uint32_t i = 0; i < convThreads; i++)
-                    {
-                        count += loaders[i]->GetNitCount(currentIdx);
-                    }
-                    if (count >= countTarget)
-                    {
-                        _maxCLL = currentIdx;
-                        break;
-                    }
-                    currentIdx--;
+                    const TraceScope trace("decode-band", "firstRow", firstLine);
+                    _decoder->DecodeRows(firstLine, rowCount, buffer);
                 }
-            }
 
-            _maxPALL = static_cast<uint16_t>(round(10000 * (maxComponentSum / static_cast<double>(pixelCount))));
+                // The buffer decoded next was read by the band before this one
+                if (converting)
+                {
+                    converting = false;
+                    pool.Wait(group);
+                }
 
-            std::cout << "Computed HDR metadata: " << _maxCLL << " MaxCLL, " << _maxPALL << " MaxPALL.\n";
+                pool.Submit(group, [&pool, &loaders, buffer, firstLine, rowCount, rowsPerTile]
+                {
+                    pool.ParallelFor(firstLine, firstLine + rowCount, rowsPerTile, [&loaders, buffer, firstLine](const size_t startLine, const size_t endLine, const uint32_t worker)
+                    {
+                        loaders[worker]->SetSourceBand(buffer, firstLine);
+                        loaders[worker]->ProcessRows(static_cast<uint32_t>(startLine), static_cast<uint32_t>(endLine));
+                    });
+                });
+                converting = true;
+            }
+        }
+        catch (...)
+        {
+            // Tasks still reference the buffers
+            if (converting)
+            {
+                try
+                {
+                    pool.Wait(group);
+                }
+                catch (...)
+                {
+                }
+            }
+            throw;
         }
+
+        pool.Wait(group);
     }
 }
@@ -5,7 +5,12 @@
 
 #include <string>
 #include <memory>
+#include <vector>
 #include <simd_math.h>
+#include <avif/avif.h>
+#include "JxrData.hpp"
+#include "HdrStatistics.hpp"
+#include "JxrChunkLoader.hpp"
 
 namespace JxrToAvif
 {
@@ -14,7 +19,21 @@ namespace JxrToAvif
     public:
         static constexpr double DefaultMaxCllPercentile = 0.9999;
 
-        explicit JxrImage(const std::wstring& filename, bool realMaxCLL = false, double maxCllPercentile = DefaultMaxCllPercentile);
+        // Decodes the file, pixels are converted by one of the Convert* methods.
+        // MaxCLL is the light level maxCllPercentile of pixels don't exceed, or the real maximum with realMaxCLL.
+        // A streaming image is only opened here, bands of rows are decoded during conversion
+        // while previous bands are converted, and there is no source buffer to reuse.
+        explicit JxrImage(const std::wstring& filename, bool realMaxCLL = false, double maxCllPercentile = DefaultMaxCllPercentile,
+            bool streaming = false);
+
+        // Same as above for a JPEG XR file held in memory. Streaming reads the buffer
+        // during conversion, so it must outlive the image then.
+        JxrImage(const uint8_t* buffer, size_t size, bool realMaxCLL = false, double maxCllPercentile = DefaultMaxCllPercentile,
+            bool streaming = false);
+
+        // Converts decoded pixels owned by the caller, which are only read and must outlive the image.
+        // Pixels are scRGB RGBA, with half or float components for 8 or 16 bytes per pixel.
+        explicit JxrImage(const jxr_data& pixels, bool realMaxCLL = false, double maxCllPercentile = DefaultMaxCllPercentile);
 
         JxrImage(const JxrImage&) = delete;
 
@@ -26,6 +45,37 @@ namespace JxrToAvif
 
         ~JxrImage() = default;
 
+        // Converts to 16 bit BT.2100 PQ RGB, available through GetDataPointer().
+        // With reuseSourceBuffer, RGB rows are written over the decoded rows instead of a new buffer.
+        void ConvertToRgb(bool reuseSourceBuffer = false);
+
+        // Converts to BT.2100 PQ straight into the YUV planes of the image, which must have the size of this image.
+        // Planes must be allocated, unless reuseSourceBuffer is set. In that case the planes are
+        // pointed into the decoded buffer and stay valid until ReleaseData() or destruction.
+        void ConvertToYuv(avifImage* image, bool reuseSourceBuffer = false);
+
+        // Frees the decoded pixels and the RGB output
+        void ReleaseData();
+
+        // Use the table based PQ curve for the following conversions, see PqCurve for its error bound
+        void SetFastPq(const bool fastPq)
+        {
+            _fastPq = fastPq;
+        }
+
+        // The following conversions also average the image in linear light into a thumbnail,
+        // no side of which exceeds maxSize. Zero disables the thumbnail.
+        void SetThumbnailSize(const uint32_t maxSize)
+        {
+            _thumbnailMaxSize = maxSize;
+        }
+
+        // Whether the image was decoded as a whole into a buffer it owns, which conversions may reuse
+        [[nodiscard]] bool HasSourceBuffer() const
+        {
+            return _data.Get().pixels != nullptr;
+        }
+
         [[nodiscard]] uint32_t GetWidth() const
         {
             return _width;
@@ -41,22 +91,95 @@ namespace JxrToAvif
             return _maxCLL;
         }
 
-        [[nodiscard]] uint16_t GetMaxPALL() const
+        [[nodiscard]] uint16_t GetMaxFALL() const
+        {
+            return _maxFALL;
+        }
+
+        // Available after conversion
+        [[nodiscard]] const HdrStatistics& GetStatistics() const
         {
-            return _maxPALL;
+            return _statistics;
+        }
+
+        // Time each pool worker spent converting rows in the last conversion, indexed by worker
+        [[nodiscard]] const std::vector<double>& GetWorkerBusySeconds() const
+        {
+            return _workerBusySeconds;
+        }
+
+        // 16 bit BT.2100 PQ RGB thumbnail rows without padding, available after conversion with a thumbnail size set
+        [[nodiscard]] const ushort3* GetThumbnailPixels() const
+        {
+            return _thumbnailPixels.get();
+        }
+
+        [[nodiscard]] uint32_t GetThumbnailWidth() const
+        {
+            return _thumbnailWidth;
+        }
+
+        [[nodiscard]] uint32_t GetThumbnailHeight() const
+        {
+            return _thumbnailHeight;
         }
 
         [[nodiscard]] ushort3* GetDataPointer() const
         {
-            return _pixels.get();
+            return _rgbPixels;
+        }
+
+        [[nodiscard]] size_t GetRowBytes() const
+        {
+            return _rgbRowBytes;
         }
 
     private:
+        static constexpr uint32_t MinPixelsPerTile = 16384;
+
+        // Target size of a band of decoded rows and the number of bands in flight
+        static constexpr size_t StreamingBandBytes = 32 << 20;
+        static constexpr size_t StreamingBandBuffers = 2;
+
+        std::unique_ptr<JxrLoaderThreadState> _loaderState;
+        std::unique_ptr<JxrDecoder> _decoder;
+        JxrData _data;
+        jxr_data _borrowedPixels;
         uint32_t _width;
         uint32_t _height;
         uint16_t _maxCLL;
-        uint16_t _maxPALL;
+        uint16_t _maxFALL;
+        bool _realMaxCLL;
+        bool _fastPq;
+        double _maxCllPercentile;
+        HdrStatistics _statistics;
+        std::vector<double> _workerBusySeconds;
         std::unique_ptr<ushort3[]> _pixels;
+        ushort3* _rgbPixels;
+        size_t _rgbRowBytes;
+        uint32_t _thumbnailMaxSize;
+        uint32_t _thumbnailWidth;
+        uint32_t _thumbnailHeight;
+        std::unique_ptr<ushort3[]> _thumbnailPixels;
+
+        static JxrData Load(const std::wstring& filename);
+
+        static JxrData Load(const uint8_t* buffer, size_t size);
+
+        [[nodiscard]] const jxr_data& GetSourceInfo() const
+        {
+            if (_decoder)
+                return _decoder->GetInfo();
+
+            return _borrowedPixels.pixels ? _borrowedPixels : _data.Get();
+        }
+
+        void ConvertBands(const std::vector<std::unique_ptr<JxrChunkLoader>>& loaders, uint32_t rowsPerTile);
+
+        void Convert(ushort3* rgbOutput, size_t rgbRowBytes, avifImage* yuvOutput);
+
+        // Turns the sums of linear light over boxes of scale x scale pixels into PQ pixels
+        void FinishThumbnail(const std::vector<float>& sums, uint32_t scale);
     };
 }
 
@@ -0,0 +1,278 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include "jxr_sys_helpers.h"
+#include "ContentHash.hpp"
+#include "Stopwatch.hpp"
+#include "Trace.hpp"
+#include "OutputCache.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        // Changes whenever the converter starts producing different files from the same options
+        constexpr int CacheVersion = 1;
+
+        // Copies of hits go through a buffer of this size
+        constexpr size_t CopyBufferSize = 8 << 20;
+
+        std::string GetErrorDescription(const int hr)
+        {
+            const auto errorDesc = jxr_get_error_description(hr);
+            std::string description(errorDesc ? errorDesc : "");
+            jxr_free_error_description(errorDesc);
+            return description;
+        }
+
+        std::wstring ToHex(const uint64_t value)
+        {
+            std::wostringstream stream;
+            stream << std::hex << std::setfill(L'0') << std::setw(16) << value;
+            return stream.str();
+        }
+
+        bool FileExists(const std::wstring& path)
+        {
+            uint64_t size = 0;
+            int isDirectory = 0;
+            return jxr_get_file_info(path.c_str(), &size, &isDirectory) >= 0 && !isDirectory;
+        }
+    }
+
+    OutputCache::OutputCache(std::wstring directory, const uint64_t maxSize, const bool link)
+        : _directory(std::move(directory)), _maxSize(maxSize), _link(link), _hits(0), _misses(0)
+    {
+        const auto rv = jxr_create_directory(_directory.c_str());
+        if (rv < 0)
+        {
+            throw std::runtime_error("Failed to create cache directory: " + GetErrorDescription(rv));
+        }
+    }
+
+    CacheLookup OutputCache::Fetch(const std::wstring& inputFile, const ConversionOptions& options,
+        const std::wstring& outputFile, const std::wstring& thumbnailFile)
+    {
+        CacheLookup lookup;
+        Stopwatch stopwatch;
+
+        uint64_t inputHash = 0;
+        try
+        {
+            inputHash = ContentHash::HashFile(inputFile);
+        }
+        catch (std::exception&)
+        {
+            // The conversion reports why the input can not be read
+            _misses++;
+            return lookup;
+        }
+
+        const auto optionsText = GetOptionsText(options);
+        lookup.key = ToHex(inputHash) + ToHex(ContentHash::Hash(optionsText.data(), optionsText.size()));
+        lookup.hashSeconds = stopwatch.Lap("hash").wallSeconds;
+
+        const TraceScope trace("cache-fetch");
+        const auto entry = GetEntryPath(lookup.key, EntryExtension);
+        const auto thumbnailEntry = GetEntryPath(lookup.key, ThumbnailExtension);
+        const auto wantsThumbnail = !thumbnailFile.empty();
+
+        if (FileExists(entry) && (!wantsThumbnail || FileExists(thumbnailEntry)))
+        {
+            // Eviction goes by modification time, so a hit makes the entry the most recently used.
+            // This happens before the output is placed, a linked output shares the time of the entry
+            // and gets the one of its own creation instead of a later one.
+            jxr_touch_file(entry.c_str());
+            if (wantsThumbnail)
+                jxr_touch_file(thumbnailEntry.c_str());
+            lookup.hit = Place(entry, outputFile) && (!wantsThumbnail || Place(thumbnailEntry, thumbnailFile));
+        }
+
+        if (lookup.hit)
+        {
+            _hits++;
+        }
+        else
+        {
+            // Outputs linked by an earlier hit are safe, writing a file replaces it instead of writing into it
+            _misses++;
+        }
+
+        lookup.seconds = lookup.hashSeconds + stopwatch.Lap("fetch").wallSeconds;
+        return lookup;
+    }
+
+    bool OutputCache::Store(const std::wstring& key, const ConversionResult& result)
+    {
+        if (key.empty() || result.avif.GetSize() == 0)
+            return false;
+
+        const TraceScope trace("cache-store");
+        const std::lock_guard lock(_storeMutex);
+
+        // The entry itself goes last, a hit needs it and finds the thumbnail already in place
+        if (result.thumbnail.GetSize() > 0 && !WriteEntry(GetEntryPath(key, ThumbnailExtension), result.thumbnail))
+            return false;
+        if (!WriteEntry(GetEntryPath(key, EntryExtension), result.avif))
+            return false;
+
+        Evict();
+        return true;
+    }
+
+    CacheStatistics OutputCache::GetStatistics(const CacheLookup& lookup) const
+    {
+        CacheStatistics statistics;
+        statistics.hit = lookup.hit;
+        statistics.hashSeconds = lookup.hashSeconds;
+        statistics.seconds = lookup.seconds;
+        statistics.hits = _hits.load();
+        statistics.misses = _misses.load();
+        return statistics;
+    }
+
+    std::string OutputCache::GetOptionsText(const ConversionOptions& options)
+    {
+        // Everything that changes the output bytes. Memory and threading options do not, and
+        // the encoder version does, so a libavif update starts over with new entries.
+        std::ostringstream text;
+        text << std::setprecision(17)
+            << "version " << CacheVersion
+            << " libavif " << avifVersion()
+            << " speed " << options.speed
+            << " tiling " << options.useTiling
+            << " tiles " << options.tileRowsLog2 << ' ' << options.tileColsLog2
+            << " depth " << static_cast<int>(options.depth)
+            << " format " << static_cast<int>(options.format)
+            << " real-maxcll " << options.realMaxCLL
+            << " maxcll-percentile " << options.maxCllPercentile
+            << " direct-yuv " << options.directYuv
+            << " fast-pq " << options.fastPq
+            << " grid " << options.gridColumns << 'x' << options.gridRows
+            << " target-size " << options.targetSize
+            << " thumbnail " << options.thumbnailSize
+            << " gain-map " << options.gainMapScale;
+        return text.str();
+    }
+
+    std::wstring OutputCache::GetEntryPath(const std::wstring& key, const wchar_t* extension) const
+    {
+        if (_directory.empty() || jxr_is_path_separator(_directory.back()))
+            return _directory + key + extension;
+        return _directory + jxr_get_path_separator() + key + extension;
+    }
+
+    bool OutputCache::Place(const std::wstring& entry, const std::wstring& target) const
+    {
+        // Links fail across volumes, a copy still serves the hit
+        if (_link && target != L"-" && jxr_create_hard_link(entry.c_str(), target.c_str()) >= 0)
+            return true;
+
+        jxr_file* file = nullptr;
+        uint64_t size = 0;
+        if (jxr_open_file(entry.c_str(), &file, &size) < 0)
+            return false;
+
+        jxr_output* output = nullptr;
+        if (jxr_create_output(target.c_str(), size, &output) < 0)
+        {
+            jxr_close_file(file);
+            return false;
+        }
+
+        const auto buffer = std::make_unique<uint8_t[]>(CopyBufferSize);
+        auto rv = 0;
+        while (rv >= 0)
+        {
+            size_t bytesRead = 0;
+            rv = jxr_read_file_part(file, buffer.get(), CopyBufferSize, &bytesRead);
+            if (rv < 0 || bytesRead == 0)
+                break;
+            rv = jxr_write_output(output, buffer.get(), bytesRead);
+        }
+        jxr_close_file(file);
+
+        if (rv < 0)
+        {
+            jxr_abort_output(output);
+            return false;
+        }
+        return jxr_commit_output(output) >= 0;
+    }
+
+    bool OutputCache::WriteEntry(const std::wstring& path, const AvifData& data) const
+    {
+        // Other processes sharing the directory never see a partly written entry, see jxr_create_output
+        return jxr_write_data_to_file(path.c_str(), data.GetData(), data.GetSize()) >= 0;
+    }
+
+    void OutputCache::Evict()
+    {
+        struct Entry
+        {
+            uint64_t size = 0;
+            int64_t time = 0;
+            std::vector<std::wstring> paths;
+        };
+
+        jxr_directory_list list{};
+        if (jxr_list_directory(_directory.c_str(), &list) < 0)
+            return;
+
+        std::vector<std::wstring> names(list.names, list.names + list.count);
+        jxr_free_directory_list(&list);
+
+        // An entry and its thumbnail share the key before the first dot and are evicted together
+        std::map<std::wstring, Entry> entries;
+        uint64_t totalSize = 0;
+        const std::wstring extension(EntryExtension);
+        for (const auto& name : names)
+        {
+            const auto dot = name.find(L'.');
+            if (dot == std::wstring::npos || name.size() < extension.size() ||
+                name.compare(name.size() - extension.size(), extension.size(), extension) != 0)
+                continue;
+
+            const auto path = GetEntryPath(name, L"");
+            uint64_t size = 0;
+            int64_t time = 0;
+            int isDirectory = 0;
+            if (jxr_get_file_info(path.c_str(), &size, &isDirectory) < 0 || jxr_get_file_time(path.c_str(), &time) < 0)
+                continue;
+
+            auto& entry = entries[name.substr(0, dot)];
+            entry.size += size;
+            entry.time = std::max(entry.time, time);
+            entry.paths.push_back(path);
+            totalSize += size;
+        }
+
+        if (totalSize <= _maxSize)
+            return;
+
+        std::vector<const Entry*> byAge;
+        for (const auto& [key, entry] : entries)
+        {
+            byAge.push_back(&entry);
+        }
+        std::sort(byAge.begin(), byAge.end(), [](const Entry* a, const Entry* b) { return a->time < b->time; });
+
+        for (const auto entry : byAge)
+        {
+            if (totalSize <= _maxSize)
+                break;
+
+            for (const auto& path : entry->paths)
+            {
+                jxr_delete_file(path.c_str());
+            }
+            totalSize -= entry->size;
+        }
+    }
+}
@@ -0,0 +1,91 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __OUTPUT_CACHE_HPP__
+#define __OUTPUT_CACHE_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include "Converter.hpp"
+
+namespace JxrToAvif
+{
+    struct CacheLookup
+    {
+        // Empty if the input could not be hashed, such a result is not stored
+        std::wstring key;
+        bool hit = false;
+        double hashSeconds = 0;
+        // Hashing and, on a hit, writing the outputs
+        double seconds = 0;
+    };
+
+    // Hit and miss counts of a cache with the lookup of one file, for the statistics
+    struct CacheStatistics
+    {
+        bool hit = false;
+        double hashSeconds = 0;
+        double seconds = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+
+    // Converted files kept in a directory under a hash of the input bytes and of every option
+    // that changes the output, so an input seen before is copied or linked without decoding.
+    // Entries over the size limit are evicted least recently used first, by modification time,
+    // which a hit refreshes. Several processes may share a directory, entries are written
+    // under a temporary name and renamed into place.
+    class OutputCache
+    {
+    public:
+        static constexpr uint64_t DefaultMaxSize = 1ull << 30;
+
+        static constexpr auto EntryExtension = L".avif";
+
+        static constexpr auto ThumbnailExtension = L".thumb.avif";
+
+        // Hard linked outputs share their storage with the cache instead of being copies
+        OutputCache(std::wstring directory, uint64_t maxSize, bool link);
+
+        OutputCache(const OutputCache&) = delete;
+
+        OutputCache(OutputCache&&) = delete;
+
+        OutputCache& operator=(const OutputCache&) = delete;
+
+        OutputCache& operator=(OutputCache&&) = delete;
+
+        ~OutputCache() = default;
+
+        // Hashes the input and on a hit writes the output, and the thumbnail unless its path is empty.
+        // A missing entry, or one that can not be read, is a miss.
+        CacheLookup Fetch(const std::wstring& inputFile, const ConversionOptions& options,
+            const std::wstring& outputFile, const std::wstring& thumbnailFile);
+
+        // Failures are reported by the return value, an output that is not cached is still written
+        bool Store(const std::wstring& key, const ConversionResult& result);
+
+        [[nodiscard]] CacheStatistics GetStatistics(const CacheLookup& lookup) const;
+
+    private:
+        std::wstring _directory;
+        uint64_t _maxSize;
+        bool _link;
+        std::atomic<uint64_t> _hits;
+        std::atomic<uint64_t> _misses;
+        std::mutex _storeMutex;
+
+        static std::string GetOptionsText(const ConversionOptions& options);
+
+        [[nodiscard]] std::wstring GetEntryPath(const std::wstring& key, const wchar_t* extension) const;
+
+        bool Place(const std::wstring& entry, const std::wstring& target) const;
+
+        bool WriteEntry(const std::wstring& path, const AvifData& data) const;
+
+        void Evict();
+    };
+}
+
+#endif // __OUTPUT_CACHE_HPP__
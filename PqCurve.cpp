@@ -0,0 +1,37 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <cmath>
+#include "PqCurve.hpp"
+
+namespace JxrToAvif
+{
+    const std::array<float, PqCurve::FastTableSize> PqCurve::FastTable = BuildFastTable();
+
+    double PqCurve::InverseEotfReference(const double y)
+    {
+        constexpr double m1 = 2610. / 16384.;
+        constexpr double m2 = 2523. / 4096. * 128.;
+        constexpr double c1 = 3424. / 4096.;
+        constexpr double c2 = 2413. / 4096. * 32.;
+        constexpr double c3 = 2392. / 4096. * 32.;
+
+        const auto ym1 = std::pow(y, m1);
+        return std::pow((c1 + c2 * ym1) / (1 + c3 * ym1), m2);
+    }
+
+    std::array<float, PqCurve::FastTableSize> PqCurve::BuildFastTable()
+    {
+        constexpr size_t segments = 1 << FastSegmentBits;
+
+        std::array<float, FastTableSize> table{};
+
+        for (size_t i = 0; i < FastTableSize; i++)
+        {
+            // Entry i is the start of segment i % segments in octave i / segments
+            const auto y = std::ldexp(1. + static_cast<double>(i % segments) / segments, static_cast<int>(i / segments) - FastOctaves);
+            table[i] = static_cast<float>(InverseEotfReference(y));
+        }
+
+        return table;
+    }
+}
@@ -0,0 +1,142 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __PQ_CURVE_HPP__
+#define __PQ_CURVE_HPP__
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+namespace JxrToAvif
+{
+    // SMPTE ST 2084 inverse EOTF, eight values at a time.
+    // Input is linear light normalized to 10000 nits, output is the [0, 1] signal.
+    class PqCurve
+    {
+    public:
+        // The fast curve interpolates a table indexed by the float bits of the input:
+        // FastSegmentBits mantissa bits pick the segment within each of the FastOctaves octaves below 1.
+        // Inputs below 2^-FastOctaves are treated as 2^-FastOctaves.
+        static constexpr int FastOctaves = 40;
+        static constexpr int FastSegmentBits = 5;
+        static constexpr size_t FastTableSize = (static_cast<size_t>(FastOctaves) << FastSegmentBits) + 2;
+
+        static constexpr float M1 = 2610.f / 16384.f;
+        static constexpr float M2 = 2523.f / 4096.f * 128.f;
+        static constexpr float C1 = 3424.f / 4096.f;
+        static constexpr float C2 = 2413.f / 4096.f * 32.f;
+        static constexpr float C3 = 2392.f / 4096.f * 32.f;
+
+        // Largest errors of InverseEotf and InverseEotfFast over every float in [0, 1], against InverseEotfReference,
+        // in steps of a 16 bit code. jxr_to_avif_bench --pq-accuracy checks them. Both are over half a step of the
+        // 16 bit RGB intermediate, but below 0.06 of a step of the 10 or 12 bit output it is rounded to.
+        static constexpr double MaxError16 = 0.66;
+        static constexpr double FastMaxError16 = 0.87;
+
+        // In double precision, for building tables and checking the curves above
+        static double InverseEotfReference(double y);
+
+        static __m256 InverseEotf(const __m256 y)
+        {
+            // Zero is mapped to the smallest normal number, its PQ value is zero at any output depth
+            const auto ym1 = Pow(_mm256_max_ps(y, _mm256_set1_ps(1.17549435e-38f)), M1);
+            const auto numerator = _mm256_fmadd_ps(ym1, _mm256_set1_ps(C2), _mm256_set1_ps(C1));
+            const auto denominator = _mm256_fmadd_ps(ym1, _mm256_set1_ps(C3), _mm256_set1_ps(1.f));
+            return Pow(_mm256_div_ps(numerator, denominator), M2);
+        }
+
+        // Input must be in [0, 1]
+        static __m256 InverseEotfFast(const __m256 y)
+        {
+            const auto bits = _mm256_castps_si256(_mm256_max_ps(y, _mm256_set1_ps(FastMinInput)));
+            const auto index = _mm256_sub_epi32(_mm256_srli_epi32(bits, FastFractionBits), _mm256_set1_epi32(FastIndexBias));
+            const auto fraction = _mm256_mul_ps(
+                _mm256_cvtepi32_ps(_mm256_and_si256(bits, _mm256_set1_epi32(FastFractionMask))),
+                _mm256_set1_ps(FastFractionScale));
+
+            const auto low = _mm256_i32gather_ps(FastTable.data(), index, 4);
+            const auto high = _mm256_i32gather_ps(FastTable.data() + 1, index, 4);
+
+            return _mm256_fmadd_ps(_mm256_sub_ps(high, low), fraction, low);
+        }
+
+        // Input must be in [0, 1]
+        static float InverseEotfFast(const float y)
+        {
+            uint32_t bits;
+            const auto clamped = y > FastMinInput ? y : FastMinInput;
+            std::memcpy(&bits, &clamped, sizeof(bits));
+
+            const auto index = (bits >> FastFractionBits) - FastIndexBias;
+            const auto fraction = static_cast<float>(bits & FastFractionMask) * FastFractionScale;
+            const auto low = FastTable[index];
+
+            return low + (FastTable[index + 1] - low) * fraction;
+        }
+
+    private:
+        static constexpr int FastFractionBits = 23 - FastSegmentBits;
+        static constexpr int FastFractionMask = (1 << FastFractionBits) - 1;
+        static constexpr int FastIndexBias = (127 - FastOctaves) << FastSegmentBits;
+        static constexpr float FastFractionScale = 1.f / (1 << FastFractionBits);
+        static constexpr float FastMinInput = 1.f / (1ull << FastOctaves);
+
+        static const std::array<float, FastTableSize> FastTable;
+
+        static std::array<float, FastTableSize> BuildFastTable();
+
+        static __m256 Pow(const __m256 x, const float exponent)
+        {
+            return Exp2(_mm256_mul_ps(Log2(x), _mm256_set1_ps(exponent)));
+        }
+
+        // Positive normal numbers only
+        static __m256 Log2(const __m256 x)
+        {
+            const auto bits = _mm256_castps_si256(x);
+            const auto one = _mm256_set1_ps(1.f);
+
+            // x = 2^e * m, with m moved into [sqrt(1/2), sqrt(2)) to keep t small
+            auto exponent = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+            auto mantissa = _mm256_or_ps(_mm256_castsi256_ps(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF))), one);
+            const auto isLarge = _mm256_cmp_ps(mantissa, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+            mantissa = _mm256_blendv_ps(mantissa, _mm256_mul_ps(mantissa, _mm256_set1_ps(0.5f)), isLarge);
+            exponent = _mm256_add_ps(exponent, _mm256_and_ps(isLarge, one));
+
+            // log2(m) = 2/ln(2) * atanh(t), t = (m - 1) / (m + 1), |t| < 0.172
+            const auto t = _mm256_div_ps(_mm256_sub_ps(mantissa, one), _mm256_add_ps(mantissa, one));
+            const auto t2 = _mm256_mul_ps(t, t);
+            auto p = _mm256_set1_ps(0.32059890f);
+            p = _mm256_fmadd_ps(p, t2, _mm256_set1_ps(0.41219858f));
+            p = _mm256_fmadd_ps(p, t2, _mm256_set1_ps(0.57707802f));
+            p = _mm256_fmadd_ps(p, t2, _mm256_set1_ps(0.96179669f));
+            p = _mm256_fmadd_ps(p, t2, _mm256_set1_ps(2.88539008f));
+
+            return _mm256_fmadd_ps(p, t, exponent);
+        }
+
+        static __m256 Exp2(__m256 x)
+        {
+            x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-126.f)), _mm256_set1_ps(127.f));
+
+            const auto n = _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            const auto f = _mm256_sub_ps(x, n);
+
+            // 2^f for f in [-1/2, 1/2], Taylor series of exp(f * ln(2))
+            auto p = _mm256_set1_ps(1.5252734e-5f);
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.5403530e-4f));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.3333558e-3f));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(9.6181291e-3f));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(5.5504109e-2f));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(0.24022651f));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(0.69314718f));
+            p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.f));
+
+            const auto scale = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+            return _mm256_mul_ps(p, _mm256_castsi256_ps(scale));
+        }
+    };
+}
+
+#endif // __PQ_CURVE_HPP__
@@ -0,0 +1,284 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Converter.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
+#include "QualitySearch.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        using ImagePtr = std::unique_ptr<avifImage, decltype(&avifImageDestroy)>;
+        using EncoderPtr = std::unique_ptr<avifEncoder, decltype(&avifEncoderDestroy)>;
+
+        // Spread over the range, denser at the top where web images usually end up
+        constexpr int TrialQualities[] = { 10, 25, 40, 55, 65, 75, 85, 92, AVIF_QUALITY_LOSSLESS };
+        constexpr size_t TrialCount = sizeof(TrialQualities) / sizeof(TrialQualities[0]);
+
+        // Full size encodes of a bisection over qualities 0 to 100, ceil(log2(101))
+        constexpr uint32_t BisectionEncodes = 7;
+
+        template<typename T>
+        void DownscalePlane(const avifImage* image, avifImage* proxy, const int plane, const uint32_t scale,
+            const uint32_t sourceWidth, const uint32_t sourceHeight, const uint32_t targetWidth, const uint32_t targetHeight)
+        {
+            for (uint32_t y = 0; y < targetHeight; y++)
+            {
+                const auto top = std::min(y * scale, sourceHeight - 1);
+                const auto bottom = std::clamp((y + 1) * scale, top + 1, sourceHeight);
+                const auto target = reinterpret_cast<T*>(proxy->yuvPlanes[plane] + static_cast<size_t>(y) * proxy->yuvRowBytes[plane]);
+
+                for (uint32_t x = 0; x < targetWidth; x++)
+                {
+                    const auto left = std::min(x * scale, sourceWidth - 1);
+                    const auto right = std::clamp((x + 1) * scale, left + 1, sourceWidth);
+
+                    uint64_t sum = 0;
+                    for (auto sourceY = top; sourceY < bottom; sourceY++)
+                    {
+                        const auto source = reinterpret_cast<const T*>(image->yuvPlanes[plane] + static_cast<size_t>(sourceY) * image->yuvRowBytes[plane]);
+                        for (auto sourceX = left; sourceX < right; sourceX++)
+                        {
+                            sum += source[sourceX];
+                        }
+                    }
+
+                    const auto count = static_cast<uint64_t>(bottom - top) * (right - left);
+                    target[x] = static_cast<T>((sum + count / 2) / count);
+                }
+            }
+        }
+
+        // Box filtered copy of the YUV planes, averaging PQ code values just like the encoder sees them
+        ImagePtr CreateProxy(const avifImage* image, const uint32_t scale)
+        {
+            const auto width = std::max(image->width / scale, 1u);
+            const auto height = std::max(image->height / scale, 1u);
+
+            ImagePtr proxy(avifImageCreate(width, height, image->depth, image->yuvFormat), avifImageDestroy);
+            if (!proxy || avifImageAllocatePlanes(proxy.get(), AVIF_PLANES_YUV) != AVIF_RESULT_OK)
+                throw std::bad_alloc();
+
+            proxy->yuvRange = image->yuvRange;
+            proxy->colorPrimaries = image->colorPrimaries;
+            proxy->transferCharacteristics = image->transferCharacteristics;
+            proxy->matrixCoefficients = image->matrixCoefficients;
+            proxy->clli = image->clli;
+
+            avifPixelFormatInfo formatInfo;
+            avifGetPixelFormatInfo(image->yuvFormat, &formatInfo);
+            const auto planeCount = formatInfo.monochrome ? 1 : 3;
+
+            // Rows of a plane are independent, but a proxy is small enough for a single thread
+            for (int plane = 0; plane < planeCount; plane++)
+            {
+                const auto shiftX = plane == AVIF_CHAN_Y ? 0u : static_cast<uint32_t>(formatInfo.chromaShiftX);
+                const auto shiftY = plane == AVIF_CHAN_Y ? 0u : static_cast<uint32_t>(formatInfo.chromaShiftY);
+                const auto sourceWidth = (image->width + (1u << shiftX) - 1) >> shiftX;
+                const auto sourceHeight = (image->height + (1u << shiftY) - 1) >> shiftY;
+                const auto targetWidth = (width + (1u << shiftX) - 1) >> shiftX;
+                const auto targetHeight = (height + (1u << shiftY) - 1) >> shiftY;
+
+                if (avifImageUsesU16(image))
+                    DownscalePlane<uint16_t>(image, proxy.get(), plane, scale, sourceWidth, sourceHeight, targetWidth, targetHeight);
+                else
+                    DownscalePlane<uint8_t>(image, proxy.get(), plane, scale, sourceWidth, sourceHeight, targetWidth, targetHeight);
+            }
+
+            return proxy;
+        }
+
+        // Proxy file sizes of the trial qualities, interpolated linearly in log size between them
+        class SizeCurve
+        {
+        public:
+            explicit SizeCurve(std::vector<double> sizes)
+                : _logSizes(std::move(sizes))
+            {
+                // Sizes only grow with quality, noise in the trials must not make the curve fall
+                double previous = 1;
+                for (auto& size : _logSizes)
+                {
+                    previous = std::max(previous, size);
+                    size = std::log(previous);
+                }
+            }
+
+            [[nodiscard]] double GetSize(const int quality) const
+            {
+                // Qualities below the first trial extrapolate its segment
+                size_t segment = 0;
+                while (segment + 2 < TrialCount && quality > TrialQualities[segment + 1])
+                {
+                    segment++;
+                }
+
+                const auto q0 = TrialQualities[segment];
+                const auto q1 = TrialQualities[segment + 1];
+                const auto t = static_cast<double>(quality - q0) / (q1 - q0);
+                return std::exp(_logSizes[segment] + t * (_logSizes[segment + 1] - _logSizes[segment]));
+            }
+
+            // The highest quality in [low, high] predicted to fit, or low - 1 if none is
+            [[nodiscard]] int Choose(const double targetSize, const double scale, const int low, const int high) const
+            {
+                for (auto quality = high; quality >= low; quality--)
+                {
+                    if (GetSize(quality) * scale <= targetSize)
+                        return quality;
+                }
+                return low - 1;
+            }
+
+        private:
+            std::vector<double> _logSizes;
+        };
+    }
+
+    QualitySearchResult QualitySearch::Run(const avifImage* image, const uint64_t targetSize, const CpuBudget::Lease& threads, const EncoderFactory& createEncoder,
+        const FullEncoder& encodeFull, avifRWData* output, std::ostream* log)
+    {
+        QualitySearchResult result;
+        Stopwatch stopwatch;
+
+        const auto minSide = std::min(image->width, image->height);
+        const auto scale = std::max(1u, std::min(ProxyScale, minSide / MinProxySize));
+        const auto proxy = CreateProxy(image, scale);
+        result.proxyWidth = proxy->width;
+        result.proxyHeight = proxy->height;
+
+        auto& pool = ThreadPool::GetInstance();
+        const auto concurrentTrials = std::min({ static_cast<uint32_t>(TrialCount), pool.GetWorkerCount(), threads.GetCount() });
+        const auto threadsPerTrial = static_cast<int>(std::max<uint32_t>(1, threads.GetCount() / concurrentTrials));
+        std::vector<double> trialSizes(TrialCount);
+        std::atomic<avifResult> trialResult(AVIF_RESULT_OK);
+        std::atomic<size_t> nextTrial(0);
+
+        {
+            // Exactly concurrentTrials tasks, each taking the next trial until none are left, as in GridEncoder::Encode.
+            // Low qualities finish much sooner than lossless.
+            const auto callerIsWorker = pool.GetCurrentWorkerIndex() < pool.GetWorkerCount();
+            const CpuBudget::Loan loan(threads, concurrentTrials - (callerIsWorker ? 1 : 0));
+            pool.ParallelFor(0, concurrentTrials, 1, [&](size_t, size_t, uint32_t)
+            {
+                for (auto i = nextTrial++; i < TrialCount && trialResult.load() == AVIF_RESULT_OK; i = nextTrial++)
+                {
+                    const TraceScope trace("encode-trial", "quality", TrialQualities[i]);
+                    EncoderPtr encoder(createEncoder(TrialQualities[i], threadsPerTrial), avifEncoderDestroy);
+                    if (!encoder)
+                        throw std::bad_alloc();
+
+                    AvifData data;
+                    auto encodeResult = avifEncoderAddImage(encoder.get(), proxy.get(), 1, AVIF_ADD_IMAGE_FLAG_SINGLE);
+                    if (encodeResult == AVIF_RESULT_OK)
+                        encodeResult = avifEncoderFinish(encoder.get(), data.Get());
+
+                    if (encodeResult != AVIF_RESULT_OK)
+                    {
+                        auto expected = AVIF_RESULT_OK;
+                        trialResult.compare_exchange_strong(expected, encodeResult);
+                        return;
+                    }
+
+                    trialSizes[i] = static_cast<double>(data.GetSize());
+                }
+            });
+        }
+
+        if (trialResult.load() != AVIF_RESULT_OK)
+        {
+            throw std::runtime_error(std::string("Failed to encode quality trial: ") + avifResultToString(trialResult.load()));
+        }
+
+        result.trialEncodes = static_cast<uint32_t>(TrialCount);
+        result.proxySeconds = stopwatch.Lap("proxy").wallSeconds;
+
+        if (log)
+        {
+            *log << "Encoded " << TrialCount << " trials of a " << proxy->width << "x" << proxy->height << " proxy in "
+                << result.proxySeconds << " s\n" << std::flush;
+        }
+
+        const SizeCurve curve(std::move(trialSizes));
+        const auto target = static_cast<double>(targetSize);
+
+        // Starts from the pixel count ratio, every full size encode measures the real one
+        auto sizeScale = static_cast<double>(image->width) * image->height / (static_cast<double>(proxy->width) * proxy->height);
+        auto best = -1;
+        auto fail = AVIF_QUALITY_LOSSLESS + 1;
+        auto quality = std::max(curve.Choose(target, sizeScale, 0, AVIF_QUALITY_LOSSLESS), 0);
+        auto bisecting = false;
+
+        while (true)
+        {
+            AvifData data;
+            encodeFull(quality, data.Get());
+            result.fullEncodes++;
+
+            const auto size = static_cast<double>(data.GetSize());
+            if (log)
+            {
+                *log << "Quality " << quality << ": " << data.GetSize() << " bytes\n" << std::flush;
+            }
+
+            if (size <= target)
+            {
+                best = quality;
+                std::swap(*output, *data.Get());
+            }
+            else
+            {
+                fail = quality;
+            }
+
+            // Two full size encodes are enough once one of them fits, a bisection goes on to the highest quality that does
+            if (best >= 0 && ((result.fullEncodes >= 2 && !bisecting) || size >= target * (1 - Tolerance) || best + 1 == fail))
+                break;
+
+            if (best < 0 && fail == 0)
+            {
+                throw std::runtime_error("Even quality 0 takes " + std::to_string(data.GetSize()) + " bytes, more than the target size.");
+            }
+
+            // The curve was off twice, so it is not asked again. Both ends are known not to be
+            // the answer, and the midpoint is within [best + 1, fail - 1] since they are apart.
+            if (bisecting || result.fullEncodes >= 2)
+            {
+                bisecting = true;
+                quality = (best + fail) / 2;
+                continue;
+            }
+
+            sizeScale = size / curve.GetSize(quality);
+            quality = curve.Choose(target, sizeScale, best + 1, fail - 1);
+            if (quality <= best)
+            {
+                if (best >= 0)
+                    break;
+                quality = 0;
+            }
+        }
+
+        result.quality = best;
+        result.fullSeconds = stopwatch.Lap("full").wallSeconds;
+        result.bisectionSeconds = BisectionEncodes * result.fullSeconds / result.fullEncodes;
+
+        if (log)
+        {
+            const auto seconds = result.proxySeconds + result.fullSeconds;
+            *log << "Chose quality " << best << " with " << result.fullEncodes << " full size encodes in " << seconds
+                << " s, bisection would take about " << result.bisectionSeconds << " s, "
+                << result.bisectionSeconds / seconds << "x as long\n" << std::flush;
+        }
+
+        return result;
+    }
+}
@@ -0,0 +1,54 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __QUALITY_SEARCH_HPP__
+#define __QUALITY_SEARCH_HPP__
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <avif/avif.h>
+#include "CpuBudget.hpp"
+
+namespace JxrToAvif
+{
+    struct QualitySearchResult
+    {
+        // The quality of the output, zero encodes mean no search was done
+        int quality = AVIF_QUALITY_LOSSLESS;
+        uint32_t proxyWidth = 0;
+        uint32_t proxyHeight = 0;
+        uint32_t trialEncodes = 0;
+        uint32_t fullEncodes = 0;
+        double proxySeconds = 0;
+        double fullSeconds = 0;
+        // What bisecting the quality range with full size encodes would have taken, at the measured encode time
+        double bisectionSeconds = 0;
+    };
+
+    // Finds the highest lossy quality whose file fits a byte budget. Trial encodes of a downscaled proxy
+    // at several qualities run in parallel and trace the size curve, which scaled to the full image picks
+    // the quality of the first full size encode. Its real size corrects the scale for the second one,
+    // further encodes bisect between the known qualities, to the highest one that fits, only if both miss.
+    class QualitySearch
+    {
+    public:
+        // Proxies have 1/16 of the pixels, but no side below MinProxySize unless the image is smaller
+        static constexpr uint32_t ProxyScale = 4;
+        static constexpr uint32_t MinProxySize = 256;
+
+        // Full size results this close below the budget are not worth another encode
+        static constexpr double Tolerance = 0.05;
+
+        // Creates a configured encoder for a quality and number of threads
+        using EncoderFactory = std::function<avifEncoder*(int quality, int threads)>;
+
+        // Encodes the whole image at a quality, failures are thrown
+        using FullEncoder = std::function<void(int quality, avifRWData* output)>;
+
+        // The threads of the lease are shared by the trials encoded at once
+        static QualitySearchResult Run(const avifImage* image, uint64_t targetSize, const CpuBudget::Lease& threads, const EncoderFactory& createEncoder,
+            const FullEncoder& encodeFull, avifRWData* output, std::ostream* log);
+    };
+}
+
+#endif // __QUALITY_SEARCH_HPP__
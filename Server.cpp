@@ -0,0 +1,530 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "jxr_sys_helpers.h"
+#include "CommandLineParser.hpp"
+#include "JsonWriter.hpp"
+#include "JxrData.hpp"
+#include "Server.hpp"
+#include "SharedPixels.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        std::string GetErrorDescription(const int hr)
+        {
+            const auto errorDesc = jxr_get_error_description(hr);
+            std::string description(errorDesc ? errorDesc : "");
+            jxr_free_error_description(errorDesc);
+            return description;
+        }
+
+        std::string GetErrorResponse(const char* message)
+        {
+            std::ostringstream stream;
+            JsonWriter json(stream);
+            json.BeginObject();
+            json.Write("ok", false);
+            json.Write("error", message);
+            json.EndObject();
+            stream << '\n';
+            return stream.str();
+        }
+
+        std::wstring ToWide(const std::string& str)
+        {
+            const auto wide = jxr_multibyte_to_wide(str.c_str());
+            if (!wide)
+            {
+                throw std::invalid_argument("Job arguments are not valid text.");
+            }
+
+            std::wstring result(wide);
+            jxr_free_wide(wide);
+            return result;
+        }
+
+        // Closes a descriptor passed with a job, -1 for none
+        class PassedHandle
+        {
+        public:
+            explicit PassedHandle(const intptr_t handle)
+                : _handle(handle)
+            {
+            }
+
+            PassedHandle(const PassedHandle&) = delete;
+
+            PassedHandle(PassedHandle&&) = delete;
+
+            PassedHandle& operator=(const PassedHandle&) = delete;
+
+            PassedHandle& operator=(PassedHandle&&) = delete;
+
+            ~PassedHandle()
+            {
+                jxr_close_shared_handle(_handle);
+            }
+
+            [[nodiscard]] intptr_t Get() const
+            {
+                return _handle;
+            }
+
+        private:
+            intptr_t _handle;
+        };
+    }
+
+    // Buffered reads and whole writes on a socket, failures are thrown.
+    // Descriptors passed along with the bytes queue up until jobs take them.
+    class Server::Connection
+    {
+    public:
+        explicit Connection(const jxr_socket socket)
+            : _socket(socket), _begin(0), _end(0)
+        {
+        }
+
+        Connection(const Connection&) = delete;
+
+        Connection(Connection&&) = delete;
+
+        Connection& operator=(const Connection&) = delete;
+
+        Connection& operator=(Connection&&) = delete;
+
+        ~Connection()
+        {
+            for (const auto handle : _handles)
+            {
+                jxr_close_shared_handle(handle);
+            }
+            jxr_socket_close(_socket);
+        }
+
+        // Returns false when the peer closed the connection between lines
+        bool ReadLine(std::string& line)
+        {
+            line.clear();
+            while (true)
+            {
+                for (; _begin < _end; _begin++)
+                {
+                    const auto c = static_cast<char>(_buffer[_begin]);
+                    if (c == '\n')
+                    {
+                        _begin++;
+                        if (!line.empty() && line.back() == '\r')
+                            line.pop_back();
+                        return true;
+                    }
+                    line.push_back(c);
+                }
+
+                if (line.size() > MaxRequestLength)
+                {
+                    throw std::runtime_error("Job line is too long.");
+                }
+
+                if (!Fill())
+                {
+                    if (line.empty())
+                        return false;
+                    throw std::runtime_error("Connection closed in the middle of a job.");
+                }
+            }
+        }
+
+        void Read(uint8_t* data, size_t size)
+        {
+            while (size > 0)
+            {
+                if (_begin == _end && !Fill())
+                {
+                    throw std::runtime_error("Connection closed in the middle of a job.");
+                }
+
+                const auto count = std::min(size, _end - _begin);
+                std::copy(_buffer + _begin, _buffer + _begin + count, data);
+                _begin += count;
+                data += count;
+                size -= count;
+            }
+        }
+
+        // The oldest descriptor received and not taken yet, or -1, to be closed by the caller
+        intptr_t TakeHandle()
+        {
+            if (_handles.empty())
+                return -1;
+
+            const auto handle = _handles.front();
+            _handles.pop_front();
+            return handle;
+        }
+
+        void Write(const void* data, const size_t size)
+        {
+            const auto hr = jxr_socket_send_all(_socket, data, size);
+            if (hr < 0)
+            {
+                throw std::runtime_error("Failed to send job result: " + GetErrorDescription(hr));
+            }
+        }
+
+    private:
+        // Descriptors jobs never took are closed past that
+        static constexpr size_t MaxQueuedHandles = 16;
+
+        jxr_socket _socket;
+        uint8_t _buffer[64 << 10];
+        size_t _begin;
+        size_t _end;
+        std::deque<intptr_t> _handles;
+
+        bool Fill()
+        {
+            size_t received = 0;
+            intptr_t handle = -1;
+            const auto hr = jxr_socket_receive(_socket, _buffer, sizeof(_buffer), &received, &handle);
+            if (hr < 0)
+            {
+                throw std::runtime_error("Failed to receive job: " + GetErrorDescription(hr));
+            }
+
+            if (handle >= 0)
+            {
+                if (_handles.size() < MaxQueuedHandles)
+                    _handles.push_back(handle);
+                else
+                    jxr_close_shared_handle(handle);
+            }
+
+            _begin = 0;
+            _end = received;
+            return received > 0;
+        }
+    };
+
+    // A job slot with its buffers, held from before the job's file is read until it is converted
+    class Server::Slot
+    {
+    public:
+        explicit Slot(Server& server)
+            : _server(server), _buffer(server.AcquireSlot())
+        {
+        }
+
+        Slot(const Slot&) = delete;
+
+        Slot(Slot&&) = delete;
+
+        Slot& operator=(const Slot&) = delete;
+
+        Slot& operator=(Slot&&) = delete;
+
+        ~Slot()
+        {
+            _server.ReleaseSlot(std::move(_buffer));
+        }
+
+        [[nodiscard]] PixelBuffer& GetBuffer() const
+        {
+            return *_buffer;
+        }
+
+    private:
+        Server& _server;
+        std::unique_ptr<PixelBuffer> _buffer;
+    };
+
+    Server::Server(std::wstring socketPath, const uint32_t maxJobs)
+        : _socketPath(std::move(socketPath)), _maxJobs(maxJobs), _listener(JXR_INVALID_SOCKET), _connectionCount(0), _freeSlots(maxJobs)
+    {
+        for (uint32_t i = 0; i < maxJobs; i++)
+        {
+            _freeBuffers.push_back(std::make_unique<PixelBuffer>());
+        }
+    }
+
+    Server::~Server()
+    {
+        jxr_socket_close(_listener);
+    }
+
+    void Server::Run()
+    {
+        const auto listenResult = jxr_socket_listen(_socketPath.c_str(), &_listener);
+        if (listenResult < 0)
+        {
+            throw std::runtime_error("Failed to listen on socket: " + GetErrorDescription(listenResult));
+        }
+
+        {
+            const auto nativePath = jxr_wide_to_multibyte(_socketPath.c_str());
+            std::cout << "Listening on " << (nativePath ? nativePath : "socket") << ", running up to " << _maxJobs << " jobs at once\n" << std::flush;
+            jxr_free_multibyte(nativePath);
+        }
+
+        while (true)
+        {
+            jxr_socket socket = JXR_INVALID_SOCKET;
+            const auto acceptResult = jxr_socket_accept(_listener, &socket);
+            if (acceptResult < 0)
+            {
+                throw std::runtime_error("Failed to accept connection: " + GetErrorDescription(acceptResult));
+            }
+
+            if (_connectionCount.fetch_add(1) >= MaxConnections)
+            {
+                _connectionCount--;
+                jxr_socket_close(socket);
+                continue;
+            }
+
+            // The server lives as long as the process, so connection threads never outlive it
+            std::thread([this, socket]
+            {
+                Serve(socket);
+                _connectionCount--;
+            }).detach();
+        }
+    }
+
+    void Server::Serve(const jxr_socket socket)
+    {
+        try
+        {
+            Connection connection(socket);
+
+            // Decoder state of the thread is set up once for all of its jobs
+            const JxrLoaderThreadState state;
+
+            std::string request;
+            while (connection.ReadLine(request))
+            {
+                if (!request.empty() && !RunJob(connection, request))
+                    break;
+            }
+        }
+        catch (std::exception& e)
+        {
+            const std::lock_guard lock(_logMutex);
+            std::cerr << e.what() << "\n";
+        }
+    }
+
+    bool Server::RunJob(Connection& connection, const std::string& request)
+    {
+        const auto startTime = std::chrono::steady_clock::now();
+
+        std::vector<std::string> arguments;
+        for (size_t start = 0; start <= request.size();)
+        {
+            auto end = request.find('\t', start);
+            if (end == std::string::npos)
+                end = request.size();
+            arguments.push_back(request.substr(start, end - start));
+            start = end + 1;
+        }
+
+        // The input file follows the job line, it is read first to keep the connection in sync.
+        // It goes into the buffer of the job's slot, so a connection waits for one before reading it.
+        std::optional<Slot> slot;
+        bool hasInput = false;
+        for (size_t i = 0; i + 1 < arguments.size(); i++)
+        {
+            if (arguments[i] == "--input-size")
+            {
+                uint64_t size = 0;
+                try
+                {
+                    size_t length = 0;
+                    size = std::stoull(arguments[i + 1], &length);
+                    if (length != arguments[i + 1].size())
+                        size = 0;
+                }
+                catch (std::exception&)
+                {
+                }
+
+                if (size == 0 || size > MaxInputSize)
+                {
+                    // There is no telling where the next job starts
+                    const auto response = GetErrorResponse("Invalid input size.");
+                    connection.Write(response.data(), response.size());
+                    return false;
+                }
+
+                slot.emplace(*this);
+                auto& input = slot->GetBuffer().input;
+                input.resize(static_cast<size_t>(size));
+                connection.Read(input.data(), input.size());
+                arguments.erase(arguments.begin() + static_cast<ptrdiff_t>(i), arguments.begin() + static_cast<ptrdiff_t>(i) + 2);
+                hasInput = true;
+                break;
+            }
+        }
+
+        // So does the descriptor of shared memory, taken even if the job turns out to be invalid
+        const PassedHandle handle(std::find(arguments.begin(), arguments.end(), "--shm-fd") != arguments.end() ? connection.TakeHandle() : -1);
+
+        std::string response;
+        ConversionResult result;
+        bool sendOutput = false;
+
+        try
+        {
+            std::vector<std::wstring> args{ L"jxr_to_avif" };
+            for (const auto& argument : arguments)
+            {
+                args.push_back(ToWide(argument));
+            }
+
+            // Named shared memory can be truncated by any process while it is read, which kills the server with SIGBUS
+            CommandLineParser parser(std::move(args));
+            if (!parser.Parse() || parser.GetIsHelpRequired() || !parser.GetServeSocket().empty() || parser.GetIsBatch() || !parser.GetStatsFile().empty() || !parser.GetTraceFile().empty() || !parser.GetIsOutputFileSet() ||
+                parser.GetTimeBudget() > 0 || parser.GetThumbnailSize() > 0 || !parser.GetCalibrateFile().empty() || !parser.GetCacheDirectory().empty() || parser.GetThreads() > 0 ||
+                !parser.GetSharedMemoryName().empty() || hasInput != (parser.GetInputFile() == L"-"))
+            {
+                throw std::invalid_argument("Invalid job arguments.");
+            }
+
+            const Converter converter(parser.GetConversionOptions());
+            const auto outputFile = parser.GetOutputFile();
+
+            // Raw pixels are read straight from the shared memory, the slot buffer stays unused
+            std::unique_ptr<SharedPixels> shared;
+            if (parser.GetIsSharedMemoryHandle())
+            {
+                if (handle.Get() < 0)
+                {
+                    throw std::invalid_argument("No shared memory descriptor came with the job.");
+                }
+                shared = std::make_unique<SharedPixels>(handle.Get(), parser.GetRawLayout());
+            }
+
+            if (!slot)
+                slot.emplace(*this);
+            auto& buffer = slot->GetBuffer();
+            result = shared ? converter.ConvertPixels(shared->GetPixels()) : Convert(converter, parser.GetInputFile(), hasInput ? &buffer.input : nullptr, buffer);
+            slot.reset();
+
+            sendOutput = outputFile == L"-";
+            if (!sendOutput)
+            {
+                const auto rv = jxr_write_data_to_file(outputFile.c_str(), result.avif.GetData(), result.avif.GetSize());
+                if (rv < 0)
+                {
+                    throw std::runtime_error("Failed to write output: " + GetErrorDescription(rv));
+                }
+            }
+
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+
+            std::ostringstream stream;
+            JsonWriter json(stream);
+            json.BeginObject();
+            json.Write("ok", true);
+            json.Write("width", result.width);
+            json.Write("height", result.height);
+            json.Write("maxCLL", result.maxCLL);
+            json.Write("maxFALL", result.maxFALL);
+            json.Write("medianNits", result.statistics.GetPercentileNits(0.5));
+            json.Write("averageNits", result.statistics.GetAverageNits());
+            json.Write("maxNits", result.statistics.GetMaxNits());
+            json.Write("gridColumns", result.grid.columns);
+            json.Write("gridRows", result.grid.rows);
+            json.Write("size", result.avif.GetSize());
+            json.Write("seconds", elapsed.count());
+            json.EndObject();
+            stream << '\n';
+            response = stream.str();
+        }
+        catch (std::bad_alloc&)
+        {
+            response = GetErrorResponse("Out of memory");
+            sendOutput = false;
+        }
+        catch (std::exception& e)
+        {
+            response = GetErrorResponse(e.what());
+            sendOutput = false;
+        }
+
+        // A failed job may still hold it
+        slot.reset();
+
+        connection.Write(response.data(), response.size());
+
+        // The file follows the result, its length is the size above
+        if (sendOutput)
+        {
+            connection.Write(result.avif.GetData(), result.avif.GetSize());
+        }
+
+        return true;
+    }
+
+    ConversionResult Server::Convert(const Converter& converter, const std::wstring& inputFile,
+        const std::vector<uint8_t>* input, PixelBuffer& buffer) const
+    {
+        // Streaming never holds the decoded image, so there is nothing to reuse
+        if (converter.GetOptions().streaming)
+        {
+            return input ? converter.ConvertMemory(input->data(), input->size()) : converter.ConvertFile(inputFile);
+        }
+
+        const auto decoder = input ? std::make_unique<JxrDecoder>(input->data(), input->size()) : std::make_unique<JxrDecoder>(inputFile);
+        const auto& info = decoder->GetInfo();
+        const auto size = static_cast<size_t>(info.stride) * info.height;
+
+        // Buffers only grow, so a slot settles at the size of the largest image it has seen
+        if (buffer.size < size)
+        {
+            buffer.pixels.reset();
+            buffer.pixels = std::unique_ptr<uint8_t[]>(new uint8_t[size]);
+            buffer.size = size;
+        }
+
+        decoder->DecodeRows(0, info.height, buffer.pixels.get());
+
+        PixelSpan pixels{};
+        pixels.pixels = buffer.pixels.get();
+        pixels.width = info.width;
+        pixels.height = info.height;
+        pixels.stride = info.stride;
+        pixels.bytesPerPixel = info.bytes_per_pixel;
+        return converter.ConvertPixels(pixels);
+    }
+
+    std::unique_ptr<Server::PixelBuffer> Server::AcquireSlot()
+    {
+        std::unique_lock lock(_slotMutex);
+        _slotFreed.wait(lock, [this] { return _freeSlots > 0; });
+        _freeSlots--;
+
+        auto buffer = std::move(_freeBuffers.back());
+        _freeBuffers.pop_back();
+        return buffer;
+    }
+
+    void Server::ReleaseSlot(std::unique_ptr<PixelBuffer> buffer)
+    {
+        {
+            const std::lock_guard lock(_slotMutex);
+            _freeBuffers.push_back(std::move(buffer));
+            _freeSlots++;
+        }
+        _slotFreed.notify_one();
+    }
+}
@@ -0,0 +1,87 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __SERVER_HPP__
+#define __SERVER_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "jxr_socket.h"
+#include "Converter.hpp"
+
+namespace JxrToAvif
+{
+    // Runs conversion jobs sent over a Unix domain socket, so a capture pipeline pays for
+    // process startup, thread creation and decoder initialization only once.
+    //
+    // A job is a line of tab separated command line arguments, see README for the protocol.
+    // Every connection may send any number of jobs one after another and receives
+    // a line of JSON for each of them. Jobs of all connections share maxJobs slots,
+    // each with its own decoded pixel buffer and buffer for a sent file that are kept for the following jobs.
+    // A job takes its slot before its file is read, so memory is bounded by the slots, not the connections.
+    class Server
+    {
+    public:
+        static constexpr uint32_t MaxConnections = 64;
+
+        // Longest job line and largest file sent with a job
+        static constexpr size_t MaxRequestLength = 64 << 10;
+        static constexpr uint64_t MaxInputSize = 4ull << 30;
+
+        Server(std::wstring socketPath, uint32_t maxJobs);
+
+        Server(const Server&) = delete;
+
+        Server(Server&&) = delete;
+
+        Server& operator=(const Server&) = delete;
+
+        Server& operator=(Server&&) = delete;
+
+        ~Server();
+
+        // Serves until accepting connections fails
+        void Run();
+
+    private:
+        class Connection;
+
+        class Slot;
+
+        struct PixelBuffer
+        {
+            std::unique_ptr<uint8_t[]> pixels;
+            size_t size = 0;
+            // The file sent with the job, its capacity is kept for the next ones
+            std::vector<uint8_t> input;
+        };
+
+        std::wstring _socketPath;
+        uint32_t _maxJobs;
+        jxr_socket _listener;
+        std::atomic<uint32_t> _connectionCount;
+        std::mutex _slotMutex;
+        std::condition_variable _slotFreed;
+        std::vector<std::unique_ptr<PixelBuffer>> _freeBuffers;
+        uint32_t _freeSlots;
+        std::mutex _logMutex;
+
+        void Serve(jxr_socket socket);
+
+        // Returns false when the connection can not be used any longer
+        bool RunJob(Connection& connection, const std::string& request);
+
+        ConversionResult Convert(const Converter& converter, const std::wstring& inputFile,
+            const std::vector<uint8_t>* input, PixelBuffer& buffer) const;
+
+        std::unique_ptr<PixelBuffer> AcquireSlot();
+
+        void ReleaseSlot(std::unique_ptr<PixelBuffer> buffer);
+    };
+}
+
+#endif // __SERVER_HPP__
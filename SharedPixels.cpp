@@ -0,0 +1,52 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <sstream>
+#include <stdexcept>
+#include "SharedPixels.hpp"
+
+namespace JxrToAvif
+{
+    SharedPixels::SharedPixels(const std::wstring& name, const PixelSpan& layout)
+        : _mapping(nullptr), _pixels(layout)
+    {
+        const uint8_t* data = nullptr;
+        SetPixels(jxr_map_shared_memory(name.c_str(), GetSize(layout), &_mapping, &data), data);
+    }
+
+    SharedPixels::SharedPixels(const intptr_t handle, const PixelSpan& layout)
+        : _mapping(nullptr), _pixels(layout)
+    {
+        const uint8_t* data = nullptr;
+        SetPixels(jxr_map_shared_handle(handle, GetSize(layout), &_mapping, &data), data);
+    }
+
+    SharedPixels::~SharedPixels()
+    {
+        jxr_unmap_shared_memory(_mapping);
+    }
+
+    uint64_t SharedPixels::GetSize(const PixelSpan& layout)
+    {
+        if (layout.width == 0 || layout.height == 0 || (layout.bytesPerPixel != 8 && layout.bytesPerPixel != 16) ||
+            layout.stride < static_cast<uint64_t>(layout.width) * layout.bytesPerPixel)
+        {
+            throw std::invalid_argument("Invalid shared memory pixel layout.");
+        }
+
+        return static_cast<uint64_t>(layout.stride) * layout.height;
+    }
+
+    void SharedPixels::SetPixels(const int hr, const uint8_t* data)
+    {
+        if (hr < 0)
+        {
+            std::stringstream s;
+            const auto errorDesc = jxr_get_error_description(hr);
+            s << "Failed to map shared memory: " << (errorDesc ? errorDesc : "");
+            jxr_free_error_description(errorDesc);
+            throw std::runtime_error(s.str());
+        }
+
+        _pixels.pixels = data;
+    }
+}
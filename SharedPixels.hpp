@@ -0,0 +1,52 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __SHARED_PIXELS_HPP__
+#define __SHARED_PIXELS_HPP__
+
+#include <cstdint>
+#include <string>
+#include "jxr_sys_helpers.h"
+#include "Converter.hpp"
+
+namespace JxrToAvif
+{
+    // Raw scRGB pixels another process, like a screen capture, left in shared memory. The memory is mapped
+    // read only for the life of the object, and Converter::ConvertPixels reads the pixels straight from it,
+    // so they are neither decoded nor copied. The layout comes from the producer, which must not write
+    // to the memory until the conversion is done.
+    class SharedPixels
+    {
+    public:
+        // Shared memory of the name, see jxr_map_shared_memory
+        SharedPixels(const std::wstring& name, const PixelSpan& layout);
+
+        // A received descriptor, which stays open, see jxr_map_shared_handle
+        SharedPixels(intptr_t handle, const PixelSpan& layout);
+
+        SharedPixels(const SharedPixels&) = delete;
+
+        SharedPixels(SharedPixels&&) = delete;
+
+        SharedPixels& operator=(const SharedPixels&) = delete;
+
+        SharedPixels& operator=(SharedPixels&&) = delete;
+
+        ~SharedPixels();
+
+        [[nodiscard]] const PixelSpan& GetPixels() const
+        {
+            return _pixels;
+        }
+
+    private:
+        jxr_mapping* _mapping;
+        PixelSpan _pixels;
+
+        // Stride bytes for every row, padding of the last one included
+        static uint64_t GetSize(const PixelSpan& layout);
+
+        void SetPixels(int hr, const uint8_t* data);
+    };
+}
+
+#endif // __SHARED_PIXELS_HPP__
@@ -0,0 +1,136 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include "jxr_sys_helpers.h"
+#include "StatisticsReport.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        std::string ToNarrow(const std::wstring& str)
+        {
+            const auto narrow = jxr_wide_to_multibyte(str.c_str());
+            std::string result(narrow ? narrow : "");
+            jxr_free_multibyte(narrow);
+            return result;
+        }
+
+        void WriteCache(JsonWriter& json, const CacheStatistics& cache)
+        {
+            json.BeginObject("cache");
+            json.Write("hit", cache.hit);
+            json.Write("hashSeconds", cache.hashSeconds);
+            json.Write("hits", cache.hits);
+            json.Write("misses", cache.misses);
+            json.EndObject();
+        }
+    }
+
+    void WriteStatisticsReport(JsonWriter& json, const std::wstring& inputFile, const std::wstring& outputFile,
+        const ConversionResult& result, const CacheStatistics* cache)
+    {
+        const auto megapixels = static_cast<double>(result.width) * result.height / 1e6;
+        const auto perSecond = [megapixels](const double seconds) { return seconds > 0 ? megapixels / seconds : 0; };
+
+        double wallSeconds = 0;
+        double cpuSeconds = 0;
+        for (const auto& phase : result.phases)
+        {
+            wallSeconds += phase.wallSeconds;
+            cpuSeconds += phase.cpuSeconds;
+        }
+
+        json.BeginObject();
+        json.Write("input", ToNarrow(inputFile));
+        json.Write("output", ToNarrow(outputFile));
+        json.Write("width", result.width);
+        json.Write("height", result.height);
+        json.Write("threads", result.threads);
+        json.Write("encoderThreads", result.encoderThreads);
+        json.Write("budgetWaitSeconds", result.budgetWaitSeconds);
+        json.Write("speed", result.speed);
+        if (result.predictedEncodeSeconds > 0)
+        {
+            json.Write("tileRowsLog2", result.tileRowsLog2);
+            json.Write("tileColsLog2", result.tileColsLog2);
+            json.Write("predictedEncodeSeconds", result.predictedEncodeSeconds);
+            json.Write("encodeSeconds", result.encodeSeconds);
+        }
+
+        json.BeginArray("phases");
+        for (const auto& phase : result.phases)
+        {
+            json.BeginObject();
+            json.Write("name", phase.name);
+            json.Write("wallSeconds", phase.wallSeconds);
+            json.Write("cpuSeconds", phase.cpuSeconds);
+            json.Write("megapixelsPerSecond", perSecond(phase.wallSeconds));
+            json.EndObject();
+        }
+        json.EndArray();
+
+        json.Write("wallSeconds", wallSeconds);
+        json.Write("cpuSeconds", cpuSeconds);
+        json.Write("megapixelsPerSecond", perSecond(wallSeconds));
+
+        json.BeginArray("workerBusySeconds");
+        for (const auto seconds : result.workerBusySeconds)
+        {
+            json.Write(seconds);
+        }
+        json.EndArray();
+
+        json.Write("peakRss", jxr_get_peak_memory_usage());
+        json.Write("outputSize", result.avif.GetSize());
+        if (result.thumbnail.GetSize() > 0)
+        {
+            json.Write("thumbnailSize", result.thumbnail.GetSize());
+        }
+        json.Write("bitsPerPixel", megapixels > 0 ? static_cast<double>(result.avif.GetSize()) * 8 / (megapixels * 1e6) : 0.);
+        json.Write("maxCLL", result.maxCLL);
+        json.Write("maxPALL", result.maxFALL);
+        if (result.gainMapWidth > 0)
+        {
+            json.Write("gainMapWidth", result.gainMapWidth);
+            json.Write("gainMapHeight", result.gainMapHeight);
+        }
+
+        const auto& search = result.qualitySearch;
+        if (search.fullEncodes > 0)
+        {
+            json.BeginObject("qualitySearch");
+            json.Write("quality", search.quality);
+            json.Write("proxyWidth", search.proxyWidth);
+            json.Write("proxyHeight", search.proxyHeight);
+            json.Write("trialEncodes", search.trialEncodes);
+            json.Write("fullEncodes", search.fullEncodes);
+            json.Write("proxySeconds", search.proxySeconds);
+            json.Write("fullSeconds", search.fullSeconds);
+            json.Write("bisectionSeconds", search.bisectionSeconds);
+            json.EndObject();
+        }
+
+        if (cache)
+        {
+            WriteCache(json, *cache);
+        }
+        json.EndObject();
+    }
+
+    void WriteCacheHitReport(JsonWriter& json, const std::wstring& inputFile, const std::wstring& outputFile,
+        const CacheStatistics& cache)
+    {
+        uint64_t outputSize = 0;
+        int isDirectory = 0;
+        jxr_get_file_info(outputFile.c_str(), &outputSize, &isDirectory);
+
+        json.BeginObject();
+        json.Write("input", ToNarrow(inputFile));
+        json.Write("output", ToNarrow(outputFile));
+        json.Write("wallSeconds", cache.seconds);
+        json.Write("peakRss", jxr_get_peak_memory_usage());
+        json.Write("outputSize", outputSize);
+        WriteCache(json, cache);
+        json.EndObject();
+    }
+}
@@ -0,0 +1,25 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __STATISTICS_REPORT_HPP__
+#define __STATISTICS_REPORT_HPP__
+
+#include <string>
+#include "Converter.hpp"
+#include "JsonWriter.hpp"
+#include "OutputCache.hpp"
+
+namespace JxrToAvif
+{
+    // Writes the statistics of a finished conversion as a JSON object: time per phase,
+    // throughput, worker busy time, peak memory, output size and light levels.
+    // Totals are the sums of the phases, so the caller appends those it ran itself, such as writing.
+    // The cache counts are written when the conversion ran after a cache miss.
+    void WriteStatisticsReport(JsonWriter& json, const std::wstring& inputFile, const std::wstring& outputFile,
+        const ConversionResult& result, const CacheStatistics* cache = nullptr);
+
+    // The report of a file copied from the cache, which has no conversion to time
+    void WriteCacheHitReport(JsonWriter& json, const std::wstring& inputFile, const std::wstring& outputFile,
+        const CacheStatistics& cache);
+}
+
+#endif // __STATISTICS_REPORT_HPP__
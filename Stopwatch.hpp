@@ -0,0 +1,54 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __STOPWATCH_HPP__
+#define __STOPWATCH_HPP__
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include "jxr_sys_helpers.h"
+
+namespace JxrToAvif
+{
+    struct PhaseTiming
+    {
+        std::string name;
+        double wallSeconds = 0;
+        // Of all threads of the process, including those of the encoder
+        double cpuSeconds = 0;
+    };
+
+    // Measures consecutive phases of work in wall clock and process CPU time
+    class Stopwatch
+    {
+    public:
+        Stopwatch()
+            : _wallStart(Clock::now()), _cpuStart(jxr_get_process_cpu_time())
+        {
+        }
+
+        // Time since construction or the previous lap
+        PhaseTiming Lap(std::string name)
+        {
+            const auto wallNow = Clock::now();
+            const auto cpuNow = jxr_get_process_cpu_time();
+
+            PhaseTiming timing;
+            timing.name = std::move(name);
+            timing.wallSeconds = std::chrono::duration<double>(wallNow - _wallStart).count();
+            timing.cpuSeconds = static_cast<double>(cpuNow - _cpuStart) / 1e6;
+
+            _wallStart = wallNow;
+            _cpuStart = cpuNow;
+            return timing;
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        Clock::time_point _wallStart;
+        uint64_t _cpuStart;
+    };
+}
+
+#endif // __STOPWATCH_HPP__
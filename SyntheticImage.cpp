@@ -0,0 +1,107 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <stdexcept>
+#include <immintrin.h>
+#include "ThreadPool.hpp"
+#include "SyntheticImage.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        uint32_t Hash(uint32_t x)
+        {
+            x ^= x >> 16;
+            x *= 0x7feb352dU;
+            x ^= x >> 15;
+            x *= 0x846ca68bU;
+            x ^= x >> 16;
+            return x;
+        }
+
+        // Uniform in [0, 1)
+        float HashToUnit(const uint32_t hash)
+        {
+            return static_cast<float>(hash >> 8) * (1.f / (1 << 24));
+        }
+
+        // Saturated BT.2020 primaries in scRGB, outside of the sRGB gamut
+        constexpr float SpotColors[][3] =
+        {
+            { 1.f, 1.f, 1.f },
+            { 1.6605f, -0.1246f, -0.0182f },
+            { -0.5876f, 1.1329f, -0.1006f },
+            { -0.0728f, -0.0083f, 1.1187f },
+        };
+    }
+
+    SyntheticImage::SyntheticImage(const SyntheticImageOptions& options)
+        : _width(options.width), _height(options.height), _bytesPerPixel(options.halfFloat ? 8 : 16)
+    {
+        if (!options.width || !options.height || static_cast<uint64_t>(options.width) * _bytesPerPixel > UINT32_MAX ||
+            !(options.sceneNits > 0) || !(options.highlightNits > 0) || !(options.highlightFraction >= 0 && options.highlightFraction <= 1))
+        {
+            throw std::invalid_argument("Invalid synthetic image options.");
+        }
+
+        _stride = _width * _bytesPerPixel;
+        _pixels = std::unique_ptr<uint8_t[]>(new uint8_t[GetSize()]);
+
+        ThreadPool::GetInstance().ParallelFor(0, _height, SpotSize, [this, &options](const size_t begin, const size_t end, uint32_t)
+        {
+            GenerateRows(options, static_cast<uint32_t>(begin), static_cast<uint32_t>(end));
+        });
+    }
+
+    void SyntheticImage::GenerateRows(const SyntheticImageOptions& options, const uint32_t firstRow, const uint32_t lastRow)
+    {
+        const auto sceneScale = static_cast<float>(options.sceneNits / ScRgbWhiteNits);
+        const auto highlightScale = static_cast<float>(options.highlightNits / ScRgbWhiteNits);
+        const auto spotThreshold = static_cast<uint32_t>(std::min(options.highlightFraction * 4294967296.0, 4294967295.0));
+        const auto xScale = 1.f / static_cast<float>(_width);
+        const auto yScale = 1.f / static_cast<float>(_height);
+
+        for (auto y = firstRow; y < lastRow; y++)
+        {
+            const auto row = _pixels.get() + static_cast<size_t>(y) * _stride;
+            const auto v = static_cast<float>(y) * yScale;
+
+            for (uint32_t x = 0; x < _width; x++)
+            {
+                const auto u = static_cast<float>(x) * xScale;
+
+                // Dim corner to bright corner, with a slightly out of gamut green edge
+                const auto level = sceneScale * (0.02f + 0.98f * (u + v) * 0.5f);
+                float rgb[3] = { level * u, level * (1.f - u * 0.5f) - (v > 0.95f ? 0.02f : 0.f), level * (1.f - v) };
+
+                const auto spot = Hash((x / SpotSize) * 0x9e3779b9U ^ Hash(y / SpotSize ^ options.seed * 0x85ebca6bU));
+                if (spot < spotThreshold)
+                {
+                    const auto peak = highlightScale * (0.25f + 0.75f * HashToUnit(Hash(spot)));
+                    const auto& color = SpotColors[spot & 3];
+                    for (int c = 0; c < 3; c++)
+                    {
+                        rgb[c] = color[c] * peak;
+                    }
+                }
+
+                if (options.halfFloat)
+                {
+                    const auto pixel = reinterpret_cast<uint16_t*>(row) + static_cast<size_t>(x) * 4;
+                    for (int c = 0; c < 3; c++)
+                    {
+                        pixel[c] = _cvtss_sh(rgb[c], _MM_FROUND_TO_NEAREST_INT);
+                    }
+                    pixel[3] = _cvtss_sh(1.f, _MM_FROUND_TO_NEAREST_INT);
+                }
+                else
+                {
+                    const auto pixel = reinterpret_cast<float*>(row) + static_cast<size_t>(x) * 4;
+                    std::copy(rgb, rgb + 3, pixel);
+                    pixel[3] = 1.f;
+                }
+            }
+        }
+    }
+}
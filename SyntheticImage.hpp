@@ -0,0 +1,75 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __SYNTHETIC_IMAGE_HPP__
+#define __SYNTHETIC_IMAGE_HPP__
+
+#include <cstdint>
+#include <memory>
+#include "Converter.hpp"
+
+namespace JxrToAvif
+{
+    struct SyntheticImageOptions
+    {
+        static constexpr double DefaultSceneNits = 200;
+        static constexpr double DefaultHighlightNits = 1000;
+        static constexpr double DefaultHighlightFraction = 0.01;
+
+        uint32_t width = 3840;
+        uint32_t height = 2160;
+        // Half components take 8 bytes per pixel, float components 16
+        bool halfFloat = true;
+        // Brightest point of the diffuse gradient
+        double sceneNits = DefaultSceneNits;
+        // Highlights are square spots covering about this fraction of the image,
+        // with peaks spread up to highlightNits
+        double highlightNits = DefaultHighlightNits;
+        double highlightFraction = DefaultHighlightFraction;
+        uint32_t seed = 1;
+    };
+
+    // Generates scRGB RGBA pixels like those of a decoded HDR screenshot: a smooth colored
+    // gradient with bright spots, including out of gamut and negative components.
+    // Equal options always give the same pixels.
+    class SyntheticImage
+    {
+    public:
+        explicit SyntheticImage(const SyntheticImageOptions& options);
+
+        SyntheticImage(const SyntheticImage&) = delete;
+
+        SyntheticImage(SyntheticImage&&) = delete;
+
+        SyntheticImage& operator=(const SyntheticImage&) = delete;
+
+        SyntheticImage& operator=(SyntheticImage&&) = delete;
+
+        ~SyntheticImage() = default;
+
+        [[nodiscard]] PixelSpan GetPixels() const
+        {
+            return { _pixels.get(), _width, _height, _stride, _bytesPerPixel };
+        }
+
+        [[nodiscard]] size_t GetSize() const
+        {
+            return static_cast<size_t>(_stride) * _height;
+        }
+
+    private:
+        // scRGB 1.0 is 80 nits
+        static constexpr double ScRgbWhiteNits = 80;
+
+        static constexpr uint32_t SpotSize = 64;
+
+        std::unique_ptr<uint8_t[]> _pixels;
+        uint32_t _width;
+        uint32_t _height;
+        uint32_t _stride;
+        uint8_t _bytesPerPixel;
+
+        void GenerateRows(const SyntheticImageOptions& options, uint32_t firstRow, uint32_t lastRow);
+    };
+}
+
+#endif // __SYNTHETIC_IMAGE_HPP__
@@ -0,0 +1,301 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include "jxr_sys_helpers.h"
+#include "Trace.hpp"
+#include "ThreadPool.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        thread_local const ThreadPool* currentPool = nullptr;
+        thread_local uint32_t currentWorkerIndex = 0;
+
+        std::atomic<uint32_t> instanceWorkerCount(0);
+        std::atomic<bool> instanceCreated(false);
+    }
+
+    ThreadPool::ThreadPool(const uint32_t workerCount)
+        : _queuedTasks(0), _nextQueue(0), _activeWorkers(0), _activeLimit(std::max<uint32_t>(workerCount, 1)), _stopping(false)
+    {
+        const auto count = std::max<uint32_t>(workerCount, 1);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            _workers.push_back(std::make_unique<Worker>());
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            _workers[i]->thread = std::thread(&ThreadPool::WorkerLoop, this, i);
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_sleepMutex);
+            _stopping = true;
+        }
+        _wakeUp.notify_all();
+
+        for (const auto& worker : _workers)
+        {
+            if (worker->thread.joinable())
+                worker->thread.join();
+        }
+    }
+
+    ThreadPool& ThreadPool::GetInstance()
+    {
+        static ThreadPool instance([]
+        {
+            instanceCreated = true;
+            const auto count = instanceWorkerCount.load();
+            return count > 0 ? count : jxr_get_number_of_processors();
+        }());
+        return instance;
+    }
+
+    void ThreadPool::SetInstanceWorkerCount(const uint32_t workerCount)
+    {
+        if (instanceCreated.load())
+        {
+            throw std::logic_error("The thread pool is already running.");
+        }
+        instanceWorkerCount = workerCount;
+    }
+
+    void ThreadPool::SetActiveWorkerLimit(const uint32_t limit)
+    {
+        const auto previous = _activeLimit.exchange(std::clamp(limit, 1u, GetWorkerCount()));
+        if (previous >= limit)
+            return;
+
+        // Workers held back by the old limit sleep until woken
+        {
+            std::lock_guard<std::mutex> lock(_sleepMutex);
+        }
+        _wakeUp.notify_all();
+    }
+
+    uint32_t ThreadPool::GetCurrentWorkerIndex() const
+    {
+        return currentPool == this ? currentWorkerIndex : GetWorkerCount();
+    }
+
+    void ThreadPool::Submit(TaskGroup& group, std::function<void()> task)
+    {
+        const auto workerCount = GetWorkerCount();
+        auto index = GetCurrentWorkerIndex();
+
+        if (index >= workerCount)
+        {
+            index = _nextQueue.fetch_add(1, std::memory_order_relaxed) % workerCount;
+        }
+
+        group._pending.fetch_add(1);
+
+        // Counted before the task is queued, so the counter never drops below zero and the group is not
+        // touched once the task may have run. A worker waiting for the group checks it under the mutex.
+        {
+            std::lock_guard<std::mutex> lock(group._mutex);
+            group._queued.fetch_add(1);
+        }
+        group._done.notify_all();
+
+        {
+            auto& worker = *_workers[index];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(Task{&group, std::move(task)});
+        }
+
+        _queuedTasks.fetch_add(1);
+
+        // Sleeping workers check the counter under this mutex, so the wakeup can't get lost
+        {
+            std::lock_guard<std::mutex> lock(_sleepMutex);
+        }
+        _wakeUp.notify_one();
+    }
+
+    void ThreadPool::Wait(TaskGroup& group)
+    {
+        const auto index = GetCurrentWorkerIndex();
+
+        if (index < GetWorkerCount())
+        {
+            // Blocking a worker could starve the pool, help out instead. Only with tasks of the group:
+            // the worker is already active for the task it waits in, so any other task would run beyond
+            // the active worker limit, and might keep it busy long after the group is done.
+            while (group._pending.load() > 0)
+            {
+                if (TryRunTask(index, &group))
+                    continue;
+
+                // Nothing of the group is queued, the rest runs on other workers and may submit more
+                std::unique_lock<std::mutex> lock(group._mutex);
+                group._done.wait(lock, [&group] { return group._pending.load() == 0 || group._queued.load() > 0; });
+            }
+        }
+
+        std::exception_ptr exception;
+        {
+            std::unique_lock<std::mutex> lock(group._mutex);
+            group._done.wait(lock, [&group] { return group._pending.load() == 0; });
+            std::swap(exception, group._exception);
+        }
+
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+
+    void ThreadPool::ParallelFor(const size_t begin, const size_t end, const size_t grain, const RangeBody& body)
+    {
+        if (begin >= end)
+            return;
+
+        const auto tileSize = std::max<size_t>(grain, 1);
+
+        TaskGroup group;
+        Submit(group, [this, &group, begin, end, tileSize, &body]
+        {
+            SplitRange(group, begin, end, tileSize, body);
+        });
+        Wait(group);
+    }
+
+    void ThreadPool::SplitRange(TaskGroup& group, const size_t begin, size_t end, const size_t grain, const RangeBody& body)
+    {
+        // Hand out the upper half and keep the lower one, so the oldest
+        // tasks in a deque are the largest ones and thieves take those first.
+        while (end - begin > grain)
+        {
+            const auto tiles = (end - begin + grain - 1) / grain;
+            const auto middle = begin + tiles / 2 * grain;
+
+            Submit(group, [this, &group, middle, end, grain, &body]
+            {
+                SplitRange(group, middle, end, grain, body);
+            });
+
+            end = middle;
+        }
+
+        body(begin, end, GetCurrentWorkerIndex());
+    }
+
+    void ThreadPool::WorkerLoop(const uint32_t index)
+    {
+        currentPool = this;
+        currentWorkerIndex = index;
+        Trace::SetThreadName("worker " + std::to_string(index));
+
+        // Pools larger than a Windows processor group would otherwise share the processors of one
+        jxr_set_thread_processor_group(index);
+
+        while (true)
+        {
+            if (TryActivate())
+            {
+                const auto ran = TryRunTask(index, nullptr);
+                _activeWorkers.fetch_sub(1);
+                if (ran)
+                    continue;
+            }
+
+            // A worker over the limit is not woken when another one finishes, but that one goes on with the queued tasks
+            std::unique_lock<std::mutex> lock(_sleepMutex);
+            _wakeUp.wait(lock, [this]
+            {
+                return _stopping || (_queuedTasks.load() > 0 && _activeWorkers.load() < _activeLimit.load());
+            });
+            if (_stopping && _queuedTasks.load() == 0)
+                return;
+        }
+    }
+
+    bool ThreadPool::TryActivate()
+    {
+        auto active = _activeWorkers.load();
+        while (active < _activeLimit.load())
+        {
+            if (_activeWorkers.compare_exchange_weak(active, active + 1))
+                return true;
+        }
+        return false;
+    }
+
+    bool ThreadPool::TryRunTask(const uint32_t index, const TaskGroup* group)
+    {
+        Task task;
+
+        if (!TryPopTask(index, group, task))
+            return false;
+
+        RunTask(task);
+        return true;
+    }
+
+    bool ThreadPool::TryPopTask(const uint32_t index, const TaskGroup* group, Task& task)
+    {
+        const auto workerCount = GetWorkerCount();
+        const auto matches = [group](const Task& queued) { return !group || queued.group == group; };
+
+        {
+            auto& own = *_workers[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            const auto found = std::find_if(own.tasks.rbegin(), own.tasks.rend(), matches);
+            if (found != own.tasks.rend())
+            {
+                task = std::move(*found);
+                task.group->_queued.fetch_sub(1);
+                own.tasks.erase(std::next(found).base());
+                _queuedTasks.fetch_sub(1);
+                return true;
+            }
+        }
+
+        for (uint32_t i = 1; i < workerCount; i++)
+        {
+            auto& victim = *_workers[(index + i) % workerCount];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            const auto found = std::find_if(victim.tasks.begin(), victim.tasks.end(), matches);
+            if (found != victim.tasks.end())
+            {
+                task = std::move(*found);
+                task.group->_queued.fetch_sub(1);
+                victim.tasks.erase(found);
+                _queuedTasks.fetch_sub(1);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void ThreadPool::RunTask(Task& task)
+    {
+        auto& group = *task.group;
+
+        try
+        {
+            task.function();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(group._mutex);
+            if (!group._exception)
+                group._exception = std::current_exception();
+        }
+
+        // The waiter may destroy the group as soon as the counter drops to zero,
+        // so the counter is only touched under the group's mutex
+        std::lock_guard<std::mutex> lock(group._mutex);
+        if (group._pending.fetch_sub(1) == 1)
+            group._done.notify_all();
+    }
+}
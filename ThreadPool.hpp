@@ -0,0 +1,134 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __THREAD_POOL_HPP__
+#define __THREAD_POOL_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace JxrToAvif
+{
+    // Process-wide pool of worker threads.
+    // Every worker owns a deque of tasks. It pops its own tasks from the back
+    // and steals from the front of other workers' deques when it runs dry,
+    // so ranges split by ParallelFor are balanced on the fly.
+    class ThreadPool
+    {
+    public:
+        class TaskGroup
+        {
+        public:
+            TaskGroup() = default;
+
+            TaskGroup(const TaskGroup&) = delete;
+
+            TaskGroup(TaskGroup&&) = delete;
+
+            TaskGroup& operator=(const TaskGroup&) = delete;
+
+            TaskGroup& operator=(TaskGroup&&) = delete;
+
+            ~TaskGroup() = default;
+
+        private:
+            friend class ThreadPool;
+
+            std::atomic<size_t> _pending{0};
+            // Tasks still in a deque, a waiting worker sleeps while there are none
+            std::atomic<size_t> _queued{0};
+            std::mutex _mutex;
+            std::condition_variable _done;
+            std::exception_ptr _exception;
+        };
+
+        using RangeBody = std::function<void(size_t begin, size_t end, uint32_t workerIndex)>;
+
+        explicit ThreadPool(uint32_t workerCount);
+
+        ThreadPool(const ThreadPool&) = delete;
+
+        ThreadPool(ThreadPool&&) = delete;
+
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        ThreadPool& operator=(ThreadPool&&) = delete;
+
+        ~ThreadPool();
+
+        // The process-wide pool, created on first use with a worker per usable processor,
+        // see jxr_get_number_of_processors, or as many as SetInstanceWorkerCount asked for
+        static ThreadPool& GetInstance();
+
+        // Must be called before the first GetInstance, throws std::logic_error otherwise. Zero restores the default.
+        static void SetInstanceWorkerCount(uint32_t workerCount);
+
+        [[nodiscard]] uint32_t GetWorkerCount() const
+        {
+            return static_cast<uint32_t>(_workers.size());
+        }
+
+        // Caps the number of workers running tasks at once, at least one always may.
+        // Workers finish the task at hand first, so lowering the limit takes effect within a task.
+        void SetActiveWorkerLimit(uint32_t limit);
+
+        // Index of the calling thread within this pool, or GetWorkerCount() for outside threads
+        [[nodiscard]] uint32_t GetCurrentWorkerIndex() const;
+
+        void Submit(TaskGroup& group, std::function<void()> task);
+
+        // Outside threads sleep until the group finishes. Workers run queued tasks of the group meanwhile,
+        // and sleep while the rest of it runs elsewhere.
+        // Rethrows the first exception thrown by the group's tasks.
+        void Wait(TaskGroup& group);
+
+        // Runs body over [begin, end) split into tiles of `grain` items.
+        // Tile boundaries are always multiples of `grain` counted from `begin`.
+        void ParallelFor(size_t begin, size_t end, size_t grain, const RangeBody& body);
+
+    private:
+        struct Task
+        {
+            TaskGroup* group;
+            std::function<void()> function;
+        };
+
+        struct Worker
+        {
+            std::thread thread;
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::unique_ptr<Worker>> _workers;
+        std::atomic<size_t> _queuedTasks;
+        std::atomic<uint32_t> _nextQueue;
+        std::atomic<uint32_t> _activeWorkers;
+        std::atomic<uint32_t> _activeLimit;
+        std::mutex _sleepMutex;
+        std::condition_variable _wakeUp;
+        bool _stopping;
+
+        void WorkerLoop(uint32_t index);
+
+        // Null takes tasks of any group
+        bool TryRunTask(uint32_t index, const TaskGroup* group);
+
+        bool TryActivate();
+
+        bool TryPopTask(uint32_t index, const TaskGroup* group, Task& task);
+
+        void RunTask(Task& task);
+
+        void SplitRange(TaskGroup& group, size_t begin, size_t end, size_t grain, const RangeBody& body);
+    };
+}
+
+#endif // __THREAD_POOL_HPP__
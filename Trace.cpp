@@ -0,0 +1,225 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "jxr_sys_helpers.h"
+#include "JsonWriter.hpp"
+#include "Trace.hpp"
+
+namespace JxrToAvif
+{
+    namespace
+    {
+        struct Event
+        {
+            const char* name;
+            int64_t start;
+            int64_t end;
+            const char* argName;
+            int64_t argValue;
+        };
+
+        struct Sample
+        {
+            int64_t time;
+            double cores;
+        };
+
+        struct ThreadBuffer
+        {
+            uint32_t id = 0;
+            std::string name;
+            std::mutex mutex;
+            std::vector<Event> events;
+        };
+
+        struct TraceState
+        {
+            std::mutex mutex;
+            // Buffers outlive their threads, so events of finished threads are kept
+            std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+            int64_t startTime = 0;
+
+            std::thread sampler;
+            std::mutex samplerMutex;
+            std::condition_variable samplerStop;
+            bool stopping = false;
+            std::vector<Sample> samples;
+        };
+
+        thread_local ThreadBuffer* currentBuffer = nullptr;
+        thread_local std::string currentThreadName;
+
+        TraceState& GetState()
+        {
+            static TraceState state;
+            return state;
+        }
+
+        void SampleCpuUsage(TraceState& state)
+        {
+            auto lastTime = std::chrono::steady_clock::now();
+            auto lastCpuTime = jxr_get_process_cpu_time();
+
+            std::unique_lock lock(state.samplerMutex);
+            while (!state.samplerStop.wait_for(lock, Trace::SampleInterval, [&state] { return state.stopping; }))
+            {
+                const auto time = std::chrono::steady_clock::now();
+                const auto cpuTime = jxr_get_process_cpu_time();
+                const auto wallMicroseconds = std::chrono::duration<double, std::micro>(time - lastTime).count();
+
+                // Cores busy on average over the interval
+                if (wallMicroseconds > 0)
+                {
+                    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+                    state.samples.push_back({ ns, static_cast<double>(cpuTime - lastCpuTime) / wallMicroseconds });
+                }
+
+                lastTime = time;
+                lastCpuTime = cpuTime;
+            }
+        }
+    }
+
+    std::atomic<bool> Trace::_enabled(false);
+
+    void Trace::Start()
+    {
+        Stop();
+
+        auto& state = GetState();
+        {
+            const std::lock_guard lock(state.mutex);
+            for (const auto& buffer : state.buffers)
+            {
+                const std::lock_guard bufferLock(buffer->mutex);
+                buffer->events.clear();
+            }
+            state.startTime = Now();
+        }
+
+        state.samples.clear();
+        state.stopping = false;
+        state.sampler = std::thread(SampleCpuUsage, std::ref(state));
+
+        _enabled = true;
+    }
+
+    void Trace::Stop()
+    {
+        _enabled = false;
+
+        auto& state = GetState();
+        if (state.sampler.joinable())
+        {
+            {
+                const std::lock_guard lock(state.samplerMutex);
+                state.stopping = true;
+            }
+            state.samplerStop.notify_all();
+            state.sampler.join();
+        }
+    }
+
+    void Trace::SetThreadName(std::string name)
+    {
+        if (currentBuffer)
+        {
+            const std::lock_guard lock(currentBuffer->mutex);
+            currentBuffer->name = name;
+        }
+
+        currentThreadName = std::move(name);
+    }
+
+    void Trace::Write(std::ostream& stream)
+    {
+        auto& state = GetState();
+        const std::lock_guard lock(state.mutex);
+
+        const auto toMicroseconds = [&state](const int64_t time) { return static_cast<double>(time - state.startTime) / 1000; };
+
+        JsonWriter json(stream);
+        json.BeginObject();
+        json.Write("displayTimeUnit", "ms");
+        json.BeginArray("traceEvents");
+
+        for (const auto& buffer : state.buffers)
+        {
+            const std::lock_guard bufferLock(buffer->mutex);
+
+            json.BeginObject();
+            json.Write("name", "thread_name");
+            json.Write("ph", "M");
+            json.Write("pid", 1);
+            json.Write("tid", buffer->id);
+            json.BeginObject("args");
+            json.Write("name", buffer->name);
+            json.EndObject();
+            json.EndObject();
+
+            for (const auto& event : buffer->events)
+            {
+                json.BeginObject();
+                json.Write("name", event.name);
+                json.Write("cat", "jxr_to_avif");
+                json.Write("ph", "X");
+                json.Write("pid", 1);
+                json.Write("tid", buffer->id);
+                json.Write("ts", toMicroseconds(event.start));
+                json.Write("dur", static_cast<double>(event.end - event.start) / 1000);
+                if (event.argName)
+                {
+                    json.BeginObject("args");
+                    json.Write(event.argName, event.argValue);
+                    json.EndObject();
+                }
+                json.EndObject();
+            }
+        }
+
+        for (const auto& sample : state.samples)
+        {
+            json.BeginObject();
+            json.Write("name", "CPU usage");
+            json.Write("ph", "C");
+            json.Write("pid", 1);
+            json.Write("ts", toMicroseconds(sample.time));
+            json.BeginObject("args");
+            json.Write("cores", sample.cores);
+            json.EndObject();
+            json.EndObject();
+        }
+
+        json.EndArray();
+        json.EndObject();
+        stream << '\n';
+    }
+
+    int64_t Trace::Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Trace::Record(const char* name, const int64_t start, const int64_t end, const char* argName, const int64_t argValue)
+    {
+        if (!currentBuffer)
+        {
+            auto& state = GetState();
+            const std::lock_guard lock(state.mutex);
+
+            auto buffer = std::make_unique<ThreadBuffer>();
+            buffer->id = static_cast<uint32_t>(state.buffers.size()) + 1;
+            buffer->name = currentThreadName.empty() ? "thread " + std::to_string(buffer->id) : currentThreadName;
+            currentBuffer = buffer.get();
+            state.buffers.push_back(std::move(buffer));
+        }
+
+        const std::lock_guard lock(currentBuffer->mutex);
+        currentBuffer->events.push_back({ name, start, end, argName, argValue });
+    }
+}
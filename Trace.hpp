@@ -0,0 +1,82 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __TRACE_HPP__
+#define __TRACE_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace JxrToAvif
+{
+    // Process-wide timeline of TraceScope spans, written in the Chrome trace event format
+    // which Perfetto and chrome://tracing open. While tracing, the CPU usage of the whole
+    // process is sampled as well, which shows the encoder's own threads at work.
+    //
+    // Every thread records into its own buffer. While tracing is off, a scope costs a single relaxed load.
+    class Trace
+    {
+    public:
+        // Interval of the process CPU usage samples
+        static constexpr std::chrono::milliseconds SampleInterval{ 5 };
+
+        static void Start();
+
+        static void Stop();
+
+        [[nodiscard]] static bool IsEnabled()
+        {
+            return _enabled.load(std::memory_order_relaxed);
+        }
+
+        // Names the calling thread in traces, at any time, tracing or not
+        static void SetThreadName(std::string name);
+
+        // Writes everything recorded since Start as a JSON document. Tracing must be stopped.
+        static void Write(std::ostream& stream);
+
+    private:
+        friend class TraceScope;
+
+        static std::atomic<bool> _enabled;
+
+        static int64_t Now();
+
+        static void Record(const char* name, int64_t start, int64_t end, const char* argName, int64_t argValue);
+    };
+
+    // Records the span of a scope on the calling thread's timeline.
+    // Names and argument names must be string literals.
+    class TraceScope
+    {
+    public:
+        explicit TraceScope(const char* name, const char* argName = nullptr, const int64_t argValue = 0)
+            : _name(Trace::IsEnabled() ? name : nullptr), _argName(argName), _argValue(argValue), _start(_name ? Trace::Now() : 0)
+        {
+        }
+
+        TraceScope(const TraceScope&) = delete;
+
+        TraceScope(TraceScope&&) = delete;
+
+        TraceScope& operator=(const TraceScope&) = delete;
+
+        TraceScope& operator=(TraceScope&&) = delete;
+
+        ~TraceScope()
+        {
+            if (_name)
+                Trace::Record(_name, _start, Trace::Now(), _argName, _argValue);
+        }
+
+    private:
+        const char* _name;
+        const char* _argName;
+        int64_t _argValue;
+        int64_t _start;
+    };
+}
+
+#endif // __TRACE_HPP__
@@ -0,0 +1,261 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <algorithm>
+#include <cwctype>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Benchmark.hpp"
+#include "jxr_sys_helpers.h"
+
+using namespace JxrToAvif;
+
+namespace
+{
+    constexpr auto DefaultOutputFile = L"jxr_to_avif_bench.json";
+
+    // The checks only pass or fail, without timing anything
+    enum class Mode
+    {
+        Benchmark,
+        PqAccuracy,
+        GridRoundTrip
+    };
+
+    void PrintUsage()
+    {
+        std::cout << "Usage: jxr_to_avif_bench [options]\n";
+        std::cout << "Converts a synthetic HDR image and times every stage.\n";
+        std::cout << "Options:\n";
+        std::cout << "  --help                  Print this message.\n";
+        std::cout << "  --width <n>             Image width. Defaults to 3840.\n";
+        std::cout << "  --height <n>            Image height. Defaults to 2160.\n";
+        std::cout << "  --float                 Use float components instead of half.\n";
+        std::cout << "  --scene-nits <n>        Brightest point of the background.\n";
+        std::cout << "                          Defaults to 200.\n";
+        std::cout << "  --highlight-nits <n>    Brightest highlight. Defaults to 1000.\n";
+        std::cout << "  --highlights <n>        Percentage of the image covered by highlights.\n";
+        std::cout << "                          Defaults to 1.\n";
+        std::cout << "  --seed <n>              Seed of the highlight placement.\n";
+        std::cout << "  --iterations <n>        Runs of every measurement. Defaults to 3.\n";
+        std::cout << "  --speeds <n,...>        Encoder speeds. Defaults to 6.\n";
+        std::cout << "  --depths <n,...>        Output color depths. Defaults to 12.\n";
+        std::cout << "  --formats <f,...>       Output pixel formats. Defaults to yuv444.\n";
+        std::cout << "  --jobs <n>              Images converted at once to compare throughput\n";
+        std::cout << "                          with and without the CPU budget. Defaults to 2,\n";
+        std::cout << "                          1 skips the comparison.\n";
+        std::cout << "  --no-encode             Only time the conversion stages.\n";
+        std::cout << "  --pq-accuracy           Check the PQ curves on every input instead,\n";
+        std::cout << "                          exits with 1 if either is off by more than\n";
+        std::cout << "                          its bound.\n";
+        std::cout << "  --grid-round-trip       Check that lossless grid images decode to\n";
+        std::cout << "                          their source instead, exits with 1 if not.\n";
+        std::cout << "  --output <file>         JSON results file.\n";
+        std::cout << "                          Defaults to jxr_to_avif_bench.json.\n";
+    }
+
+    std::vector<std::wstring> Split(const std::wstring& list)
+    {
+        std::vector<std::wstring> items;
+        std::wstringstream stream(list);
+        std::wstring item;
+        while (std::getline(stream, item, L','))
+        {
+            items.push_back(item);
+        }
+        return items;
+    }
+
+    // Throws on anything but a whole number in range
+    long long ParseInteger(const std::wstring& arg, const long long min, const long long max)
+    {
+        size_t length = 0;
+        const auto n = std::stoll(arg, &length);
+        if (length != arg.size() || n < min || n > max)
+        {
+            throw std::invalid_argument("Out of range");
+        }
+        return n;
+    }
+
+    double ParseNumber(const std::wstring& arg, const double min, const double max)
+    {
+        size_t length = 0;
+        const auto n = std::stod(arg, &length);
+        if (length != arg.size() || !(n >= min && n <= max))
+        {
+            throw std::invalid_argument("Out of range");
+        }
+        return n;
+    }
+
+    PixelFormat ParseFormat(std::wstring arg)
+    {
+        std::transform(arg.begin(), arg.end(), arg.begin(), std::towlower);
+        if (arg == L"rgb")
+            return PixelFormat::Rgb;
+        if (arg == L"yuv444")
+            return PixelFormat::Yuv444;
+        if (arg == L"yuv422")
+            return PixelFormat::Yuv422;
+        if (arg == L"yuv420")
+            return PixelFormat::Yuv420;
+        if (arg == L"yuv400")
+            return PixelFormat::Yuv400;
+        throw std::invalid_argument("Unknown format");
+    }
+
+    // Returns false if the arguments are invalid or help is asked for
+    bool ParseArguments(const std::vector<std::wstring>& args, BenchmarkOptions& options, std::wstring& outputFile, Mode& mode)
+    {
+        try
+        {
+            for (size_t i = 1; i < args.size(); i++)
+            {
+                const auto& arg = args[i];
+                if (arg == L"--help")
+                    return false;
+                if (arg == L"--float")
+                {
+                    options.image.halfFloat = false;
+                    continue;
+                }
+                if (arg == L"--no-encode")
+                {
+                    options.speeds.clear();
+                    continue;
+                }
+                if (arg == L"--pq-accuracy")
+                {
+                    mode = Mode::PqAccuracy;
+                    continue;
+                }
+                if (arg == L"--grid-round-trip")
+                {
+                    mode = Mode::GridRoundTrip;
+                    continue;
+                }
+
+                if (i + 1 >= args.size())
+                    return false;
+                const auto& value = args[++i];
+
+                if (arg == L"--width")
+                    options.image.width = static_cast<uint32_t>(ParseInteger(value, 1, 65536));
+                else if (arg == L"--height")
+                    options.image.height = static_cast<uint32_t>(ParseInteger(value, 1, 65536));
+                else if (arg == L"--scene-nits")
+                    options.image.sceneNits = ParseNumber(value, 1, 10000);
+                else if (arg == L"--highlight-nits")
+                    options.image.highlightNits = ParseNumber(value, 1, 10000);
+                else if (arg == L"--highlights")
+                    options.image.highlightFraction = ParseNumber(value, 0, 100) / 100;
+                else if (arg == L"--seed")
+                    options.image.seed = static_cast<uint32_t>(ParseInteger(value, 0, UINT32_MAX));
+                else if (arg == L"--jobs")
+                    options.jobs = static_cast<uint32_t>(ParseInteger(value, 1, 64));
+                else if (arg == L"--iterations")
+                    options.iterations = static_cast<uint32_t>(ParseInteger(value, 1, 1000));
+                else if (arg == L"--speeds")
+                {
+                    options.speeds.clear();
+                    for (const auto& item : Split(value))
+                        options.speeds.push_back(static_cast<int>(ParseInteger(item, 0, 10)));
+                }
+                else if (arg == L"--depths")
+                {
+                    options.depths.clear();
+                    for (const auto& item : Split(value))
+                    {
+                        const auto depth = ParseInteger(item, 10, 12);
+                        if (depth == 11)
+                            return false;
+                        options.depths.push_back(static_cast<uint8_t>(depth));
+                    }
+                }
+                else if (arg == L"--formats")
+                {
+                    options.formats.clear();
+                    for (const auto& item : Split(value))
+                        options.formats.push_back(ParseFormat(item));
+                }
+                else if (arg == L"--output")
+                    outputFile = value;
+                else
+                    return false;
+            }
+        }
+        catch (std::exception&)
+        {
+            return false;
+        }
+
+        return !options.depths.empty() && !options.formats.empty();
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        jxr_command_line cmdline{};
+        if (jxr_get_command_line(argc, argv, &cmdline) < 0)
+        {
+            std::cerr << "Failed to retrieve process command line.\n";
+            return 1;
+        }
+        const std::vector<std::wstring> args(cmdline.argv, cmdline.argv + cmdline.argc);
+        jxr_free_command_line(&cmdline);
+
+        BenchmarkOptions options;
+        std::wstring outputFile = DefaultOutputFile;
+        auto mode = Mode::Benchmark;
+        if (!ParseArguments(args, options, outputFile, mode))
+        {
+            PrintUsage();
+            return 1;
+        }
+
+        if (mode == Mode::PqAccuracy)
+        {
+            return Benchmark::CheckPqAccuracy(std::cout) ? 0 : 1;
+        }
+        if (mode == Mode::GridRoundTrip)
+        {
+            return Benchmark::CheckGridRoundTrip(std::cout) ? 0 : 1;
+        }
+
+        Benchmark benchmark(options);
+        benchmark.Run(std::cout);
+
+        std::ostringstream results;
+        benchmark.WriteResults(results);
+        const auto json = results.str();
+
+        const auto rv = jxr_write_data_to_file(outputFile.c_str(), json.data(), json.size());
+        if (rv < 0)
+        {
+            auto writeErrorDesc = jxr_get_error_description(rv);
+            std::cerr << "Failed to write results: " << writeErrorDesc << "\n";
+            jxr_free_error_description(writeErrorDesc);
+            return 1;
+        }
+
+        auto nativeOutputFile = jxr_wide_to_multibyte(outputFile.c_str());
+        std::cout << "Wrote: " << (nativeOutputFile ? nativeOutputFile : "results") << "\n";
+        jxr_free_multibyte(nativeOutputFile);
+        return 0;
+    }
+    catch (std::bad_alloc&)
+    {
+        std::cerr << "Out of memory\n";
+        return 1;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
@@ -1,5 +1,6 @@
 // Copyright 2024 Dmitry Ignatiev. All rights reserved
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <windows.h>
@@ -12,96 +13,226 @@
 #define SAFE_RELEASE(p) do{if(p){(p)->lpVtbl->Release(p); (p) = NULL;}}while(0)
 #endif
 
-int jxr_load_data(const wchar_t* filename, jxr_data* data)
+struct jxr_decoder
+{
+    IWICImagingFactory* pFactory;
+    IWICStream* pStream;
+    IWICBitmapDecoder* pDecoder;
+    IWICBitmapFrameDecode* pFrame;
+    IWICBitmapSource* pBitmapSource;
+    uint32_t width;
+};
+
+// Reads the format and size of the first frame of an opened decoder
+static HRESULT jxr_read_info(jxr_decoder* d, jxr_data* data)
 {
-    IWICImagingFactory* pFactory = NULL;
-    IWICBitmapFrameDecode* pFrame = NULL;
-    IWICBitmapDecoder* pDecoder = NULL;
-    IWICBitmapSource* pBitmapSource = NULL;
+    HRESULT hr = d->pDecoder->lpVtbl->GetFrame(d->pDecoder, 0, &d->pFrame);
+
+    V_HR();
+
+    hr = d->pFrame->lpVtbl->QueryInterface(d->pFrame, &IID_IWICBitmapSource, (void**)&d->pBitmapSource);
+
+    V_HR();
+
+    WICPixelFormatGUID pixelFormat;
+
+    hr = d->pBitmapSource->lpVtbl->GetPixelFormat(d->pBitmapSource, &pixelFormat);
+
+    V_HR();
+
+    if(IsEqualGUID(&pixelFormat, &GUID_WICPixelFormat128bppRGBAFloat))
+    {
+        data->bytes_per_pixel = 4 * 4;
+    }
+    else if(IsEqualGUID(&pixelFormat, &GUID_WICPixelFormat64bppRGBAHalf))
+    {
+        data->bytes_per_pixel = 2 * 4;
+    }
+    else
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        goto exit;
+    }
+
+    hr = d->pBitmapSource->lpVtbl->GetSize(d->pBitmapSource, &data->width, &data->height);
 
-    if (!filename || !data)
+    V_HR();
+
+    if ((uint64_t)data->width * data->bytes_per_pixel > UINT_MAX)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW);
+        goto exit;
+    }
+
+    data->stride = data->width * data->bytes_per_pixel;
+    d->width = data->width;
+
+    hr = S_OK;
+
+exit:
+    return hr;
+}
+
+int jxr_open_decoder(const wchar_t* filename, jxr_decoder** decoder, jxr_data* data)
+{
+    if (!filename || !decoder || !data)
         return E_INVALIDARG;
 
+    *decoder = NULL;
     ZeroMemory(data, sizeof(jxr_data));
 
+    jxr_decoder* d = (jxr_decoder*)calloc(1, sizeof(jxr_decoder));
+    if (!d)
+        return E_OUTOFMEMORY;
+
     HRESULT hr = CoCreateInstance(
         &CLSID_WICImagingFactory,
         NULL,
         CLSCTX_INPROC_SERVER,
         &IID_IWICImagingFactory,
-        (void**)&pFactory);
+        (void**)&d->pFactory);
 
     V_HR();
 
-    hr = pFactory->lpVtbl->CreateDecoderFromFilename(
-        pFactory,
+    hr = d->pFactory->lpVtbl->CreateDecoderFromFilename(
+        d->pFactory,
         filename,                        // Image to be decoded
         NULL,                            // Do not prefer a particular vendor
         GENERIC_READ,                    // Desired read access to the file
         WICDecodeMetadataCacheOnDemand,  // Cache metadata when needed
-        &pDecoder                        // Pointer to the decoder
+        &d->pDecoder                     // Pointer to the decoder
     );
 
     V_HR();
 
-    hr = pDecoder->lpVtbl->GetFrame(pDecoder, 0, &pFrame);
+    hr = jxr_read_info(d, data);
+
+exit:
+    if(FAILED(hr))
+    {
+        jxr_close_decoder(d);
+        ZeroMemory(data, sizeof(jxr_data));
+    }
+    else
+    {
+        *decoder = d;
+    }
+
+    return hr;
+}
+
+int jxr_open_decoder_from_memory(const uint8_t* buffer, size_t size, jxr_decoder** decoder, jxr_data* data)
+{
+    if (!buffer || !size || !decoder || !data)
+        return E_INVALIDARG;
+
+    // Memory streams take a 32 bit size
+    if (size > UINT_MAX)
+        return HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW);
+
+    *decoder = NULL;
+    ZeroMemory(data, sizeof(jxr_data));
+
+    jxr_decoder* d = (jxr_decoder*)calloc(1, sizeof(jxr_decoder));
+    if (!d)
+        return E_OUTOFMEMORY;
+
+    HRESULT hr = CoCreateInstance(
+        &CLSID_WICImagingFactory,
+        NULL,
+        CLSCTX_INPROC_SERVER,
+        &IID_IWICImagingFactory,
+        (void**)&d->pFactory);
 
     V_HR();
 
-    hr = pFrame->lpVtbl->QueryInterface(pFrame, &IID_IWICBitmapSource, (void**)&pBitmapSource);
+    hr = d->pFactory->lpVtbl->CreateStream(d->pFactory, &d->pStream);
 
     V_HR();
 
-    WICPixelFormatGUID pixelFormat;
+    // The stream is only read from, despite the buffer type
+    hr = d->pStream->lpVtbl->InitializeFromMemory(d->pStream, (BYTE*)buffer, (DWORD)size);
+
+    V_HR();
 
-    hr = pBitmapSource->lpVtbl->GetPixelFormat(pBitmapSource, &pixelFormat);
+    hr = d->pFactory->lpVtbl->CreateDecoderFromStream(
+        d->pFactory,
+        (IStream*)d->pStream,
+        NULL,
+        WICDecodeMetadataCacheOnDemand,
+        &d->pDecoder);
 
     V_HR();
 
-    if(IsEqualGUID(&pixelFormat, &GUID_WICPixelFormat128bppRGBAFloat))
+    hr = jxr_read_info(d, data);
+
+exit:
+    if(FAILED(hr))
     {
-        data->bytes_per_pixel = 4 * 4;
+        jxr_close_decoder(d);
+        ZeroMemory(data, sizeof(jxr_data));
     }
-    else if(IsEqualGUID(&pixelFormat, &GUID_WICPixelFormat64bppRGBAHalf))
+    else
     {
-        data->bytes_per_pixel = 2 * 4;
+        *decoder = d;
     }
-    else
+
+    return hr;
+}
+
+int jxr_decode_rows(jxr_decoder* decoder, uint32_t first_row, uint32_t row_count, uint8_t* buffer, uint32_t stride)
+{
+    if (!decoder || !buffer || !stride || first_row > INT_MAX || row_count > INT_MAX)
+        return E_INVALIDARG;
+
+    HRESULT hr = S_OK;
+
+    // CopyPixels takes a 32 bit buffer size, so bands over 4 GiB are copied in parts
+    const uint32_t partHeight = (uint32_t)min((uint64_t)UINT_MAX / stride, (uint64_t)row_count);
+    for (uint32_t y = 0; y < row_count && SUCCEEDED(hr); y += partHeight)
     {
-        hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
-        goto exit;
+        WICRect rc;
+        rc.Y = (INT)(first_row + y);
+        rc.X = 0;
+        rc.Width = (INT)decoder->width;
+        rc.Height = (INT)min(partHeight, row_count - y);
+        hr = decoder->pBitmapSource->lpVtbl->CopyPixels(decoder->pBitmapSource, &rc, stride,
+            (UINT)((size_t)stride * (size_t)rc.Height), buffer + (size_t)y * stride);
     }
 
-    hr = pBitmapSource->lpVtbl->GetSize(pBitmapSource, &data->width, &data->height);
+    return hr;
+}
+
+void jxr_close_decoder(jxr_decoder* decoder)
+{
+    if (decoder)
+    {
+        SAFE_RELEASE(decoder->pFactory);
+        SAFE_RELEASE(decoder->pDecoder);
+        SAFE_RELEASE(decoder->pFrame);
+        SAFE_RELEASE(decoder->pBitmapSource);
+        SAFE_RELEASE(decoder->pStream);
+        free(decoder);
+    }
+}
 
-    V_HR();
+// Decodes all rows of an opened image and closes the decoder
+static HRESULT jxr_load_all_rows(jxr_decoder* decoder, jxr_data* data)
+{
+    HRESULT hr = S_OK;
 
-    data->stride = data->width * data->bytes_per_pixel;
     data->buffer_size = (size_t)data->stride * (size_t)data->height;
-
     data->pixels = (uint8_t*)malloc(data->buffer_size);
     if(!data->pixels)
     {
         hr = HRESULT_FROM_WIN32(ERROR_OUTOFMEMORY);
-        goto exit;
+    }
+    else
+    {
+        hr = jxr_decode_rows(decoder, 0, data->height, data->pixels, data->stride);
     }
 
-    WICRect rc;
-    rc.Y = 0;
-    rc.X = 0;
-    rc.Width = (int)data->width;
-    rc.Height = (int)data->height;
-    hr = pBitmapSource->lpVtbl->CopyPixels(pBitmapSource, &rc, data->stride, (UINT)data->buffer_size, data->pixels);
-
-    V_HR();
-
-    hr = S_OK;
-
-exit:
-    SAFE_RELEASE(pFactory);
-    SAFE_RELEASE(pDecoder);
-    SAFE_RELEASE(pFrame);
-    SAFE_RELEASE(pBitmapSource);
+    jxr_close_decoder(decoder);
 
     if(FAILED(hr))
     {
@@ -111,6 +242,28 @@ exit:
     return hr;
 }
 
+int jxr_load_data(const wchar_t* filename, jxr_data* data)
+{
+    jxr_decoder* decoder = NULL;
+
+    const HRESULT hr = jxr_open_decoder(filename, &decoder, data);
+    if (FAILED(hr))
+        return hr;
+
+    return jxr_load_all_rows(decoder, data);
+}
+
+int jxr_load_data_from_memory(const uint8_t* buffer, size_t size, jxr_data* data)
+{
+    jxr_decoder* decoder = NULL;
+
+    const HRESULT hr = jxr_open_decoder_from_memory(buffer, size, &decoder, data);
+    if (FAILED(hr))
+        return hr;
+
+    return jxr_load_all_rows(decoder, data);
+}
+
 void jxr_free_data(jxr_data* data)
 {
     if(data)
@@ -20,8 +20,24 @@ typedef struct
     uint8_t* pixels;
 } jxr_data;
 
+typedef struct jxr_decoder jxr_decoder;
+
 int jxr_load_data(const wchar_t* filename, jxr_data* data);
 
+// The buffer holds a whole JPEG XR file
+int jxr_load_data_from_memory(const uint8_t* buffer, size_t size, jxr_data* data);
+
+// Opens an image for decoding in bands of rows. Data receives the size, stride and format, but no pixels.
+int jxr_open_decoder(const wchar_t* filename, jxr_decoder** decoder, jxr_data* data);
+
+// The buffer is read during decoding and must outlive the decoder
+int jxr_open_decoder_from_memory(const uint8_t* buffer, size_t size, jxr_decoder** decoder, jxr_data* data);
+
+// Bands are best decoded top to bottom, going back up may restart decoding
+int jxr_decode_rows(jxr_decoder* decoder, uint32_t first_row, uint32_t row_count, uint8_t* buffer, uint32_t stride);
+
+void jxr_close_decoder(jxr_decoder* decoder);
+
 void jxr_free_data(jxr_data* data);
 
 int jxr_init_loader_thread(void);
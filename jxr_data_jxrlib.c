@@ -0,0 +1,296 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <JXRGlue.h>
+#include "jxr_sys_helpers.h"
+#include "jxr_data.h"
+
+#define V_ERR() do{if(Failed(err)) { goto exit; }}while(0)
+
+#ifndef SAFE_RELEASE
+#define SAFE_RELEASE(p) do{if(p){(p)->Release(&(p)); (p) = NULL;}}while(0)
+#endif
+
+static int jxr_error_from_wmp(ERR err)
+{
+    switch (err)
+    {
+    case WMP_errOutOfMemory:
+        return -ENOMEM;
+    case WMP_errInvalidParameter:
+    case WMP_errInvalidArgument:
+        return -EINVAL;
+    case WMP_errNotYetImplemented:
+    case WMP_errUnsupportedFormat:
+    case WMP_errIncorrectCodecVersion:
+    case WMP_errIncorrectCodecSubVersion:
+        return -ENOTSUP;
+    case WMP_errFileIO:
+        // jxrlib opens files with fopen, so errno tells more than its own code
+        return errno ? -errno : -EIO;
+    default:
+        return -EIO;
+    }
+}
+
+struct jxr_decoder
+{
+    PKCodecFactory* pCodecFactory;
+    PKImageDecode* pDecoder;
+};
+
+// Reads the format and size of an initialized decoder
+static int jxr_read_info(jxr_decoder* d, jxr_data* data)
+{
+    PKPixelFormatGUID pixelFormat;
+
+    ERR err = d->pDecoder->GetPixelFormat(d->pDecoder, &pixelFormat);
+
+    if (Failed(err))
+        return jxr_error_from_wmp(err);
+
+    // RGB variants are padded to four components by jxrlib,
+    // so they share the memory layout of their RGBA counterparts.
+    if (IsEqualGUID(&pixelFormat, &GUID_PKPixelFormat128bppRGBAFloat)
+        || IsEqualGUID(&pixelFormat, &GUID_PKPixelFormat128bppRGBFloat))
+    {
+        data->bytes_per_pixel = 4 * 4;
+    }
+    else if (IsEqualGUID(&pixelFormat, &GUID_PKPixelFormat64bppRGBAHalf)
+        || IsEqualGUID(&pixelFormat, &GUID_PKPixelFormat64bppRGBHalf))
+    {
+        data->bytes_per_pixel = 2 * 4;
+    }
+    else
+    {
+        return -ENOTSUP;
+    }
+
+    I32 width = 0, height = 0;
+
+    err = d->pDecoder->GetSize(d->pDecoder, &width, &height);
+
+    if (Failed(err))
+        return jxr_error_from_wmp(err);
+
+    if (width <= 0 || height <= 0)
+        return -EINVAL;
+
+    if ((uint64_t)width * data->bytes_per_pixel > UINT32_MAX)
+        return -EOVERFLOW;
+
+    data->width = (uint32_t)width;
+    data->height = (uint32_t)height;
+    data->stride = data->width * data->bytes_per_pixel;
+
+    return 0;
+}
+
+int jxr_open_decoder(const wchar_t* filename, jxr_decoder** decoder, jxr_data* data)
+{
+    char* nativeFilename = NULL;
+    ERR err = WMP_errSuccess;
+    int rv = 0;
+
+    if (!filename || !decoder || !data)
+        return -EINVAL;
+
+    *decoder = NULL;
+    memset(data, 0, sizeof(jxr_data));
+
+    jxr_decoder* d = (jxr_decoder*)calloc(1, sizeof(jxr_decoder));
+    if (!d)
+        return -ENOMEM;
+
+    nativeFilename = jxr_wide_to_multibyte(filename);
+    if (!nativeFilename)
+    {
+        rv = -EILSEQ;
+        goto exit;
+    }
+
+    err = PKCreateCodecFactory(&d->pCodecFactory, WMP_SDK_VERSION);
+
+    V_ERR();
+
+    errno = 0;
+    err = d->pCodecFactory->CreateDecoderFromFile(nativeFilename, &d->pDecoder);
+
+    V_ERR();
+
+    rv = jxr_read_info(d, data);
+
+exit:
+    jxr_free_multibyte(nativeFilename);
+
+    if (Failed(err))
+        rv = jxr_error_from_wmp(err);
+
+    if (rv < 0)
+    {
+        jxr_close_decoder(d);
+        memset(data, 0, sizeof(jxr_data));
+    }
+    else
+    {
+        *decoder = d;
+    }
+
+    return rv;
+}
+
+int jxr_open_decoder_from_memory(const uint8_t* buffer, size_t size, jxr_decoder** decoder, jxr_data* data)
+{
+    struct WMPStream* pStream = NULL;
+    ERR err = WMP_errSuccess;
+    int rv = 0;
+
+    if (!buffer || !size || !decoder || !data)
+        return -EINVAL;
+
+    *decoder = NULL;
+    memset(data, 0, sizeof(jxr_data));
+
+    jxr_decoder* d = (jxr_decoder*)calloc(1, sizeof(jxr_decoder));
+    if (!d)
+        return -ENOMEM;
+
+    err = PKCodecFactory_CreateCodec(&IID_PKImageWmpDecode, (void**)&d->pDecoder);
+
+    V_ERR();
+
+    // Memory streams are never written to by a decoder
+    err = CreateWS_Memory(&pStream, (void*)buffer, size);
+
+    V_ERR();
+
+    err = d->pDecoder->Initialize(d->pDecoder, pStream);
+
+    // The decoder took the stream as soon as initialization started
+    d->pDecoder->fStreamOwner = !0;
+
+    V_ERR();
+
+    rv = jxr_read_info(d, data);
+
+exit:
+    if (Failed(err))
+        rv = jxr_error_from_wmp(err);
+
+    if (rv < 0)
+    {
+        jxr_close_decoder(d);
+        memset(data, 0, sizeof(jxr_data));
+    }
+    else
+    {
+        *decoder = d;
+    }
+
+    return rv;
+}
+
+int jxr_decode_rows(jxr_decoder* decoder, uint32_t first_row, uint32_t row_count, uint8_t* buffer, uint32_t stride)
+{
+    if (!decoder || !buffer || first_row > INT32_MAX || row_count > INT32_MAX)
+        return -EINVAL;
+
+    // jxrlib decodes macroblock rows in order, a band above the last one restarts decoding from the top
+    PKRect rc;
+    I32 width = 0, height = 0;
+    ERR err = decoder->pDecoder->GetSize(decoder->pDecoder, &width, &height);
+
+    if (Failed(err))
+        return jxr_error_from_wmp(err);
+
+    if ((uint64_t)first_row + row_count > (uint64_t)height)
+        return -EINVAL;
+
+    rc.X = 0;
+    rc.Y = (I32)first_row;
+    rc.Width = width;
+    rc.Height = (I32)row_count;
+    err = decoder->pDecoder->Copy(decoder->pDecoder, &rc, buffer, stride);
+
+    return Failed(err) ? jxr_error_from_wmp(err) : 0;
+}
+
+void jxr_close_decoder(jxr_decoder* decoder)
+{
+    if (decoder)
+    {
+        SAFE_RELEASE(decoder->pDecoder);
+        SAFE_RELEASE(decoder->pCodecFactory);
+        free(decoder);
+    }
+}
+
+// Decodes all rows of an opened image and closes the decoder
+static int jxr_load_all_rows(jxr_decoder* decoder, jxr_data* data)
+{
+    int rv = 0;
+
+    data->buffer_size = (size_t)data->stride * (size_t)data->height;
+    data->pixels = (uint8_t*)malloc(data->buffer_size);
+    if (!data->pixels)
+    {
+        rv = -ENOMEM;
+    }
+    else
+    {
+        rv = jxr_decode_rows(decoder, 0, data->height, data->pixels, data->stride);
+    }
+
+    jxr_close_decoder(decoder);
+
+    if (rv < 0)
+    {
+        jxr_free_data(data);
+    }
+
+    return rv;
+}
+
+int jxr_load_data(const wchar_t* filename, jxr_data* data)
+{
+    jxr_decoder* decoder = NULL;
+
+    const int rv = jxr_open_decoder(filename, &decoder, data);
+    if (rv < 0)
+        return rv;
+
+    return jxr_load_all_rows(decoder, data);
+}
+
+int jxr_load_data_from_memory(const uint8_t* buffer, size_t size, jxr_data* data)
+{
+    jxr_decoder* decoder = NULL;
+
+    const int rv = jxr_open_decoder_from_memory(buffer, size, &decoder, data);
+    if (rv < 0)
+        return rv;
+
+    return jxr_load_all_rows(decoder, data);
+}
+
+void jxr_free_data(jxr_data* data)
+{
+    if (data)
+    {
+        free(data->pixels);
+        memset(data, 0, sizeof(jxr_data));
+    }
+}
+
+int jxr_init_loader_thread(void)
+{
+    // jxrlib keeps no per-thread state
+    return 0;
+}
+
+void jxr_deinit_loader_thread(void)
+{
+}
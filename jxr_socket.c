@@ -0,0 +1,129 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#include <limits.h>
+#include <string.h>
+#include "jxr_sys_helpers.h"
+#include "jxr_socket.h"
+
+static int jxr_socket_error(void)
+{
+    return HRESULT_FROM_WIN32(WSAGetLastError());
+}
+
+int jxr_socket_listen(const wchar_t* path, jxr_socket* listener)
+{
+    WSADATA wsaData;
+    SOCKADDR_UN address;
+    int rv = 0;
+
+    if (!path || !listener)
+        return E_INVALIDARG;
+
+    *listener = JXR_INVALID_SOCKET;
+
+    // Unix domain sockets need Winsock 2.2, available since Windows 10 1803
+    rv = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (rv)
+        return HRESULT_FROM_WIN32(rv);
+
+    char* nativePath = jxr_wide_to_multibyte(path);
+    if (!nativePath)
+    {
+        WSACleanup();
+        return HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION);
+    }
+
+    ZeroMemory(&address, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(nativePath) >= sizeof(address.sun_path))
+    {
+        jxr_free_multibyte(nativePath);
+        WSACleanup();
+        return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+    }
+    strcpy_s(address.sun_path, sizeof(address.sun_path), nativePath);
+    jxr_free_multibyte(nativePath);
+
+    const SOCKET s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET)
+    {
+        rv = jxr_socket_error();
+        WSACleanup();
+        return rv;
+    }
+
+    // Socket files are reparse points, they are left behind by servers that exited
+    const DWORD attributes = GetFileAttributesW(path);
+    if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_REPARSE_POINT))
+        DeleteFileW(path);
+
+    if (bind(s, (const SOCKADDR*)&address, sizeof(address)) == SOCKET_ERROR || listen(s, SOMAXCONN) == SOCKET_ERROR)
+    {
+        rv = jxr_socket_error();
+        closesocket(s);
+        WSACleanup();
+        return rv;
+    }
+
+    *listener = (jxr_socket)s;
+    return S_OK;
+}
+
+int jxr_socket_accept(jxr_socket listener, jxr_socket* connection)
+{
+    if (!connection)
+        return E_INVALIDARG;
+
+    const SOCKET s = accept((SOCKET)listener, NULL, NULL);
+    if (s == INVALID_SOCKET)
+    {
+        *connection = JXR_INVALID_SOCKET;
+        return jxr_socket_error();
+    }
+
+    *connection = (jxr_socket)s;
+    return S_OK;
+}
+
+int jxr_socket_receive(jxr_socket s, void* buffer, size_t size, size_t* received, intptr_t* handle)
+{
+    if (!buffer || !received)
+        return E_INVALIDARG;
+
+    if (handle)
+        *handle = -1;
+
+    const int n = recv((SOCKET)s, (char*)buffer, (int)min(size, (size_t)INT_MAX), 0);
+    if (n == SOCKET_ERROR)
+    {
+        *received = 0;
+        return jxr_socket_error();
+    }
+
+    *received = (size_t)n;
+    return S_OK;
+}
+
+int jxr_socket_send_all(jxr_socket s, const void* buffer, size_t size)
+{
+    const char* p = (const char*)buffer;
+    while (size > 0)
+    {
+        const int sent = send((SOCKET)s, p, (int)min(size, (size_t)INT_MAX), 0);
+        if (sent == SOCKET_ERROR)
+            return jxr_socket_error();
+        p += sent;
+        size -= (size_t)sent;
+    }
+
+    return S_OK;
+}
+
+void jxr_socket_close(jxr_socket s)
+{
+    if (s != JXR_INVALID_SOCKET)
+        closesocket((SOCKET)s);
+}
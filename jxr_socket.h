@@ -0,0 +1,39 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#ifndef __JXR_SOCKET_H__
+#define __JXR_SOCKET_H__
+
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdint>
+extern "C" {
+#else
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+// Stream sockets of the Unix domain, a SOCKET on Windows and a file descriptor elsewhere
+typedef intptr_t jxr_socket;
+
+#define JXR_INVALID_SOCKET ((jxr_socket)-1)
+
+// Binds a listening socket to the path, replacing a stale socket file left there
+int jxr_socket_listen(const wchar_t* path, jxr_socket* listener);
+
+int jxr_socket_accept(jxr_socket listener, jxr_socket* connection);
+
+// Receives up to size bytes, zero bytes received means the peer closed the connection.
+// A descriptor the peer passed along with the bytes is stored in handle, which is -1 otherwise,
+// and freed by jxr_close_shared_handle. Further descriptors are closed, as are all with a null handle.
+// Windows sockets never pass handles.
+int jxr_socket_receive(jxr_socket s, void* buffer, size_t size, size_t* received, intptr_t* handle);
+
+int jxr_socket_send_all(jxr_socket s, const void* buffer, size_t size);
+
+void jxr_socket_close(jxr_socket s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __JXR_SOCKET_H__
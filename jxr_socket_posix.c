@@ -0,0 +1,174 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "jxr_sys_helpers.h"
+#include "jxr_socket.h"
+
+// Descriptors taken from a single message, a job passes one
+#define JXR_MAX_PASSED_DESCRIPTORS 16
+
+// Passed descriptors are not inherited by child processes
+#ifdef MSG_CMSG_CLOEXEC
+#define JXR_RECEIVE_FLAGS MSG_CMSG_CLOEXEC
+#else
+#define JXR_RECEIVE_FLAGS 0
+#endif
+
+int jxr_socket_listen(const wchar_t* path, jxr_socket* listener)
+{
+    struct sockaddr_un address;
+    struct stat status;
+    int rv = 0;
+
+    if (!path || !listener)
+        return -EINVAL;
+
+    *listener = JXR_INVALID_SOCKET;
+
+    char* nativePath = jxr_wide_to_multibyte(path);
+    if (!nativePath)
+        return -EILSEQ;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(nativePath) >= sizeof(address.sun_path))
+    {
+        jxr_free_multibyte(nativePath);
+        return -ENAMETOOLONG;
+    }
+    strcpy(address.sun_path, nativePath);
+    jxr_free_multibyte(nativePath);
+
+    // Clients that went away are noticed by failing writes, not by a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -errno;
+
+    // Only sockets are replaced, never regular files
+    if (lstat(address.sun_path, &status) == 0 && S_ISSOCK(status.st_mode))
+        unlink(address.sun_path);
+
+    if (bind(fd, (const struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        rv = -errno;
+        close(fd);
+        return rv;
+    }
+
+    *listener = fd;
+    return 0;
+}
+
+int jxr_socket_accept(jxr_socket listener, jxr_socket* connection)
+{
+    if (!connection)
+        return -EINVAL;
+
+    int fd;
+    do
+    {
+        fd = accept((int)listener, NULL, NULL);
+    } while (fd < 0 && (errno == EINTR || errno == ECONNABORTED));
+
+    if (fd < 0)
+    {
+        *connection = JXR_INVALID_SOCKET;
+        return -errno;
+    }
+
+    *connection = fd;
+    return 0;
+}
+
+int jxr_socket_receive(jxr_socket s, void* buffer, size_t size, size_t* received, intptr_t* handle)
+{
+    struct msghdr message;
+    struct iovec vector;
+    struct cmsghdr* header;
+    // Descriptors that do not fit are closed by the kernel
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * JXR_MAX_PASSED_DESCRIPTORS)];
+    } control;
+
+    if (!buffer || !received)
+        return -EINVAL;
+
+    if (handle)
+        *handle = -1;
+
+    vector.iov_base = buffer;
+    vector.iov_len = size;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t n;
+    do
+    {
+        n = recvmsg((int)s, &message, JXR_RECEIVE_FLAGS);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+    {
+        *received = 0;
+        return -errno;
+    }
+
+    for (header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+    {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        const size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (handle && *handle < 0)
+                *handle = fd;
+            else
+                close(fd);
+        }
+    }
+
+    *received = (size_t)n;
+    return 0;
+}
+
+int jxr_socket_send_all(jxr_socket s, const void* buffer, size_t size)
+{
+    const uint8_t* p = buffer;
+    while (size > 0)
+    {
+        const ssize_t sent = send((int)s, p, size, 0);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        p += sent;
+        size -= (size_t)sent;
+    }
+
+    return 0;
+}
+
+void jxr_socket_close(jxr_socket s)
+{
+    if (s != JXR_INVALID_SOCKET)
+        close((int)s);
+}
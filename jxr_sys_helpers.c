@@ -1,15 +1,132 @@
 // Copyright 2024 Dmitry Ignatiev. All rights reserved
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <wchar.h>
 #include <windows.h>
 #include <intsafe.h>
+#include <psapi.h>
 #include "jxr_sys_helpers.h"
 
+struct jxr_file
+{
+    HANDLE handle;
+};
+
+struct jxr_mapping
+{
+    const void* address;
+};
+
+struct jxr_output
+{
+    HANDLE handle;
+    BOOL is_stdout;
+    // Both null when writing straight to the target
+    wchar_t* temporary;
+    wchar_t* target;
+};
+
+// Tells apart the temporary files of the threads of a process
+static volatile LONG jxr_temporary_counter;
+
+// FILETIME counts 100 ns intervals since 1601
+#define FILETIME_UNIX_EPOCH 116444736000000000LL
+
+static uint32_t jxr_count_bits(DWORD_PTR mask)
+{
+    uint32_t count = 0;
+    for (; mask; mask &= mask - 1)
+        count++;
+    return count;
+}
+
+// An explicit process affinity mask, which also confines the process to one group. Zero without one.
+static DWORD_PTR jxr_get_process_affinity(void)
+{
+    DWORD_PTR processMask = 0, systemMask = 0;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+        return 0;
+
+    // Both are zero for processes whose threads already span several groups
+    return processMask != systemMask ? processMask : 0;
+}
+
 uint32_t jxr_get_number_of_processors(void)
 {
-    SYSTEM_INFO systemInfo;
-    GetSystemInfo(&systemInfo);
-    return systemInfo.dwNumberOfProcessors;
+    JOBOBJECT_CPU_RATE_CONTROL_INFORMATION rate;
+
+    // GetSystemInfo only counts the processors of the group of the calling thread
+    const DWORD total = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    uint32_t count = total > 0 ? total : 1;
+
+    const DWORD_PTR affinity = jxr_get_process_affinity();
+    if (affinity)
+        count = jxr_count_bits(affinity);
+
+    // Containers cap the CPU time of their job object in hundredths of a percent of all processors
+    if (QueryInformationJobObject(NULL, JobObjectCpuRateControlInformation, &rate, sizeof(rate), NULL) &&
+        (rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_ENABLE) && (rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP))
+    {
+        const uint32_t limit = (uint32_t)(((uint64_t)rate.CpuRate * count + 9999) / 10000);
+        if (limit > 0 && limit < count)
+            count = limit;
+    }
+
+    return count > 0 ? count : 1;
+}
+
+int jxr_set_thread_processor_group(uint32_t index)
+{
+    GROUP_AFFINITY affinity;
+
+    const WORD groupCount = GetActiveProcessorGroupCount();
+    if (groupCount <= 1 || jxr_get_process_affinity())
+        return S_OK;
+
+    // Before Windows 11 the threads of a process start in a single group, whatever the number of processors
+    index %= GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    for (WORD group = 0; group < groupCount; group++)
+    {
+        const DWORD processors = GetActiveProcessorCount(group);
+        if (index < processors)
+        {
+            ZeroMemory(&affinity, sizeof(affinity));
+            affinity.Group = group;
+            affinity.Mask = processors >= sizeof(KAFFINITY) * 8 ? ~(KAFFINITY)0 : ((KAFFINITY)1 << processors) - 1;
+            if (!SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL))
+                return HRESULT_FROM_WIN32(GetLastError());
+            return S_OK;
+        }
+        index -= processors;
+    }
+
+    return S_OK;
+}
+
+uint64_t jxr_get_peak_memory_usage(void)
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+}
+
+uint64_t jxr_get_process_cpu_time(void)
+{
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime))
+        return 0;
+
+    ULARGE_INTEGER kernel, user;
+    kernel.LowPart = kernelTime.dwLowDateTime;
+    kernel.HighPart = kernelTime.dwHighDateTime;
+    user.LowPart = userTime.dwLowDateTime;
+    user.HighPart = userTime.dwHighDateTime;
+
+    // 100 ns units
+    return (kernel.QuadPart + user.QuadPart) / 10;
 }
 
 char* jxr_get_error_description(int code)
@@ -80,28 +197,666 @@ void jxr_free_command_line(jxr_command_line* cmdline)
     }
 }
 
-int jxr_write_data_to_file(const wchar_t* filename, void* buffer, size_t size)
+int jxr_write_data_to_file(const wchar_t* filename, const void* buffer, size_t size)
+{
+    jxr_output* output = NULL;
+    HRESULT hr = jxr_create_output(filename, size, &output);
+    if (FAILED(hr))
+        return hr;
+
+    hr = jxr_write_output(output, buffer, size);
+    if (FAILED(hr))
+    {
+        jxr_abort_output(output);
+        return hr;
+    }
+
+    return jxr_commit_output(output);
+}
+
+static void jxr_free_output(jxr_output* output)
+{
+    free(output->temporary);
+    free(output->target);
+    free(output);
+}
+
+int jxr_create_output(const wchar_t* filename, uint64_t size, jxr_output** output)
+{
+    FILE_ALLOCATION_INFO allocation;
+
+    if (!filename || !output)
+        return E_INVALIDARG;
+
+    *output = NULL;
+
+    jxr_output* o = calloc(1, sizeof(jxr_output));
+    if (!o)
+        return E_OUTOFMEMORY;
+
+    if (!wcscmp(filename, L"-"))
+    {
+        o->handle = GetStdHandle(STD_OUTPUT_HANDLE);
+        if (o->handle == INVALID_HANDLE_VALUE || !o->handle)
+        {
+            free(o);
+            return HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE);
+        }
+
+        o->is_stdout = TRUE;
+        *output = o;
+        return S_OK;
+    }
+
+    // Pipes and devices have no directory entry to replace
+    if (!wcsncmp(filename, L"\\\\.\\", 4))
+    {
+        o->handle = CreateFileW(filename, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (o->handle == INVALID_HANDLE_VALUE)
+        {
+            const DWORD err = GetLastError();
+            free(o);
+            return HRESULT_FROM_WIN32(err);
+        }
+
+        *output = o;
+        return S_OK;
+    }
+
+    const size_t length = wcslen(filename) + 1;
+    o->target = malloc(length * sizeof(wchar_t));
+    o->temporary = malloc((length + 32) * sizeof(wchar_t));
+    if (!o->target || !o->temporary)
+    {
+        jxr_free_output(o);
+        return E_OUTOFMEMORY;
+    }
+    memcpy(o->target, filename, length * sizeof(wchar_t));
+
+    o->handle = INVALID_HANDLE_VALUE;
+    for (int attempt = 0; attempt < 16 && o->handle == INVALID_HANDLE_VALUE; attempt++)
+    {
+        swprintf(o->temporary, length + 32, L"%ls.%lu.%ld.tmp", filename, GetCurrentProcessId(), InterlockedIncrement(&jxr_temporary_counter));
+        o->handle = CreateFileW(
+            o->temporary,
+            GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_DELETE,
+            NULL,
+            CREATE_NEW,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+            NULL);
+        if (o->handle == INVALID_HANDLE_VALUE && GetLastError() != ERROR_FILE_EXISTS)
+            break;
+    }
+
+    if (o->handle == INVALID_HANDLE_VALUE)
+    {
+        const DWORD err = GetLastError();
+        jxr_free_output(o);
+        return HRESULT_FROM_WIN32(err);
+    }
+
+    // Only a full disk is worth failing for, other file systems simply do not preallocate
+    allocation.AllocationSize.QuadPart = (LONGLONG)size;
+    if (size > 0 && !SetFileInformationByHandle(o->handle, FileAllocationInfo, &allocation, sizeof(allocation)) &&
+        (GetLastError() == ERROR_DISK_FULL || GetLastError() == ERROR_DISK_QUOTA_EXCEEDED))
+    {
+        const DWORD err = GetLastError();
+        jxr_abort_output(o);
+        return HRESULT_FROM_WIN32(err);
+    }
+
+    *output = o;
+    return S_OK;
+}
+
+int jxr_write_output(jxr_output* output, const void* buffer, size_t size)
 {
-    if (size > UINT32_MAX)
+    if (!output || (!buffer && size))
         return E_INVALIDARG;
 
+    // WriteFile takes a 32 bit size, so large outputs are written in pieces
+    const uint8_t* p = buffer;
+    while (size > 0)
+    {
+        DWORD written = 0;
+        const DWORD piece = (DWORD)min(size, (size_t)1 << 30);
+        if (!WriteFile(output->handle, p, piece, &written, NULL))
+            return HRESULT_FROM_WIN32(GetLastError());
+        p += written;
+        size -= written;
+    }
+
+    return S_OK;
+}
+
+int jxr_commit_output(jxr_output* output)
+{
+    if (!output)
+        return E_INVALIDARG;
+
+    HRESULT hr = S_OK;
+    if (output->temporary && !FlushFileBuffers(output->handle))
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    if (!output->is_stdout && !CloseHandle(output->handle) && SUCCEEDED(hr))
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+    if (output->temporary)
+    {
+        // Write through returns once the rename is on the disk, like syncing the directory elsewhere
+        if (SUCCEEDED(hr) && !MoveFileExW(output->temporary, output->target, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        if (FAILED(hr))
+            DeleteFileW(output->temporary);
+    }
+
+    jxr_free_output(output);
+    return hr;
+}
+
+void jxr_abort_output(jxr_output* output)
+{
+    if (!output)
+        return;
+
+    if (!output->is_stdout && output->handle != INVALID_HANDLE_VALUE)
+        CloseHandle(output->handle);
+    if (output->temporary)
+        DeleteFileW(output->temporary);
+
+    jxr_free_output(output);
+}
+
+char* jxr_wide_to_multibyte(const wchar_t* str)
+{
+    if (!str)
+        return NULL;
+    int len = WideCharToMultiByte(CP_UTF8, 0, str, -1, NULL, 0, NULL, NULL);
+    if (len <= 0)
+        return NULL;
+    char* rv = malloc((size_t)len);
+    if (rv && !WideCharToMultiByte(CP_UTF8, 0, str, -1, rv, len, NULL, NULL))
+    {
+        free(rv);
+        rv = NULL;
+    }
+    return rv;
+}
+
+void jxr_free_multibyte(char* str)
+{
+    free(str);
+}
+
+wchar_t* jxr_multibyte_to_wide(const char* str)
+{
+    if (!str)
+        return NULL;
+    int len = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, str, -1, NULL, 0);
+    if (len <= 0)
+        return NULL;
+    wchar_t* rv = malloc(sizeof(wchar_t) * (size_t)len);
+    if (rv && !MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, str, -1, rv, len))
+    {
+        free(rv);
+        rv = NULL;
+    }
+    return rv;
+}
+
+void jxr_free_wide(wchar_t* str)
+{
+    free(str);
+}
+
+int jxr_list_directory(const wchar_t* path, jxr_directory_list* list)
+{
+    WIN32_FIND_DATAW findData;
+    HRESULT hr = S_OK;
+    size_t capacity = 0;
+
+    if (!path || !list)
+        return E_INVALIDARG;
+
+    ZeroMemory(list, sizeof(jxr_directory_list));
+
+    const size_t pathLength = wcslen(path);
+    wchar_t* pattern = malloc(sizeof(wchar_t) * (pathLength + 3));
+    if (!pattern)
+        return E_OUTOFMEMORY;
+    wcscpy_s(pattern, pathLength + 3, path);
+    wcscat_s(pattern, pathLength + 3, L"\\*");
+
+    HANDLE hFind = FindFirstFileW(pattern, &findData);
+    free(pattern);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        const DWORD err = GetLastError();
+        return err == ERROR_FILE_NOT_FOUND ? S_OK : HRESULT_FROM_WIN32(err);
+    }
+
+    do
+    {
+        if (findData.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_DEVICE))
+            continue;
+
+        if (list->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            wchar_t** names = realloc(list->names, sizeof(wchar_t*) * capacity);
+            if (!names)
+            {
+                hr = E_OUTOFMEMORY;
+                break;
+            }
+            list->names = names;
+        }
+
+        list->names[list->count] = _wcsdup(findData.cFileName);
+        if (!list->names[list->count])
+        {
+            hr = E_OUTOFMEMORY;
+            break;
+        }
+        list->count++;
+    } while (FindNextFileW(hFind, &findData));
+
+    if (SUCCEEDED(hr) && GetLastError() != ERROR_NO_MORE_FILES)
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+    FindClose(hFind);
+
+    if (FAILED(hr))
+        jxr_free_directory_list(list);
+
+    return hr;
+}
+
+void jxr_free_directory_list(jxr_directory_list* list)
+{
+    if (list && list->names)
+    {
+        for (size_t i = 0; i < list->count; i++)
+            free(list->names[i]);
+        free(list->names);
+        ZeroMemory(list, sizeof(jxr_directory_list));
+    }
+}
+
+int jxr_get_file_info(const wchar_t* path, uint64_t* size, int* is_directory)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+    if (!path || !size || !is_directory)
+        return E_INVALIDARG;
+
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &attributes))
+        return HRESULT_FROM_WIN32(GetLastError());
+
+    *is_directory = (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    *size = *is_directory ? 0 : ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+    return S_OK;
+}
+
+int jxr_read_file(const wchar_t* filename, uint8_t** data, size_t* size)
+{
+    LARGE_INTEGER fileSize;
+    HRESULT hr = S_OK;
+
+    if (!filename || !data || !size)
+        return E_INVALIDARG;
+
+    *data = NULL;
+    *size = 0;
+
     HANDLE hFile = CreateFileW(
         filename,
-        GENERIC_READ | GENERIC_WRITE,
+        GENERIC_READ,
         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
         NULL,
-        CREATE_ALWAYS,
-        FILE_ATTRIBUTE_NORMAL,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
         NULL);
     if (hFile == INVALID_HANDLE_VALUE)
         return HRESULT_FROM_WIN32(GetLastError());
-    BOOL rv = WriteFile(hFile, buffer, (DWORD)size, NULL, NULL);
-    if (!rv)
+
+    if (!GetFileSizeEx(hFile, &fileSize))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    else if ((uint64_t)fileSize.QuadPart > SIZE_MAX)
     {
-        DWORD err = GetLastError();
+        hr = HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW);
+    }
+    else
+    {
+        // One spare byte keeps empty files from being a zero sized allocation
+        *data = malloc((size_t)fileSize.QuadPart + 1);
+        if (!*data)
+            hr = E_OUTOFMEMORY;
+    }
+
+    // ReadFile takes a 32 bit size, so large files are read in parts
+    while (SUCCEEDED(hr) && *size < (size_t)fileSize.QuadPart)
+    {
+        DWORD read = 0;
+        const DWORD part = (DWORD)min((size_t)fileSize.QuadPart - *size, (size_t)1 << 30);
+        if (!ReadFile(hFile, *data + *size, part, &read, NULL))
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        else if (!read)
+            break;
+        *size += read;
+    }
+
+    CloseHandle(hFile);
+
+    if (FAILED(hr))
+    {
+        free(*data);
+        *data = NULL;
+        *size = 0;
+    }
+
+    return hr;
+}
+
+int jxr_read_standard_input(uint8_t** data, size_t* size)
+{
+    LARGE_INTEGER fileSize;
+    HRESULT hr = S_OK;
+
+    if (!data || !size)
+        return E_INVALIDARG;
+
+    *data = NULL;
+    *size = 0;
+
+    const HANDLE hInput = GetStdHandle(STD_INPUT_HANDLE);
+    if (hInput == INVALID_HANDLE_VALUE || !hInput)
+        return HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE);
+
+    // A redirected file is read in one go, pipes grow the buffer as they go
+    size_t capacity = (size_t)1 << 20;
+    if (GetFileType(hInput) == FILE_TYPE_DISK && GetFileSizeEx(hInput, &fileSize) && (uint64_t)fileSize.QuadPart < SIZE_MAX)
+        capacity = (size_t)fileSize.QuadPart + 1;
+
+    *data = malloc(capacity);
+    if (!*data)
+        return E_OUTOFMEMORY;
+
+    while (SUCCEEDED(hr))
+    {
+        if (*size == capacity)
+        {
+            uint8_t* grown = capacity <= SIZE_MAX / 2 ? realloc(*data, capacity * 2) : NULL;
+            if (!grown)
+            {
+                hr = E_OUTOFMEMORY;
+                break;
+            }
+            *data = grown;
+            capacity *= 2;
+        }
+
+        // ReadFile takes a 32 bit size, and the writing end of a pipe closing is the end of the input
+        DWORD read = 0;
+        const DWORD part = (DWORD)min(capacity - *size, (size_t)1 << 30);
+        if (!ReadFile(hInput, *data + *size, part, &read, NULL))
+        {
+            if (GetLastError() != ERROR_BROKEN_PIPE)
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+        if (!read)
+            break;
+        *size += read;
+    }
+
+    if (FAILED(hr))
+    {
+        free(*data);
+        *data = NULL;
+        *size = 0;
+    }
+
+    return hr;
+}
+
+void jxr_free_file_data(uint8_t* data)
+{
+    free(data);
+}
+
+int jxr_open_file(const wchar_t* filename, jxr_file** file, uint64_t* size)
+{
+    LARGE_INTEGER fileSize;
+
+    if (!filename || !file || !size)
+        return E_INVALIDARG;
+
+    *file = NULL;
+    *size = 0;
+
+    HANDLE hFile = CreateFileW(
+        filename,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return HRESULT_FROM_WIN32(GetLastError());
+
+    if (!GetFileSizeEx(hFile, &fileSize))
+    {
+        const DWORD err = GetLastError();
         CloseHandle(hFile);
         return HRESULT_FROM_WIN32(err);
     }
-    CloseHandle(hFile);
+
+    jxr_file* f = malloc(sizeof(jxr_file));
+    if (!f)
+    {
+        CloseHandle(hFile);
+        return E_OUTOFMEMORY;
+    }
+
+    f->handle = hFile;
+    *file = f;
+    *size = (uint64_t)fileSize.QuadPart;
+    return S_OK;
+}
+
+int jxr_read_file_part(jxr_file* file, void* buffer, size_t size, size_t* bytes_read)
+{
+    if (!file || !buffer || !bytes_read)
+        return E_INVALIDARG;
+
+    // ReadFile takes a 32 bit size, so large parts are read in pieces
+    uint8_t* p = buffer;
+    *bytes_read = 0;
+    while (*bytes_read < size)
+    {
+        DWORD read = 0;
+        const DWORD piece = (DWORD)min(size - *bytes_read, (size_t)1 << 30);
+        if (!ReadFile(file->handle, p + *bytes_read, piece, &read, NULL))
+            return HRESULT_FROM_WIN32(GetLastError());
+        if (!read)
+            break;
+        *bytes_read += read;
+    }
+
+    return S_OK;
+}
+
+void jxr_close_file(jxr_file* file)
+{
+    if (file)
+    {
+        CloseHandle(file->handle);
+        free(file);
+    }
+}
+
+static HRESULT jxr_map_view(HANDLE section, uint64_t size, jxr_mapping** mapping, const uint8_t** data)
+{
+    if (!size || size > SIZE_MAX)
+        return E_INVALIDARG;
+
+    jxr_mapping* m = malloc(sizeof(jxr_mapping));
+    if (!m)
+        return E_OUTOFMEMORY;
+
+    // Fails for views larger than the section, and sections never shrink
+    m->address = MapViewOfFile(section, FILE_MAP_READ, 0, 0, (SIZE_T)size);
+    if (!m->address)
+    {
+        const DWORD err = GetLastError();
+        free(m);
+        return HRESULT_FROM_WIN32(err);
+    }
+
+    *mapping = m;
+    *data = m->address;
+    return S_OK;
+}
+
+int jxr_map_shared_memory(const wchar_t* name, uint64_t size, jxr_mapping** mapping, const uint8_t** data)
+{
+    if (!name || !mapping || !data)
+        return E_INVALIDARG;
+
+    *mapping = NULL;
+    *data = NULL;
+
+    HANDLE section = OpenFileMappingW(FILE_MAP_READ, FALSE, name);
+    if (!section)
+        return HRESULT_FROM_WIN32(GetLastError());
+
+    // The view outlives the handle
+    const HRESULT hr = jxr_map_view(section, size, mapping, data);
+    CloseHandle(section);
+    return hr;
+}
+
+int jxr_map_shared_handle(intptr_t handle, uint64_t size, jxr_mapping** mapping, const uint8_t** data)
+{
+    if (handle == -1 || !handle || !mapping || !data)
+        return E_INVALIDARG;
+
+    *mapping = NULL;
+    *data = NULL;
+
+    return jxr_map_view((HANDLE)handle, size, mapping, data);
+}
+
+void jxr_unmap_shared_memory(jxr_mapping* mapping)
+{
+    if (mapping)
+    {
+        UnmapViewOfFile(mapping->address);
+        free(mapping);
+    }
+}
+
+void jxr_close_shared_handle(intptr_t handle)
+{
+    if (handle != -1 && handle)
+        CloseHandle((HANDLE)handle);
+}
+
+int jxr_create_directory(const wchar_t* path)
+{
+    if (!CreateDirectoryW(path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+        return HRESULT_FROM_WIN32(GetLastError());
+    return S_OK;
+}
+
+int jxr_delete_file(const wchar_t* filename)
+{
+    if (!DeleteFileW(filename) && GetLastError() != ERROR_FILE_NOT_FOUND)
+        return HRESULT_FROM_WIN32(GetLastError());
+    return S_OK;
+}
+
+int jxr_rename_file(const wchar_t* from, const wchar_t* to)
+{
+    if (!MoveFileExW(from, to, MOVEFILE_REPLACE_EXISTING))
+        return HRESULT_FROM_WIN32(GetLastError());
+    return S_OK;
+}
+
+int jxr_create_hard_link(const wchar_t* existing, const wchar_t* link)
+{
+    if (!existing || !link)
+        return E_INVALIDARG;
+
+    const size_t length = wcslen(link) + 32;
+    wchar_t* temporary = malloc(length * sizeof(wchar_t));
+    if (!temporary)
+        return E_OUTOFMEMORY;
+
+    HRESULT hr = HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+    for (int attempt = 0; attempt < 16 && hr == HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS); attempt++)
+    {
+        swprintf(temporary, length, L"%ls.%lu.%ld.tmp", link, GetCurrentProcessId(), InterlockedIncrement(&jxr_temporary_counter));
+        hr = CreateHardLinkW(temporary, existing, NULL) ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr) && !MoveFileExW(temporary, link, MOVEFILE_REPLACE_EXISTING))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        DeleteFileW(temporary);
+    }
+
+    free(temporary);
+    return hr;
+}
+
+int jxr_get_file_time(const wchar_t* path, int64_t* modified)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+    if (!path || !modified)
+        return E_INVALIDARG;
+
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &attributes))
+        return HRESULT_FROM_WIN32(GetLastError());
+
+    const int64_t time = ((int64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+    *modified = (time - FILETIME_UNIX_EPOCH) / 10;
     return S_OK;
 }
+
+int jxr_touch_file(const wchar_t* path)
+{
+    FILETIME now;
+
+    HANDLE hFile = CreateFileW(
+        path,
+        FILE_WRITE_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return HRESULT_FROM_WIN32(GetLastError());
+
+    GetSystemTimeAsFileTime(&now);
+    const BOOL rv = SetFileTime(hFile, NULL, &now, &now);
+    const DWORD err = GetLastError();
+    CloseHandle(hFile);
+    return rv ? S_OK : HRESULT_FROM_WIN32(err);
+}
+
+int jxr_is_path_separator(wchar_t c)
+{
+    return c == L'\\' || c == L'/';
+}
+
+wchar_t jxr_get_path_separator(void)
+{
+    return L'\\';
+}
@@ -4,9 +4,11 @@
 #define __JXR_SYS_HELPERS__H__
 
 #ifdef __cplusplus
+#include <cstddef>
 #include <cstdint>
 extern "C" {
 #else
+#include <stddef.h>
 #include <stdint.h>
 #endif
 
@@ -16,8 +18,31 @@ typedef struct
     wchar_t** argv;
 } jxr_command_line;
 
+typedef struct
+{
+    size_t count;
+    wchar_t** names;
+} jxr_directory_list;
+
+typedef struct jxr_file jxr_file;
+
+typedef struct jxr_output jxr_output;
+
+typedef struct jxr_mapping jxr_mapping;
+
+// Processors the process may actually use: those of its affinity mask, limited by a CPU quota
+// of its cgroup or job object. Spans all processor groups on Windows.
 uint32_t jxr_get_number_of_processors(void);
 
+// Moves the calling thread to the processor group holding the index-th processor, so threads
+// numbered from zero spread over all groups. Does nothing with one group or a process affinity mask.
+int jxr_set_thread_processor_group(uint32_t index);
+
+uint64_t jxr_get_peak_memory_usage(void);
+
+// User and kernel time of all threads of the process, in microseconds
+uint64_t jxr_get_process_cpu_time(void);
+
 char* jxr_get_error_description(int code);
 
 void jxr_free_error_description(char* desc);
@@ -26,7 +51,97 @@ int jxr_get_command_line(int argc, char* argv[], jxr_command_line* cmdline);
 
 void jxr_free_command_line(jxr_command_line* cmdline);
 
-int jxr_write_data_to_file(const wchar_t* filename, void* buffer, size_t size);
+// Writes a whole file at once through jxr_create_output, so it is published atomically
+int jxr_write_data_to_file(const wchar_t* filename, const void* buffer, size_t size);
+
+// Opens a file to be written in parts of any size. A regular file is written under a temporary name
+// next to it, which replaces the file on commit, so readers never see it half written. "-" writes to
+// the standard output, and pipes and devices are written directly. A nonzero size preallocates
+// the file where the file system supports it, which fails early on a full disk.
+int jxr_create_output(const wchar_t* filename, uint64_t size, jxr_output** output);
+
+int jxr_write_output(jxr_output* output, const void* buffer, size_t size);
+
+// Publishes the file and frees the output, the temporary file is deleted if that fails. A file written
+// under a temporary name is flushed to the disk before the rename, so after a crash the target holds
+// either the old or the new bytes, never a file of the new size with blocks that were not written.
+int jxr_commit_output(jxr_output* output);
+
+// Deletes the temporary file and frees the output. Does nothing for null.
+void jxr_abort_output(jxr_output* output);
+
+char* jxr_wide_to_multibyte(const wchar_t* str);
+
+void jxr_free_multibyte(char* str);
+
+// The reverse of jxr_wide_to_multibyte
+wchar_t* jxr_multibyte_to_wide(const char* str);
+
+void jxr_free_wide(wchar_t* str);
+
+// Names of the regular files in a directory, in no particular order
+int jxr_list_directory(const wchar_t* path, jxr_directory_list* list);
+
+void jxr_free_directory_list(jxr_directory_list* list);
+
+// Size is only set for regular files
+int jxr_get_file_info(const wchar_t* path, uint64_t* size, int* is_directory);
+
+int jxr_read_file(const wchar_t* filename, uint8_t** data, size_t* size);
+
+// Reads the standard input to its end, the data is freed by jxr_free_file_data
+int jxr_read_standard_input(uint8_t** data, size_t* size);
+
+void jxr_free_file_data(uint8_t* data);
+
+// Reads a file sequentially in parts, for files too large to hold at once
+int jxr_open_file(const wchar_t* filename, jxr_file** file, uint64_t* size);
+
+// Fills the buffer unless the end of the file comes first
+int jxr_read_file_part(jxr_file* file, void* buffer, size_t size, size_t* bytes_read);
+
+void jxr_close_file(jxr_file* file);
+
+// Maps the first size bytes of memory shared by another process, read only: a POSIX shared memory object
+// of the name, or a named file mapping on Windows. Fails if the memory is smaller than that. Elsewhere than
+// on Windows, nothing keeps the other process from shrinking the memory afterwards, reading the pages
+// it took away raises SIGBUS.
+int jxr_map_shared_memory(const wchar_t* name, uint64_t size, jxr_mapping** mapping, const uint8_t** data);
+
+// The same for a descriptor received from another process, or a file mapping handle on Windows,
+// which stays open. On Linux the memory must be sealed against shrinking, see F_SEAL_SHRINK,
+// so the other process cannot take pages away while they are read.
+int jxr_map_shared_handle(intptr_t handle, uint64_t size, jxr_mapping** mapping, const uint8_t** data);
+
+// Does nothing for null
+void jxr_unmap_shared_memory(jxr_mapping* mapping);
+
+// Does nothing for -1
+void jxr_close_shared_handle(intptr_t handle);
+
+// Succeeds if the directory already exists
+int jxr_create_directory(const wchar_t* path);
+
+// Succeeds if the file does not exist
+int jxr_delete_file(const wchar_t* filename);
+
+// Replaces the target if it exists
+int jxr_rename_file(const wchar_t* from, const wchar_t* to);
+
+// Another name for an existing file on the same volume, replacing any file of that name. The link is made
+// under a temporary name next to it and renamed over the file, so the name is never missing.
+int jxr_create_hard_link(const wchar_t* existing, const wchar_t* link);
+
+// Last modification time in microseconds since 1970
+int jxr_get_file_time(const wchar_t* path, int64_t* modified);
+
+// Sets the modification time to now
+int jxr_touch_file(const wchar_t* path);
+
+int jxr_is_path_separator(wchar_t c);
+
+// The preferred one of the platform
+wchar_t jxr_get_path_separator(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,1033 @@
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// sched_getaffinity, the CPU_* macros and file seals
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <limits.h>
+#include <sched.h>
+#endif
+#include "jxr_sys_helpers.h"
+
+struct jxr_file
+{
+    int fd;
+};
+
+struct jxr_mapping
+{
+    void* address;
+    size_t size;
+};
+
+struct jxr_output
+{
+    int fd;
+    int is_stdout;
+    // Both null when writing straight to the target
+    char* temporary;
+    char* target;
+};
+
+// Tells apart the temporary files of the threads of a process
+static atomic_uint jxr_temporary_counter;
+
+#ifdef __linux__
+// The whole of a small text file as a string, false if it can not be read
+static int jxr_read_text_file(const char* path, char* buffer, size_t size)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    size_t length = 0;
+    while (length + 1 < size)
+    {
+        const ssize_t n = read(fd, buffer + length, size - length - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        length += (size_t)n;
+    }
+    close(fd);
+
+    buffer[length] = '\0';
+    return length > 0;
+}
+
+static uint32_t jxr_get_affinity_processors(void)
+{
+    // The mask grows with the processors, sched_getaffinity fails while it is too small
+    for (int cpus = 1024; cpus <= (1 << 16); cpus *= 2)
+    {
+        cpu_set_t* set = CPU_ALLOC(cpus);
+        if (!set)
+            return 0;
+
+        const size_t size = CPU_ALLOC_SIZE(cpus);
+        CPU_ZERO_S(size, set);
+        if (sched_getaffinity(0, size, set) == 0)
+        {
+            const int count = CPU_COUNT_S(size, set);
+            CPU_FREE(set);
+            return count > 0 ? (uint32_t)count : 0;
+        }
+
+        CPU_FREE(set);
+        if (errno != EINVAL)
+            return 0;
+    }
+    return 0;
+}
+
+// Processors a quota of CPU time per period allows, rounded up. Zero for no quota.
+static uint32_t jxr_quota_to_processors(const long long quota, const long long period)
+{
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return (uint32_t)((quota + period - 1) / period);
+}
+
+// The tightest quota of a cgroup and its parents. A container sees its own group as the root of
+// the hierarchy, while /proc/self/cgroup may name the path on the host, so every level is tried.
+static uint32_t jxr_get_cgroup_limit(const char* root, const char* group, int version2)
+{
+    char dir[PATH_MAX];
+    char path[PATH_MAX + 64];
+    char text[128];
+    uint32_t limit = 0;
+
+    snprintf(dir, sizeof(dir), "%s", group);
+    while (1)
+    {
+        const size_t length = strlen(dir);
+        if (length > 0 && dir[length - 1] == '/')
+            dir[length - 1] = '\0';
+
+        uint32_t level = 0;
+        if (version2)
+        {
+            // "max 100000" or "<quota> <period>"
+            long long quota = 0, period = 0;
+            snprintf(path, sizeof(path), "%s%s/cpu.max", root, dir);
+            if (jxr_read_text_file(path, text, sizeof(text)) && sscanf(text, "%lld %lld", &quota, &period) == 2)
+                level = jxr_quota_to_processors(quota, period);
+        }
+        else
+        {
+            // A quota of -1 means none
+            long long quota = 0, period = 0;
+            snprintf(path, sizeof(path), "%s%s/cpu.cfs_quota_us", root, dir);
+            if (jxr_read_text_file(path, text, sizeof(text)) && sscanf(text, "%lld", &quota) == 1)
+            {
+                snprintf(path, sizeof(path), "%s%s/cpu.cfs_period_us", root, dir);
+                if (jxr_read_text_file(path, text, sizeof(text)) && sscanf(text, "%lld", &period) == 1)
+                    level = jxr_quota_to_processors(quota, period);
+            }
+        }
+
+        if (level > 0 && (limit == 0 || level < limit))
+            limit = level;
+
+        char* slash = strrchr(dir, '/');
+        if (!slash)
+            break;
+        *slash = '\0';
+    }
+
+    return limit;
+}
+
+static int jxr_has_controller(const char* controllers, const char* name)
+{
+    const size_t length = strlen(name);
+    for (const char* p = controllers; p; p = strchr(p, ','))
+    {
+        if (*p == ',')
+            p++;
+        if (strncmp(p, name, length) == 0 && (p[length] == ',' || p[length] == ':' || p[length] == '\0'))
+            return 1;
+    }
+    return 0;
+}
+
+static uint32_t jxr_get_cgroup_processors(void)
+{
+    char text[4096];
+    uint32_t limit = 0;
+
+    if (!jxr_read_text_file("/proc/self/cgroup", text, sizeof(text)))
+        return 0;
+
+    // Lines of "hierarchy:controllers:path", version 2 has a single one with no controllers
+    char* save = NULL;
+    for (char* line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+    {
+        char* controllers = strchr(line, ':');
+        char* group = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!group)
+            continue;
+        controllers++;
+        group++;
+
+        uint32_t level = 0;
+        if (controllers == group - 1)
+        {
+            level = jxr_get_cgroup_limit("/sys/fs/cgroup", group, 1);
+        }
+        else if (jxr_has_controller(controllers, "cpu"))
+        {
+            level = jxr_get_cgroup_limit("/sys/fs/cgroup/cpu,cpuacct", group, 0);
+            if (!level)
+                level = jxr_get_cgroup_limit("/sys/fs/cgroup/cpu", group, 0);
+        }
+
+        if (level > 0 && (limit == 0 || level < limit))
+            limit = level;
+    }
+
+    return limit;
+}
+#endif
+
+uint32_t jxr_get_number_of_processors(void)
+{
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t count = online > 0 ? (uint32_t)online : 1;
+
+#ifdef __linux__
+    const uint32_t affinity = jxr_get_affinity_processors();
+    if (affinity > 0 && affinity < count)
+        count = affinity;
+
+    const uint32_t quota = jxr_get_cgroup_processors();
+    if (quota > 0 && quota < count)
+        count = quota;
+#endif
+
+    return count;
+}
+
+int jxr_set_thread_processor_group(uint32_t index)
+{
+    // Threads may run on any processor of the affinity mask already
+    (void)index;
+    return 0;
+}
+
+uint64_t jxr_get_peak_memory_usage(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return 0;
+#ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+#else
+    // Linux and BSDs report kilobytes
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+uint64_t jxr_get_process_cpu_time(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return 0;
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+        (uint64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+char* jxr_get_error_description(int code)
+{
+    static const char defaultMessage[] = "Unidentified error.";
+    const char* msg = code < 0 ? strerror(-code) : NULL;
+    return strdup(msg ? msg : defaultMessage);
+}
+
+void jxr_free_error_description(char* desc)
+{
+    free(desc);
+}
+
+int jxr_get_command_line(int argc, char* argv[], jxr_command_line* cmdline)
+{
+    if (!cmdline || argc < 0 || (argc && !argv))
+        return -EINVAL;
+
+    memset(cmdline, 0, sizeof(jxr_command_line));
+
+    // Arguments are decoded according to the user's locale
+    setlocale(LC_ALL, "");
+
+    // Pointer table and strings share a single allocation,
+    // just like CommandLineToArgvW does it.
+    size_t totalChars = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        const size_t len = mbstowcs(NULL, argv[i], 0);
+        if (len == (size_t)-1)
+            return -EILSEQ;
+        totalChars += len + 1;
+    }
+
+    wchar_t** args = malloc(sizeof(wchar_t*) * ((size_t)argc + 1) + sizeof(wchar_t) * totalChars);
+    if (!args)
+        return -ENOMEM;
+
+    wchar_t* strings = (wchar_t*)(args + argc + 1);
+    for (int i = 0; i < argc; i++)
+    {
+        const size_t len = mbstowcs(strings, argv[i], totalChars);
+        args[i] = strings;
+        strings += len + 1;
+        totalChars -= len + 1;
+    }
+    args[argc] = NULL;
+
+    cmdline->argc = argc;
+    cmdline->argv = args;
+
+    return 0;
+}
+
+void jxr_free_command_line(jxr_command_line* cmdline)
+{
+    if (cmdline && cmdline->argv)
+    {
+        free(cmdline->argv);
+        memset(cmdline, 0, sizeof(jxr_command_line));
+    }
+}
+
+int jxr_write_data_to_file(const wchar_t* filename, const void* buffer, size_t size)
+{
+    jxr_output* output = NULL;
+    int rv = jxr_create_output(filename, size, &output);
+    if (rv < 0)
+        return rv;
+
+    rv = jxr_write_output(output, buffer, size);
+    if (rv < 0)
+    {
+        jxr_abort_output(output);
+        return rv;
+    }
+
+    return jxr_commit_output(output);
+}
+
+int jxr_create_output(const wchar_t* filename, uint64_t size, jxr_output** output)
+{
+    struct stat status;
+
+    if (!filename || !output)
+        return -EINVAL;
+
+    *output = NULL;
+
+    jxr_output* o = calloc(1, sizeof(jxr_output));
+    if (!o)
+        return -ENOMEM;
+
+    if (!wcscmp(filename, L"-"))
+    {
+        o->fd = STDOUT_FILENO;
+        o->is_stdout = 1;
+        *output = o;
+        return 0;
+    }
+
+    char* nativeFilename = jxr_wide_to_multibyte(filename);
+    if (!nativeFilename)
+    {
+        free(o);
+        return -EILSEQ;
+    }
+
+    // Pipes and devices have no directory entry to replace
+    if (stat(nativeFilename, &status) == 0 && !S_ISREG(status.st_mode))
+    {
+        o->fd = open(nativeFilename, O_WRONLY | O_CLOEXEC);
+        jxr_free_multibyte(nativeFilename);
+        if (o->fd < 0)
+        {
+            const int err = errno;
+            free(o);
+            return -err;
+        }
+
+        *output = o;
+        return 0;
+    }
+
+    const size_t length = strlen(nativeFilename) + 32;
+    o->temporary = malloc(length);
+    if (!o->temporary)
+    {
+        jxr_free_multibyte(nativeFilename);
+        free(o);
+        return -ENOMEM;
+    }
+
+    o->fd = -1;
+    for (int attempt = 0; attempt < 16 && o->fd < 0; attempt++)
+    {
+        snprintf(o->temporary, length, "%s.%ld.%u.tmp", nativeFilename, (long)getpid(), atomic_fetch_add(&jxr_temporary_counter, 1));
+        o->fd = open(o->temporary, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (o->fd < 0 && errno != EEXIST)
+            break;
+    }
+
+    if (o->fd < 0)
+    {
+        const int err = errno;
+        jxr_free_multibyte(nativeFilename);
+        free(o->temporary);
+        free(o);
+        return -err;
+    }
+
+    o->target = nativeFilename;
+
+#ifdef __linux__
+    // Unlike posix_fallocate, fails instead of writing zeros where the file system can not allocate
+    if (size > 0 && fallocate(o->fd, 0, 0, (off_t)size) < 0 && (errno == ENOSPC || errno == EFBIG || errno == EDQUOT))
+    {
+        const int err = errno;
+        jxr_abort_output(o);
+        return -err;
+    }
+#else
+    (void)size;
+#endif
+
+    *output = o;
+    return 0;
+}
+
+int jxr_write_output(jxr_output* output, const void* buffer, size_t size)
+{
+    if (!output || (!buffer && size))
+        return -EINVAL;
+
+    const uint8_t* p = buffer;
+    while (size > 0)
+    {
+        const ssize_t written = write(output->fd, p, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        p += written;
+        size -= (size_t)written;
+    }
+
+    return 0;
+}
+
+// Makes a rename in the directory of a file durable. The file is already in place, so this
+// is best effort: some file systems can not sync directories and there is no way back anyway.
+static void jxr_sync_parent_directory(const char* path)
+{
+    const char* separator = strrchr(path, '/');
+    char* directory = NULL;
+    if (!separator)
+        directory = strdup(".");
+    else if (separator == path)
+        directory = strdup("/");
+    else
+        directory = strndup(path, (size_t)(separator - path));
+    if (!directory)
+        return;
+
+    const int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(directory);
+    if (fd < 0)
+        return;
+    fsync(fd);
+    close(fd);
+}
+
+int jxr_commit_output(jxr_output* output)
+{
+    if (!output)
+        return -EINVAL;
+
+    int rv = 0;
+    if (output->temporary && fsync(output->fd) < 0)
+        rv = -errno;
+    if (!output->is_stdout && close(output->fd) < 0 && !rv)
+        rv = -errno;
+    output->fd = -1;
+
+    if (output->temporary)
+    {
+        if (!rv && rename(output->temporary, output->target) < 0)
+            rv = -errno;
+        if (rv < 0)
+            unlink(output->temporary);
+        else
+            jxr_sync_parent_directory(output->target);
+    }
+
+    free(output->temporary);
+    jxr_free_multibyte(output->target);
+    free(output);
+    return rv;
+}
+
+void jxr_abort_output(jxr_output* output)
+{
+    if (!output)
+        return;
+
+    if (!output->is_stdout && output->fd >= 0)
+        close(output->fd);
+    if (output->temporary)
+        unlink(output->temporary);
+
+    free(output->temporary);
+    jxr_free_multibyte(output->target);
+    free(output);
+}
+
+char* jxr_wide_to_multibyte(const wchar_t* str)
+{
+    if (!str)
+        return NULL;
+    const size_t len = wcstombs(NULL, str, 0);
+    if (len == (size_t)-1)
+        return NULL;
+    char* rv = malloc(len + 1);
+    if (rv)
+        wcstombs(rv, str, len + 1);
+    return rv;
+}
+
+void jxr_free_multibyte(char* str)
+{
+    free(str);
+}
+
+wchar_t* jxr_multibyte_to_wide(const char* str)
+{
+    if (!str)
+        return NULL;
+    const size_t len = mbstowcs(NULL, str, 0);
+    if (len == (size_t)-1)
+        return NULL;
+    wchar_t* rv = malloc(sizeof(wchar_t) * (len + 1));
+    if (rv)
+        mbstowcs(rv, str, len + 1);
+    return rv;
+}
+
+void jxr_free_wide(wchar_t* str)
+{
+    free(str);
+}
+
+int jxr_list_directory(const wchar_t* path, jxr_directory_list* list)
+{
+    struct dirent* entry;
+    struct stat status;
+    size_t capacity = 0;
+    int rv = 0;
+
+    if (!path || !list)
+        return -EINVAL;
+
+    memset(list, 0, sizeof(jxr_directory_list));
+
+    char* nativePath = jxr_wide_to_multibyte(path);
+    if (!nativePath)
+        return -EILSEQ;
+
+    DIR* dir = opendir(nativePath);
+    if (!dir)
+    {
+        rv = -errno;
+        jxr_free_multibyte(nativePath);
+        return rv;
+    }
+
+    const int dirFd = dirfd(dir);
+    errno = 0;
+    while ((entry = readdir(dir)))
+    {
+        // Symbolic links are followed, so they count as the files they point to
+        if (fstatat(dirFd, entry->d_name, &status, 0) < 0 || !S_ISREG(status.st_mode))
+        {
+            errno = 0;
+            continue;
+        }
+
+        if (list->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            wchar_t** names = realloc(list->names, sizeof(wchar_t*) * capacity);
+            if (!names)
+            {
+                rv = -ENOMEM;
+                break;
+            }
+            list->names = names;
+        }
+
+        // Names that are not valid in the current locale can not be passed on
+        wchar_t* name = jxr_multibyte_to_wide(entry->d_name);
+        if (name)
+            list->names[list->count++] = name;
+
+        errno = 0;
+    }
+
+    if (!rv && errno)
+        rv = -errno;
+
+    closedir(dir);
+    jxr_free_multibyte(nativePath);
+
+    if (rv < 0)
+        jxr_free_directory_list(list);
+
+    return rv;
+}
+
+void jxr_free_directory_list(jxr_directory_list* list)
+{
+    if (list && list->names)
+    {
+        for (size_t i = 0; i < list->count; i++)
+            free(list->names[i]);
+        free(list->names);
+        memset(list, 0, sizeof(jxr_directory_list));
+    }
+}
+
+int jxr_get_file_info(const wchar_t* path, uint64_t* size, int* is_directory)
+{
+    struct stat status;
+
+    if (!path || !size || !is_directory)
+        return -EINVAL;
+
+    char* nativePath = jxr_wide_to_multibyte(path);
+    if (!nativePath)
+        return -EILSEQ;
+
+    const int rv = stat(nativePath, &status) < 0 ? -errno : 0;
+    jxr_free_multibyte(nativePath);
+    if (rv < 0)
+        return rv;
+
+    *is_directory = S_ISDIR(status.st_mode);
+    *size = S_ISREG(status.st_mode) ? (uint64_t)status.st_size : 0;
+    return 0;
+}
+
+int jxr_read_file(const wchar_t* filename, uint8_t** data, size_t* size)
+{
+    struct stat status;
+    int rv = 0;
+
+    if (!filename || !data || !size)
+        return -EINVAL;
+
+    *data = NULL;
+    *size = 0;
+
+    char* nativeFilename = jxr_wide_to_multibyte(filename);
+    if (!nativeFilename)
+        return -EILSEQ;
+
+    const int fd = open(nativeFilename, O_RDONLY);
+    jxr_free_multibyte(nativeFilename);
+    if (fd < 0)
+        return -errno;
+
+    if (fstat(fd, &status) < 0)
+    {
+        rv = -errno;
+    }
+    else if ((uint64_t)status.st_size > SIZE_MAX)
+    {
+        rv = -EOVERFLOW;
+    }
+    else
+    {
+        // One spare byte keeps empty files from being a zero sized allocation
+        *data = malloc((size_t)status.st_size + 1);
+        if (!*data)
+            rv = -ENOMEM;
+    }
+
+    while (!rv && *size < (size_t)status.st_size)
+    {
+        const ssize_t n = read(fd, *data + *size, (size_t)status.st_size - *size);
+        if (n < 0)
+        {
+            if (errno != EINTR)
+                rv = -errno;
+            continue;
+        }
+        if (!n)
+            break;
+        *size += (size_t)n;
+    }
+
+    close(fd);
+
+    if (rv < 0)
+    {
+        free(*data);
+        *data = NULL;
+        *size = 0;
+    }
+
+    return rv;
+}
+
+int jxr_read_standard_input(uint8_t** data, size_t* size)
+{
+    struct stat status;
+    int rv = 0;
+
+    if (!data || !size)
+        return -EINVAL;
+
+    *data = NULL;
+    *size = 0;
+
+    // A redirected file is read in one go, pipes grow the buffer as they go
+    size_t capacity = (size_t)1 << 20;
+    if (fstat(STDIN_FILENO, &status) == 0 && S_ISREG(status.st_mode) && (uint64_t)status.st_size < SIZE_MAX)
+        capacity = (size_t)status.st_size + 1;
+
+    *data = malloc(capacity);
+    if (!*data)
+        return -ENOMEM;
+
+    while (!rv)
+    {
+        if (*size == capacity)
+        {
+            uint8_t* grown = capacity <= SIZE_MAX / 2 ? realloc(*data, capacity * 2) : NULL;
+            if (!grown)
+            {
+                rv = -ENOMEM;
+                break;
+            }
+            *data = grown;
+            capacity *= 2;
+        }
+
+        const ssize_t n = read(STDIN_FILENO, *data + *size, capacity - *size);
+        if (n < 0)
+        {
+            if (errno != EINTR)
+                rv = -errno;
+            continue;
+        }
+        if (!n)
+            break;
+        *size += (size_t)n;
+    }
+
+    if (rv < 0)
+    {
+        free(*data);
+        *data = NULL;
+        *size = 0;
+    }
+
+    return rv;
+}
+
+void jxr_free_file_data(uint8_t* data)
+{
+    free(data);
+}
+
+int jxr_open_file(const wchar_t* filename, jxr_file** file, uint64_t* size)
+{
+    struct stat status;
+
+    if (!filename || !file || !size)
+        return -EINVAL;
+
+    *file = NULL;
+    *size = 0;
+
+    char* nativeFilename = jxr_wide_to_multibyte(filename);
+    if (!nativeFilename)
+        return -EILSEQ;
+
+    const int fd = open(nativeFilename, O_RDONLY);
+    jxr_free_multibyte(nativeFilename);
+    if (fd < 0)
+        return -errno;
+
+    if (fstat(fd, &status) < 0)
+    {
+        const int err = errno;
+        close(fd);
+        return -err;
+    }
+
+    jxr_file* f = malloc(sizeof(jxr_file));
+    if (!f)
+    {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    f->fd = fd;
+    *file = f;
+    *size = (uint64_t)status.st_size;
+    return 0;
+}
+
+int jxr_read_file_part(jxr_file* file, void* buffer, size_t size, size_t* bytes_read)
+{
+    if (!file || !buffer || !bytes_read)
+        return -EINVAL;
+
+    uint8_t* p = buffer;
+    *bytes_read = 0;
+    while (*bytes_read < size)
+    {
+        const ssize_t n = read(file->fd, p + *bytes_read, size - *bytes_read);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (!n)
+            break;
+        *bytes_read += (size_t)n;
+    }
+
+    return 0;
+}
+
+void jxr_close_file(jxr_file* file)
+{
+    if (file)
+    {
+        close(file->fd);
+        free(file);
+    }
+}
+
+static int jxr_map_descriptor(int fd, uint64_t size, jxr_mapping** mapping, const uint8_t** data)
+{
+    struct stat status;
+
+    if (fstat(fd, &status) < 0)
+        return -errno;
+
+    // Pages past the end of the object would raise SIGBUS when read
+    if (!size || size > SIZE_MAX || (uint64_t)status.st_size < size)
+        return -EINVAL;
+
+    jxr_mapping* m = malloc(sizeof(jxr_mapping));
+    if (!m)
+        return -ENOMEM;
+
+    m->address = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m->address == MAP_FAILED)
+    {
+        const int err = errno;
+        free(m);
+        return -err;
+    }
+
+    m->size = (size_t)size;
+    *mapping = m;
+    *data = m->address;
+    return 0;
+}
+
+int jxr_map_shared_memory(const wchar_t* name, uint64_t size, jxr_mapping** mapping, const uint8_t** data)
+{
+    if (!name || !mapping || !data)
+        return -EINVAL;
+
+    *mapping = NULL;
+    *data = NULL;
+
+    char* nativeName = jxr_wide_to_multibyte(name);
+    if (!nativeName)
+        return -EILSEQ;
+
+    const int fd = shm_open(nativeName, O_RDONLY, 0);
+    jxr_free_multibyte(nativeName);
+    if (fd < 0)
+        return -errno;
+
+    // The mapping outlives the descriptor
+    const int rv = jxr_map_descriptor(fd, size, mapping, data);
+    close(fd);
+    return rv;
+}
+
+int jxr_map_shared_handle(intptr_t handle, uint64_t size, jxr_mapping** mapping, const uint8_t** data)
+{
+    if (handle < 0 || !mapping || !data)
+        return -EINVAL;
+
+    *mapping = NULL;
+    *data = NULL;
+
+#ifdef F_GET_SEALS
+    // Descriptors that cannot be sealed, like those of regular files, fail with EINVAL
+    const int seals = fcntl((int)handle, F_GET_SEALS);
+    if (seals < 0 && errno != EINVAL)
+        return -errno;
+    if (seals < 0 || !(seals & F_SEAL_SHRINK))
+        return -EPERM;
+#endif
+
+    return jxr_map_descriptor((int)handle, size, mapping, data);
+}
+
+void jxr_unmap_shared_memory(jxr_mapping* mapping)
+{
+    if (mapping)
+    {
+        munmap(mapping->address, mapping->size);
+        free(mapping);
+    }
+}
+
+void jxr_close_shared_handle(intptr_t handle)
+{
+    if (handle >= 0)
+        close((int)handle);
+}
+
+int jxr_create_directory(const wchar_t* path)
+{
+    char* nativePath = jxr_wide_to_multibyte(path);
+    if (!nativePath)
+        return -EILSEQ;
+
+    const int rv = mkdir(nativePath, 0777) < 0 && errno != EEXIST ? -errno : 0;
+    jxr_free_multibyte(nativePath);
+    return rv;
+}
+
+int jxr_delete_file(const wchar_t* filename)
+{
+    char* nativeFilename = jxr_wide_to_multibyte(filename);
+    if (!nativeFilename)
+        return -EILSEQ;
+
+    const int rv = unlink(nativeFilename) < 0 && errno != ENOENT ? -errno : 0;
+    jxr_free_multibyte(nativeFilename);
+    return rv;
+}
+
+int jxr_rename_file(const wchar_t* from, const wchar_t* to)
+{
+    char* nativeFrom = jxr_wide_to_multibyte(from);
+    char* nativeTo = jxr_wide_to_multibyte(to);
+    int rv = -EILSEQ;
+    if (nativeFrom && nativeTo)
+        rv = rename(nativeFrom, nativeTo) < 0 ? -errno : 0;
+
+    jxr_free_multibyte(nativeFrom);
+    jxr_free_multibyte(nativeTo);
+    return rv;
+}
+
+int jxr_create_hard_link(const wchar_t* existing, const wchar_t* link_name)
+{
+    char* nativeExisting = jxr_wide_to_multibyte(existing);
+    char* nativeLink = jxr_wide_to_multibyte(link_name);
+    const size_t length = nativeLink ? strlen(nativeLink) + 32 : 0;
+    char* temporary = nativeLink ? malloc(length) : NULL;
+    int rv = nativeExisting && nativeLink ? -ENOMEM : -EILSEQ;
+    if (temporary)
+    {
+        rv = -EEXIST;
+        for (int attempt = 0; attempt < 16 && rv == -EEXIST; attempt++)
+        {
+            snprintf(temporary, length, "%s.%ld.%u.tmp", nativeLink, (long)getpid(), atomic_fetch_add(&jxr_temporary_counter, 1));
+            rv = link(nativeExisting, temporary) < 0 ? -errno : 0;
+        }
+
+        if (!rv)
+        {
+            rv = rename(temporary, nativeLink) < 0 ? -errno : 0;
+            // Renaming a link over another link to the same file does nothing and leaves both names
+            unlink(temporary);
+        }
+    }
+
+    free(temporary);
+    jxr_free_multibyte(nativeExisting);
+    jxr_free_multibyte(nativeLink);
+    return rv;
+}
+
+int jxr_get_file_time(const wchar_t* path, int64_t* modified)
+{
+    struct stat status;
+
+    if (!path || !modified)
+        return -EINVAL;
+
+    char* nativePath = jxr_wide_to_multibyte(path);
+    if (!nativePath)
+        return -EILSEQ;
+
+    const int rv = stat(nativePath, &status) < 0 ? -errno : 0;
+    jxr_free_multibyte(nativePath);
+    if (rv < 0)
+        return rv;
+
+    *modified = (int64_t)status.st_mtim.tv_sec * 1000000 + status.st_mtim.tv_nsec / 1000;
+    return 0;
+}
+
+int jxr_touch_file(const wchar_t* path)
+{
+    char* nativePath = jxr_wide_to_multibyte(path);
+    if (!nativePath)
+        return -EILSEQ;
+
+    const int rv = utimensat(AT_FDCWD, nativePath, NULL, 0) < 0 ? -errno : 0;
+    jxr_free_multibyte(nativePath);
+    return rv;
+}
+
+int jxr_is_path_separator(wchar_t c)
+{
+    return c == L'/';
+}
+
+wchar_t jxr_get_path_separator(void)
+{
+    return L'/';
+}
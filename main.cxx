@@ -1,175 +1,293 @@
-// adapted from avif-example-encode.c, see libavif license in LICENSE-THIRD-PARTY
-// original copyright notice follows
+// Copyright 2024 Dmitry Ignatiev. All rights reserved
 
-// Copyright 2020 Joe Drago, 2024 Dmitry Ignatiev. All rights reserved
-
-#include <cmath>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
 
-#include <avif/avif.h>
-
+#include "BatchConverter.hpp"
 #include "CommandLineParser.hpp"
-#include "JxrImage.hpp"
+#include "Converter.hpp"
+#include "EncodeTimeModel.hpp"
+#include "JsonWriter.hpp"
+#include "OutputCache.hpp"
+#include "Server.hpp"
+#include "SharedPixels.hpp"
+#include "StatisticsReport.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
 #include "jxr_sys_helpers.h"
 
-constexpr auto INTERMEDIATE_BITS = 16;  // bit depth of the integer texture given to the encoder;
-
 using namespace JxrToAvif;
 
+namespace
+{
+    int WriteTrace(const std::wstring& traceFile)
+    {
+        Trace::Stop();
+
+        std::ostringstream trace;
+        Trace::Write(trace);
+        const auto json = trace.str();
+
+        const auto rv = jxr_write_data_to_file(traceFile.c_str(), json.data(), json.size());
+        if (rv < 0)
+        {
+            auto writeErrorDesc = jxr_get_error_description(rv);
+            std::cerr << "Failed to write trace: " << writeErrorDesc << "\n";
+            jxr_free_error_description(writeErrorDesc);
+        }
+        return rv;
+    }
+
+    // "-" writes to the standard output
+    int WriteStatistics(const std::wstring& statsFile, const std::string& statistics)
+    {
+        if (statsFile == L"-")
+        {
+            std::cout << statistics << std::flush;
+            return 0;
+        }
+
+        const auto rv = jxr_write_data_to_file(statsFile.c_str(), statistics.data(), statistics.size());
+        if (rv < 0)
+        {
+            auto writeErrorDesc = jxr_get_error_description(rv);
+            std::cerr << "Failed to write statistics: " << writeErrorDesc << "\n";
+            jxr_free_error_description(writeErrorDesc);
+        }
+        return rv;
+    }
+
+    // "-" reads the standard input, and shared memory replaces the input file
+    ConversionResult ConvertInput(const Converter& converter, const CommandLineParser& cmdLineParser)
+    {
+        if (!cmdLineParser.GetSharedMemoryName().empty())
+        {
+            const SharedPixels pixels(cmdLineParser.GetSharedMemoryName(), cmdLineParser.GetRawLayout());
+            return converter.ConvertPixels(pixels.GetPixels());
+        }
+
+        const auto& inputFile = cmdLineParser.GetInputFile();
+        if (inputFile != L"-")
+            return converter.ConvertFile(inputFile);
+
+        uint8_t* data = nullptr;
+        size_t size = 0;
+        const auto rv = jxr_read_standard_input(&data, &size);
+        if (rv < 0)
+        {
+            auto readErrorDesc = jxr_get_error_description(rv);
+            const std::string message = std::string("Failed to read the standard input: ") + (readErrorDesc ? readErrorDesc : "");
+            jxr_free_error_description(readErrorDesc);
+            throw std::runtime_error(message);
+        }
+
+        // The decoder reads the image straight from the buffer
+        const std::unique_ptr<uint8_t, decltype(&jxr_free_file_data)> input(data, jxr_free_file_data);
+        return converter.ConvertMemory(input.get(), size);
+    }
+}
+
 int main(int argc, char *argv[])
 {
     try
     {
         CommandLineParser cmdLineParser(argc, argv);
 
-        if (!cmdLineParser.Parse() || cmdLineParser.GetIsHelpRequired())
+        // Descriptors only come with server jobs
+        if (!cmdLineParser.Parse() || cmdLineParser.GetIsHelpRequired() || cmdLineParser.GetIsSharedMemoryHandle())
         {
             CommandLineParser::PrintUsage();
             return 1;
         }
 
-        const auto speed = cmdLineParser.GetSpeed();
-        const auto inputFile = cmdLineParser.GetInputFile();
-        const auto outputFile = cmdLineParser.GetOutputFile().c_str();
-        const auto useTiling = cmdLineParser.GetIsTilingUsed();
-        const auto depth = cmdLineParser.GetDepth();
-        const auto outputFormat = cmdLineParser.GetPixelFormat();
-        const auto realMaxCLL = cmdLineParser.GetIsRealMaxCLL();
-
-        const JxrImage jxrImage(inputFile, realMaxCLL);        
+        ThreadPool::SetInstanceWorkerCount(cmdLineParser.GetThreads());
 
-        int returnCode = 1;
-        avifEncoder* encoder = nullptr;
-        avifRWData avifOutput = AVIF_DATA_EMPTY;
-        avifRGBImage rgb = {};
-        avifPixelFormat targetFormat = AVIF_PIXEL_FORMAT_YUV444;
-        switch (outputFormat)
-        {
-        case PixelFormat::Yuv400:
-            targetFormat = AVIF_PIXEL_FORMAT_YUV400;
-            break;
-        case PixelFormat::Yuv420:
-            targetFormat = AVIF_PIXEL_FORMAT_YUV420;
-            break;
-        case PixelFormat::Yuv422:
-            targetFormat = AVIF_PIXEL_FORMAT_YUV422;
-            break;
-        case PixelFormat::Yuv444:
-        case PixelFormat::Rgb:
-            targetFormat = AVIF_PIXEL_FORMAT_YUV444;
-            break;
-        }
-
-        const auto image = avifImageCreate(jxrImage.GetWidth(), jxrImage.GetHeight(), depth, targetFormat); // these values dictate what goes into the final AVIF
-        if (!image)
-        {
-            throw std::bad_alloc();
-        }
-        // Configure image here: (see avif/avif.h)
-        // * colorPrimaries
-        // * transferCharacteristics
-        // * matrixCoefficients
-        // * avifImageSetProfileICC()
-        // * avifImageSetMetadataExif()
-        // * avifImageSetMetadataXMP()
-        // * yuvRange
-        // * alphaPremultiplied
-        // * transforms (transformFlags, pasp, clap, irot, imir)
-        image->colorPrimaries = AVIF_COLOR_PRIMARIES_BT2020;
-        image->transferCharacteristics = AVIF_TRANSFER_CHARACTERISTICS_SMPTE2084;
-
-        if (outputFormat == PixelFormat::Rgb)
-        {
-            image->matrixCoefficients = AVIF_MATRIX_COEFFICIENTS_IDENTITY;
+        if (!cmdLineParser.GetServeSocket().empty())
+        {
+            Server server(cmdLineParser.GetServeSocket(), cmdLineParser.GetMaxJobs());
+            server.Run();
+            return 0;
         }
-        else
+
+        if (!cmdLineParser.GetCalibrateFile().empty())
         {
-            image->matrixCoefficients = AVIF_MATRIX_COEFFICIENTS_BT2020_NCL;
+            const auto model = EncodeTimeModel::Calibrate(&std::cout);
+            model.Save(cmdLineParser.GetCalibrateFile());
+            std::cout << "Calibration done\n";
+            return 0;
         }
 
-        image->clli.maxCLL = jxrImage.GetMaxCLL();
-        image->clli.maxPALL = jxrImage.GetMaxPALL();
+        auto options = cmdLineParser.GetConversionOptions();
 
-        // If you have RGB(A) data you want to encode, use this path
-        std::cout << "Doing AVIF encoding...\n" << std::flush;
+        // Lives until the last conversion
+        std::unique_ptr<EncodeTimeModel> timeModel;
+        if (options.timeBudget > 0)
+        {
+            timeModel = std::make_unique<EncodeTimeModel>(EncodeTimeModel::Load(cmdLineParser.GetModelFile()));
+            options.timeModel = timeModel.get();
+        }
 
-        avifRGBImageSetDefaults(&rgb, image);
-        // Override RGB(A)->YUV(A) defaults here:
-        //   depth, format, chromaDownsampling, avoidLibYUV, ignoreAlpha, alphaPremultiplied, etc.
-        rgb.format = AVIF_RGB_FORMAT_RGB;
-        rgb.depth = INTERMEDIATE_BITS;
-        rgb.pixels = reinterpret_cast<uint8_t*>(jxrImage.GetDataPointer());
-        rgb.rowBytes = sizeof(ushort3) * jxrImage.GetWidth();
+        std::unique_ptr<OutputCache> cache;
+        if (!cmdLineParser.GetCacheDirectory().empty())
+        {
+            cache = std::make_unique<OutputCache>(cmdLineParser.GetCacheDirectory(), cmdLineParser.GetCacheSize(), cmdLineParser.GetIsCacheLinked());
+        }
 
-        auto convertResult = avifImageRGBToYUV(image, &rgb);
-        if (convertResult != AVIF_RESULT_OK)
+        // Statistics on the standard output replace the progress messages
+        const auto& statsFile = cmdLineParser.GetStatsFile();
+        const auto statsToStdout = statsFile == L"-";
+
+        const auto& traceFile = cmdLineParser.GetTraceFile();
+        if (!traceFile.empty())
         {
-            std::cerr << "Failed to convert to YUV(A): " << avifResultToString(convertResult) << "\n";
+            Trace::SetThreadName("main");
+            Trace::Start();
         }
-        else
+
+        if (cmdLineParser.GetIsBatch())
         {
-            encoder = avifEncoderCreate();
-            if (!encoder)
+            std::ostringstream statistics;
+
+            // One line per file instead of the progress of every conversion
+            BatchConverter batch(options, cmdLineParser.GetOutputDirectory(), statsToStdout ? std::cerr : std::cout,
+                statsFile.empty() ? nullptr : statsToStdout ? &std::cout : &statistics, cache.get());
+            for (const auto& input : cmdLineParser.GetInputFiles())
             {
-                throw std::bad_alloc();
+                batch.AddInput(input);
             }
-            // Configure your encoder here (see avif/avif.h):
-            // * maxThreads
-            // * quality
-            // * qualityAlpha
-            // * tileRowsLog2
-            // * tileColsLog2
-            // * speed
-            // * keyframeInterval
-            // * timescale
-            encoder->quality = AVIF_QUALITY_LOSSLESS;
-            encoder->qualityAlpha = AVIF_QUALITY_LOSSLESS;
-            encoder->speed = speed;
-            encoder->maxThreads = static_cast<int>(jxr_get_number_of_processors());
-            encoder->autoTiling = useTiling ? AVIF_TRUE : AVIF_FALSE;
-
-            // Call avifEncoderAddImage() for each image in your sequence
-            // Only set AVIF_ADD_IMAGE_FLAG_SINGLE if you're not encoding a sequence
-            // Use avifEncoderAddImageGrid() instead with an array of avifImage* to make a grid image
-            auto addImageResult = avifEncoderAddImage(encoder, image, 1, AVIF_ADD_IMAGE_FLAG_SINGLE);
-            if (addImageResult != AVIF_RESULT_OK)
+            if (!cmdLineParser.GetListFile().empty())
             {
-                std::cerr << "Failed to add image to encoder: " << avifResultToString(addImageResult) << "\n";
+                batch.AddListFile(cmdLineParser.GetListFile());
             }
-            else
+
+            const auto failedCount = batch.Run();
+            if (!traceFile.empty() && WriteTrace(traceFile) < 0)
             {
-                auto finishResult = avifEncoderFinish(encoder, &avifOutput);
-                if (finishResult != AVIF_RESULT_OK)
+                return 1;
+            }
+            if (!statsFile.empty() && !statsToStdout && WriteStatistics(statsFile, statistics.str()) < 0)
+            {
+                return 1;
+            }
+
+            (statsToStdout ? std::cerr : std::cout) << "Peak memory usage: " << (jxr_get_peak_memory_usage() >> 20) << " MiB\n";
+            return failedCount > 0 ? 1 : 0;
+        }
+
+        // The file itself may take the standard output, the messages go to the standard error then
+        const auto outputFile = cmdLineParser.GetOutputFile().c_str();
+        auto& console = cmdLineParser.GetOutputFile() == L"-" ? std::cerr : std::cout;
+        options.log = statsToStdout ? nullptr : &console;
+
+        CacheLookup cacheLookup;
+        if (cache)
+        {
+            const auto thumbnailFile = options.thumbnailSize > 0 ? BatchConverter::GetThumbnailPath(outputFile) : std::wstring();
+            cacheLookup = cache->Fetch(cmdLineParser.GetInputFile(), options, outputFile, thumbnailFile);
+            if (cacheLookup.hit)
+            {
+                int returnCode = 0;
+                if (!statsToStdout)
                 {
-                    std::cerr << "Failed to finish encoding: " << avifResultToString(finishResult) << "\n";
+                    auto nativeOutputFile = jxr_wide_to_multibyte(outputFile);
+                    console << "Wrote from the cache: " << (nativeOutputFile ? nativeOutputFile : "output file") << "\n";
+                    jxr_free_multibyte(nativeOutputFile);
                 }
-                else
+
+                if (!traceFile.empty() && WriteTrace(traceFile) < 0)
                 {
-                    std::cout << "Encode success: " << avifOutput.size << " total bytes\n";
+                    returnCode = 1;
+                }
 
-                    auto rv = jxr_write_data_to_file(outputFile, avifOutput.data, avifOutput.size);
-                    if (rv < 0)
-                    {
-                        auto writeErrorDesc = jxr_get_error_description(rv);
-                        std::cerr << "Failed to write " << avifOutput.size << " bytes: " << writeErrorDesc << "\n";
-                        jxr_free_error_description(writeErrorDesc);
-                        returnCode = rv;
-                    }
-                    else
+                if (!statsFile.empty())
+                {
+                    std::ostringstream statistics;
+                    JsonWriter json(statistics);
+                    WriteCacheHitReport(json, cmdLineParser.GetInputFile(), outputFile, cache->GetStatistics(cacheLookup));
+                    statistics << "\n";
+                    if (WriteStatistics(statsFile, statistics.str()) < 0)
                     {
-                        std::wcout << L"Wrote: " << outputFile << L"\n";
-                        returnCode = 0;
+                        returnCode = 1;
                     }
                 }
+                return returnCode;
+            }
+        }
+
+        int returnCode = 1;
+        const Converter converter(options);
+        auto result = ConvertInput(converter, cmdLineParser);
+
+        Stopwatch stopwatch;
+        int rv;
+        {
+            const TraceScope trace("write");
+            rv = jxr_write_data_to_file(outputFile, result.avif.GetData(), result.avif.GetSize());
+        }
+        int thumbnailResult = 0;
+        if (rv >= 0 && result.thumbnail.GetSize() > 0)
+        {
+            const auto thumbnailFile = BatchConverter::GetThumbnailPath(outputFile);
+            thumbnailResult = jxr_write_data_to_file(thumbnailFile.c_str(), result.thumbnail.GetData(), result.thumbnail.GetSize());
+        }
+        result.phases.push_back(stopwatch.Lap("write"));
+        if (rv < 0)
+        {
+            auto writeErrorDesc = jxr_get_error_description(rv);
+            std::cerr << "Failed to write " << result.avif.GetSize() << " bytes: " << writeErrorDesc << "\n";
+            jxr_free_error_description(writeErrorDesc);
+            returnCode = rv;
+        }
+        else if (thumbnailResult < 0)
+        {
+            auto writeErrorDesc = jxr_get_error_description(thumbnailResult);
+            std::cerr << "Failed to write thumbnail: " << writeErrorDesc << "\n";
+            jxr_free_error_description(writeErrorDesc);
+            returnCode = thumbnailResult;
+        }
+        else
+        {
+            if (!statsToStdout)
+            {
+                // Narrow output only, stdout can not mix byte and wide orientation
+                auto nativeOutputFile = jxr_wide_to_multibyte(outputFile);
+                console << "Wrote: " << (nativeOutputFile ? nativeOutputFile : "output file") << "\n";
+                jxr_free_multibyte(nativeOutputFile);
+            }
+            returnCode = 0;
+
+            if (cache && !cache->Store(cacheLookup.key, result))
+            {
+                std::cerr << "Failed to store the output in the cache\n";
             }
         }
-        if (image) {
-            avifImageDestroy(image);
+
+        if (!traceFile.empty() && WriteTrace(traceFile) < 0)
+        {
+            returnCode = 1;
         }
-        if (encoder) {
-            avifEncoderDestroy(encoder);
+
+        if (returnCode == 0 && !statsFile.empty())
+        {
+            std::ostringstream statistics;
+            JsonWriter json(statistics);
+            const auto cacheStatistics = cache ? cache->GetStatistics(cacheLookup) : CacheStatistics();
+            const auto& inputName = cmdLineParser.GetSharedMemoryName().empty() ? cmdLineParser.GetInputFile() : cmdLineParser.GetSharedMemoryName();
+            WriteStatisticsReport(json, inputName, outputFile, result, cache ? &cacheStatistics : nullptr);
+            statistics << "\n";
+            if (WriteStatistics(statsFile, statistics.str()) < 0)
+            {
+                returnCode = 1;
+            }
         }
-        avifRWDataFree(&avifOutput);
+
+        if (!statsToStdout)
+        {
+            console << "Peak memory usage: " << (jxr_get_peak_memory_usage() >> 20) << " MiB\n";
+        }
+
         return returnCode;
     }
     catch (std::bad_alloc&)